@@ -0,0 +1,672 @@
+/*
+ * Copyrights
+ *
+ * Copyright (c) 2006-2007 Matthias Wimmer
+ *
+ * This file is part of jabberd14.
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ */
+
+/**
+ * @file bench.cc
+ * @brief microbenchmarks for the frequently used primitives of jabberd/lib
+ *
+ * This program measures the performance of the functions in jabberd/lib, that
+ * are used for each stanza passing the server: parsing and serializing
+ * xmlnodes, querying them, handling JIDs, hashes, memory pools, escaping,
+ * hashing and base64 coding.
+ *
+ * The stanzas used as input are read from the corpus directory (bench/corpus
+ * in the source tree). Each file in this directory contains a single stanza.
+ *
+ * Each benchmark is run with an increasing number of iterations until it
+ * took at least the minimum time. The results are printed either as a table
+ * or in JSON format (compatible to the output of Google Benchmark, so that
+ * the same tools can be used to compare results).
+ *
+ * Usage: jabberd-bench [--corpus=dir] [--filter=substring] [--min-time=sec]
+ * [--format=console|json]
+ *
+ * Use 'make bench' to build and run the benchmarks. The JSON results are
+ * written to bench-results.json in the build directory.
+ */
+
+#include <base64.hh>
+#include <expat.hh>
+#include <hash.hh>
+#include <jpacket.hh>
+#include <str.hh>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#ifndef BENCH_CORPUS_DIR
+#define BENCH_CORPUS_DIR "corpus"
+#endif
+
+/** how many iterations are run before temporary data is freed */
+#define BENCH_BATCH 256
+
+/**
+ * a stanza of the corpus
+ */
+typedef struct {
+    std::string name; /**< name of the stanza (file name without extension) */
+    std::string data; /**< the serialized stanza */
+    xmlnode x;        /**< the parsed stanza */
+} bench_stanza;
+
+/**
+ * state of a running benchmark
+ */
+class bench_state {
+  private:
+    unsigned long long paused_at; /**< when timing has been paused */
+    unsigned long long paused;    /**< time spent paused */
+
+  public:
+    bench_state(long iterations, bench_stanza const *stanza);
+    void pause_timing();
+    void resume_timing();
+    unsigned long long get_paused() const;
+
+    long iterations;            /**< number of iterations to run */
+    bench_stanza const *stanza; /**< stanza to use as input (may be NULL) */
+    long long bytes;            /**< bytes processed (0 if not applicable) */
+};
+
+/** a benchmark function */
+typedef void (*bench_func)(bench_state &state);
+
+/**
+ * a registered benchmark
+ */
+typedef struct {
+    char const *name;  /**< name of the benchmark */
+    bench_func f;      /**< the function running the benchmark */
+    bool uses_corpus;  /**< if the benchmark is run for each stanza */
+} bench_entry;
+
+/**
+ * the result of a benchmark
+ */
+typedef struct {
+    std::string name;    /**< name of the benchmark (including the stanza) */
+    long iterations;     /**< number of iterations that have been run */
+    double real_ns;      /**< wall clock time per iteration */
+    double cpu_ns;       /**< CPU time per iteration */
+    double bytes_per_s;  /**< throughput (0 if not applicable) */
+} bench_result;
+
+/**
+ * get the time of a clock
+ *
+ * @param clock which clock to read
+ * @return time in nanoseconds
+ */
+static unsigned long long bench_now(clockid_t clock) {
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return static_cast<unsigned long long>(ts.tv_sec) * 1000000000ULL +
+           ts.tv_nsec;
+}
+
+bench_state::bench_state(long iterations, bench_stanza const *stanza)
+    : paused_at(0), paused(0), iterations(iterations), stanza(stanza),
+      bytes(0) {}
+
+/**
+ * stop the clock while preparing data, that should not be measured
+ */
+void bench_state::pause_timing() { paused_at = bench_now(CLOCK_MONOTONIC); }
+
+/**
+ * start the clock again after pause_timing()
+ */
+void bench_state::resume_timing() {
+    paused += bench_now(CLOCK_MONOTONIC) - paused_at;
+}
+
+/**
+ * get the time the benchmark has been paused
+ *
+ * @return time in nanoseconds
+ */
+unsigned long long bench_state::get_paused() const { return paused; }
+
+/**
+ * prevent the compiler from optimizing away a result
+ */
+template <class T> static inline void bench_keep(T const &value) {
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+/* ---------------------------------------------------------------------- */
+/* the benchmarks                                                          */
+/* ---------------------------------------------------------------------- */
+
+static void bm_xmlnode_str(bench_state &state) {
+    for (long i = 0; i < state.iterations; i++) {
+        xmlnode x = xmlnode_str(state.stanza->data.c_str(),
+                                state.stanza->data.length());
+        bench_keep(x);
+        xmlnode_free(x);
+    }
+    state.bytes = state.iterations * state.stanza->data.length();
+}
+
+static void bm_xmlnode_serialize_string(bench_state &state) {
+    xmlnode x = NULL;
+
+    for (long i = 0; i < state.iterations; i++) {
+        /* the serialization is allocated from the pool of the node */
+        if (i % BENCH_BATCH == 0) {
+            state.pause_timing();
+            xmlnode_free(x);
+            x = xmlnode_dup(state.stanza->x);
+            state.resume_timing();
+        }
+        char *serialized =
+            xmlnode_serialize_string(x, xmppd::ns_decl_list(), 0);
+        bench_keep(serialized);
+    }
+    xmlnode_free(x);
+    state.bytes = state.iterations * state.stanza->data.length();
+}
+
+static void bm_xmlnode_dup(bench_state &state) {
+    for (long i = 0; i < state.iterations; i++) {
+        xmlnode x = xmlnode_dup(state.stanza->x);
+        bench_keep(x);
+        xmlnode_free(x);
+    }
+}
+
+static void bm_xmlnode_get_tags(bench_state &state) {
+    xht namespaces = xhash_new(3);
+    xhash_put(namespaces, "", const_cast<char *>("jabber:server"));
+    xhash_put(namespaces, "roster", const_cast<char *>("jabber:iq:roster"));
+    xhash_put(namespaces, "disco",
+              const_cast<char *>("http://jabber.org/protocol/disco#info"));
+    xhash_put(namespaces, "vcard", const_cast<char *>("vcard-temp"));
+
+    /* a typical query for each kind of stanza */
+    char const *path = "body";
+    if (state.stanza->name == "roster")
+        path = "roster:query/roster:item[@subscription='both']/roster:group";
+    else if (state.stanza->name == "disco-info")
+        path = "disco:query/disco:feature";
+    else if (state.stanza->name == "vcard")
+        path = "vcard:vCard/vcard:PHOTO/vcard:BINVAL";
+    else if (state.stanza->name == "presence")
+        path = "show";
+
+    for (long i = 0; i < state.iterations; i++) {
+        xmlnode_vector result =
+            xmlnode_get_tags(state.stanza->x, path, namespaces);
+        bench_keep(result);
+    }
+
+    xhash_free(namespaces);
+}
+
+static void bm_jpacket_new(bench_state &state) {
+    std::vector<xmlnode> nodes(BENCH_BATCH);
+
+    for (long i = 0; i < state.iterations; i++) {
+        /* jpacket_new() changes and allocates from the node, use copies */
+        if (i % BENCH_BATCH == 0) {
+            state.pause_timing();
+            for (std::vector<xmlnode>::iterator x = nodes.begin();
+                 x != nodes.end(); ++x) {
+                xmlnode_free(*x);
+                *x = xmlnode_dup(state.stanza->x);
+            }
+            state.resume_timing();
+        }
+        jpacket p = jpacket_new(nodes[i % BENCH_BATCH]);
+        bench_keep(p);
+    }
+
+    for (std::vector<xmlnode>::iterator x = nodes.begin(); x != nodes.end();
+         ++x)
+        xmlnode_free(*x);
+}
+
+static void bm_jid_new(bench_state &state) {
+    pool p = NULL;
+
+    for (long i = 0; i < state.iterations; i++) {
+        if (i % BENCH_BATCH == 0) {
+            pool_free(p);
+            p = pool_new();
+        }
+        jid id = jid_new(p, "juliet@capulet.example/balcony");
+        bench_keep(id);
+    }
+    pool_free(p);
+}
+
+static void bm_jid_full(bench_state &state) {
+    pool p = NULL;
+
+    for (long i = 0; i < state.iterations; i++) {
+        if (i % BENCH_BATCH == 0) {
+            pool_free(p);
+            p = pool_new();
+        }
+        char *full = jid_full(jid_new(p, "Romeo@Montague.Example/Orchard"));
+        bench_keep(full);
+    }
+    pool_free(p);
+}
+
+static void bm_jid_cmpx(bench_state &state) {
+    pool p = pool_new();
+    jid a = jid_new(p, "juliet@capulet.example/balcony");
+    jid b = jid_new(p, "juliet@capulet.example/chamber");
+
+    for (long i = 0; i < state.iterations; i++) {
+        int result = jid_cmpx(a, b, JID_USER | JID_SERVER);
+        bench_keep(result);
+    }
+    pool_free(p);
+}
+
+/**
+ * keys used for the hash benchmarks
+ */
+static std::vector<std::string> &bench_keys() {
+    static std::vector<std::string> keys;
+
+    if (keys.empty()) {
+        for (int i = 0; i < 1000; i++) {
+            std::ostringstream key;
+            key << "user" << i << "@example.com";
+            keys.push_back(key.str());
+        }
+    }
+    return keys;
+}
+
+static void bm_xhash_put(bench_state &state) {
+    std::vector<std::string> &keys = bench_keys();
+    xht h = NULL;
+
+    for (long i = 0; i < state.iterations; i++) {
+        if (i % keys.size() == 0) {
+            state.pause_timing();
+            xhash_free(h);
+            h = xhash_new(401);
+            state.resume_timing();
+        }
+        xhash_put(h, keys[i % keys.size()].c_str(), &keys);
+    }
+    xhash_free(h);
+}
+
+static void bm_xhash_get(bench_state &state) {
+    std::vector<std::string> &keys = bench_keys();
+    xht h = xhash_new(401);
+
+    for (std::vector<std::string>::const_iterator key = keys.begin();
+         key != keys.end(); ++key)
+        xhash_put(h, key->c_str(), &keys);
+
+    for (long i = 0; i < state.iterations; i++) {
+        void *value = xhash_get(h, keys[i % keys.size()].c_str());
+        bench_keep(value);
+    }
+    xhash_free(h);
+}
+
+static void bm_pool_new_free(bench_state &state) {
+    for (long i = 0; i < state.iterations; i++) {
+        pool p = pool_new();
+        for (int n = 0; n < 8; n++)
+            bench_keep(pmalloco(p, 48));
+        pool_free(p);
+    }
+}
+
+static void bm_pool_heap_free(bench_state &state) {
+    for (long i = 0; i < state.iterations; i++) {
+        /* like the pools used for incoming stanzas */
+        pool p = pool_heap(5 * 1024);
+        for (int n = 0; n < 32; n++)
+            bench_keep(pmalloco(p, 48));
+        pool_free(p);
+    }
+}
+
+static void bm_strescape(bench_state &state) {
+    pool p = NULL;
+    char text[] = "Art thou not Romeo, and a Montague? <Neither>, fair saint, "
+                  "if either thee \"dislike\" & the orchard's walls are high.";
+
+    for (long i = 0; i < state.iterations; i++) {
+        if (i % BENCH_BATCH == 0) {
+            pool_free(p);
+            p = pool_new();
+        }
+        char *escaped = strescape(p, text);
+        bench_keep(escaped);
+    }
+    pool_free(p);
+    state.bytes = state.iterations * (sizeof(text) - 1);
+}
+
+static void bm_shahash(bench_state &state) {
+    char const *input = "e0ffe42b28561960c6b12b944a092794b9683a38secret";
+    char hashbuf[41];
+
+    for (long i = 0; i < state.iterations; i++) {
+        shahash_r(input, hashbuf);
+        bench_keep(hashbuf);
+    }
+    state.bytes = state.iterations * strlen(input);
+}
+
+static void bm_base64_encode(bench_state &state) {
+    unsigned char source[1024];
+    char target[2048];
+
+    for (size_t n = 0; n < sizeof(source); n++)
+        source[n] = n * 7;
+
+    for (long i = 0; i < state.iterations; i++) {
+        int len = base64_encode(source, sizeof(source), target, sizeof(target));
+        bench_keep(len);
+    }
+    state.bytes = state.iterations * sizeof(source);
+}
+
+static void bm_base64_decode(bench_state &state) {
+    unsigned char source[1024];
+    char encoded[2048];
+    unsigned char target[1024];
+
+    for (size_t n = 0; n < sizeof(source); n++)
+        source[n] = n * 7;
+    base64_encode(source, sizeof(source), encoded, sizeof(encoded));
+
+    for (long i = 0; i < state.iterations; i++) {
+        size_t len = base64_decode(encoded, target, sizeof(target));
+        bench_keep(len);
+    }
+    state.bytes = state.iterations * strlen(encoded);
+}
+
+/**
+ * all benchmarks
+ */
+static bench_entry bench_entries[] = {
+    {"xmlnode_str", bm_xmlnode_str, true},
+    {"xmlnode_serialize_string", bm_xmlnode_serialize_string, true},
+    {"xmlnode_dup", bm_xmlnode_dup, true},
+    {"xmlnode_get_tags", bm_xmlnode_get_tags, true},
+    {"jpacket_new", bm_jpacket_new, true},
+    {"jid_new", bm_jid_new, false},
+    {"jid_new+jid_full", bm_jid_full, false},
+    {"jid_cmpx", bm_jid_cmpx, false},
+    {"xhash_put", bm_xhash_put, false},
+    {"xhash_get", bm_xhash_get, false},
+    {"pool_new+pmalloco+pool_free", bm_pool_new_free, false},
+    {"pool_heap+pmalloco+pool_free", bm_pool_heap_free, false},
+    {"strescape", bm_strescape, false},
+    {"shahash_r", bm_shahash, false},
+    {"base64_encode/1024", bm_base64_encode, false},
+    {"base64_decode/1024", bm_base64_decode, false},
+    {NULL, NULL, false}};
+
+/* ---------------------------------------------------------------------- */
+/* the harness                                                             */
+/* ---------------------------------------------------------------------- */
+
+/**
+ * read the stanzas of the corpus
+ *
+ * @param dir the directory containing the corpus
+ * @param corpus where to add the stanzas to
+ * @return true on success, false if a file could not be read or parsed
+ */
+static bool bench_read_corpus(std::string const &dir,
+                              std::vector<bench_stanza> &corpus) {
+    static char const *files[] = {"message",    "presence", "roster",
+                                  "disco-info", "vcard",    NULL};
+
+    for (int i = 0; files[i] != NULL; i++) {
+        bench_stanza stanza;
+        std::string filename = dir + "/" + files[i] + ".xml";
+        std::ifstream file(filename.c_str());
+        std::ostringstream content;
+
+        if (!file.is_open()) {
+            std::cerr << "Cannot open corpus file " << filename << std::endl;
+            return false;
+        }
+        content << file.rdbuf();
+
+        stanza.name = files[i];
+        stanza.data = content.str();
+        while (!stanza.data.empty() &&
+               (stanza.data[stanza.data.length() - 1] == '\n'))
+            stanza.data.erase(stanza.data.length() - 1);
+        stanza.x = xmlnode_str(stanza.data.c_str(), stanza.data.length());
+        if (stanza.x == NULL) {
+            std::cerr << "Cannot parse corpus file " << filename << std::endl;
+            return false;
+        }
+        corpus.push_back(stanza);
+    }
+
+    return true;
+}
+
+/**
+ * run a single benchmark until it took at least the minimum time
+ *
+ * @param name name of the benchmark (for the result)
+ * @param f the benchmark function
+ * @param stanza the stanza to pass (may be NULL)
+ * @param min_time minimum time in seconds
+ * @return the result
+ */
+static bench_result bench_run(std::string const &name, bench_func f,
+                              bench_stanza const *stanza, double min_time) {
+    bench_result result;
+    long iterations = 1;
+
+    while (true) {
+        bench_state state(iterations, stanza);
+        unsigned long long real_start = bench_now(CLOCK_MONOTONIC);
+        unsigned long long cpu_start = bench_now(CLOCK_PROCESS_CPUTIME_ID);
+
+        (*f)(state);
+
+        unsigned long long real =
+            bench_now(CLOCK_MONOTONIC) - real_start - state.get_paused();
+        unsigned long long cpu = bench_now(CLOCK_PROCESS_CPUTIME_ID) -
+                                 cpu_start - state.get_paused();
+
+        if (real >= min_time * 1e9 || iterations >= 1000000000L) {
+            result.name = name;
+            result.iterations = iterations;
+            result.real_ns = static_cast<double>(real) / iterations;
+            result.cpu_ns = static_cast<double>(cpu) / iterations;
+            result.bytes_per_s =
+                state.bytes > 0 ? state.bytes / (real / 1e9) : 0;
+            return result;
+        }
+
+        /* estimate the needed iterations, but grow at most by factor 10 */
+        double factor = real > 0 ? min_time * 1.4e9 / real : 10;
+        if (factor > 10)
+            factor = 10;
+        if (factor < 2)
+            factor = 2;
+        iterations = static_cast<long>(iterations * factor);
+    }
+}
+
+/**
+ * escape a string for use in JSON
+ */
+static std::string bench_json_string(std::string const &s) {
+    std::string result("\"");
+
+    for (std::string::const_iterator c = s.begin(); c != s.end(); ++c) {
+        if (*c == '"' || *c == '\\')
+            result += '\\';
+        result += *c;
+    }
+    return result + "\"";
+}
+
+/**
+ * print the results as JSON (format of Google Benchmark)
+ */
+static void bench_print_json(std::vector<bench_result> const &results) {
+    char hostname[256] = "";
+    char date[64] = "";
+    time_t now = time(NULL);
+
+    gethostname(hostname, sizeof(hostname) - 1);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", localtime(&now));
+
+    std::cout << "{\n  \"context\": {\n";
+    std::cout << "    \"date\": " << bench_json_string(date) << ",\n";
+    std::cout << "    \"host_name\": " << bench_json_string(hostname)
+              << ",\n";
+    std::cout << "    \"executable\": \"jabberd-bench\",\n";
+    std::cout << "    \"num_cpus\": " << sysconf(_SC_NPROCESSORS_ONLN)
+              << ",\n";
+    std::cout << "    \"library_version\": "
+              << bench_json_string(PACKAGE " " VERSION) << "\n";
+    std::cout << "  },\n  \"benchmarks\": [";
+    for (std::vector<bench_result>::const_iterator r = results.begin();
+         r != results.end(); ++r) {
+        std::cout << (r == results.begin() ? "\n" : ",\n");
+        std::cout << "    {\n      \"name\": " << bench_json_string(r->name)
+                  << ",\n";
+        std::cout << "      \"run_type\": \"iteration\",\n";
+        std::cout << "      \"iterations\": " << r->iterations << ",\n";
+        std::cout << "      \"real_time\": " << r->real_ns << ",\n";
+        std::cout << "      \"cpu_time\": " << r->cpu_ns << ",\n";
+        if (r->bytes_per_s > 0)
+            std::cout << "      \"bytes_per_second\": " << r->bytes_per_s
+                      << ",\n";
+        std::cout << "      \"time_unit\": \"ns\"\n    }";
+    }
+    std::cout << "\n  ]\n}\n";
+}
+
+/**
+ * print a single result as a table row
+ */
+static void bench_print_console(bench_result const &r) {
+    char line[256];
+
+    snprintf(line, sizeof(line), "%-48s %12.1f ns %12.1f ns %12ld",
+             r.name.c_str(), r.real_ns, r.cpu_ns, r.iterations);
+    std::cout << line;
+    if (r.bytes_per_s > 0)
+        std::cout << "  " << r.bytes_per_s / (1024 * 1024) << " MiB/s";
+    std::cout << std::endl;
+}
+
+int main(int argc, char const **argv) {
+    std::string corpus_dir(BENCH_CORPUS_DIR);
+    std::string filter;
+    std::string format("console");
+    double min_time = 0.5;
+    std::vector<bench_stanza> corpus;
+    std::vector<bench_result> results;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg(argv[i]);
+
+        if (arg.compare(0, 9, "--corpus=") == 0)
+            corpus_dir = arg.substr(9);
+        else if (arg.compare(0, 9, "--filter=") == 0)
+            filter = arg.substr(9);
+        else if (arg.compare(0, 11, "--min-time=") == 0)
+            min_time = atof(arg.substr(11).c_str());
+        else if (arg.compare(0, 9, "--format=") == 0)
+            format = arg.substr(9);
+        else {
+            std::cerr << "Usage: " << argv[0]
+                      << " [--corpus=dir] [--filter=substring]"
+                         " [--min-time=sec] [--format=console|json]"
+                      << std::endl;
+            return 1;
+        }
+    }
+
+    if (!bench_read_corpus(corpus_dir, corpus))
+        return 1;
+
+    if (format == "console") {
+        char header[256];
+        snprintf(header, sizeof(header), "%-48s %15s %15s %12s", "Benchmark",
+                 "Time", "CPU", "Iterations");
+        std::cout << header << std::endl;
+    }
+
+    for (int i = 0; bench_entries[i].name != NULL; i++) {
+        std::vector<std::string> names;
+        std::vector<bench_stanza const *> stanzas;
+
+        if (bench_entries[i].uses_corpus) {
+            for (std::vector<bench_stanza>::const_iterator s = corpus.begin();
+                 s != corpus.end(); ++s) {
+                names.push_back(std::string(bench_entries[i].name) + "/" +
+                                s->name);
+                stanzas.push_back(&*s);
+            }
+        } else {
+            names.push_back(bench_entries[i].name);
+            stanzas.push_back(NULL);
+        }
+
+        for (size_t n = 0; n < names.size(); n++) {
+            if (!filter.empty() && names[n].find(filter) == std::string::npos)
+                continue;
+
+            bench_result r =
+                bench_run(names[n], bench_entries[i].f, stanzas[n], min_time);
+            results.push_back(r);
+            if (format == "console")
+                bench_print_console(r);
+        }
+    }
+
+    if (format == "json")
+        bench_print_json(results);
+
+    return 0;
+}
@@ -0,0 +1,536 @@
+/*
+ * Copyrights
+ *
+ * Copyright (c) 2006-2007 Matthias Wimmer
+ *
+ * This file is part of jabberd14.
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ */
+
+/**
+ * @file dnstest.cc
+ * @brief tests the asynchronous resolver of the dnsrv component
+ *
+ * This program starts a stub nameserver on the loopback interface (in a
+ * child process, answering over UDP and TCP) and runs lookups using the
+ * resolver in dnsrv/srv_resolv.cc against it. The stub knows a fixed set of
+ * names, each of them testing one case:
+ *
+ * - _xmpp-server._tcp.srv.test: SRV record without additional records, the
+ *   addresses of the target have to be queried using AAAA and A queries
+ * - host.srv.test: AAAA and A records (lookup without service)
+ * - nx.test: NXDOMAIN
+ * - timeout.test: never answered, the lookup has to fail after the retries
+ * - badid.test: first answered with a wrong id (and a wrong address), that
+ *   has to be ignored, then with the right one
+ * - tc.test: the UDP answer is truncated, the address is only sent over TCP
+ * - _xmpp-server._tcp.glue.test: SRV record pointing into the domain, with
+ *   the address in the additional section (and a record for another name,
+ *   that has to be ignored)
+ * - _xmpp-server._tcp.foreign.test: SRV record pointing to host.srv.test,
+ *   with a forged address for it in the additional section, that has to be
+ *   ignored as host.srv.test is not inside foreign.test
+ *
+ * The result of each lookup is compared to the expected result.
+ *
+ * Usage: jabberd-dnstest [--timeout=sec]
+ *
+ * The test is run by 'make check', 'make dnstest' builds and runs only it.
+ */
+
+#include "jabberd.h"
+#include "srv_resolv.h"
+
+#include <namespaces.hh>
+
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <gcrypt.h>
+#include <iostream>
+#include <netinet/in.h>
+#include <poll.h>
+#include <resolv.h>
+#include <sstream>
+#include <string>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+/* from jabberd/config.cc and jabberd/heartbeat.cc */
+extern xmlnode greymatter__;
+void heartbeat_birth(void);
+
+/**
+ * a lookup, that is tested
+ */
+typedef struct {
+    char const *service;  /**< the service, NULL for AAAA/A lookups */
+    char const *domain;   /**< the domain */
+    char const *expected; /**< the expected result, NULL for failure */
+    bool done;            /**< if the callback has been called */
+    std::string result;   /**< the result passed to the callback */
+    bool failed;          /**< if the callback got NULL */
+} dnstest_case;
+
+/**
+ * encode a domain name as a sequence of labels
+ *
+ * @param name the name (without trailing dot)
+ * @return the encoded name
+ */
+static std::string dnstest_name(std::string const &name) {
+    std::string encoded;
+    std::string::size_type start = 0;
+
+    while (start < name.length()) {
+        std::string::size_type end = name.find('.', start);
+        if (end == std::string::npos)
+            end = name.length();
+        encoded += static_cast<char>(end - start);
+        encoded += name.substr(start, end - start);
+        start = end + 1;
+    }
+    return encoded + '\0';
+}
+
+/**
+ * append a 16 bit number in network byte order
+ *
+ * @param data where to append the number
+ * @param value the number
+ */
+static void dnstest_put16(std::string &data, unsigned value) {
+    data += static_cast<char>((value >> 8) & 0xff);
+    data += static_cast<char>(value & 0xff);
+}
+
+/**
+ * encode a resource record with an IPv4 address
+ *
+ * @param name the owner of the record
+ * @param address the address
+ * @return the encoded record
+ */
+static std::string dnstest_a_record(std::string const &name,
+                                    char const *address) {
+    std::string rr = dnstest_name(name);
+    unsigned char addr[4];
+
+    inet_pton(AF_INET, address, addr);
+    dnstest_put16(rr, ns_t_a);
+    dnstest_put16(rr, ns_c_in);
+    dnstest_put16(rr, 0);
+    dnstest_put16(rr, 60);
+    dnstest_put16(rr, 4);
+    rr.append(reinterpret_cast<char *>(addr), 4);
+    return rr;
+}
+
+/**
+ * build an answer to a query
+ *
+ * The answer contains the question of the query and the given records, which
+ * all are for the queried name.
+ *
+ * @param query the query
+ * @param question_end where the question section of the query ends
+ * @param id the id to use for the answer
+ * @param rcode the response code
+ * @param tc if the truncated flag should be set
+ * @param type type of the records
+ * @param rdata the data of the records
+ * @param additional encoded records for the additional section
+ * @return the answer
+ */
+static std::string dnstest_message(
+    unsigned char const *query, size_t question_end, unsigned id, int rcode,
+    bool tc, int type, std::vector<std::string> const &rdata,
+    std::vector<std::string> const &additional = std::vector<std::string>()) {
+    std::string answer;
+
+    dnstest_put16(answer, id);
+    answer += static_cast<char>(0x84 | (query[2] & 0x01) | (tc ? 0x02 : 0));
+    answer += static_cast<char>(0x80 | rcode);
+    dnstest_put16(answer, 1);
+    dnstest_put16(answer, rdata.size());
+    dnstest_put16(answer, 0);
+    dnstest_put16(answer, additional.size());
+    answer.append(reinterpret_cast<char const *>(query) + 12,
+                  question_end - 12);
+
+    for (std::vector<std::string>::const_iterator rr = rdata.begin();
+         rr != rdata.end(); ++rr) {
+        /* the name is a pointer to the question */
+        dnstest_put16(answer, 0xc00c);
+        dnstest_put16(answer, type);
+        dnstest_put16(answer, ns_c_in);
+        dnstest_put16(answer, 0);
+        dnstest_put16(answer, 60);
+        dnstest_put16(answer, rr->length());
+        answer += *rr;
+    }
+
+    for (std::vector<std::string>::const_iterator rr = additional.begin();
+         rr != additional.end(); ++rr)
+        answer += *rr;
+
+    return answer;
+}
+
+/**
+ * get the answers of the stub nameserver to a query
+ *
+ * @param query the query
+ * @param len length of the query
+ * @param tcp if the query has been received over TCP
+ * @return the answers to send, may be empty
+ */
+static std::vector<std::string> dnstest_answers(unsigned char const *query,
+                                                int len, bool tcp) {
+    std::vector<std::string> answers;
+    std::vector<std::string> rdata;
+    std::vector<std::string> additional;
+    unsigned char addr[16];
+    ns_msg msg;
+    ns_rr rr;
+
+    if (ns_initparse(query, len, &msg) < 0 ||
+        ns_msg_count(msg, ns_s_qd) != 1 ||
+        ns_parserr(&msg, ns_s_qd, 0, &rr) < 0)
+        return answers;
+
+    std::string name(ns_rr_name(rr));
+    int type = ns_rr_type(rr);
+    unsigned id = ns_msg_id(msg);
+    int skip = dn_skipname(query + 12, query + len);
+    if (skip < 0 || 12 + skip + 4 > len)
+        return answers;
+    size_t question_end = 12 + skip + 4;
+
+    if (name == "_xmpp-server._tcp.srv.test" && type == ns_t_srv) {
+        std::string srv;
+        dnstest_put16(srv, 0);
+        dnstest_put16(srv, 0);
+        dnstest_put16(srv, 5269);
+        srv += dnstest_name("host.srv.test");
+        rdata.push_back(srv);
+    } else if (name == "_xmpp-server._tcp.glue.test" && type == ns_t_srv) {
+        std::string srv;
+        dnstest_put16(srv, 0);
+        dnstest_put16(srv, 0);
+        dnstest_put16(srv, 5269);
+        srv += dnstest_name("host.glue.test");
+        rdata.push_back(srv);
+        additional.push_back(dnstest_a_record("other.glue.test", "192.0.2.98"));
+        additional.push_back(dnstest_a_record("host.glue.test", "192.0.2.4"));
+    } else if (name == "_xmpp-server._tcp.foreign.test" && type == ns_t_srv) {
+        std::string srv;
+        dnstest_put16(srv, 0);
+        dnstest_put16(srv, 0);
+        dnstest_put16(srv, 5269);
+        srv += dnstest_name("host.srv.test");
+        rdata.push_back(srv);
+        additional.push_back(dnstest_a_record("host.srv.test", "192.0.2.97"));
+    } else if (name == "host.srv.test" && type == ns_t_aaaa) {
+        inet_pton(AF_INET6, "2001:db8::1", addr);
+        rdata.push_back(std::string(reinterpret_cast<char *>(addr), 16));
+    } else if (name == "host.srv.test" && type == ns_t_a) {
+        inet_pton(AF_INET, "192.0.2.1", addr);
+        rdata.push_back(std::string(reinterpret_cast<char *>(addr), 4));
+    } else if (name == "nx.test") {
+        answers.push_back(dnstest_message(query, question_end, id,
+                                          ns_r_nxdomain, false, type, rdata));
+        return answers;
+    } else if (name == "timeout.test") {
+        return answers;
+    } else if (name == "badid.test" && type == ns_t_a) {
+        /* a forged answer first, it has to be dropped */
+        inet_pton(AF_INET, "192.0.2.99", addr);
+        rdata.push_back(std::string(reinterpret_cast<char *>(addr), 4));
+        answers.push_back(dnstest_message(query, question_end, id ^ 0x5555,
+                                          ns_r_noerror, false, type, rdata));
+        rdata.clear();
+        inet_pton(AF_INET, "192.0.2.2", addr);
+        rdata.push_back(std::string(reinterpret_cast<char *>(addr), 4));
+    } else if (name == "tc.test" && type == ns_t_a) {
+        if (!tcp) {
+            answers.push_back(dnstest_message(query, question_end, id,
+                                              ns_r_noerror, true, type, rdata));
+            return answers;
+        }
+        inet_pton(AF_INET, "192.0.2.3", addr);
+        rdata.push_back(std::string(reinterpret_cast<char *>(addr), 4));
+    }
+
+    /* known names without records of the type get an empty answer */
+    answers.push_back(dnstest_message(query, question_end, id, ns_r_noerror,
+                                      false, type, rdata, additional));
+    return answers;
+}
+
+/**
+ * answer a query received over TCP
+ *
+ * @param fd the accepted connection
+ */
+static void dnstest_serve_tcp(int fd) {
+    struct timeval timeout = {2, 0};
+    unsigned char buffer[NS_PACKETSZ + 2];
+    size_t len = 0;
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    /* the query is preceded by its length */
+    while (len < 2 || len < 2 + ns_get16(buffer)) {
+        if (len >= sizeof(buffer))
+            return;
+        ssize_t got = read(fd, buffer + len, sizeof(buffer) - len);
+        if (got <= 0)
+            return;
+        len += got;
+    }
+
+    std::vector<std::string> answers =
+        dnstest_answers(buffer + 2, ns_get16(buffer), true);
+    for (std::vector<std::string>::const_iterator answer = answers.begin();
+         answer != answers.end(); ++answer) {
+        std::string framed;
+        dnstest_put16(framed, answer->length());
+        framed += *answer;
+        if (write(fd, framed.data(), framed.length()) < 0)
+            return;
+    }
+}
+
+/**
+ * the stub nameserver, runs until it gets killed
+ *
+ * @param udp the UDP socket
+ * @param tcp the listening TCP socket
+ */
+static void dnstest_serve(int udp, int tcp) {
+    struct pollfd fds[2];
+
+    fds[0].fd = udp;
+    fds[0].events = POLLIN;
+    fds[1].fd = tcp;
+    fds[1].events = POLLIN;
+
+    for (;;) {
+        if (poll(fds, 2, -1) < 0)
+            continue;
+
+        if (fds[0].revents & POLLIN) {
+            unsigned char buffer[NS_PACKETSZ];
+            struct sockaddr_storage from;
+            socklen_t fromlen = sizeof(from);
+            ssize_t len = recvfrom(udp, buffer, sizeof(buffer), 0,
+                                   (struct sockaddr *)&from, &fromlen);
+            if (len > 0) {
+                std::vector<std::string> answers =
+                    dnstest_answers(buffer, len, false);
+                for (std::vector<std::string>::const_iterator answer =
+                         answers.begin();
+                     answer != answers.end(); ++answer)
+                    sendto(udp, answer->data(), answer->length(), 0,
+                           (struct sockaddr *)&from, fromlen);
+            }
+        }
+
+        if (fds[1].revents & POLLIN) {
+            int fd = accept(tcp, NULL, NULL);
+            if (fd >= 0) {
+                dnstest_serve_tcp(fd);
+                close(fd);
+            }
+        }
+    }
+}
+
+/**
+ * open the sockets of the stub nameserver on the same port for UDP and TCP
+ *
+ * @param udp where to store the UDP socket
+ * @param tcp where to store the TCP socket
+ * @return the port, -1 on failure
+ */
+static int dnstest_listen(int &udp, int &tcp) {
+    for (int tries = 0; tries < 10; tries++) {
+        struct sockaddr_in sa;
+        socklen_t salen = sizeof(sa);
+        int flag = 1;
+
+        bzero(&sa, sizeof(sa));
+        sa.sin_family = AF_INET;
+        sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        udp = socket(PF_INET, SOCK_DGRAM, 0);
+        tcp = socket(PF_INET, SOCK_STREAM, 0);
+        if (udp < 0 || tcp < 0)
+            return -1;
+        setsockopt(tcp, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+
+        if (bind(udp, (struct sockaddr *)&sa, sizeof(sa)) == 0 &&
+            getsockname(udp, (struct sockaddr *)&sa, &salen) == 0 &&
+            bind(tcp, (struct sockaddr *)&sa, sizeof(sa)) == 0 &&
+            listen(tcp, 16) == 0)
+            return ntohs(sa.sin_port);
+
+        close(udp);
+        close(tcp);
+    }
+    return -1;
+}
+
+/**
+ * callback for srv_lookup()
+ *
+ * @param result the result of the lookup
+ * @param arg the test case
+ */
+static void dnstest_result(char const *result, void *arg) {
+    dnstest_case *c = static_cast<dnstest_case *>(arg);
+
+    c->done = true;
+    c->failed = result == NULL;
+    c->result = result ? result : "";
+}
+
+int main(int argc, char const **argv) {
+    std::vector<dnstest_case> cases;
+    int timeout = 20;
+    int udp = -1;
+    int tcp = -1;
+    int failures = 0;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg(argv[i]);
+
+        if (arg.compare(0, 10, "--timeout=") == 0)
+            timeout = atoi(arg.substr(10).c_str());
+        else {
+            std::cerr << "Usage: " << argv[0] << " [--timeout=sec]"
+                      << std::endl;
+            return 1;
+        }
+    }
+
+    int port = dnstest_listen(udp, tcp);
+    if (port < 0) {
+        std::cerr << "Could not open the sockets of the stub nameserver: "
+                  << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    pid_t stub = fork();
+    if (stub < 0) {
+        std::cerr << "Could not fork: " << strerror(errno) << std::endl;
+        return 1;
+    }
+    if (stub == 0) {
+        dnstest_serve(udp, tcp);
+        _exit(0);
+    }
+    close(udp);
+    close(tcp);
+
+    dnstest_case srv = {"_xmpp-server._tcp", "srv.test",
+                        "[2001:db8::1]:5269,192.0.2.1:5269"};
+    dnstest_case host = {NULL, "host.srv.test", "2001:db8::1,192.0.2.1"};
+    dnstest_case nx = {NULL, "nx.test", NULL};
+    dnstest_case lost = {NULL, "timeout.test", NULL};
+    dnstest_case badid = {NULL, "badid.test", "192.0.2.2"};
+    dnstest_case tc = {NULL, "tc.test", "192.0.2.3"};
+    dnstest_case glue = {"_xmpp-server._tcp", "glue.test", "192.0.2.4:5269"};
+    dnstest_case foreign = {"_xmpp-server._tcp", "foreign.test",
+                            "[2001:db8::1]:5269,192.0.2.1:5269"};
+    cases.push_back(srv);
+    cases.push_back(host);
+    cases.push_back(nx);
+    cases.push_back(lost);
+    cases.push_back(badid);
+    cases.push_back(tc);
+    cases.push_back(glue);
+    cases.push_back(foreign);
+
+    /* the parts of the server, the resolver needs */
+    gcry_check_version(NULL);
+    pth_init();
+    greymatter__ = xmlnode_new_tag_ns("jabber", NULL, NS_JABBERD_CONFIGFILE);
+    heartbeat_birth();
+    mio_init();
+
+    std::ostringstream nameserver;
+    nameserver << "127.0.0.1:" << port;
+    pool p = pool_new();
+    xmlnode config = xmlnode_new_tag_pool_ns(p, "dnsrv", NULL,
+                                             NS_JABBERD_CONFIG_DNSRV);
+    xmlnode_put_attrib_ns(config, "dnstimeout", NULL, NULL, "1");
+    xmlnode_put_attrib_ns(config, "dnsretries", NULL, NULL, "1");
+    xmlnode_insert_cdata(xmlnode_insert_tag_ns(config, "nameserver", NULL,
+                                               NS_JABBERD_CONFIG_DNSRV),
+                         nameserver.str().c_str(), -1);
+    srv_resolver r = srv_resolver_new(p, config);
+
+    for (std::vector<dnstest_case>::iterator c = cases.begin();
+         c != cases.end(); ++c) {
+        c->done = false;
+        c->failed = false;
+        srv_lookup(r, c->service, c->domain, dnstest_result, &*c);
+    }
+
+    for (int waited = 0; waited < timeout; waited++) {
+        bool all_done = true;
+        for (std::vector<dnstest_case>::const_iterator c = cases.begin();
+             c != cases.end(); ++c)
+            all_done = all_done && c->done;
+        if (all_done)
+            break;
+        pth_sleep(1);
+    }
+
+    for (std::vector<dnstest_case>::const_iterator c = cases.begin();
+         c != cases.end(); ++c) {
+        bool ok = c->done && (c->expected == NULL
+                                  ? c->failed
+                                  : !c->failed && c->result == c->expected);
+        std::string name = c->service ? std::string(c->service) + "." +
+                                            c->domain
+                                      : c->domain;
+
+        std::cout << (ok ? "PASS " : "FAIL ") << name << ": "
+                  << (!c->done    ? "no result"
+                      : c->failed ? "failed"
+                                  : c->result)
+                  << std::endl;
+        if (!ok)
+            failures++;
+    }
+
+    pool_free(p);
+    kill(stub, SIGTERM);
+    waitpid(stub, NULL, 0);
+
+    return failures > 0 ? 1 : 0;
+}
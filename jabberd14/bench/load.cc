@@ -0,0 +1,1751 @@
+/*
+ * Copyrights
+ *
+ * Copyright (c) 2006-2007 Matthias Wimmer
+ *
+ * This file is part of jabberd14.
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ */
+
+/**
+ * @file load.cc
+ * @brief end-to-end load generator for a complete jabberd14 server
+ *
+ * This program starts a local jabberd14 server with a generated configuration
+ * (pthsock_client, the session manager and xdb_file using a spool in a
+ * temporary directory) and connects a large number of clients over the
+ * loopback interface. The clients then run the following scenarios one after
+ * the other:
+ *
+ * - register: in-band registration of all accounts
+ * - login: all clients log in at the same time (login storm)
+ * - subscribe: each client subscribes to the presence of the next clients
+ * - roster: each client fetches its roster
+ * - presence: all clients broadcast a presence update to their subscribers
+ * - message: one-to-one messages between random online clients
+ * - offline: every second client goes offline, gets messages stored, and
+ *   logs in again to receive them
+ *
+ * The scenarios to run can be selected using --mix, a comma separated list of
+ * scenario names, each optionally followed by a colon and a weight (e.g.
+ * --mix=subscribe,message:8,presence:1,roster:1). Registration and login are
+ * always done, as all other scenarios need online clients. If a mix is given,
+ * the roster, presence and message scenarios are not run one after the other,
+ * but together for --duration seconds: each client starts --rate operations
+ * per second, picking roster fetches, presence updates and messages randomly
+ * according to their weights (default weight: 1). Presence updates only reach
+ * someone if the subscribe scenario is part of the mix as well.
+ *
+ * For each scenario the number of operations, the throughput, the median and
+ * 99th percentile of the latency and the memory usage (RSS) of the server are
+ * reported, either as a table or in JSON format. The JSON results can
+ * additionally be written to a file.
+ *
+ * The clients are driven from a single thread using epoll. Latencies of
+ * presences and messages are measured using a timestamp, that the sender
+ * puts into the stanza.
+ *
+ * Usage: jabberd-load [--jabberd=path] [--modules=dir] [--clients=n]
+ * [--concurrency=n] [--roster-size=n] [--rate=msgs] [--duration=sec]
+ * [--offline-messages=n] [--timeout=sec] [--port=port] [--keep]
+ * [--format=console|json] [--json=file] [--mix=scenario[:weight],...]
+ *
+ * Use 'make loadtest' to build the server and run the load generator against
+ * the build tree (options can be passed using LOADTEST_FLAGS, e.g.
+ * make loadtest LOADTEST_FLAGS=--clients=5000). The JSON results are written
+ * to loadtest-results.json in the build directory. Only Linux is supported.
+ */
+
+#include <namespaces.hh>
+#include <str.hh>
+#include <xstream.hh>
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <fstream>
+#include <ftw.h>
+#include <iostream>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sstream>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#ifndef LOAD_JABBERD
+#define LOAD_JABBERD "jabberd"
+#endif
+
+#ifndef LOAD_MODULES_DIR
+#define LOAD_MODULES_DIR "."
+#endif
+
+/** size of the read buffer */
+#define LOAD_BUFSIZE 8192
+
+/** maximum number of events handled by one call to epoll_wait() */
+#define LOAD_EVENTS 256
+
+/** domain served by the generated configuration */
+#define LOAD_DOMAIN "localhost"
+
+/** resource used by all clients */
+#define LOAD_RESOURCE "load"
+
+/** prefix of the timestamps in message bodies and presence states */
+#define LOAD_STAMP "load:"
+
+/**
+ * state of a client connection
+ */
+typedef enum {
+    load_DISCONNECTED, /**< not connected */
+    load_WAITING,      /**< waiting for a free connection slot */
+    load_CONNECTING,   /**< TCP connection is established */
+    load_STREAM,       /**< waiting for the stream header of the server */
+    load_REGISTER,     /**< waiting for the result of the registration */
+    load_AUTH,         /**< waiting for the result of the authentication */
+    load_ONLINE,       /**< authenticated and available */
+    load_CLOSING       /**< stream closed, waiting for the server to close */
+} load_state;
+
+/**
+ * the scenarios, that are run
+ */
+typedef enum {
+    phase_REGISTER,  /**< in-band registration */
+    phase_LOGIN,     /**< login storm */
+    phase_SUBSCRIBE, /**< building the rosters */
+    phase_ROSTER,    /**< roster fetch */
+    phase_PRESENCE,  /**< presence broadcast */
+    phase_MESSAGE,   /**< one-to-one messages */
+    phase_OFFLINE    /**< offline storage and delivery */
+} load_phase_type;
+
+/** names of the scenarios, indexed by load_phase_type */
+static char const *load_phase_names[] = {"register", "login", "subscribe",
+                                         "roster",   "presence", "message",
+                                         "offline"};
+
+/** number of scenario types */
+#define LOAD_PHASES (phase_OFFLINE + 1)
+
+/**
+ * results of a scenario
+ */
+typedef struct {
+    load_phase_type type;     /**< which scenario */
+    std::string name;         /**< name of the scenario */
+    unsigned long ops;        /**< number of finished operations */
+    unsigned long errors;     /**< number of failed operations */
+    unsigned long long started; /**< when the scenario has been started */
+    double seconds;           /**< wall clock time of the scenario */
+    long rss_kb;              /**< RSS of the server after the scenario */
+    long hwm_kb;              /**< peak RSS of the server so far */
+    std::vector<unsigned long long> latencies; /**< latencies (usec) */
+} load_phase;
+
+/**
+ * a simulated client
+ */
+typedef struct load_client_struct {
+    struct load_run_struct *run; /**< the run this client belongs to */
+    int index;                   /**< number of the client */
+    std::string user;            /**< username of the client */
+    int fd;                      /**< socket of the connection, -1 if none */
+    load_state state;            /**< state of the connection */
+    bool do_register;   /**< register the account instead of logging in */
+    bool dead;          /**< connection has to be closed after parsing */
+    char const *failure; /**< why the connection has to be closed */
+    bool want_write;    /**< if EPOLLOUT is currently requested */
+    pool p;             /**< memory pool of the connection */
+    xstream xs;         /**< parser for the incoming stream */
+    std::string out;    /**< data waiting to be written */
+    unsigned long long started;      /**< start of the current operation */
+    unsigned long long next_message; /**< when to send the next message */
+    unsigned offline_expected; /**< offline messages still to be received */
+    unsigned subscribers; /**< clients subscribed to this client's presence */
+} load_client;
+
+/**
+ * state of a complete run of the load generator
+ */
+typedef struct load_run_struct {
+    std::string jabberd;     /**< path to the jabberd binary */
+    std::string modules;     /**< where to find the shared objects */
+    std::string dir;         /**< temporary directory */
+    unsigned clients;        /**< number of clients */
+    unsigned concurrency;    /**< connections that are set up in parallel */
+    unsigned roster_size;    /**< contacts each client subscribes to */
+    double rate;             /**< messages per client and second */
+    int duration;            /**< duration of the message scenario */
+    unsigned offline_messages; /**< offline messages per offline client */
+    int timeout;             /**< maximum duration of a scenario */
+    int port;                /**< port the server listens on */
+    pid_t server;            /**< process of the server */
+    int epoll;               /**< epoll instance */
+    unsigned long long epoch; /**< start of the run (monotonic clock) */
+    std::vector<load_client *> all; /**< all clients */
+    std::deque<load_client *> waiting; /**< clients waiting to connect */
+    unsigned in_progress;    /**< connections currently being set up */
+    unsigned long finished;  /**< finished operations in the current phase */
+    unsigned long subscriptions; /**< established subscriptions */
+    unsigned long sent;      /**< stanzas sent in the current phase */
+    unsigned long received;  /**< stanzas received in the current phase */
+    unsigned closed;         /**< connections closed in the current phase */
+    bool sending;            /**< if messages are sent in the message scenario */
+    load_phase *phase;       /**< the currently running scenario */
+    std::string mix;         /**< the scenario mix given with --mix */
+    unsigned weight[LOAD_PHASES]; /**< weights of the mix, 0 if not selected */
+    load_phase *mixed[LOAD_PHASES]; /**< scenarios running in the mixed phase */
+} load_run;
+
+/** predicate checked while waiting for a scenario to finish */
+typedef bool (*load_condition)(load_run *run);
+
+/**
+ * get the current time of the monotonic clock
+ *
+ * @return time in microseconds
+ */
+static unsigned long long load_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<unsigned long long>(ts.tv_sec) * 1000000ULL +
+           ts.tv_nsec / 1000;
+}
+
+/**
+ * escape a string for the use inside XML
+ *
+ * @param s the string to escape
+ * @return the escaped string
+ */
+static std::string load_escape(std::string const &s) {
+    std::string result;
+
+    for (std::string::const_iterator c = s.begin(); c != s.end(); ++c) {
+        switch (*c) {
+            case '&':
+                result += "&amp;";
+                break;
+            case '<':
+                result += "&lt;";
+                break;
+            case '>':
+                result += "&gt;";
+                break;
+            case '\'':
+                result += "&apos;";
+                break;
+            case '"':
+                result += "&quot;";
+                break;
+            default:
+                result += *c;
+        }
+    }
+    return result;
+}
+
+/**
+ * read a value from /proc/<pid>/status
+ *
+ * @param pid the process to read the value for
+ * @param key the key to read (e.g. "VmRSS")
+ * @return the value in kB, -1 if it could not be read
+ */
+static long load_proc_status(pid_t pid, char const *key) {
+    std::ostringstream path;
+    std::string line;
+    std::string prefix(key);
+
+    path << "/proc/" << pid << "/status";
+    std::ifstream status(path.str().c_str());
+    prefix += ':';
+    while (std::getline(status, line)) {
+        if (line.compare(0, prefix.size(), prefix) == 0)
+            return atol(line.c_str() + prefix.size());
+    }
+    return -1;
+}
+
+/**
+ * find the shared object of a component
+ *
+ * The shared object is searched in the modules directory itself (installed
+ * server) and in the .libs directory of the component in the build tree.
+ *
+ * @param run the run
+ * @param subdir directory of the component in the build tree
+ * @param name file name of the shared object
+ * @return path to the shared object
+ */
+static std::string load_module(load_run *run, char const *subdir,
+                               char const *name) {
+    std::string installed = run->modules + "/" + name;
+    std::string built = run->modules + "/" + subdir + "/.libs/" + name;
+
+    if (access(built.c_str(), R_OK) == 0)
+        return built;
+    return installed;
+}
+
+/**
+ * write the configuration file for the server
+ *
+ * @param run the run
+ * @return path to the configuration file, empty string on error
+ */
+static std::string load_write_config(load_run *run) {
+    std::string cfgfile = run->dir + "/jabber.xml";
+    std::string spool = run->dir + "/spool";
+    std::string jsm = load_escape(load_module(run, "jsm", "libjabberdsm.so"));
+    std::ofstream cfg(cfgfile.c_str());
+
+    if (mkdir(spool.c_str(), 0700) != 0 && errno != EEXIST) {
+        std::cerr << "cannot create " << spool << ": " << strerror(errno)
+                  << std::endl;
+        return std::string();
+    }
+
+    cfg << "<?xml version='1.0'?>\n"
+           "<jabber xmlns='http://jabberd.org/ns/configfile'>\n"
+           "  <service id='sessions." LOAD_DOMAIN "'>\n"
+           "    <host>" LOAD_DOMAIN "</host>\n"
+           "    <jsm xmlns='jabber:config:jsm'>\n"
+           "      <register xmlns='jabber:iq:register'>\n"
+           "        <instructions>load test</instructions>\n"
+           "        <username/>\n"
+           "        <password/>\n"
+           "      </register>\n"
+           "    </jsm>\n"
+           "    <load main='jsm'>\n"
+           "      <jsm>" << jsm << "</jsm>\n"
+           "      <mod_roster>" << jsm << "</mod_roster>\n"
+           "      <mod_offline>" << jsm << "</mod_offline>\n"
+           "      <mod_presence>" << jsm << "</mod_presence>\n"
+           "      <mod_auth_plain>" << jsm << "</mod_auth_plain>\n"
+           "      <mod_register>" << jsm << "</mod_register>\n"
+           "    </load>\n"
+           "  </service>\n"
+           "  <xdb id='xdb." LOAD_DOMAIN "'>\n"
+           "    <host/>\n"
+           "    <load>\n"
+           "      <xdb_file>"
+        << load_escape(load_module(run, "xdb_file", "libjabberdxdbfile.so"))
+        << "</xdb_file>\n"
+           "    </load>\n"
+           "    <xdb_file xmlns='jabber:config:xdb_file'>\n"
+           "      <spool>" << load_escape(spool) << "</spool>\n"
+           "    </xdb_file>\n"
+           "  </xdb>\n"
+           "  <service id='c2s'>\n"
+           "    <load>\n"
+           "      <pthsock_client>"
+        << load_escape(load_module(run, "pthsock", "libjabberdpthsock.so"))
+        << "</pthsock_client>\n"
+           "    </load>\n"
+           "    <pthcsock xmlns='jabber:config:pth-csock'>\n"
+           "      <authtime>0</authtime>\n"
+           "      <karma>\n"
+           "        <init>100</init>\n"
+           "        <max>100</max>\n"
+           "        <inc>100</inc>\n"
+           "        <dec>0</dec>\n"
+           "        <penalty>-5</penalty>\n"
+           "        <restore>100</restore>\n"
+           "      </karma>\n"
+           "      <ip port='" << run->port << "'>127.0.0.1</ip>\n"
+           "    </pthcsock>\n"
+           "  </service>\n"
+           "  <log id='log." LOAD_DOMAIN "'>\n"
+           "    <host/>\n"
+           "    <logtype/>\n"
+           "    <format>%d: [%t] (%h): %s</format>\n"
+           "    <file>" << load_escape(run->dir + "/jabberd.log") << "</file>\n"
+           "  </log>\n"
+           "  <pidfile>" << load_escape(run->dir + "/jabberd.pid")
+        << "</pidfile>\n"
+           "</jabber>\n";
+
+    cfg.close();
+    if (!cfg) {
+        std::cerr << "cannot write " << cfgfile << std::endl;
+        return std::string();
+    }
+    return cfgfile;
+}
+
+/**
+ * start the server and wait until it accepts connections
+ *
+ * @param run the run
+ * @param cfgfile the configuration file to use
+ * @return true on success
+ */
+static bool load_start_server(load_run *run, std::string const &cfgfile) {
+    std::string output = run->dir + "/jabberd.out";
+    unsigned long long deadline = load_now() + run->timeout * 1000000ULL;
+    struct sockaddr_in sa;
+
+    run->server = fork();
+    if (run->server < 0) {
+        std::cerr << "cannot fork: " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    if (run->server == 0) {
+        int fd = open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (fd >= 0) {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+            close(fd);
+        }
+        execl(run->jabberd.c_str(), run->jabberd.c_str(), "-c",
+              cfgfile.c_str(), "-H", run->dir.c_str(),
+              static_cast<char *>(NULL));
+        fprintf(stderr, "cannot execute %s: %s\n", run->jabberd.c_str(),
+                strerror(errno));
+        _exit(127);
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(run->port);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    while (load_now() < deadline) {
+        int status = 0;
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+        if (fd >= 0 &&
+            connect(fd, reinterpret_cast<struct sockaddr *>(&sa),
+                    sizeof(sa)) == 0) {
+            close(fd);
+            return true;
+        }
+        if (fd >= 0)
+            close(fd);
+
+        if (waitpid(run->server, &status, WNOHANG) == run->server) {
+            std::cerr << "server terminated during startup, see " << output
+                      << std::endl;
+            run->server = 0;
+            return false;
+        }
+        usleep(100000);
+    }
+
+    std::cerr << "server did not accept connections within " << run->timeout
+              << " seconds" << std::endl;
+    return false;
+}
+
+/**
+ * stop the server
+ *
+ * @param run the run
+ */
+static void load_stop_server(load_run *run) {
+    int status = 0;
+
+    if (run->server <= 0)
+        return;
+
+    kill(run->server, SIGTERM);
+    for (int i = 0; i < 100; i++) {
+        if (waitpid(run->server, &status, WNOHANG) == run->server) {
+            run->server = 0;
+            return;
+        }
+        usleep(100000);
+    }
+    kill(run->server, SIGKILL);
+    waitpid(run->server, &status, 0);
+    run->server = 0;
+}
+
+/**
+ * nftw() callback removing a file or directory
+ */
+static int load_remove_entry(char const *path, struct stat const *sb,
+                             int typeflag, struct FTW *ftwbuf) {
+    return remove(path);
+}
+
+/**
+ * update the events a client is waiting for
+ *
+ * @param c the client
+ * @param want_write if the client has data to write
+ */
+static void load_watch(load_client *c, bool want_write) {
+    struct epoll_event ev;
+
+    if (c->fd < 0 || c->want_write == want_write)
+        return;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | (want_write ? EPOLLOUT : 0);
+    ev.data.ptr = c;
+    epoll_ctl(c->run->epoll, EPOLL_CTL_MOD, c->fd, &ev);
+    c->want_write = want_write;
+}
+
+/**
+ * close the connection of a client and free its resources
+ *
+ * @param c the client
+ */
+static void load_disconnect(load_client *c) {
+    if (c->fd >= 0) {
+        epoll_ctl(c->run->epoll, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+        c->fd = -1;
+    }
+    if (c->p != NULL) {
+        pool_free(c->p);
+        c->p = NULL;
+        c->xs = NULL;
+    }
+    c->out.clear();
+    c->want_write = false;
+    c->dead = false;
+    c->failure = NULL;
+    c->state = load_DISCONNECTED;
+}
+
+/**
+ * an operation of a client, that was setting up its connection, finished
+ *
+ * @param c the client
+ * @param success if the operation has been successful
+ */
+static void load_setup_done(load_client *c, bool success) {
+    load_run *run = c->run;
+
+    if (run->in_progress > 0)
+        run->in_progress--;
+    if (success) {
+        run->finished++;
+        if (run->phase != NULL)
+            run->phase->latencies.push_back(load_now() - c->started);
+    } else if (run->phase != NULL) {
+        run->phase->errors++;
+    }
+}
+
+/**
+ * a client failed
+ *
+ * @param c the client
+ * @param reason why it failed
+ */
+static void load_fail(load_client *c, char const *reason) {
+    bool setting_up = c->state == load_CONNECTING ||
+                      c->state == load_STREAM || c->state == load_REGISTER ||
+                      c->state == load_AUTH;
+
+    if (c->state == load_CLOSING) {
+        c->run->closed++;
+    } else if (setting_up) {
+        load_setup_done(c, false);
+    } else if (c->run->phase != NULL) {
+        c->run->phase->errors++;
+    }
+
+    if (c->run->phase == NULL || c->run->phase->errors < 10)
+        std::cerr << c->user << ": " << reason << std::endl;
+
+    load_disconnect(c);
+}
+
+/**
+ * write as much of the pending data of a client as possible
+ *
+ * @param c the client
+ */
+static void load_flush(load_client *c) {
+    while (!c->out.empty()) {
+        ssize_t written =
+            send(c->fd, c->out.data(), c->out.size(), MSG_NOSIGNAL);
+
+        if (written < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            if (errno == EINTR)
+                continue;
+            c->dead = true;
+            return;
+        }
+        c->out.erase(0, written);
+    }
+
+    if (c->out.empty() && c->state == load_CLOSING)
+        shutdown(c->fd, SHUT_WR);
+
+    load_watch(c, !c->out.empty());
+}
+
+/**
+ * send data to the server
+ *
+ * @param c the client
+ * @param data the data to send
+ */
+static void load_send(load_client *c, std::string const &data) {
+    if (c->fd < 0 || c->state == load_CLOSING)
+        return;
+
+    c->out += data;
+    if (c->state != load_CONNECTING)
+        load_flush(c);
+}
+
+/**
+ * close the stream of a client
+ *
+ * The connection is closed, when the server closed its stream as well.
+ *
+ * @param c the client
+ */
+static void load_close(load_client *c) {
+    if (c->state == load_ONLINE)
+        load_send(c, "<presence type='unavailable'/>");
+    load_send(c, "</stream:stream>");
+    c->state = load_CLOSING;
+    load_flush(c);
+}
+
+/**
+ * get the JID of a client
+ *
+ * @param run the run
+ * @param index the number of the client
+ * @param full if the full JID (including the resource) should be returned
+ * @return the JID
+ */
+static std::string load_jid(load_run *run, unsigned index, bool full) {
+    std::string jid = run->all[index % run->clients]->user + "@" LOAD_DOMAIN;
+
+    if (full)
+        jid += "/" LOAD_RESOURCE;
+    return jid;
+}
+
+/**
+ * get the timestamp to include in a stanza
+ *
+ * @param run the run
+ * @return the timestamp
+ */
+static std::string load_stamp(load_run *run) {
+    std::ostringstream stamp;
+
+    stamp << LOAD_STAMP << (load_now() - run->epoch);
+    return stamp.str();
+}
+
+/**
+ * calculate the latency of a timestamped stanza
+ *
+ * @param run the run
+ * @param stamp the timestamp (may be NULL)
+ * @param latency where to store the latency
+ * @return false if the stanza did not contain a timestamp
+ */
+static bool load_latency(load_run *run, char const *stamp,
+                         unsigned long long *latency) {
+    if (stamp == NULL || strncmp(stamp, LOAD_STAMP, strlen(LOAD_STAMP)) != 0)
+        return false;
+
+    *latency = load_now() - run->epoch -
+               strtoull(stamp + strlen(LOAD_STAMP), NULL, 10);
+    return true;
+}
+
+/**
+ * send a message to another client
+ *
+ * @param c the sending client
+ * @param to the JID of the receiver
+ */
+static void load_send_message(load_client *c, std::string const &to) {
+    load_send(c, "<message to='" + to + "' type='chat'><body>" +
+                     load_stamp(c->run) + "</body></message>");
+    c->run->sent++;
+}
+
+/**
+ * fetch the roster of a client
+ *
+ * The timestamp is used as the id of the request.
+ *
+ * @param c the client
+ */
+static void load_send_roster(load_client *c) {
+    load_send(c, "<iq type='get' id='" + load_stamp(c->run) +
+                     "'><query xmlns='" NS_ROSTER "'/></iq>");
+}
+
+/**
+ * broadcast a presence update of a client to its subscribers
+ *
+ * @param c the client
+ */
+static void load_send_presence(load_client *c) {
+    load_send(c, "<presence><status>" + load_stamp(c->run) +
+                     "</status><priority>1</priority></presence>");
+}
+
+/**
+ * get where to collect the results of a scenario type
+ *
+ * @param run the run
+ * @param type the scenario type
+ * @return the running scenario of this type, NULL if there is none
+ */
+static load_phase *load_current(load_run *run, load_phase_type type) {
+    if (run->phase != NULL && run->phase->type == type)
+        return run->phase;
+    return run->mixed[type];
+}
+
+/**
+ * handle the result of an iq request
+ *
+ * @param c the client
+ * @param x the iq stanza
+ */
+static void load_iq_result(load_client *c, xmlnode x) {
+    load_run *run = c->run;
+    load_phase *phase = NULL;
+    char const *id = xmlnode_get_attrib_ns(x, "id", NULL);
+    bool error = j_strcmp(xmlnode_get_attrib_ns(x, "type", NULL), "result");
+    unsigned long long latency = 0;
+
+    if (j_strcmp(id, "reg") == 0 && c->state == load_REGISTER) {
+        if (error) {
+            c->failure = "registration failed";
+            c->dead = true;
+            return;
+        }
+        load_setup_done(c, true);
+        load_close(c);
+    } else if (j_strcmp(id, "auth") == 0 && c->state == load_AUTH) {
+        if (error) {
+            c->failure = "authentication failed";
+            c->dead = true;
+            return;
+        }
+        c->state = load_ONLINE;
+        load_send(c, "<presence><priority>1</priority></presence>");
+        if (run->phase != NULL && run->phase->type == phase_OFFLINE) {
+            /* login done, now time the delivery of the offline messages */
+            if (run->in_progress > 0)
+                run->in_progress--;
+            c->started = load_now();
+            if (c->offline_expected == 0)
+                run->finished++;
+        } else {
+            load_setup_done(c, true);
+        }
+    } else if ((phase = load_current(run, phase_ROSTER)) != NULL &&
+               load_latency(run, id, &latency)) {
+        if (error) {
+            phase->errors++;
+        } else {
+            phase->latencies.push_back(latency);
+        }
+        run->finished++;
+        run->received++;
+    }
+}
+
+/**
+ * handle a stanza received by a client
+ *
+ * @param c the client
+ * @param x the stanza
+ */
+static void load_stanza(load_client *c, xmlnode x) {
+    load_run *run = c->run;
+    load_phase *phase = run->phase;
+    load_phase *current = NULL;
+    char const *name = xmlnode_get_localname(x);
+    char const *type = xmlnode_get_attrib_ns(x, "type", NULL);
+    unsigned long long latency = 0;
+
+    if (j_strcmp(name, "iq") == 0) {
+        load_iq_result(c, x);
+    } else if (j_strcmp(name, "presence") == 0) {
+        char const *from = xmlnode_get_attrib_ns(x, "from", NULL);
+
+        if (j_strcmp(type, "subscribe") == 0 && from != NULL) {
+            load_send(c, std::string("<presence to='") + from +
+                             "' type='subscribed'/>");
+            c->subscribers++;
+        } else if (j_strcmp(type, "subscribed") == 0) {
+            run->subscriptions++;
+            if (phase != NULL && phase->type == phase_SUBSCRIBE) {
+                phase->latencies.push_back(load_now() - c->started);
+                run->finished++;
+            }
+        } else if (type == NULL &&
+                   (current = load_current(run, phase_PRESENCE)) != NULL &&
+                   load_latency(run,
+                                xmlnode_get_data(xmlnode_get_tag(x, "status")),
+                                &latency)) {
+            current->latencies.push_back(latency);
+            run->received++;
+        }
+    } else if (j_strcmp(name, "message") == 0) {
+        if (phase != NULL && phase->type == phase_OFFLINE &&
+            c->offline_expected > 0) {
+            if (--c->offline_expected == 0) {
+                phase->latencies.push_back(load_now() - c->started);
+                run->finished++;
+            }
+            run->received++;
+        } else if ((current = load_current(run, phase_MESSAGE)) != NULL &&
+                   load_latency(run,
+                                xmlnode_get_data(xmlnode_get_tag(x, "body")),
+                                &latency)) {
+            current->latencies.push_back(latency);
+            run->received++;
+        }
+    }
+}
+
+/**
+ * callback of the xstream parser of a client
+ *
+ * @param type type of the event (XSTREAM_ROOT, XSTREAM_NODE, ...)
+ * @param x the parsed element
+ * @param arg the client
+ */
+static void load_stream_event(int type, xmlnode x, void *arg) {
+    load_client *c = static_cast<load_client *>(arg);
+
+    switch (type) {
+        case XSTREAM_ROOT:
+            if (c->state != load_STREAM)
+                break;
+            if (c->do_register) {
+                c->state = load_REGISTER;
+                load_send(c, "<iq type='set' id='reg'><query xmlns='" NS_REGISTER
+                             "'><username>" +
+                                 c->user + "</username><password>" + c->user +
+                                 "</password></query></iq>");
+            } else {
+                c->state = load_AUTH;
+                load_send(c, "<iq type='set' id='auth'><query xmlns='" NS_AUTH
+                             "'><username>" +
+                                 c->user + "</username><password>" + c->user +
+                                 "</password><resource>" LOAD_RESOURCE
+                                 "</resource></query></iq>");
+            }
+            break;
+        case XSTREAM_NODE:
+            load_stanza(c, x);
+            break;
+        case XSTREAM_CLOSE:
+        case XSTREAM_ERR:
+            c->dead = true;
+            break;
+    }
+
+    xmlnode_free(x);
+}
+
+/**
+ * start to connect a client to the server
+ *
+ * @param c the client
+ */
+static void load_connect(load_client *c) {
+    struct sockaddr_in sa;
+    struct epoll_event ev;
+    int one = 1;
+
+    c->run->in_progress++;
+    c->started = load_now();
+    c->dead = false;
+    c->want_write = true;
+
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd < 0) {
+        c->state = load_CONNECTING;
+        load_fail(c, strerror(errno));
+        return;
+    }
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(c->run->port);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    c->state = load_CONNECTING;
+    if (connect(c->fd, reinterpret_cast<struct sockaddr *>(&sa), sizeof(sa)) !=
+            0 &&
+        errno != EINPROGRESS) {
+        load_fail(c, strerror(errno));
+        return;
+    }
+
+    c->p = pool_new();
+    c->xs = xstream_new(c->p, load_stream_event, c);
+    c->out = "<?xml version='1.0'?><stream:stream xmlns='" NS_CLIENT
+             "' xmlns:stream='" NS_STREAM "' to='" LOAD_DOMAIN "'>";
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.ptr = c;
+    epoll_ctl(c->run->epoll, EPOLL_CTL_ADD, c->fd, &ev);
+}
+
+/**
+ * start connecting waiting clients, as long as connection slots are free
+ *
+ * @param run the run
+ */
+static void load_pump(load_run *run) {
+    while (!run->waiting.empty() && run->in_progress < run->concurrency) {
+        load_client *c = run->waiting.front();
+        run->waiting.pop_front();
+        load_connect(c);
+    }
+}
+
+/**
+ * handle events on the connection of a client
+ *
+ * @param c the client
+ * @param events the events reported by epoll
+ */
+static void load_event(load_client *c, uint32_t events) {
+    char buffer[LOAD_BUFSIZE];
+
+    if (c->state == load_CONNECTING && (events & (EPOLLOUT | EPOLLERR))) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+        if (error != 0) {
+            load_fail(c, strerror(error));
+            return;
+        }
+        c->state = load_STREAM;
+    }
+
+    if (events & EPOLLOUT)
+        load_flush(c);
+
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        ssize_t len = recv(c->fd, buffer, sizeof(buffer), 0);
+
+        if (len == 0) {
+            if (c->state == load_CLOSING) {
+                c->run->closed++;
+                load_disconnect(c);
+            } else {
+                load_fail(c, "connection closed by server");
+            }
+            return;
+        }
+        if (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+            errno != EINTR) {
+            load_fail(c, strerror(errno));
+            return;
+        }
+        if (len > 0 && c->xs != NULL)
+            xstream_eat(c->xs, buffer, len);
+    }
+
+    if (c->dead && c->fd >= 0) {
+        if (c->state == load_CLOSING) {
+            c->run->closed++;
+            load_disconnect(c);
+        } else {
+            load_fail(c, c->failure != NULL ? c->failure : "stream error");
+        }
+    }
+}
+
+/**
+ * pick the type of the next operation in the mixed phase by the weights
+ *
+ * @param run the run
+ * @return the scenario type, phase_MESSAGE if no mix has been given
+ */
+static load_phase_type load_pick(load_run *run) {
+    unsigned total = 0;
+    unsigned pick = 0;
+
+    for (int t = phase_ROSTER; t <= phase_MESSAGE; t++)
+        total += run->weight[t];
+    if (total == 0)
+        return phase_MESSAGE;
+
+    pick = random() % total;
+    for (int t = phase_ROSTER; t <= phase_MESSAGE; t++) {
+        if (pick < run->weight[t])
+            return static_cast<load_phase_type>(t);
+        pick -= run->weight[t];
+    }
+    return phase_MESSAGE;
+}
+
+/**
+ * start the operations that are due in the message scenario or the mixed
+ * phase
+ *
+ * @param run the run
+ */
+static void load_send_due(load_run *run) {
+    unsigned long long now = load_now();
+    unsigned long long interval = 1000000ULL / run->rate;
+
+    for (std::vector<load_client *>::iterator c = run->all.begin();
+         c != run->all.end(); ++c) {
+        unsigned to = random() % run->clients;
+
+        if ((*c)->state != load_ONLINE || (*c)->next_message > now)
+            continue;
+
+        switch (load_pick(run)) {
+            case phase_ROSTER:
+                load_send_roster(*c);
+                run->sent++;
+                break;
+            case phase_PRESENCE:
+                load_send_presence(*c);
+                run->sent += (*c)->subscribers;
+                break;
+            default:
+                /* only send to online clients, others would get offline
+                 * messages */
+                for (int tries = 0;
+                     tries < 8 && run->all[to]->state != load_ONLINE; tries++)
+                    to = random() % run->clients;
+
+                load_send_message(*c, load_jid(run, to, true));
+        }
+
+        (*c)->next_message += interval;
+        if ((*c)->next_message < now)
+            (*c)->next_message = now + interval;
+    }
+}
+
+/**
+ * process events until a condition is met or the timeout expired
+ *
+ * @param run the run
+ * @param done the condition to wait for (NULL to wait until the timeout)
+ * @param timeout how long to wait at most (in seconds)
+ * @return false if the timeout expired or the server terminated
+ */
+static bool load_wait(load_run *run, load_condition done, double timeout) {
+    unsigned long long deadline =
+        load_now() + static_cast<unsigned long long>(timeout * 1000000);
+    struct epoll_event events[LOAD_EVENTS];
+
+    while (done == NULL || !(*done)(run)) {
+        int status = 0;
+        int count = 0;
+
+        if (load_now() >= deadline)
+            return done == NULL;
+
+        if (waitpid(run->server, &status, WNOHANG) == run->server) {
+            std::cerr << "server terminated" << std::endl;
+            run->server = 0;
+            return false;
+        }
+
+        load_pump(run);
+        if (run->sending)
+            load_send_due(run);
+
+        count = epoll_wait(run->epoll, events, LOAD_EVENTS, 10);
+        for (int i = 0; i < count; i++)
+            load_event(static_cast<load_client *>(events[i].data.ptr),
+                       events[i].events);
+    }
+    return true;
+}
+
+/**
+ * condition: all clients that were set up have finished
+ */
+static bool load_setup_finished(load_run *run) {
+    return run->waiting.empty() && run->in_progress == 0;
+}
+
+/**
+ * condition: the expected number of operations have been finished
+ */
+static bool load_ops_finished(load_run *run) {
+    return run->finished + run->phase->errors >= run->phase->ops;
+}
+
+/**
+ * condition: all sent stanzas have been received
+ */
+static bool load_all_received(load_run *run) {
+    return run->received >= run->sent;
+}
+
+/**
+ * condition: all clients, that closed their stream, have been disconnected
+ */
+static bool load_all_closed(load_run *run) {
+    for (std::vector<load_client *>::iterator c = run->all.begin();
+         c != run->all.end(); ++c) {
+        if ((*c)->state == load_CLOSING)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * condition: all pending data has been written
+ */
+static bool load_all_flushed(load_run *run) {
+    for (std::vector<load_client *>::iterator c = run->all.begin();
+         c != run->all.end(); ++c) {
+        if (!(*c)->out.empty())
+            return false;
+    }
+    return true;
+}
+
+/**
+ * start a scenario
+ *
+ * @param run the run
+ * @param phases where the results are collected
+ * @param type the scenario to start
+ */
+static void load_begin(load_run *run, std::vector<load_phase> &phases,
+                       load_phase_type type) {
+    phases.push_back(load_phase());
+    run->phase = &phases.back();
+    run->phase->type = type;
+    run->phase->name = load_phase_names[type];
+    run->phase->ops = 0;
+    run->phase->errors = 0;
+    run->phase->started = load_now();
+    run->phase->seconds = 0;
+    run->phase->rss_kb = -1;
+    run->phase->hwm_kb = -1;
+    run->finished = 0;
+    run->sent = 0;
+    run->received = 0;
+    run->closed = 0;
+}
+
+/**
+ * finish a scenario
+ *
+ * @param run the run
+ * @param ops the number of finished operations to report
+ * @param ok false if the scenario did not finish in time
+ */
+static void load_end(load_run *run, unsigned long ops, bool ok) {
+    load_phase *phase = run->phase;
+
+    phase->seconds = (load_now() - phase->started) / 1000000.0;
+    phase->ops = ops;
+    phase->rss_kb = load_proc_status(run->server, "VmRSS");
+    phase->hwm_kb = load_proc_status(run->server, "VmHWM");
+    std::sort(phase->latencies.begin(), phase->latencies.end());
+    if (!ok)
+        std::cerr << phase->name << ": not finished within " << run->timeout
+                  << " seconds" << std::endl;
+    run->phase = NULL;
+}
+
+/**
+ * connect a set of clients and register or authenticate them
+ *
+ * @param run the run
+ * @param first first client to connect
+ * @param step connect every step-th client
+ * @param do_register register the accounts instead of logging in
+ * @return false if not all clients finished in time
+ */
+static bool load_login(load_run *run, unsigned first, unsigned step,
+                       bool do_register) {
+    for (unsigned i = first; i < run->clients; i += step) {
+        run->all[i]->do_register = do_register;
+        run->all[i]->state = load_WAITING;
+        run->waiting.push_back(run->all[i]);
+    }
+    return load_wait(run, load_setup_finished, run->timeout);
+}
+
+/**
+ * check if a scenario has been selected using --mix
+ *
+ * @param run the run
+ * @param type the scenario type
+ * @return true if the scenario should be run
+ */
+static bool load_selected(load_run *run, load_phase_type type) {
+    return run->mix.empty() || run->weight[type] > 0;
+}
+
+/**
+ * build the rosters: each client subscribes to the presence of the next
+ * clients
+ *
+ * @param run the run
+ * @param phases where the results are collected
+ */
+static void load_subscribe(load_run *run, std::vector<load_phase> &phases) {
+    bool ok = false;
+
+    load_begin(run, phases, phase_SUBSCRIBE);
+    for (std::vector<load_client *>::iterator c = run->all.begin();
+         c != run->all.end(); ++c) {
+        if ((*c)->state != load_ONLINE)
+            continue;
+        (*c)->started = load_now();
+        for (unsigned n = 1; n <= run->roster_size && n < run->clients; n++) {
+            load_send(*c, "<presence to='" +
+                              load_jid(run, (*c)->index + n, false) +
+                              "' type='subscribe'/>");
+            run->phase->ops++;
+        }
+    }
+    ok = load_wait(run, load_ops_finished, run->timeout);
+    load_end(run, run->finished, ok);
+}
+
+/**
+ * roster fetch: each client requests its roster once
+ *
+ * @param run the run
+ * @param phases where the results are collected
+ */
+static void load_roster(load_run *run, std::vector<load_phase> &phases) {
+    bool ok = false;
+
+    load_begin(run, phases, phase_ROSTER);
+    for (std::vector<load_client *>::iterator c = run->all.begin();
+         c != run->all.end(); ++c) {
+        if ((*c)->state != load_ONLINE)
+            continue;
+        load_send_roster(*c);
+        run->phase->ops++;
+    }
+    ok = load_wait(run, load_ops_finished, run->timeout);
+    load_end(run, run->finished, ok);
+}
+
+/**
+ * presence broadcast: each presence goes to all subscribers
+ *
+ * @param run the run
+ * @param phases where the results are collected
+ */
+static void load_presence(load_run *run, std::vector<load_phase> &phases) {
+    bool ok = false;
+
+    load_begin(run, phases, phase_PRESENCE);
+    for (std::vector<load_client *>::iterator c = run->all.begin();
+         c != run->all.end(); ++c) {
+        if ((*c)->state != load_ONLINE)
+            continue;
+        load_send_presence(*c);
+    }
+    run->sent = run->subscriptions;
+    ok = load_wait(run, load_all_received, run->timeout);
+    load_end(run, run->received, ok);
+}
+
+/**
+ * send messages, or the operations of the mix, for the configured duration
+ *
+ * @param run the run
+ * @return false if not everything has been received in time
+ */
+static bool load_traffic(load_run *run) {
+    for (std::vector<load_client *>::iterator c = run->all.begin();
+         c != run->all.end(); ++c) {
+        (*c)->next_message =
+            load_now() + random() % (static_cast<long>(1000000 / run->rate) + 1);
+    }
+    run->sending = true;
+    load_wait(run, NULL, run->duration);
+    run->sending = false;
+    return load_wait(run, load_all_received, run->timeout);
+}
+
+/**
+ * one-to-one messages between random clients
+ *
+ * @param run the run
+ * @param phases where the results are collected
+ */
+static void load_message(load_run *run, std::vector<load_phase> &phases) {
+    bool ok = false;
+
+    load_begin(run, phases, phase_MESSAGE);
+    ok = load_traffic(run);
+    load_end(run, run->received, ok);
+}
+
+/**
+ * run the roster, presence and message scenarios of the mix at the same time
+ *
+ * @param run the run
+ * @param phases where the results are collected
+ */
+static void load_mixed(load_run *run, std::vector<load_phase> &phases) {
+    size_t first = phases.size();
+    bool ok = false;
+
+    for (int t = phase_ROSTER; t <= phase_MESSAGE; t++) {
+        if (run->weight[t] > 0)
+            load_begin(run, phases, static_cast<load_phase_type>(t));
+    }
+    if (phases.size() == first)
+        return;
+
+    /* take the pointers only now, load_begin() may move the results */
+    for (size_t i = first; i < phases.size(); i++)
+        run->mixed[phases[i].type] = &phases[i];
+    run->phase = NULL;
+
+    ok = load_traffic(run);
+
+    for (size_t i = first; i < phases.size(); i++) {
+        run->mixed[phases[i].type] = NULL;
+        run->phase = &phases[i];
+        load_end(run, phases[i].latencies.size() + phases[i].errors, ok);
+    }
+}
+
+/**
+ * offline storage: every second client goes offline, gets messages stored,
+ * and logs in again to receive them
+ *
+ * @param run the run
+ * @param phases where the results are collected
+ */
+static void load_offline(load_run *run, std::vector<load_phase> &phases) {
+    bool ok = false;
+
+    load_begin(run, phases, phase_OFFLINE);
+    for (unsigned i = 1; i < run->clients; i += 2) {
+        if (run->all[i]->state == load_ONLINE)
+            load_close(run->all[i]);
+    }
+    load_wait(run, load_all_closed, run->timeout);
+    /* give the session manager the time to end the sessions */
+    load_wait(run, NULL, 1);
+    for (unsigned i = 0; i + 1 < run->clients; i += 2) {
+        if (run->all[i]->state != load_ONLINE)
+            continue;
+        run->all[i + 1]->offline_expected += run->offline_messages;
+        for (unsigned n = 0; n < run->offline_messages; n++)
+            load_send_message(run->all[i], load_jid(run, i + 1, false));
+    }
+    load_wait(run, load_all_flushed, run->timeout);
+    /* give the session manager the time to store the messages */
+    load_wait(run, NULL, 1);
+    run->phase->started = load_now();
+    for (unsigned i = 1; i < run->clients; i += 2) {
+        if (run->all[i]->offline_expected > 0)
+            run->phase->ops++;
+    }
+    ok = load_login(run, 1, 2, false);
+    ok = load_wait(run, load_ops_finished, run->timeout) && ok;
+    load_end(run, run->received, ok);
+}
+
+/**
+ * run all selected scenarios
+ *
+ * @param run the run
+ * @param phases where the results are collected
+ * @return false if the server terminated
+ */
+static bool load_scenarios(load_run *run, std::vector<load_phase> &phases) {
+    bool ok = false;
+
+    /* in-band registration of all accounts */
+    load_begin(run, phases, phase_REGISTER);
+    ok = load_login(run, 0, 1, true);
+    ok = load_wait(run, load_all_closed, run->timeout) && ok;
+    load_end(run, run->finished, ok);
+    if (run->server == 0)
+        return false;
+
+    /* login storm */
+    load_begin(run, phases, phase_LOGIN);
+    ok = load_login(run, 0, 1, false);
+    load_end(run, run->finished, ok);
+    if (run->server == 0)
+        return false;
+
+    if (load_selected(run, phase_SUBSCRIBE)) {
+        load_subscribe(run, phases);
+        if (run->server == 0)
+            return false;
+    }
+
+    if (run->mix.empty()) {
+        load_roster(run, phases);
+        if (run->server == 0)
+            return false;
+        load_presence(run, phases);
+        if (run->server == 0)
+            return false;
+        load_message(run, phases);
+    } else {
+        load_mixed(run, phases);
+    }
+    if (run->server == 0)
+        return false;
+
+    if (load_selected(run, phase_OFFLINE))
+        load_offline(run, phases);
+
+    return run->server != 0;
+}
+
+/**
+ * get a percentile of the latencies of a scenario
+ *
+ * @param phase the scenario
+ * @param permille which percentile (in 1/1000)
+ * @return the latency in milliseconds
+ */
+static double load_percentile(load_phase const &phase, int permille) {
+    size_t index = 0;
+
+    if (phase.latencies.empty())
+        return 0;
+
+    index = (phase.latencies.size() * permille + 999) / 1000;
+    if (index > 0)
+        index--;
+    return phase.latencies[index] / 1000.0;
+}
+
+/**
+ * print the results as a table
+ *
+ * @param run the run
+ * @param phases the results of the scenarios
+ */
+static void load_print_console(load_run *run,
+                               std::vector<load_phase> const &phases) {
+    char line[256];
+
+    std::cout << run->clients << " clients, roster size " << run->roster_size
+              << ", " << run->rate << " messages/s per client";
+    if (!run->mix.empty())
+        std::cout << ", mix " << run->mix;
+    std::cout << std::endl;
+    snprintf(line, sizeof(line), "%-10s %10s %7s %9s %11s %9s %9s %9s %9s",
+             "Scenario", "Ops", "Errors", "Seconds", "Ops/s", "p50 ms",
+             "p99 ms", "Max ms", "RSS MB");
+    std::cout << line << std::endl;
+
+    for (std::vector<load_phase>::const_iterator p = phases.begin();
+         p != phases.end(); ++p) {
+        snprintf(line, sizeof(line),
+                 "%-10s %10lu %7lu %9.2f %11.1f %9.2f %9.2f %9.2f %9.1f",
+                 p->name.c_str(), p->ops, p->errors, p->seconds,
+                 p->seconds > 0 ? p->ops / p->seconds : 0,
+                 load_percentile(*p, 500), load_percentile(*p, 990),
+                 load_percentile(*p, 1000), p->rss_kb / 1024.0);
+        std::cout << line << std::endl;
+    }
+
+    if (!phases.empty())
+        std::cout << "peak RSS of the server: "
+                  << phases.back().hwm_kb / 1024.0 << " MB" << std::endl;
+}
+
+/**
+ * print the results in JSON format
+ *
+ * @param out where to write the results
+ * @param run the run
+ * @param phases the results of the scenarios
+ */
+static void load_print_json(std::ostream &out, load_run *run,
+                            std::vector<load_phase> const &phases) {
+    out << "{\n  \"context\": {\n"
+              << "    \"clients\": " << run->clients << ",\n"
+              << "    \"roster_size\": " << run->roster_size << ",\n"
+              << "    \"message_rate\": " << run->rate << ",\n"
+              << "    \"duration\": " << run->duration << ",\n"
+              << "    \"offline_messages\": " << run->offline_messages << ",\n"
+              << "    \"mix\": \"" << run->mix << "\"\n"
+              << "  },\n  \"scenarios\": [";
+
+    for (std::vector<load_phase>::const_iterator p = phases.begin();
+         p != phases.end(); ++p) {
+        out << (p == phases.begin() ? "\n" : ",\n") << "    {\n"
+                  << "      \"name\": \"" << p->name << "\",\n"
+                  << "      \"ops\": " << p->ops << ",\n"
+                  << "      \"errors\": " << p->errors << ",\n"
+                  << "      \"seconds\": " << p->seconds << ",\n"
+                  << "      \"ops_per_second\": "
+                  << (p->seconds > 0 ? p->ops / p->seconds : 0) << ",\n"
+                  << "      \"p50_ms\": " << load_percentile(*p, 500) << ",\n"
+                  << "      \"p99_ms\": " << load_percentile(*p, 990) << ",\n"
+                  << "      \"max_ms\": " << load_percentile(*p, 1000)
+                  << ",\n"
+                  << "      \"rss_kb\": " << p->rss_kb << ",\n"
+                  << "      \"peak_rss_kb\": " << p->hwm_kb << "\n    }";
+    }
+    out << "\n  ]\n}" << std::endl;
+}
+
+/**
+ * parse the scenario mix given with --mix
+ *
+ * @param run the run, where the weights are stored
+ * @param mix comma separated list of scenario[:weight]
+ * @return false if the mix is invalid
+ */
+static bool load_parse_mix(load_run *run, std::string const &mix) {
+    std::istringstream items(mix);
+    std::string item;
+
+    while (std::getline(items, item, ',')) {
+        std::string::size_type colon = item.find(':');
+        std::string name = item.substr(0, colon);
+        int weight = 1;
+        int t = 0;
+
+        if (colon != std::string::npos)
+            weight = atoi(item.substr(colon + 1).c_str());
+        while (t < LOAD_PHASES && name != load_phase_names[t])
+            t++;
+        if (t == LOAD_PHASES || weight <= 0) {
+            std::cerr << "invalid scenario in mix: " << item << std::endl;
+            return false;
+        }
+        run->weight[t] = weight;
+    }
+
+    run->mix = mix;
+    return true;
+}
+
+/**
+ * raise the limit of open files, so that all clients can be connected
+ *
+ * The limit is inherited by the server as well.
+ *
+ * @param run the run
+ */
+static void load_raise_nofile(load_run *run) {
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0)
+        return;
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+
+    if (limit.rlim_cur < run->clients + 64)
+        std::cerr << "warning: only " << limit.rlim_cur
+                  << " open files allowed, some clients will fail"
+                  << std::endl;
+}
+
+int main(int argc, char const **argv) {
+    load_run run;
+    std::vector<load_phase> phases;
+    std::string format("console");
+    std::string json_file;
+    std::string cfgfile;
+    bool keep = false;
+    bool ok = false;
+    char dir_template[] = "/tmp/jabberd-load.XXXXXX";
+
+    run.jabberd = LOAD_JABBERD;
+    run.modules = LOAD_MODULES_DIR;
+    run.clients = 1000;
+    run.concurrency = 100;
+    run.roster_size = 10;
+    run.rate = 1;
+    run.duration = 30;
+    run.offline_messages = 5;
+    run.timeout = 120;
+    run.port = 20000 + getpid() % 20000;
+    run.server = 0;
+    run.in_progress = 0;
+    run.finished = 0;
+    run.subscriptions = 0;
+    run.sent = 0;
+    run.received = 0;
+    run.closed = 0;
+    run.sending = false;
+    run.phase = NULL;
+    for (int t = 0; t < LOAD_PHASES; t++) {
+        run.weight[t] = 0;
+        run.mixed[t] = NULL;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg(argv[i]);
+
+        if (arg.compare(0, 10, "--jabberd=") == 0)
+            run.jabberd = arg.substr(10);
+        else if (arg.compare(0, 10, "--modules=") == 0)
+            run.modules = arg.substr(10);
+        else if (arg.compare(0, 10, "--clients=") == 0)
+            run.clients = atoi(arg.substr(10).c_str());
+        else if (arg.compare(0, 14, "--concurrency=") == 0)
+            run.concurrency = atoi(arg.substr(14).c_str());
+        else if (arg.compare(0, 14, "--roster-size=") == 0)
+            run.roster_size = atoi(arg.substr(14).c_str());
+        else if (arg.compare(0, 7, "--rate=") == 0)
+            run.rate = atof(arg.substr(7).c_str());
+        else if (arg.compare(0, 11, "--duration=") == 0)
+            run.duration = atoi(arg.substr(11).c_str());
+        else if (arg.compare(0, 19, "--offline-messages=") == 0)
+            run.offline_messages = atoi(arg.substr(19).c_str());
+        else if (arg.compare(0, 10, "--timeout=") == 0)
+            run.timeout = atoi(arg.substr(10).c_str());
+        else if (arg.compare(0, 7, "--port=") == 0)
+            run.port = atoi(arg.substr(7).c_str());
+        else if (arg == "--keep")
+            keep = true;
+        else if (arg.compare(0, 9, "--format=") == 0)
+            format = arg.substr(9);
+        else if (arg.compare(0, 7, "--json=") == 0)
+            json_file = arg.substr(7);
+        else if (arg.compare(0, 6, "--mix=") == 0) {
+            if (!load_parse_mix(&run, arg.substr(6)))
+                return 1;
+        } else {
+            std::cerr << "Usage: " << argv[0]
+                      << " [--jabberd=path] [--modules=dir] [--clients=n]"
+                         " [--concurrency=n] [--roster-size=n] [--rate=msgs]"
+                         " [--duration=sec] [--offline-messages=n]"
+                         " [--timeout=sec] [--port=port] [--keep]"
+                         " [--format=console|json] [--json=file]"
+                         " [--mix=scenario[:weight],...]"
+                      << std::endl;
+            return 1;
+        }
+    }
+
+    if (run.clients < 2 || run.concurrency < 1 || run.rate <= 0) {
+        std::cerr << "need at least two clients, a concurrency of at least "
+                     "one and a positive message rate"
+                  << std::endl;
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    srandom(getpid());
+    load_raise_nofile(&run);
+
+    if (mkdtemp(dir_template) == NULL) {
+        std::cerr << "cannot create temporary directory: " << strerror(errno)
+                  << std::endl;
+        return 1;
+    }
+    run.dir = dir_template;
+
+    for (unsigned i = 0; i < run.clients; i++) {
+        load_client *c = new load_client();
+        std::ostringstream user;
+
+        user << "load" << i;
+        c->run = &run;
+        c->index = i;
+        c->user = user.str();
+        c->fd = -1;
+        c->state = load_DISCONNECTED;
+        c->do_register = false;
+        c->dead = false;
+        c->failure = NULL;
+        c->want_write = false;
+        c->p = NULL;
+        c->xs = NULL;
+        c->started = 0;
+        c->next_message = 0;
+        c->offline_expected = 0;
+        c->subscribers = 0;
+        run.all.push_back(c);
+    }
+
+    run.epoll = epoll_create1(0);
+    cfgfile = load_write_config(&run);
+    if (run.epoll >= 0 && !cfgfile.empty() &&
+        load_start_server(&run, cfgfile)) {
+        run.epoch = load_now();
+        ok = load_scenarios(&run, phases);
+    }
+
+    for (std::vector<load_client *>::iterator c = run.all.begin();
+         c != run.all.end(); ++c) {
+        load_disconnect(*c);
+        delete *c;
+    }
+    load_stop_server(&run);
+    if (run.epoll >= 0)
+        close(run.epoll);
+
+    if (format == "json")
+        load_print_json(std::cout, &run, phases);
+    else
+        load_print_console(&run, phases);
+
+    if (!json_file.empty()) {
+        std::ofstream json(json_file.c_str());
+        load_print_json(json, &run, phases);
+    }
+
+    if (keep)
+        std::cerr << "server configuration and logs kept in " << run.dir
+                  << std::endl;
+    else
+        nftw(run.dir.c_str(), load_remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+    return ok ? 0 : 1;
+}
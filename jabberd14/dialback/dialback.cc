@@ -246,6 +246,135 @@ char *dialback_merlin(pool p, char const *secret, char const *to,
     return result;
 }
 
+/**
+ * build the key for a dialback key cache
+ *
+ * @param id the stream id
+ * @param to the destination of the stream
+ * @param from the source of the stream
+ * @return the key for the cache
+ */
+static std::string dialback_key_cache_key(char const *id, char const *to,
+                                          char const *from) {
+    std::string result(id ? id : "");
+
+    result += ' ';
+    result += to ? to : "";
+    result += ' ';
+    result += from ? from : "";
+    return result;
+}
+
+/**
+ * get our dialback key for a stream, using the cache of recently generated
+ * keys
+ *
+ * The same key is needed when sending our db:result and when the peer asks us
+ * to verify it. Peers reconnecting often ask for the same key again.
+ *
+ * Only keys for our own outgoing streams are added to the cache, the values
+ * of a db:verify request are chosen by the peer and would let it grow the
+ * cache without limit.
+ *
+ * @param d the dialback instance
+ * @param p the memory pool used for the result
+ * @param to the destination of the stream
+ * @param from the source host of the stream
+ * @param challenge the stream ID that should be verified
+ * @param remember 1 to add a generated key to the cache, 0 to only use it
+ * @return the dialback key
+ */
+char *dialback_merlin_cached(db d, pool p, char const *to, char const *from,
+                             char const *challenge, int remember) {
+    std::string cache_key = dialback_key_cache_key(challenge, to, from);
+    dialback_key_cache::iterator entry = d->keys_generated->find(cache_key);
+    char *result = NULL;
+
+    if (entry != d->keys_generated->end()) {
+        d->keys_generated_hits++;
+        return pstrdup(p, entry->second.key.c_str());
+    }
+
+    result = dialback_merlin(p, d->secret, to, from, challenge);
+    if (result != NULL && remember) {
+        dialback_key_cache_entry &new_entry = (*d->keys_generated)[cache_key];
+        new_entry.stamp = time(NULL);
+        new_entry.key = result;
+    }
+    return result;
+}
+
+/**
+ * remember that the authoritative server verified a dialback key
+ *
+ * @param d the dialback instance
+ * @param id the id of the incoming stream
+ * @param to our domain
+ * @param from the domain of the peer
+ * @param key the dialback key, that has been verified
+ */
+void dialback_key_verified(db d, char const *id, char const *to,
+                           char const *from, char const *key) {
+    if (key == NULL)
+        return;
+
+    dialback_key_cache_entry &entry =
+        (*d->keys_verified)[dialback_key_cache_key(id, to, from)];
+    entry.stamp = time(NULL);
+    entry.key = key;
+}
+
+/**
+ * check if a dialback key has been verified recently on the same stream
+ *
+ * @param d the dialback instance
+ * @param id the id of the incoming stream
+ * @param to our domain
+ * @param from the domain of the peer
+ * @param key the dialback key
+ * @return 1 if the key has been verified, 0 else
+ */
+int dialback_key_is_verified(db d, char const *id, char const *to,
+                             char const *from, char const *key) {
+    dialback_key_cache::const_iterator entry =
+        d->keys_verified->find(dialback_key_cache_key(id, to, from));
+
+    if (key == NULL || entry == d->keys_verified->end())
+        return 0;
+    if (time(NULL) - entry->second.stamp > DIALBACK_KEY_CACHE_TTL)
+        return 0;
+    return entry->second.key == key ? 1 : 0;
+}
+
+/**
+ * remove expired entries from a key cache
+ *
+ * @param cache the cache
+ * @param now the current time
+ */
+static void _dialback_key_cache_expire(dialback_key_cache *cache, time_t now) {
+    dialback_key_cache::iterator cur = cache->begin();
+
+    while (cur != cache->end()) {
+        if (now - cur->second.stamp > DIALBACK_KEY_CACHE_TTL)
+            cache->erase(cur++);
+        else
+            ++cur;
+    }
+}
+
+/**
+ * remove expired entries from the caches of generated and verified keys
+ *
+ * @param d the dialback instance
+ */
+void dialback_key_cache_expire(db d) {
+    time_t now = time(NULL);
+
+    _dialback_key_cache_expire(d->keys_generated, now);
+    _dialback_key_cache_expire(d->keys_verified, now);
+}
+
 /**
  * write to a managed I/O connection and update the idle time values
  *
@@ -398,11 +527,9 @@ char *dialback_ip_get(db d, jid host, char *ip) {
     if (ip != NULL)
         return ip;
 
-    ret =
-        pstrdup(host->get_pool(),
-                xmlnode_get_attrib_ns(
-                    (xmlnode)xhash_get(d->nscache, host->get_domain().c_str()),
-                    "i", NULL));
+    ret = NULL;
+    dnscache_get(d->nscache, host->get_pool(), host->get_domain().c_str(),
+                 &ret, NULL);
     log_debug2(ZONE, LOGT_IO, "returning cached ip %s for %s", ret,
                host->get_domain().c_str());
     return ret;
@@ -417,25 +544,13 @@ char *dialback_ip_get(db d, jid host, char *ip) {
  * @param ip the IP address
  */
 void dialback_ip_set(db d, jid host, char *ip) {
-    xmlnode cache, old;
-
     if (host == NULL || ip == NULL)
         return;
 
-    /* first, get existing cache so we can dump it later */
-    old = (xmlnode)xhash_get(d->nscache, host->get_domain().c_str());
-
-    /* new cache */
-    cache = xmlnode_new_tag_ns("d", NULL, NS_JABBERD_WRAPPER);
-    xmlnode_put_attrib_ns(cache, "h", NULL, NULL, host->get_domain().c_str());
-    xmlnode_put_attrib_ns(cache, "i", NULL, NULL, ip);
-    xhash_put(d->nscache, xmlnode_get_attrib_ns(cache, "h", NULL),
-              (void *)cache);
+    dnscache_put(d->nscache, host->get_domain().c_str(), ip, NULL,
+                 d->nscache_ttl);
     log_debug2(ZONE, LOGT_IO, "cached ip %s for %s", ip,
                host->get_domain().c_str());
-
-    /* free any old entry that's been replaced */
-    xmlnode_free(old);
 }
 
 /**
@@ -1507,6 +1622,17 @@ void _dialback_beat_in_idle(xht h, const char *key, void *data, void *arg) {
 void _dialback_beat_out_idle(xht h, const char *key, void *data, void *arg) {
     dboc c = (dboc)data;
     if (((int)*(time_t *)arg - c->stamp) >= c->d->timeout_auth) {
+        /* don't close a connection shared with other local domains */
+        if (c->flags.shared || c->flags.deferred) {
+            /* without resolved addresses we cannot connect on our own, the
+             * same as when a shared connection gets closed */
+            if (c->ip == NULL)
+                dialback_out_connection_cleanup(c);
+            else
+                dialback_out_unshare(c);
+            return;
+        }
+
         log_debug2(ZONE, LOGT_IO, "Idle Timeout on socket %d to %s", c->m->fd,
                    mio_ip(c->m));
         mio_write(c->m, NULL, "</stream:stream>", -1);
@@ -1514,6 +1640,46 @@ void _dialback_beat_out_idle(xht h, const char *key, void *data, void *arg) {
     }
 }
 
+/**
+ * callback for walking outgoing connections, that are not authorized yet,
+ * collecting the queue statistics still in use
+ *
+ * @param h the hash table containing all connections
+ * @param key unused/ignored (the key of the value in the hash table)
+ * @param data the value in the hash table = the structure holding the
+ * connection
+ * @param arg the std::set the statistics get added to
+ */
+static void _dialback_beat_queue_stats_used(xht h, const char *key,
+                                            void *data, void *arg) {
+    static_cast<std::set<dialback_queue_stats *> *>(arg)->insert(
+        static_cast<dboc>(data)->stats);
+}
+
+/**
+ * drop the queue statistics of peers we did not try to reach for the idle
+ * timeout, so that they do not accumulate for each peer ever contacted
+ *
+ * @param d the dialback instance
+ * @param now the current time
+ */
+static void _dialback_beat_queue_stats(db d, time_t now) {
+    std::set<dialback_queue_stats *> used;
+
+    xhash_walk(d->out_connecting, _dialback_beat_queue_stats_used, &used);
+
+    std::map<std::string, dialback_queue_stats>::iterator cur =
+        d->queue_stats->begin();
+    while (cur != d->queue_stats->end()) {
+        std::map<std::string, dialback_queue_stats>::iterator entry = cur++;
+
+        if (entry->second.stanzas == 0 &&
+            now - entry->second.last >= d->timeout_idle &&
+            used.find(&entry->second) == used.end())
+            d->queue_stats->erase(entry);
+    }
+}
+
 /**
  * initiate walking the hash of existing s2s connections to check if they have
  * been idle to long
@@ -1534,6 +1700,9 @@ result dialback_beat_idle(void *arg) {
     xhash_walk(d->in_ok_db, _dialback_beat_idle, (void *)&ttmp);
     xhash_walk(d->in_id, _dialback_beat_in_idle, (void *)&ttmp);
     xhash_walk(d->out_connecting, _dialback_beat_out_idle, (void *)&ttmp);
+    _dialback_beat_queue_stats(d, ttmp);
+    dialback_key_cache_expire(d);
+    dnscache_expire(d->nscache, 0, NULL, NULL);
     return r_DONE;
 }
 
@@ -1555,6 +1724,90 @@ const char *dialback_get_loopcheck_token(db d) {
     return hmac;
 }
 
+/**
+ * free the statistics of the outgoing queues
+ *
+ * @param arg the std::map holding the statistics
+ */
+static void dialback_queue_stats_free(void *arg) {
+    delete static_cast<std::map<std::string, dialback_queue_stats> *>(arg);
+}
+
+/**
+ * free a cache of dialback keys
+ *
+ * @param arg the ::dialback_key_cache
+ */
+static void dialback_key_cache_free(void *arg) {
+    delete static_cast<dialback_key_cache *>(arg);
+}
+
+/**
+ * add the metrics of the outgoing queues of a dialback instance
+ *
+ * @param m the metrics to add to
+ * @param arg the dialback instance
+ */
+static void dialback_metrics(metrics m, void *arg) {
+    db d = static_cast<db>(arg);
+    std::string instance_label = metrics_label("instance", d->i->id);
+
+    metrics_add(m, "dialback_key_cache_hits_total", "counter",
+                "Dialback keys taken from the cache of generated keys.",
+                instance_label, d->keys_generated_hits);
+    metrics_add(m, "dialback_verify_cache_hits_total", "counter",
+                "Dialback requests answered from the cache of verified keys.",
+                instance_label, d->keys_verified_hits);
+    metrics_add(m, "dialback_verify_batched_total", "counter",
+                "Dialback requests answered together with an identical "
+                "request.",
+                instance_label, d->keys_batched);
+    metrics_add(m, "dialback_nscache_hits_total", "counter",
+                "Peer addresses found in the address cache.", instance_label,
+                dnscache_hits(d->nscache));
+    metrics_add(m, "dialback_nscache_misses_total", "counter",
+                "Peer addresses not found in the address cache.",
+                instance_label, dnscache_misses(d->nscache));
+    metrics_add(m, "dialback_nscache_evictions_total", "counter",
+                "Entries dropped from the full address cache.",
+                instance_label, dnscache_evictions(d->nscache));
+    metrics_add(m, "dialback_nscache_entries", "gauge",
+                "Entries in the address cache.", instance_label,
+                dnscache_entries(d->nscache));
+    metrics_add(m, "dialback_nscache_bytes", "gauge",
+                "Estimated memory used by the address cache.", instance_label,
+                dnscache_bytes(d->nscache));
+    metrics_add(m, "dialback_queue_total_bytes", "gauge",
+                "Bytes of all stanzas waiting for outgoing connections.",
+                instance_label, d->queue_bytes);
+
+    for (std::map<std::string, dialback_queue_stats>::const_iterator cur =
+             d->queue_stats->begin();
+         cur != d->queue_stats->end(); ++cur) {
+        std::string labels = instance_label + "," +
+                             metrics_label("peer", cur->first.c_str());
+
+        metrics_add(m, "dialback_queue_bytes", "gauge",
+                    "Bytes of stanzas waiting for a connection to a peer.",
+                    labels, cur->second.bytes);
+        metrics_add(m, "dialback_queue_stanzas", "gauge",
+                    "Stanzas waiting for a connection to a peer.", labels,
+                    cur->second.stanzas);
+        metrics_add(m, "dialback_queue_queued_total", "counter",
+                    "Stanzas queued for a connection to a peer.", labels,
+                    cur->second.queued);
+        metrics_add(m, "dialback_queue_rejected_total", "counter",
+                    "Stanzas bounced because the queue limit was reached.",
+                    labels, cur->second.rejected);
+        metrics_add(m, "dialback_queue_expired_total", "counter",
+                    "Stanzas bounced because of the queue timeout.", labels,
+                    cur->second.expired);
+        metrics_add(m, "dialback_queue_failed_total", "counter",
+                    "Stanzas bounced because the connection failed.", labels,
+                    cur->second.failed);
+    }
+}
+
 /**
  * init and register the dialback component in the server
  *
@@ -1585,6 +1838,8 @@ extern "C" void dialback(instance i, xmlnode x) {
     xhash_put(d->std_ns_prefixes, "", const_cast<char *>(NS_SERVER));
     xhash_put(d->std_ns_prefixes, "stream", const_cast<char *>(NS_STREAM));
     xhash_put(d->std_ns_prefixes, "db", const_cast<char *>(NS_DIALBACK));
+    xhash_put(d->std_ns_prefixes, "dbfeat",
+              const_cast<char *>(NS_DIALBACK_FEATURES));
     xhash_put(d->std_ns_prefixes, "wrap",
               const_cast<char *>(NS_JABBERD_WRAPPER));
     xhash_put(d->std_ns_prefixes, "tls", const_cast<char *>(NS_XMPP_TLS));
@@ -1600,12 +1855,19 @@ extern "C" void dialback(instance i, xmlnode x) {
         xmlnode_get_list_item_data(
             xmlnode_get_tags(cfg, "conf:maxhosts", d->std_ns_prefixes), 0),
         997);
-    d->nscache = xhash_new(max);
-    pool_cleanup(i->p, (pool_cleaner)xhash_free, d->nscache);
+    /* addresses of peers, that have been resolved by dnsrv */
+    cur = xmlnode_get_list_item(
+        xmlnode_get_tags(cfg, "conf:nscache", d->std_ns_prefixes), 0);
+    d->nscache = dnscache_new(
+        max, j_atoi(xmlnode_get_attrib_ns(cur, "memory", NULL), 262144));
+    pool_cleanup(i->p, (pool_cleaner)dnscache_free, d->nscache);
+    d->nscache_ttl = j_atoi(xmlnode_get_attrib_ns(cur, "timeout", NULL), 3600);
     d->out_connecting = xhash_new(67);
     pool_cleanup(i->p, (pool_cleaner)xhash_free, d->out_connecting);
     d->out_ok_db = xhash_new(max);
     pool_cleanup(i->p, (pool_cleaner)xhash_free, d->out_ok_db);
+    d->out_shared = xhash_new(max);
+    pool_cleanup(i->p, (pool_cleaner)xhash_free, d->out_shared);
     d->in_id = xhash_new(max);
     pool_cleanup(i->p, (pool_cleaner)xhash_free, d->in_id);
     d->in_ok_db = xhash_new(max);
@@ -1625,6 +1887,22 @@ extern "C" void dialback(instance i, xmlnode x) {
         xmlnode_get_list_item_data(
             xmlnode_get_tags(cfg, "conf:queuetimeout", d->std_ns_prefixes), 0),
         30);
+
+    /* limits for the memory used by stanzas waiting for a connection */
+    cur = xmlnode_get_list_item(
+        xmlnode_get_tags(cfg, "conf:queuelimit", d->std_ns_prefixes), 0);
+    d->queue_max_peer = j_atoi(xmlnode_get_attrib_ns(cur, "peer", NULL), 0);
+    if (d->queue_max_peer <= 0)
+        d->queue_max_peer = 1024 * 1024;
+    d->queue_max_total = j_atoi(xmlnode_get_attrib_ns(cur, "total", NULL), 0);
+    if (d->queue_max_total <= 0)
+        d->queue_max_total = 64 * 1024 * 1024;
+    d->queue_stats = new std::map<std::string, dialback_queue_stats>();
+    pool_cleanup(i->p, dialback_queue_stats_free, d->queue_stats);
+    d->keys_generated = new dialback_key_cache();
+    pool_cleanup(i->p, dialback_key_cache_free, d->keys_generated);
+    d->keys_verified = new dialback_key_cache();
+    pool_cleanup(i->p, dialback_key_cache_free, d->keys_verified);
     d->timeout_auth = j_atoi(
         xmlnode_get_list_item_data(
             xmlnode_get_tags(cfg, "conf:authtimeout", d->std_ns_prefixes), 0),
@@ -1750,6 +2028,7 @@ extern "C" void dialback(instance i, xmlnode x) {
                       : 60,
                   dialback_beat_idle, (void *)d);
     register_beat(d->timeout_packets, dialback_out_beat_packets, (void *)d);
+    register_metrics(dialback_metrics, (void *)d);
 
     xmlnode_free(cfg);
 }
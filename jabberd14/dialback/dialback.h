@@ -43,14 +43,56 @@
 
 #include <jabberd.h>
 
+#include <map>
+#include <set>
+#include <string>
+
+/**
+ * statistics about the stanzas queued for a peer, while there is no
+ * established connection
+ */
+typedef struct {
+    long bytes;             /**< memory used by currently queued stanzas */
+    long stanzas;           /**< number of currently queued stanzas */
+    unsigned long queued;   /**< stanzas that have been queued */
+    unsigned long rejected; /**< stanzas bounced as a queue limit has been
+                               reached */
+    unsigned long expired;  /**< stanzas bounced as no connection has been
+                               established in time */
+    unsigned long failed;   /**< stanzas bounced as establishing the
+                               connection failed */
+    time_t last;            /**< when a connect object to the peer has last
+                               been created or a stanza has been queued */
+} dialback_queue_stats;
+
+/**
+ * a dialback key, that has been generated or verified recently
+ */
+typedef struct {
+    time_t stamp;    /**< when the key has been generated or verified */
+    std::string key; /**< the dialback key */
+} dialback_key_cache_entry;
+
+/** key cache, key is "id to from" */
+typedef std::map<std::string, dialback_key_cache_entry> dialback_key_cache;
+
+/** how many seconds generated and verified dialback keys are cached */
+#define DIALBACK_KEY_CACHE_TTL 60
+
 /** s2s instance */
 typedef struct db_struct {
     instance i;         /**< data jabberd hold for each instance */
-    xht nscache;        /**< host/ip local resolution cache */
+    dnscache nscache;   /**< host/ip local resolution cache, limited by
+                           &lt;maxhosts/&gt; and &lt;nscache memory=''/&gt; */
+    int nscache_ttl;    /**< configuration option &lt;nscache timeout=''/&gt;:
+                           seconds to keep addresses in the nscache */
     xht out_connecting; /**< where unvalidated in-progress connections are, key
                            is to/from */
     xht out_ok_db; /**< hash table of all connected dialback hosts, key is same
                       to/from */
+    xht out_shared; /**< established outgoing dialback connections, that can
+                       be reused to authorize further local domains, key is
+                       the domain of the peer */
     xht in_id; /**< all the incoming connections waiting to be checked, rand id
                   attrib is key */
     xht in_ok_db;   /**< all the incoming dialback connections that are ok,
@@ -64,6 +106,26 @@ typedef struct db_struct {
     int timeout_packets; /**< configuration option &lt;queuetimeout/&gt;: how
                             long should stanzas wait for an established
                             connection */
+    long queue_max_peer;  /**< configuration option &lt;queuelimit
+                             peer=''/&gt;: how many bytes of stanzas may be
+                             queued for a single peer */
+    long queue_max_total; /**< configuration option &lt;queuelimit
+                             total=''/&gt;: how many bytes of stanzas may be
+                             queued for all peers together */
+    long queue_bytes;     /**< bytes of stanzas currently queued for all
+                             peers */
+    std::map<std::string, dialback_queue_stats>
+        *queue_stats; /**< queue statistics, key is the domain of the peer */
+    dialback_key_cache *keys_generated; /**< dialback keys we generated for
+                                           our outgoing streams */
+    dialback_key_cache *keys_verified;  /**< dialback keys of incoming streams,
+                                           the authoritative server told us to
+                                           be valid */
+    unsigned long keys_generated_hits; /**< keys taken from keys_generated */
+    unsigned long keys_verified_hits;  /**< db:result answered from
+                                          keys_verified */
+    unsigned long keys_batched; /**< db:result answered by the db:verify of an
+                                   identical db:result */
     int timeout_idle; /**< configuration option &lt;idletimeout/&gt;: after how
                          many seconds an authorized connection should be timed
                          out */
@@ -82,6 +144,8 @@ typedef struct miod_struct {
     int last;  /**< last time this connection has been used */
     int count; /**< number of sent stanzas on the connection */
     db d;      /**< the dialback instance */
+    char *stream_id; /**< stream id of an outgoing connection, needed to send
+                        further db:result elements on this connection */
 } * miod, _miod;
 
 void dialback_out_packet(db d, xmlnode x, char *ip);
@@ -96,6 +160,13 @@ int dialback_check_settings(db d, mio m, const char *server, int is_outgoing,
 char *dialback_randstr(void);
 char *dialback_merlin(pool p, char const *secret, char const *to,
                       char const *from, char const *challenge);
+char *dialback_merlin_cached(db d, pool p, char const *to, char const *from,
+                             char const *challenge, int remember);
+void dialback_key_verified(db d, char const *id, char const *to,
+                           char const *from, char const *key);
+int dialback_key_is_verified(db d, char const *id, char const *to,
+                             char const *from, char const *key);
+void dialback_key_cache_expire(db d);
 void dialback_miod_hash(miod md, xht ht, jid key);
 miod dialback_miod_new(db d, mio m);
 void dialback_miod_write(miod md, xmlnode x);
@@ -107,9 +178,10 @@ const char *dialback_get_loopcheck_token(db d);
 
 /** simple queue for out_queue */
 typedef struct dboq_struct {
-    int stamp;
-    xmlnode x;
-    struct dboq_struct *next;
+    int stamp;  /**< when the stanza has been queued */
+    long bytes; /**< memory used by the stanza */
+    xmlnode x;  /**< the queued stanza */
+    struct dboq_struct *next; /**< the next (newer) queued stanza */
 } * dboq, _dboq;
 
 /**
@@ -148,6 +220,8 @@ typedef enum {
     sasl_success      /**< we successfully used sasl */
 } db_connection_state;
 
+struct dboa_struct;
+
 /* for connecting db sockets */
 /**
  * structure holding information about an outgoing connection
@@ -162,7 +236,10 @@ typedef struct {
     xmlnode
         verifies; /**< waiting db:verify elements we have to send to the peer */
     pool p;       /**< memory pool we are using for this connections data */
-    dboq q;       /**< pending stanzas, that need to be sent to the peer */
+    dboq q;       /**< pending stanzas, that need to be sent to the peer
+                     (oldest first) */
+    dboq q_last;  /**< last (newest) element of q, new stanzas are appended */
+    dialback_queue_stats *stats; /**< queue statistics of the peer */
     mio m;        /**< the mio connection this outgoing stream is using */
     /* original comment: for that short time when we're connected and open, but
      * haven't auth'd ourselves yet */
@@ -178,11 +255,22 @@ typedef struct {
                                              connecting to the other host */
     std::ostringstream
         *connect_results; /**< result messages for the connection attempts */
+    miod md; /**< established connection we are sharing (if flags.shared) */
+    struct dboa_struct *attempts; /**< connection attempts in progress */
     struct {
-        int db : 1; /**< if the peer supports dialback */
+        int db : 1;       /**< if the peer supports dialback */
+        int db_errors : 1; /**< if the peer advertised dialback errors
+                              (XEP-0220), needed to share the connection */
+        int shared : 1;   /**< if we authorize on an established connection,
+                             that is used by another local domain */
+        int deferred : 1; /**< if we wait for an other connection to the same
+                             peer to be established, to share it */
     } flags;
 } * dboc, _dboc;
 
+void dialback_out_unshare(dboc c);
+void dialback_out_connection_cleanup(dboc c);
+
 /**
  * incoming dialback streams
  */
@@ -202,4 +290,5 @@ typedef struct dbic_struct {
                            from attribute (if present) */
     int xmpp_version; /**< version of the stream, -1 not yet known, 0 preXMPP */
     time_t stamp;     /**< then the connection has been accepted */
+    miod md; /**< wrapper used for all domains authorized on this stream */
 } * dbic, _dbic;
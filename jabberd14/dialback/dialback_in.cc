@@ -114,6 +114,49 @@ static dbic dialback_in_dbic_new(db d, mio m, const char *we_domain,
     return c;
 }
 
+/**
+ * send the answer for db:result requests on an incoming stream
+ *
+ * @param c the incoming stream
+ * @param key the key of the requests (stream id as user, our domain as domain,
+ * the domain of the peer as resource)
+ * @param type the result of the verification, NULL on a timeout
+ * @param count how many db:result requests get answered
+ */
+static void dialback_in_answer(dbic c, jid key, char const *type, int count) {
+    xmlnode x = NULL;
+
+    /* valid requests get the honour of being miod */
+    if (j_strcmp(type, "valid") == 0) {
+        /* check the security settings for this connection */
+        if (!dialback_check_settings(c->d, c->m, key->get_resource().c_str(),
+                                     0, 0, c->xmpp_version)) {
+            return;
+        }
+
+        /* accept incoming stanzas on this connection, all domains the peer
+         * authorizes on this stream share the same wrapper (and idle time) */
+        if (c->md == NULL)
+            c->md = dialback_miod_new(c->d, c->m);
+        dialback_miod_hash(c->md, c->d->in_ok_db, key);
+    } else
+        log_warn(c->d->i->id,
+                 "Denying peer to use the domain %s. Dialback failed (%s)",
+                 key->get_resource().c_str(), type ? type : "timeout");
+
+    /* rewrite and send on to the socket */
+    for (; count > 0; count--) {
+        x = xmlnode_new_tag_ns("result", "db", NS_DIALBACK);
+        xmlnode_put_attrib_ns(x, "to", NULL, NULL,
+                              key->get_resource().c_str());
+        xmlnode_put_attrib_ns(x, "from", NULL, NULL,
+                              key->get_domain().c_str());
+        xmlnode_put_attrib_ns(x, "type", NULL, NULL,
+                              type != NULL ? type : "invalid");
+        mio_write(c->m, x, NULL, -1);
+    }
+}
+
 /**
  * callback for mio for accepted sockets that are dialback
  *
@@ -195,7 +238,7 @@ void dialback_in_read_db(mio m, int flags, void *arg, xmlnode x, char *unused1,
             mio_write(m, proceed, NULL, 0);
 
             /* start TLS on this connection */
-            if (mio_xml_starttls(m, 0, c->we_domain) != 0) {
+            if (mio_xml_starttls(m, 0, c->we_domain, NULL) != 0) {
                 /* STARTTLS failed */
                 mio_close(m);
                 return;
@@ -331,10 +374,10 @@ void dialback_in_read_db(mio m, int flags, void *arg, xmlnode x, char *unused1,
     if (j_strcmp(xmlnode_get_localname(x), "verify") == 0 &&
         j_strcmp(xmlnode_get_namespace(x), NS_DIALBACK) == 0) {
         char *is = xmlnode_get_data(x); /* what the peer tries to verify */
-        char *should = dialback_merlin(xmlnode_pool(x), c->d->secret,
-                                       xmlnode_get_attrib_ns(x, "from", NULL),
-                                       xmlnode_get_attrib_ns(x, "to", NULL),
-                                       xmlnode_get_attrib_ns(x, "id", NULL));
+        char *should = dialback_merlin_cached(
+            c->d, xmlnode_pool(x), xmlnode_get_attrib_ns(x, "from", NULL),
+            xmlnode_get_attrib_ns(x, "to", NULL),
+            xmlnode_get_attrib_ns(x, "id", NULL), 0);
 
         if (j_strcmp(is, should) == 0) {
             xmlnode_put_attrib_ns(x, "type", NULL, NULL, "valid");
@@ -379,10 +422,44 @@ void dialback_in_read_db(mio m, int flags, void *arg, xmlnode x, char *unused1,
     /* incoming result, track it and forward on */
     if (j_strcmp(xmlnode_get_localname(x), "result") == 0 &&
         j_strcmp(xmlnode_get_namespace(x), NS_DIALBACK) == 0) {
+        char const *dbkey = xmlnode_get_data(x);
+        int pending = 0;
+
+        /* did the authoritative server just verify the same key? */
+        if (dialback_key_is_verified(c->d, c->id, key->get_domain().c_str(),
+                                     from->get_domain().c_str(), dbkey)) {
+            log_debug2(ZONE, LOGT_AUTH, "answering db:result for %s from cache",
+                       jid_full(key));
+            c->d->keys_verified_hits++;
+            dialback_in_answer(c, key, "valid", 1);
+            xmlnode_free(x);
+            return;
+        }
+
+        /* is an identical db:result already waiting for verification? */
+        std::ostringstream xpath;
+        xpath << "*[@key='" << jid_full(key) << "']";
+        xmlnode_vector waiting = xmlnode_get_tags(
+            c->results, xpath.str().c_str(), c->d->std_ns_prefixes);
+        for (xmlnode_vector::iterator iter = waiting.begin();
+             iter != waiting.end(); ++iter) {
+            if (j_strcmp(xmlnode_get_data(*iter), dbkey) == 0)
+                pending = 1;
+        }
+
         /* store the result in the connection, for later validation */
         xmlnode_put_attrib_ns(xmlnode_insert_tag_node(c->results, x), "key",
                               NULL, NULL, jid_full(key));
 
+        /* it gets answered together with the identical one */
+        if (pending) {
+            log_debug2(ZONE, LOGT_AUTH,
+                       "db:result for %s already waiting for verification",
+                       jid_full(key));
+            xmlnode_free(x);
+            return;
+        }
+
         /* send the verify back to them, on another outgoing trusted socket, via
          * deliver (so it is real and goes through dnsrv and anything else) */
         x2 = xmlnode_new_tag_pool_ns(xmlnode_pool(x), "verify", "db",
@@ -614,7 +691,8 @@ void dialback_in_read(mio m, int flags, void *arg, xmlnode x, char *unused1,
         jid_set(
             key, c->id,
             JID_USER); /* special user of the id attrib makes this key unique */
-        dialback_miod_hash(dialback_miod_new(c->d, c->m), c->d->in_ok_db, key);
+        c->md = dialback_miod_new(c->d, c->m);
+        dialback_miod_hash(c->md, c->d->in_ok_db, key);
     }
 
     /* write our header */
@@ -661,30 +739,23 @@ void dialback_in_read(mio m, int flags, void *arg, xmlnode x, char *unused1,
 }
 
 /**
- * Handle db:verify packets, that we got as a result to our dialback to the
- * authoritive server.
- *
- * We expect the to attribute to be our name and the from attribute to be the
- * remote name.
+ * process the answer to a db:verify request, we sent to the authoritative
+ * server of a peer
  *
- * We have to do:
- * - Check if there is (still) a connection for this dialback result
- * - If the we got type='valid' we have to authorize the peer to use the
- * verified sender address
- * - Inform the peer about the result
+ * All db:result requests of the peer for the same key, that are waiting for
+ * this verification, are answered together.
  *
- * @note dialback_out_connection_cleanup() calls this function as well to trash
- * pending verifies. In that case we don't get the db:verify result, but the
- * db:verify query (no type attribute set).
- *
- * @param d the db instance
- * @param x the db:verify answer packet
+ * @param d the dialback instance
+ * @param x the db:verify answer
  */
 void dialback_in_verify(db d, xmlnode x) {
     dbic c;
-    xmlnode x2;
     jid key;
     const char *type = NULL;
+    char const *verified_key = NULL;
+    char const *answered_key = NULL;
+    int ambiguous = 0;
+    int count = 0;
 
     log_debug2(ZONE, LOGT_AUTH, "dbin validate: %s",
                xmlnode_serialize_string(x, xmppd::ns_decl_list(), 0));
@@ -708,10 +779,9 @@ void dialback_in_verify(db d, xmlnode x) {
 
     std::ostringstream xpath;
     xpath << "*[@key='" << jid_full(key) << "']";
-    x2 = xmlnode_get_list_item(
-        xmlnode_get_tags(c->results, xpath.str().c_str(), d->std_ns_prefixes),
-        0);
-    if (x2 == NULL) {
+    xmlnode_vector waiting =
+        xmlnode_get_tags(c->results, xpath.str().c_str(), d->std_ns_prefixes);
+    if (waiting.empty()) {
         log_warn(
             d->i->id,
             "Dropping a db:verify answer, we don't have a waiting incoming "
@@ -721,39 +791,52 @@ void dialback_in_verify(db d, xmlnode x) {
         return;
     }
 
-    /* hide the waiting db:result, it has been processed now */
-    xmlnode_hide(x2);
+    /* if the answer contains the key, it is for the db:result with this key,
+     * else it is for the oldest waiting db:result */
+    answered_key = xmlnode_get_data(x);
+    for (xmlnode_vector::iterator iter = waiting.begin();
+         iter != waiting.end(); ++iter) {
+        if (answered_key == NULL ||
+            j_strcmp(xmlnode_get_data(*iter), answered_key) == 0) {
+            verified_key = pstrdup(xmlnode_pool(x), xmlnode_get_data(*iter));
+            break;
+        }
+    }
+    if (verified_key == NULL) {
+        log_warn(d->i->id,
+                 "Dropping a db:verify answer, we don't have a waiting "
+                 "incoming <db:result/> query (anymore?) for this key: %s",
+                 xmlnode_serialize_string(x, xmppd::ns_decl_list(), 0));
+        xmlnode_free(x);
+        return;
+    }
 
-    /* get type of db:verify result */
-    type = xmlnode_get_attrib_ns(x, "type", NULL);
+    /* the answer is also for all identical db:result elements received while
+     * it has been waiting */
+    for (xmlnode_vector::iterator iter = waiting.begin();
+         iter != waiting.end(); ++iter) {
+        if (j_strcmp(xmlnode_get_data(*iter), verified_key) != 0) {
+            /* other keys for the same stream are waiting as well, without the
+             * key in the answer we cannot be sure which one has been answered */
+            if (answered_key == NULL)
+                ambiguous = 1;
+            continue;
+        }
 
-    /* rewrite the result */
-    x2 = xmlnode_new_tag_pool_ns(xmlnode_pool(x), "result", "db", NS_DIALBACK);
-    xmlnode_put_attrib_ns(x2, "to", NULL, NULL,
-                          xmlnode_get_attrib_ns(x, "from", NULL));
-    xmlnode_put_attrib_ns(x2, "from", NULL, NULL,
-                          xmlnode_get_attrib_ns(x, "to", NULL));
-    xmlnode_put_attrib_ns(x2, "type", NULL, NULL,
-                          type != NULL ? type : "invalid");
+        /* hide the waiting db:result, it has been processed now */
+        xmlnode_hide(*iter);
+        count++;
+    }
+    d->keys_batched += count - 1;
 
-    /* valid requests get the honour of being miod */
+    /* get type of db:verify result */
     type = xmlnode_get_attrib_ns(x, "type", NULL);
-    if (j_strcmp(type, "valid") == 0) {
-        /* check the security settings for this connection */
-        if (!dialback_check_settings(c->d, c->m,
-                                     xmlnode_get_attrib_ns(x, "from", NULL), 0,
-                                     0, c->xmpp_version)) {
-            return;
-        }
 
-        /* accept incoming stanzas on this connection */
-        dialback_miod_hash(dialback_miod_new(c->d, c->m), c->d->in_ok_db, key);
-    } else
-        log_warn(d->i->id,
-                 "Denying peer to use the domain %s. Dialback failed (%s): %s",
-                 key->get_resource().c_str(), type ? type : "timeout",
-                 xmlnode_serialize_string(x2, xmppd::ns_decl_list(), 0));
+    /* remember valid keys, the peer might send them again */
+    if (j_strcmp(type, "valid") == 0 && !ambiguous)
+        dialback_key_verified(d, c->id, key->get_domain().c_str(),
+                              key->get_resource().c_str(), verified_key);
 
-    /* rewrite and send on to the socket */
-    mio_write(c->m, x2, NULL, -1);
+    dialback_in_answer(c, key, type, count);
+    xmlnode_free(x);
 }
@@ -51,6 +51,21 @@
  * - After we are authorized by the peer to send stanzas from a domain, we send
  * them.
  * - The starttls command, if the peer and we are supporting TLS.
+ *
+ * Connections are shared between our local domains: if there is already an
+ * established dialback connection to a peer, additional local domains send
+ * their db:result on this connection instead of opening a new one. This is
+ * only done if the peer advertised support for dialback errors in its stream
+ * features (XEP-0220), legacy peers would close the stream. If a
+ * connection to the peer is just being established, additional local domains
+ * wait for it. Only if the peer rejects sharing the connection (by returning
+ * a db:result of type 'error') or the shared connection gets closed, a new
+ * connection is opened.
+ *
+ * If the peer has multiple addresses, they are not tried one after the other,
+ * but connection attempts are started in parallel with a small delay between
+ * them, alternating between IPv6 and IPv4 addresses. The first connection that
+ * gets established is used.
  */
 #include "dialback.h"
 
@@ -58,25 +73,191 @@
 #include <messages.hh>
 #include <namespaces.hh>
 
-/* forward declaration */
+#include <vector>
+
+/* forward declarations */
 void dialback_out_read(mio m, int flags, void *arg, xmlnode x, char *unused1,
                        int unused2);
+void dialback_out_connection_cleanup(dboc c);
+void dialback_out_qflush(miod md, dboc c);
+static void dialback_out_send_verifies(mio m, dboc c);
+
+typedef struct dboa_attempt_struct _dboa_attempt, *dboa_attempt;
 
 /**
- * try to start a connection based upon a given connect object
+ * connection attempts of a connect object, that are running in parallel
+ *
+ * The addresses of the peer are tried staggered: a new attempt is started
+ * each DIALBACK_OUT_ATTEMPT_DELAY seconds, or as soon as a running attempt
+ * failed. The first attempt that gets connected wins, all others get aborted.
+ *
+ * This structure has its own memory pool as the connect object might be gone
+ * before all attempts finished.
+ */
+typedef struct dboa_struct {
+    pool p;  /**< memory pool of the attempts */
+    dboc c;  /**< the connect object, NULL if the connect object does not wait
+                for these attempts anymore */
+    int running; /**< number of attempts that did not finish yet */
+    int timer;   /**< 1 if the beat to start the next attempt is registered */
+    int results; /**< number of results added to c->connect_results */
+    dboa_attempt first; /**< list of all started attempts */
+} _dboa, *dboa;
+
+/**
+ * a single connection attempt
+ */
+struct dboa_attempt_struct {
+    dboa a;   /**< the attempts this attempt belongs to */
+    char *ip; /**< the address (as found in dboc::ip) we are connecting to */
+    mio_connecting connecting; /**< handle to abort the connect */
+    int done;          /**< 1 if mio already called back for this attempt */
+    dboa_attempt next; /**< next attempt in dboa::first */
+};
+
+/** seconds to wait before starting an attempt to connect to the next address */
+#define DIALBACK_OUT_ATTEMPT_DELAY 1
+
+/**
+ * check if an address in the format used in dboc::ip is an IPv6 address
+ *
+ * @param ip the address
+ * @return 1 if it is an IPv6 address, 0 else
+ */
+static int dialback_out_is_ipv6(const char *ip) {
+    const char *col = NULL;
+
+    if (ip[0] == '[')
+        return 1;
+
+    /* if it has at least two colons it is an IPv6 address */
+    col = strchr(ip, ':');
+    return col != NULL && strchr(col + 1, ':') != NULL;
+}
+
+/**
+ * reorder a list of addresses, so that IPv6 and IPv4 addresses alternate
+ *
+ * The family of the first address is kept first, the order of addresses of
+ * the same family is kept.
+ *
+ * @param p the memory pool to use
+ * @param ips comma separated list of addresses
+ * @return reordered comma separated list of addresses
+ */
+static char *dialback_out_interleave(pool p, const char *ips) {
+    std::vector<std::string> family[2];
+    std::string result;
+    const char *cur = ips;
+    int first = 0;
+
+    if (ips == NULL)
+        return NULL;
+
+    while (*cur != '\0') {
+        const char *comma = strchr(cur, ',');
+        std::string ip(cur, comma == NULL ? strlen(cur) : comma - cur);
+
+        if (!ip.empty()) {
+            if (family[0].empty() && family[1].empty())
+                first = dialback_out_is_ipv6(ip.c_str());
+            family[dialback_out_is_ipv6(ip.c_str())].push_back(ip);
+        }
+        if (comma == NULL)
+            break;
+        cur = comma + 1;
+    }
+
+    for (size_t n = 0; n < family[0].size() || n < family[1].size(); n++) {
+        for (int f = first, count = 0; count < 2; f = !f, count++) {
+            if (n >= family[f].size())
+                continue;
+            if (!result.empty())
+                result += ',';
+            result += family[f][n];
+        }
+    }
+
+    return result.empty() ? NULL : pstrdup(p, result.c_str());
+}
+
+/**
+ * free the attempts structure, if nothing references it anymore
  *
- * Tell mio to connect to the peer and make dialback_out_read() the first mio
- * handler
+ * @param a the attempts
+ */
+static void dialback_out_attempts_release(dboa a) {
+    if (a->c == NULL && a->running == 0 && !a->timer)
+        pool_free(a->p);
+}
+
+/**
+ * the connect object does not wait for its connection attempts anymore
+ *
+ * Still running attempts are aborted, they report back with MIO_CLOSED. An
+ * attempt, that already connected but did not report back yet, gets closed in
+ * dialback_out_attempt_read(). The beat starting further attempts unregisters
+ * itself on its next call.
  *
  * @param c the connect object
  */
-void dialback_out_connect(dboc c) {
-    char *ip, *col;
+static void dialback_out_attempts_detach(dboc c) {
+    dboa a = c->attempts;
+
+    if (a == NULL)
+        return;
+
+    c->attempts = NULL;
+    a->c = NULL;
+
+    for (dboa_attempt t = a->first; t != NULL; t = t->next) {
+        if (!t->done)
+            mio_connect_cancel(t->connecting);
+    }
+
+    dialback_out_attempts_release(a);
+}
+
+/**
+ * add the result of an attempt to the result messages of the connect object
+ *
+ * @param t the attempt
+ * @param msg the result message
+ */
+static void dialback_out_attempt_result(dboa_attempt t, const char *msg) {
+    dboc c = t->a->c;
+
+    if (c == NULL || c->connect_results == NULL)
+        return;
+
+    if (t->a->results++ > 0)
+        *c->connect_results << " / ";
+    *c->connect_results << t->ip << ": " << (msg ? msg : "");
+}
+
+void dialback_out_attempt_read(mio m, int flags, void *arg, xmlnode x,
+                               char *unused1, int unused2);
+
+/**
+ * start connecting to the next address of a connect object
+ *
+ * @param a the attempts of the connect object
+ */
+static void dialback_out_attempt_start(dboa a) {
+    dboc c = a->c;
+    dboa_attempt t = NULL;
+    char *ip = NULL;
+    char *col = NULL;
     int port = 5269;
 
-    if (c->ip == NULL)
+    if (c == NULL || c->ip == NULL)
         return;
 
+    t = static_cast<dboa_attempt>(pmalloco(a->p, sizeof(_dboa_attempt)));
+    t->a = a;
+    t->next = a->first;
+    a->first = t;
+
     ip = c->ip;
     c->ip = strchr(ip, ',');
     if (c->ip != NULL) {
@@ -84,15 +265,12 @@ void dialback_out_connect(dboc c) {
         *c->ip = '\0';
         c->ip++;
     }
+    t->ip = pstrdup(a->p, ip);
+    ip = pstrdup(a->p, ip);
 
     log_debug2(ZONE, LOGT_IO, "Attempting to connect to %s at %s",
                jid_full(c->key), ip);
 
-    /* to which IP we connect, for logging */
-    if (c->connect_results != NULL) {
-        *c->connect_results << ip << ": ";
-    }
-
     /* get the ip/port for io_select */
     if (ip[0] == '[') {
         /* format "[ipaddr]:port" or "[ipaddr]" */
@@ -118,10 +296,131 @@ void dialback_out_connect(dboc c) {
         port = atoi(col);
     }
 
+    a->running++;
+    t->connecting = mio_connect(ip, port, dialback_out_attempt_read, (void *)t,
+                                20, MIO_CONNECT_XML);
+}
+
+/**
+ * heartbeat function, that starts the next connection attempt
+ *
+ * @param arg the ::dboa attempts
+ * @return r_UNREG if there are no more addresses to try, r_DONE else
+ */
+static result dialback_out_attempt_beat(void *arg) {
+    dboa a = static_cast<dboa>(arg);
+
+    if (a->c == NULL || a->c->ip == NULL) {
+        a->timer = 0;
+        dialback_out_attempts_release(a);
+        return r_UNREG;
+    }
+
+    dialback_out_attempt_start(a);
+    return r_DONE;
+}
+
+/**
+ * mio callback for a connection attempt
+ *
+ * The first attempt, that connects, is handed over to dialback_out_read(), the
+ * others are aborted. An attempt, that connected nevertheless, is closed
+ * again. If all attempts failed, the connect object is cleaned up.
+ *
+ * @param m the connection of the attempt
+ * @param flags the mio event
+ * @param arg the ::dboa_attempt
+ * @param x received stanza, freed
+ * @param unused1 unused/ignored
+ * @param unused2 unused/ignored
+ */
+void dialback_out_attempt_read(mio m, int flags, void *arg, xmlnode x,
+                               char *unused1, int unused2) {
+    dboa_attempt t = static_cast<dboa_attempt>(arg);
+    dboa a = t->a;
+    dboc c = a->c;
+
+    switch (flags) {
+        case MIO_NEW:
+            t->done = 1;
+            if (c == NULL) {
+                /* another attempt already won, or nobody waits anymore */
+                log_debug2(ZONE, LOGT_IO, "closing superfluous connection to %s",
+                           t->ip);
+                mio_close(m);
+                return;
+            }
+
+            /* this one won, the others are not needed anymore */
+            log_debug2(ZONE, LOGT_IO, "%s: using connection to %s",
+                       jid_full(c->key), t->ip);
+            dialback_out_attempt_result(t, NULL);
+            a->running--;
+            dialback_out_attempts_detach(c);
+            mio_reset(m, dialback_out_read, (void *)c);
+            dialback_out_read(m, MIO_NEW, (void *)c, NULL, NULL, 0);
+            return;
+
+        case MIO_CLOSED:
+            t->done = 1;
+            a->running--;
+            if (c != NULL) {
+                dialback_out_attempt_result(t, mio_connect_errmsg(m));
+
+                if (c->ip != NULL) {
+                    /* this one failed, try another one right now */
+                    dialback_out_attempt_start(a);
+                } else if (a->running == 0) {
+                    /* all attempts failed */
+                    dialback_out_attempts_detach(c);
+                    dialback_out_connection_cleanup(c); /* buh bye! */
+                    return;
+                }
+            }
+            dialback_out_attempts_release(a);
+            return;
+
+        default:
+            if (x != NULL)
+                xmlnode_free(x);
+            return;
+    }
+}
+
+/**
+ * try to start a connection based upon a given connect object
+ *
+ * Start connecting to the first address of the peer, the other addresses are
+ * tried in parallel, staggered by DIALBACK_OUT_ATTEMPT_DELAY seconds, as long
+ * as no connection got established. The first established connection is
+ * handled by dialback_out_read().
+ *
+ * @param c the connect object
+ */
+void dialback_out_connect(dboc c) {
+    pool p = NULL;
+    dboa a = NULL;
+
+    if (c->ip == NULL || c->attempts != NULL)
+        return;
+
+    p = pool_new();
+    a = static_cast<dboa>(pmalloco(p, sizeof(_dboa)));
+    a->p = p;
+    a->c = c;
+    c->attempts = a;
+
     /* we are now in the state of connecting */
     c->connection_state = connecting;
 
-    mio_connect(ip, port, dialback_out_read, (void *)c, 20, MIO_CONNECT_XML);
+    /* more addresses to try, if the first one does not connect soon? */
+    if (strchr(c->ip, ',') != NULL) {
+        a->timer = 1;
+        register_beat(DIALBACK_OUT_ATTEMPT_DELAY, dialback_out_attempt_beat,
+                      (void *)a);
+    }
+
+    dialback_out_attempt_start(a);
 }
 
 /**
@@ -135,6 +434,280 @@ static void delete_ostringstream(void *arg) {
     delete os;
 }
 
+/**
+ * queue a stanza until the connection to the peer is established
+ *
+ * Stanzas are bounced immediately, if the memory used by the queued stanzas
+ * would exceed the limit for the peer or for all peers together.
+ *
+ * @param c the connect object
+ * @param x the stanza to queue
+ */
+static void dialback_out_enqueue(dboc c, xmlnode x) {
+    long bytes = pool_size(xmlnode_pool(x));
+    dboq q = NULL;
+
+    if (c->stats->bytes + bytes > c->d->queue_max_peer ||
+        c->d->queue_bytes + bytes > c->d->queue_max_total) {
+        log_debug2(ZONE, LOGT_IO,
+                   "queue limit reached for %s (%li bytes queued for the "
+                   "peer, %li for all peers), bouncing stanza",
+                   jid_full(c->key), c->stats->bytes, c->d->queue_bytes);
+        c->stats->rejected++;
+        deliver_fail(dpacket_new(x),
+                     messages_get(xmlnode_get_lang(x),
+                                  N_("Too many stanzas are waiting for the "
+                                     "connection to the other server")));
+        return;
+    }
+
+    q = static_cast<dboq>(pmalloco(xmlnode_pool(x), sizeof(_dboq)));
+    q->stamp = time(NULL);
+    q->bytes = bytes;
+    q->x = x;
+
+    /* append, the queue is kept in the order of the time stamps */
+    if (c->q_last == NULL)
+        c->q = q;
+    else
+        c->q_last->next = q;
+    c->q_last = q;
+
+    c->stats->bytes += bytes;
+    c->stats->stanzas++;
+    c->stats->queued++;
+    c->stats->last = q->stamp;
+    c->d->queue_bytes += bytes;
+}
+
+/**
+ * remove the oldest stanza from the queue of a connect object
+ *
+ * @param c the connect object
+ * @return the removed stanza, NULL if the queue is empty
+ */
+static xmlnode dialback_out_dequeue(dboc c) {
+    dboq q = c->q;
+
+    if (q == NULL)
+        return NULL;
+
+    c->q = q->next;
+    if (c->q == NULL)
+        c->q_last = NULL;
+
+    c->stats->bytes -= q->bytes;
+    c->stats->stanzas--;
+    c->d->queue_bytes -= q->bytes;
+
+    return q->x;
+}
+
+/**
+ * send a <db:result/> to request authorization for our sending domain
+ *
+ * @param c the connect object (the stream id has to be known already)
+ * @param m the connection to send the request on
+ */
+static void dialback_out_send_result(dboc c, mio m) {
+    xmlnode db_result = xmlnode_new_tag_ns("result", "db", NS_DIALBACK);
+
+    xmlnode_put_attrib_ns(db_result, "to", NULL, NULL,
+                          c->key->get_domain().c_str());
+    xmlnode_put_attrib_ns(db_result, "from", NULL, NULL,
+                          c->key->get_resource().c_str());
+    xmlnode_insert_cdata(db_result,
+                         dialback_merlin_cached(c->d, xmlnode_pool(db_result),
+                                                c->key->get_domain().c_str(),
+                                                c->key->get_resource().c_str(),
+                                                c->stream_id, 1),
+                         -1);
+    mio_write(m, db_result, NULL, 0);
+    c->db_state = sent_request;
+    c->connection_state = sent_db_request;
+}
+
+/**
+ * parameters and result of searching connect objects to a peer
+ */
+typedef struct {
+    char const *peer;         /**< domain of the peer */
+    int deferred;             /**< 1 to search connect objects waiting for
+                                 another connection, 0 to search connect
+                                 objects establishing a connection */
+    std::vector<dboc> found;  /**< the connect objects, that have been found */
+} _dialback_out_search;
+
+/**
+ * callback for walking the connecting hash: collect the connect objects to a
+ * peer
+ *
+ * @param h the hash containing all pending connections
+ * @param key destination/source address
+ * @param data the dboc
+ * @param arg the ::_dialback_out_search structure
+ */
+static void _dialback_out_search_walk(xht h, const char *key, void *data,
+                                      void *arg) {
+    dboc c = static_cast<dboc>(data);
+    _dialback_out_search *search = static_cast<_dialback_out_search *>(arg);
+
+    if (c->flags.shared ||
+        j_strcmp(c->key->get_domain().c_str(), search->peer) != 0)
+        return;
+
+    if (search->deferred) {
+        if (c->flags.deferred)
+            search->found.push_back(c);
+        return;
+    }
+
+    /* only connections, that will authorize, can be shared later */
+    if (!c->flags.deferred &&
+        (c->db_state == want_request || c->db_state == sent_request))
+        search->found.push_back(c);
+}
+
+/**
+ * reference from an established connection to a connect object sharing it
+ */
+typedef struct {
+    db d;      /**< the dialback instance */
+    mio m;     /**< the shared connection */
+    char *key; /**< key of the connect object in out_connecting */
+} _dialback_out_shared_ref, *dialback_out_shared_ref;
+
+/**
+ * stop waiting for or sharing another connection and connect on our own
+ *
+ * Used if the peer did not accept sharing the connection, if the shared
+ * connection has been closed, or if sharing did not succeed in time.
+ *
+ * @param c the connect object
+ */
+void dialback_out_unshare(dboc c) {
+    log_debug2(ZONE, LOGT_IO, "%s: connecting on our own (was %s)",
+               jid_full(c->key), c->flags.shared ? "shared" : "deferred");
+
+    c->flags.shared = 0;
+    c->flags.deferred = 0;
+    c->m = NULL;
+    c->md = NULL;
+    c->stream_id = NULL;
+    c->stamp = time(NULL);
+    c->connection_state = created;
+    if (c->db_state == sent_request)
+        c->db_state = want_request;
+    else if (c->db_state == could_request)
+        c->db_state = not_requested;
+    if (c->connect_results != NULL)
+        *c->connect_results << " / ";
+
+    dialback_out_connect(c);
+}
+
+/**
+ * a shared connection has been closed, connect objects still waiting for
+ * their authorization on this connection have to connect on their own
+ *
+ * @param arg the ::_dialback_out_shared_ref
+ */
+static void _dialback_out_shared_closed(void *arg) {
+    dialback_out_shared_ref ref = static_cast<dialback_out_shared_ref>(arg);
+    dboc c = static_cast<dboc>(xhash_get(ref->d->out_connecting, ref->key));
+
+    if (c == NULL || !c->flags.shared || c->m != ref->m)
+        return;
+
+    if (c->connect_results != NULL)
+        *c->connect_results << "shared connection closed";
+
+    if (c->ip == NULL)
+        dialback_out_connection_cleanup(c);
+    else
+        dialback_out_unshare(c);
+}
+
+/**
+ * authorize a connect object on an established connection to the same peer,
+ * instead of opening a new connection
+ *
+ * @param c the connect object
+ * @param md the established connection
+ */
+static void dialback_out_share(dboc c, miod md) {
+    dialback_out_shared_ref ref = static_cast<dialback_out_shared_ref>(
+        pmalloco(md->m->p, sizeof(_dialback_out_shared_ref)));
+
+    ref->d = c->d;
+    ref->m = md->m;
+    ref->key = pstrdup(md->m->p, jid_full(c->key));
+    pool_cleanup(md->m->p, _dialback_out_shared_closed, ref);
+
+    log_debug2(ZONE, LOGT_IO, "%s: sharing connection on socket %d",
+               jid_full(c->key), md->m->fd);
+
+    c->flags.shared = 1;
+    c->flags.deferred = 0;
+    c->md = md;
+    c->m = md->m;
+    c->stream_id = md->stream_id;
+    c->connection_state = connected;
+    if (c->connect_results != NULL)
+        *c->connect_results << "sharing connection to " << mio_ip(md->m)
+                            << ": ";
+
+    dialback_out_send_verifies(c->m, c);
+    if (c->db_state == want_request)
+        dialback_out_send_result(c, c->m);
+    else if (c->db_state == not_requested)
+        c->db_state = could_request;
+}
+
+/**
+ * a connection to a peer has been established, connect objects that waited
+ * for it can now authorize on it
+ *
+ * @param d the dialback instance
+ * @param md the established connection
+ * @param peer the domain of the peer
+ */
+static void dialback_out_share_deferred(db d, miod md, char const *peer) {
+    _dialback_out_search search;
+
+    search.peer = peer;
+    search.deferred = 1;
+    xhash_walk(d->out_connecting, _dialback_out_search_walk, &search);
+
+    for (std::vector<dboc>::iterator c = search.found.begin();
+         c != search.found.end(); ++c)
+        dialback_out_share(*c, md);
+}
+
+/**
+ * establishing a connection to a peer finished without a connection that can
+ * be shared, connect objects waiting for it have to connect themselves
+ *
+ * @param d the dialback instance
+ * @param peer the domain of the peer
+ * @param all 1 if all waiting connect objects should connect, 0 if only one
+ * should try (the others then wait for this one)
+ */
+static void dialback_out_wake_deferred(db d, char const *peer, int all) {
+    _dialback_out_search search;
+
+    search.peer = peer;
+    search.deferred = 1;
+    xhash_walk(d->out_connecting, _dialback_out_search_walk, &search);
+
+    for (std::vector<dboc>::iterator c = search.found.begin();
+         c != search.found.end(); ++c) {
+        dialback_out_unshare(*c);
+        if (!all)
+            break;
+    }
+}
+
 /**
  * make a new outgoing connect(ion) object, and start to connect to the peer
  *
@@ -147,6 +720,7 @@ static void delete_ostringstream(void *arg) {
 dboc dialback_out_connection(db d, jid key, char *ip, db_request db_state) {
     dboc c;
     pool p;
+    miod md = NULL;
 
     if ((c = static_cast<dboc>(xhash_get(d->out_connecting, jid_full(key)))) !=
         NULL) {
@@ -159,21 +733,7 @@ dboc dialback_out_connection(db d, jid key, char *ip, db_request db_state) {
                 c->db_state = want_request;
             } else if (c->db_state == could_request) {
                 /* send <db:result/> to request dialback */
-                xmlnode db_result =
-                    xmlnode_new_tag_ns("result", "db", NS_DIALBACK);
-                xmlnode_put_attrib_ns(db_result, "to", NULL, NULL,
-                                      c->key->get_domain().c_str());
-                xmlnode_put_attrib_ns(db_result, "from", NULL, NULL,
-                                      c->key->get_resource().c_str());
-                xmlnode_insert_cdata(
-                    db_result,
-                    dialback_merlin(xmlnode_pool(db_result), c->d->secret,
-                                    c->key->get_domain().c_str(),
-                                    c->key->get_resource().c_str(),
-                                    c->stream_id),
-                    -1);
-                mio_write(c->m, db_result, NULL, 0);
-                c->db_state = sent_request;
+                dialback_out_send_result(c, c->m);
                 log_debug2(ZONE, LOGT_IO,
                            "packet for existing connection: state change "
                            "could_request -> sent_request");
@@ -193,18 +753,44 @@ dboc dialback_out_connection(db d, jid key, char *ip, db_request db_state) {
     c->key = jid_new(p, jid_full(key));
     c->stamp = time(NULL);
     c->verifies = xmlnode_new_tag_pool_ns(p, "v", NULL, NS_JABBERD_WRAPPER);
-    c->ip = pstrdup(p, ip);
+    c->ip = dialback_out_interleave(p, ip);
     c->db_state = db_state;
     c->connection_state = created;
     c->connect_results = new std::ostringstream();
     pool_cleanup(p, delete_ostringstream, c->connect_results);
     c->xmpp_version = -1;
+    c->stats = &(*d->queue_stats)[c->key->get_domain()];
+    c->stats->last = c->stamp;
+
+    /* is there an established connection to this peer, we can share? Or is
+     * there one being established, that we can wait for? */
+    md = static_cast<miod>(
+        xhash_get(d->out_shared, c->key->get_domain().c_str()));
+    if (md == NULL && db_state == want_request) {
+        _dialback_out_search search;
+
+        search.peer = c->key->get_domain().c_str();
+        search.deferred = 0;
+        xhash_walk(d->out_connecting, _dialback_out_search_walk, &search);
+        if (!search.found.empty())
+            c->flags.deferred = 1;
+    }
 
     /* insert in the hash */
     xhash_put(d->out_connecting, jid_full(c->key), (void *)c);
 
-    /* start the conneciton process */
-    dialback_out_connect(c);
+    if (md != NULL) {
+        /* authorize on the established connection */
+        dialback_out_share(c, md);
+    } else if (c->flags.deferred) {
+        log_debug2(ZONE, LOGT_IO,
+                   "%s: waiting for other connection to the peer",
+                   jid_full(c->key));
+        *c->connect_results << "waiting for other connection to peer: ";
+    } else {
+        /* start the conneciton process */
+        dialback_out_connect(c);
+    }
 
     return c;
 }
@@ -256,13 +842,22 @@ dialback_out_connection_state_string(db_connection_state state) {
  * @param c the outgoing connect that failed
  */
 void dialback_out_connection_cleanup(dboc c) {
-    dboq cur, next;
     xmlnode x;
     char *bounce_reason = NULL;
     const char *lang = NULL;
 
+    /* running connection attempts are not needed anymore */
+    dialback_out_attempts_detach(c);
+
     xhash_zap(c->d->out_connecting, jid_full(c->key));
 
+    /* other local domains waiting for this connection to be established? */
+    if (!c->flags.shared && !c->flags.deferred &&
+        xhash_get(c->d->out_shared, c->key->get_domain().c_str()) == NULL)
+        dialback_out_wake_deferred(c->d, c->key->get_domain().c_str(),
+                                   c->connection_state == db_succeeded ||
+                                       c->connection_state == sasl_success);
+
     /* get the results of connection attempts */
     Glib::ustring connect_results;
     if (c->connect_results != NULL) {
@@ -281,9 +876,8 @@ void dialback_out_connection_cleanup(dboc c) {
     }
 
     /* if there's any packets in the queue, flush them! */
-    cur = c->q;
-    if (cur != NULL) {
-        lang = xmlnode_get_lang(cur->x);
+    if (c->q != NULL) {
+        lang = xmlnode_get_lang(c->q->x);
         /* generate bounce message, but only if there are queued messages */
         std::ostringstream errmsg;
         if (c->settings_failed) {
@@ -300,16 +894,14 @@ void dialback_out_connection_cleanup(dboc c) {
         }
         bounce_reason = pstrdup(c->p, errmsg.str().c_str());
     }
-    while (cur != NULL) {
-        next = cur->next;
+    while ((x = dialback_out_dequeue(c)) != NULL) {
+        c->stats->failed++;
         deliver_fail(
-            dpacket_new(cur->x),
+            dpacket_new(x),
             bounce_reason
                 ? bounce_reason
-                : messages_get(lang,
+                : messages_get(xmlnode_get_lang(x),
                                N_("Could not send stanza to other server")));
-        cur = next;
-        lang = cur == NULL ? NULL : xmlnode_get_lang(cur->x);
     }
 
     /* also kill any validations still waiting */
@@ -345,7 +937,6 @@ void dialback_out_packet(db d, xmlnode x, char *ip) {
     jid to, from, key;
     miod md;
     int verify = 0;
-    dboq q;
     dboc c;
 
     to = jid_new(xmlnode_pool(x), xmlnode_get_attrib_ns(x, "to", NULL));
@@ -382,6 +973,11 @@ void dialback_out_packet(db d, xmlnode x, char *ip) {
     /* try to get an active connection */
     md = static_cast<miod>(xhash_get(d->out_ok_db, jid_full(key)));
 
+    /* db:verify requests can be sent on any connection to the peer */
+    if (md == NULL && verify)
+        md = static_cast<miod>(
+            xhash_get(d->out_shared, to->get_domain().c_str()));
+
     log_debug2(ZONE, LOGT_IO,
                "outgoing packet with key %s and located existing %X",
                jid_full(key), md);
@@ -431,11 +1027,75 @@ void dialback_out_packet(db d, xmlnode x, char *ip) {
     }
 
     /* insert into the queue */
-    q = static_cast<dboq>(pmalloco(xmlnode_pool(x), sizeof(_dboq)));
-    q->stamp = time(NULL);
-    q->x = x;
-    q->next = c->q;
-    c->q = q;
+    dialback_out_enqueue(c, x);
+}
+
+/**
+ * handle the answer to a <db:result/>, that we sent on an already established
+ * connection to authorize an additional local domain
+ *
+ * @param d the dialback instance
+ * @param m the connection the answer has been received on
+ * @param x the answer
+ */
+static void dialback_out_shared_result(db d, mio m, xmlnode x) {
+    jid key = jid_new(xmlnode_pool(x), xmlnode_get_attrib_ns(x, "from", NULL));
+    char const *type = xmlnode_get_attrib_ns(x, "type", NULL);
+    dboc c = NULL;
+
+    if (key != NULL && xmlnode_get_attrib_ns(x, "to", NULL) != NULL) {
+        jid_set(key, xmlnode_get_attrib_ns(x, "to", NULL), JID_RESOURCE);
+        c = static_cast<dboc>(xhash_get(d->out_connecting, jid_full(key)));
+    }
+    if (c == NULL || !c->flags.shared || c->m != m) {
+        log_warn(d->i->id,
+                 "Dropping unexpected dialback result on outgoing connection "
+                 "to %s: %s",
+                 mio_ip(m),
+                 xmlnode_serialize_string(x, xmppd::ns_decl_list(), 0));
+        xmlnode_free(x);
+        return;
+    }
+
+    if (j_strcmp(type, "valid") == 0) {
+        log_debug2(ZONE, LOGT_IO, "%s authorized on shared connection",
+                   jid_full(c->key));
+        c->connection_state = db_succeeded;
+        dialback_miod_hash(c->md, d->out_ok_db, c->key);
+
+        /* flush the queue of packets */
+        dialback_out_qflush(c->md, c);
+
+        /* we are connected, and can trash this now */
+        dialback_out_connection_cleanup(c);
+    } else if (j_strcmp(type, "error") == 0) {
+        /* the peer does not accept this domain on this connection */
+        log_notice(d->i->id,
+                   "%s did not accept %s on a shared connection, opening a "
+                   "new connection",
+                   c->key->get_domain().c_str(),
+                   c->key->get_resource().c_str());
+        if (c->connect_results != NULL)
+            *c->connect_results << " (dialback result: error)";
+        if (c->ip == NULL)
+            dialback_out_connection_cleanup(c);
+        else
+            dialback_out_unshare(c);
+    } else {
+        c->connection_state = db_failed;
+        if (c->connect_results != NULL)
+            *c->connect_results << " (dialback result: "
+                                << (type ? type : "no type attribute") << ")";
+        log_alert(d->i->id,
+                  "We were told by %s that our sending name %s is invalid, "
+                  "either something went wrong on their end, we tried using "
+                  "that name improperly, or dns does not resolve to us",
+                  c->key->get_domain().c_str(),
+                  c->key->get_resource().c_str());
+        dialback_out_connection_cleanup(c);
+    }
+
+    xmlnode_free(x);
 }
 
 /**
@@ -443,7 +1103,8 @@ void dialback_out_packet(db d, xmlnode x, char *ip) {
  * isn't much of a job
  *
  * The only packets we have to expect on an outgoing dialback socket are
- * db:verify and maybe stream:error
+ * db:verify, db:result (answering a db:result for an additional local domain,
+ * that shares this connection) and maybe stream:error
  *
  * @param m the connection the packet has been received on
  * @param flags the mio action, we ignore anything but MIO_XML_NODE
@@ -466,6 +1127,13 @@ void dialback_out_read_db(mio m, int flags, void *arg, xmlnode x, char *unused1,
         return;
     }
 
+    /* answer for a local domain sharing this connection */
+    if (j_strcmp(xmlnode_get_localname(x), "result") == 0 &&
+        j_strcmp(xmlnode_get_namespace(x), NS_DIALBACK) == 0) {
+        dialback_out_shared_result(d, m, x);
+        return;
+    }
+
     if (j_strcmp(xmlnode_get_localname(x), "error") == 0 &&
         j_strcmp(xmlnode_get_namespace(x), NS_STREAM) == 0) {
         std::ostringstream errmsg;
@@ -516,17 +1184,13 @@ void dialback_out_read_db(mio m, int flags, void *arg, xmlnode x, char *unused1,
  * Take elements from the queue and send it to a miod connection.
  *
  * @param md the miod connection
- * @param q the queue to flush
+ * @param c the connect object containing the queue to flush
  */
-void dialback_out_qflush(miod md, dboq q) {
-    dboq cur, next;
-
-    cur = q;
-    while (cur != NULL) {
-        next = cur->next;
-        dialback_miod_write(md, cur->x);
-        cur = next;
-    }
+void dialback_out_qflush(miod md, dboc c) {
+    xmlnode x = NULL;
+
+    while ((x = dialback_out_dequeue(c)) != NULL)
+        dialback_miod_write(md, x);
 }
 
 /**
@@ -716,21 +1380,7 @@ void dialback_out_read(mio m, int flags, void *arg, xmlnode x, char *unused1,
                            "pre-XMPP 1.0 stream could now send <db:result/>");
                 if (c->db_state == want_request) {
                     /* send db request */
-                    cur = xmlnode_new_tag_ns("result", "db", NS_DIALBACK);
-                    xmlnode_put_attrib_ns(cur, "to", NULL, NULL,
-                                          c->key->get_domain().c_str());
-                    xmlnode_put_attrib_ns(cur, "from", NULL, NULL,
-                                          c->key->get_resource().c_str());
-                    xmlnode_insert_cdata(
-                        cur,
-                        dialback_merlin(xmlnode_pool(cur), c->d->secret,
-                                        c->key->get_domain().c_str(),
-                                        c->key->get_resource().c_str(),
-                                        c->stream_id),
-                        -1);
-                    mio_write(m, cur, NULL, 0);
-                    c->db_state = sent_request;
-                    c->connection_state = sent_db_request;
+                    dialback_out_send_result(c, m);
                     log_debug2(
                         ZONE, LOGT_IO,
                         "... and we wanted ... and we sent <db:result/>");
@@ -828,8 +1478,7 @@ void dialback_out_read(mio m, int flags, void *arg, xmlnode x, char *unused1,
                     dialback_out_send_verifies(m, c);
 
                     /* flush the queue of packets */
-                    dialback_out_qflush(md, c->q);
-                    c->q = NULL;
+                    dialback_out_qflush(md, c);
 
                     /* we are connected, and can trash this now */
                     dialback_out_connection_cleanup(c);
@@ -838,6 +1487,14 @@ void dialback_out_read(mio m, int flags, void *arg, xmlnode x, char *unused1,
                 }
 
                 c->connection_state = got_features;
+
+                /* can other local domains share this connection? */
+                c->flags.db_errors =
+                    xmlnode_get_list_item(
+                        xmlnode_get_tags(x, "dbfeat:dialback/dbfeat:errors",
+                                         c->d->std_ns_prefixes),
+                        0) != NULL;
+
                 /* is starttls supported? */
                 if (xmlnode_get_list_item(
                         xmlnode_get_tags(x, "tls:starttls",
@@ -942,21 +1599,7 @@ void dialback_out_read(mio m, int flags, void *arg, xmlnode x, char *unused1,
                            "XMPP-stream: we could now send <db:result/>s");
                 if (c->db_state == want_request) {
                     /* send the dialback query */
-                    cur = xmlnode_new_tag_ns("result", "db", NS_DIALBACK);
-                    xmlnode_put_attrib_ns(cur, "to", NULL, NULL,
-                                          c->key->get_domain().c_str());
-                    xmlnode_put_attrib_ns(cur, "from", NULL, NULL,
-                                          c->key->get_resource().c_str());
-                    xmlnode_insert_cdata(
-                        cur,
-                        dialback_merlin(xmlnode_pool(cur), c->d->secret,
-                                        c->key->get_domain().c_str(),
-                                        c->key->get_resource().c_str(),
-                                        c->stream_id),
-                        -1);
-                    mio_write(m, cur, NULL, 0);
-                    c->db_state = sent_request;
-                    c->connection_state = sent_db_request;
+                    dialback_out_send_result(c, m);
                     log_debug2(
                         ZONE, LOGT_IO,
                         "... and we wanted ... and we did sent a <db:result/>");
@@ -976,7 +1619,8 @@ void dialback_out_read(mio m, int flags, void *arg, xmlnode x, char *unused1,
             if (j_strcmp(xmlnode_get_localname(x), "proceed") == 0 &&
                 j_strcmp(xmlnode_get_namespace(x), NS_XMPP_TLS) == 0) {
                 /* start tls on our side */
-                if (mio_xml_starttls(m, 1, c->key->get_resource().c_str())) {
+                if (mio_xml_starttls(m, 1, c->key->get_resource().c_str(),
+                                     c->key->get_domain().c_str())) {
                     /* starting tls failed */
                     log_warn(
                         c->d->i->id,
@@ -1097,9 +1741,19 @@ void dialback_out_read(mio m, int flags, void *arg, xmlnode x, char *unused1,
                                        c->key); /* this registers us to get
                                                    stuff directly now */
 
+                    /* other local domains can authorize on this connection,
+                     * if the peer can reject them without closing it */
+                    md->stream_id = pstrdup(m->p, c->stream_id);
+                    if (c->flags.db && c->flags.db_errors) {
+                        dialback_miod_hash(
+                            md, c->d->out_shared,
+                            jid_new(c->p, c->key->get_domain().c_str()));
+                        dialback_out_share_deferred(
+                            c->d, md, c->key->get_domain().c_str());
+                    }
+
                     /* flush the queue of packets */
-                    dialback_out_qflush(md, c->q);
-                    c->q = NULL;
+                    dialback_out_qflush(md, c);
 
                     /* we are connected, and can trash this now */
                     dialback_out_connection_cleanup(c);
@@ -1190,29 +1844,16 @@ void dialback_out_read(mio m, int flags, void *arg, xmlnode x, char *unused1,
  */
 void _dialback_out_beat_packets(xht h, const char *key, void *data, void *arg) {
     dboc c = (dboc)data;
-    dboq cur = NULL;
-    dboq next = NULL;
-    dboq last = NULL;
+    xmlnode x = NULL;
     int now = time(NULL);
     char *bounce_reason = NULL;
 
-    /* time out individual queue'd packets */
-    cur = c->q;
-    while (cur != NULL) {
-        const char *lang = xmlnode_get_lang(cur->x);
-
-        if ((now - cur->stamp) <= c->d->timeout_packets) {
-            last = cur;
-            cur = cur->next;
-            continue;
-        }
-
+    /* time out queue'd packets, the oldest ones are at the head */
+    while (c->q != NULL && (now - c->q->stamp) > c->d->timeout_packets) {
         /* timed out sukkah! */
-        next = cur->next;
-        if (c->q == cur)
-            c->q = next;
-        else
-            last->next = next;
+        x = dialback_out_dequeue(c);
+        const char *lang = xmlnode_get_lang(x);
+        c->stats->expired++;
 
         if (bounce_reason == NULL) {
             std::ostringstream errmsg;
@@ -1225,11 +1866,7 @@ void _dialback_out_beat_packets(xht h, const char *key, void *data, void *arg) {
             bounce_reason = pstrdup(c->p, errmsg.str().c_str());
         }
 
-        deliver_fail(dpacket_new(cur->x),
-                     bounce_reason
-                         ? bounce_reason
-                         : messages_get(lang, N_("Server Connect Timeout")));
-        cur = next;
+        deliver_fail(dpacket_new(x), bounce_reason);
     }
 }
 
@@ -33,11 +33,22 @@
  * @brief implements the main part of the DNS resolver component
  *
  * Config format:
- * &lt;dnsrv xmlns='jabber:config:dnsrv'&gt;
+ * &lt;dnsrv xmlns='jabber:config:dnsrv' dnstimeout='3' dnsretries='2'&gt;
+ *     &lt;nameserver&gt;127.0.0.1:53&lt;/nameserver&gt;
  *     &lt;resend service="_jabber._tcp"&gt;s2s-component&lt;/resend&gt;
  * &lt;/dnsrv&gt;
  *
  * Note: You must specify the services in the order you want them tried
+ *
+ * Lookups are done asynchronously inside the server process, many domains can
+ * be resolved at the same time. dnstimeout is the number of seconds to wait
+ * for an answer before retrying (using the next nameserver), dnsretries the
+ * number of retries. Without &lt;nameserver/&gt; elements the nameservers
+ * in /etc/resolv.conf are used.
+ *
+ * Results are cached for cachetimeout seconds (failed lookups for a tenth of
+ * it). The cache is limited to cachemax entries and cachememory bytes. Used
+ * entries are resolved again cacherefresh seconds before they expire.
  */
 
 #include "jabberd.h"
@@ -45,8 +56,7 @@
 
 #include <namespaces.hh>
 
-#include <sys/wait.h>
-#include <unistd.h>
+#include <stdlib.h>
 
 #ifdef LIBIDN
 #include <idna.h>
@@ -73,27 +83,21 @@ typedef struct __dns_resend_list {
 } * dns_resend_list, _dns_resend_list;
 
 /**
- * struct to keep track of a DNS coprocess
+ * struct holding the instance global data of the DNS resolver
  */
 typedef struct {
-    int in;                  /**< Inbound data handle */
-    int out;                 /**< Outbound data handle */
-    int pid;                 /**< Coprocess PID */
+    instance i;              /**< the instance of the component */
+    srv_resolver resolver;   /**< asynchronous resolver doing the lookups */
     xht packet_table;        /**< Hash of dns_packet_lists */
+    xht jobs;                /**< running lookups (dns_job), key is the domain */
     int packet_timeout;      /**< how long to keep packets in the queue */
-    xht cache_table;         /**< Hash of resolved IPs */
+    dnscache cache;          /**< cache of resolved IPs */
     int cache_timeout;       /**< how long to keep resolutions in the cache */
+    int cache_refresh; /**< refresh used entries this many seconds ahead */
     pool mempool;            /**< memory pool to use */
     dns_resend_list svclist; /**< list of defined services */
 } * dns_io, _dns_io;
 
-/**
- * prototype for the resolver function
- *
- * @param di pointer to the instance global data
- */
-typedef int (*RESOLVEFUNC)(dns_io di);
-
 /**
  * struct to store list of dpackets which need to be delivered
  */
@@ -104,165 +108,15 @@ typedef struct __dns_packet_list {
 } * dns_packet_list, _dns_packet_list;
 
 /**
- * signal handler: just die after any signal
- *
- * @param sig the signal number that has been sent
- */
-void _dnsrv_signal(int sig) { exit(0); }
-
-void warning_write(int fd, const void *buf, size_t count) {
-    ssize_t res = write(fd, buf, count);
-    if (res < (ssize_t)count) {
-        log_debug2(ZONE, LOGT_IO, "Couldn't write everything (%i of %i)", res,
-                   count);
-    }
-}
-
-/**
- * coprocess functionality
+ * a running lookup of a domain, trying the services one after the other
  */
-void dnsrv_child_process_xstream_io(int type, xmlnode x, void *args) {
-    dns_io di = (dns_io)args;
-    char *hostname, *ascii_hostname = NULL;
-    char *str = NULL;
-    dns_resend_list iternode = NULL;
-
-    if (type == XSTREAM_NODE) {
-        /* Get the hostname out... */
-        hostname = xmlnode_get_data(x);
-        log_debug2(ZONE, LOGT_IO, "dnsrv: Recv'd lookup request for %s",
-                   hostname);
-        if (hostname != NULL) {
-#ifdef LIBIDN
-            if (idna_to_ascii_8z(hostname, &ascii_hostname, 0) ==
-                IDNA_SUCCESS) {
-                log_debug2(ZONE, LOGT_IO, "dnsrv: IDN conversion %s to %s",
-                           hostname, ascii_hostname);
-                hostname = ascii_hostname;
-            }
-#endif
-            /* For each entry in the svclist, try and resolve using
-               the specified service and resend it to the specified host */
-            iternode = di->svclist;
-            while (iternode != NULL) {
-                str = srv_lookup(xmlnode_pool(x), iternode->service, hostname);
-                if (str != NULL) {
-                    dns_resend_list_host_list iterhost = iternode->hosts;
-
-                    /* play the dice, to select one of the s2s hosts */
-                    /* XXX should we statically distribute to the hosts using a
-                     * hash over the destination? */
-                    int host_die = iternode->weight_sum <= 1
-                                       ? 0
-                                       : rand() % (iternode->weight_sum);
-
-                    /* find the host selected by our host_die */
-                    while (host_die >= iterhost->weight &&
-                           iterhost->next != NULL) {
-                        /* try next host */
-                        host_die -= iterhost->weight;
-                        iterhost = iterhost->next;
-                    }
-
-                    log_debug2(ZONE, LOGT_IO,
-                               "Resolved %s(%s): %s\tresend to:%s", hostname,
-                               iternode->service, str, iterhost->host);
-                    xmlnode_put_attrib_ns(x, "ip", NULL, NULL, str);
-                    xmlnode_put_attrib_ns(x, "to", NULL, NULL, iterhost->host);
-                    break;
-                }
-                iternode = iternode->next;
-            }
-            str = xmlnode_serialize_string(x, xmppd::ns_decl_list(), 0);
-            warning_write(di->out, str, strlen(str));
-#ifdef LIBIDN
-            if (ascii_hostname != NULL)
-                free(ascii_hostname);
-#endif
-        }
-    }
-    xmlnode_free(x);
-}
-
-int dnsrv_child_main(dns_io di) {
-    pool p = pool_new();
-    xstream xs = xstream_new(p, dnsrv_child_process_xstream_io, di);
-    int len;
-    char readbuf[1024];
-
-    log_debug2(ZONE, LOGT_INIT, "DNSRV CHILD: starting");
-
-    /* Transmit stream header */
-    warning_write(di->out, "<stream>", 8);
-
-    /* Loop forever, processing requests and feeding them to the xstream*/
-    while (1) {
-        len = read(di->in, &readbuf, 1024);
-        if (len <= 0) {
-            log_debug2(ZONE, LOGT_IO | LOGT_STRANGE,
-                       "dnsrv: Read error on coprocess(%d): %d %s", getppid(),
-                       errno, strerror(errno));
-            break;
-        }
-
-        log_debug2(ZONE, LOGT_IO, "DNSRV CHILD: Read from buffer: %.*s", len,
-                   readbuf);
-
-        if (xstream_eat(xs, readbuf, len) > XSTREAM_NODE) {
-            log_debug2(ZONE, LOGT_IO | LOGT_STRANGE,
-                       "DNSRV CHILD: xstream died");
-            break;
-        }
-    }
-
-    /* child is out of loop... normal exit so parent will start us again */
-    log_debug2(ZONE, LOGT_STRANGE | LOGT_CLEANUP,
-               "DNSRV CHILD: out of loop.. exiting normal");
-    pool_free(p);
-    exit(0);
-    return 0;
-}
-
-/* Core functionality */
-int dnsrv_fork_and_capture(RESOLVEFUNC f, dns_io di) {
-    int left_fds[2], right_fds[2];
-    int pid;
-
-    /* Create left and right pipes */
-    if (pipe(left_fds) < 0 || pipe(right_fds) < 0)
-        return -1;
-
-    pid = fork();
-    if (pid < 0) {
-        return -1;
-    } else if (pid > 0) {
-        /* Parent */
-
-        /* Close unneeded file handles */
-        close(left_fds[STDIN_FILENO]);
-        close(right_fds[STDOUT_FILENO]);
-        /* Return the in and out file descriptors */
-        di->in = right_fds[STDIN_FILENO];
-        di->out = left_fds[STDOUT_FILENO];
-        /* Transmit root element to coprocess */
-        pth_write(di->out, "<stream>", 8);
-        return pid;
-    } else {
-        /* Child */
-
-        /* set up the new process */
-        pth_kill();
-        signal(SIGHUP, _dnsrv_signal);
-        signal(SIGINT, _dnsrv_signal);
-        signal(SIGTERM, _dnsrv_signal);
-        close(left_fds[STDOUT_FILENO]);
-        close(right_fds[STDIN_FILENO]);
-        /* Start the specified function, passing the in/out descriptors */
-        di->in = left_fds[STDIN_FILENO];
-        di->out = right_fds[STDOUT_FILENO];
-        return (*f)(di);
-    }
-}
+typedef struct {
+    pool p;               /**< memory pool of the job */
+    dns_io di;            /**< instance global data */
+    char *host;           /**< the domain as used as key in the packet_table */
+    char *ascii_host;     /**< the domain after IDN conversion */
+    dns_resend_list iter; /**< the service currently tried */
+} * dns_job, _dns_job;
 
 void dnsrv_resend(xmlnode pkt, char *ip, char *to) {
     if (ip != NULL) {
@@ -289,18 +143,145 @@ void dnsrv_resend(xmlnode pkt, char *ip, char *to) {
     deliver(dpacket_new(pkt), NULL);
 }
 
-/* Hostname lookup requested */
-void dnsrv_lookup(dns_io d, dpacket p) {
-    dns_packet_list l, lnew;
-    xmlnode req;
-    char *reqs;
+/**
+ * cache the result of a lookup and resend all packets waiting for it
+ *
+ * @param di instance global data
+ * @param hostname the domain, that has been resolved
+ * @param ip the resolved addresses, NULL if resolving failed
+ * @param to where to resend the packets to
+ */
+static void dnsrv_resolved(dns_io di, char const *hostname, char const *ip,
+                           char const *to) {
+    dns_packet_list head = NULL;
+    dns_packet_list heado = NULL;
 
-    /* make sure we have a child! */
-    if (d->out <= 0) {
-        deliver_fail(p, N_("DNS Resolver Error"));
+    log_debug2(ZONE, LOGT_IO, "incoming resolution: %s -> %s (resend to %s)",
+               hostname, ip ? ip : "(failed)", to ? to : "(none)");
+
+    /* whatever the response was, let's cache it, failed lookups are timed out
+     * 10 times faster (weird, I know, *shrug*), but do not replace addresses
+     * that are still valid (this might be a failed refresh) */
+    dnscache_put(di->cache, hostname, ip, to,
+                 ip == NULL ? di->cache_timeout / 10 : di->cache_timeout);
+
+    /* Get the hostname and look it up in the hashtable */
+    head = static_cast<dns_packet_list>(xhash_get(di->packet_table, hostname));
+    if (head == NULL) {
+        /* a refresh of the cache, or all packets timed out already */
+        log_debug2(ZONE, LOGT_IO, "no packets waiting for %s", hostname);
+        return;
+    }
+
+    /* Remove the list from the hashtable */
+    xhash_zap(di->packet_table, hostname);
+
+    /* Walk the list and insert IPs */
+    while (head != NULL) {
+        heado = head;
+        /* Move to next.. */
+        head = head->next;
+        /* Deliver the packet */
+        dnsrv_resend(heado->packet->x, const_cast<char *>(ip),
+                     const_cast<char *>(to));
+    }
+}
+
+/**
+ * callback for srv_lookup(): handle the result of resolving one service
+ *
+ * If the service could be resolved, the packets are resent to one of the
+ * hosts configured for it. Else the next service is tried.
+ *
+ * @param result the resolved addresses, NULL on failure
+ * @param arg the dns_job
+ */
+static void dnsrv_job_result(char const *result, void *arg) {
+    dns_job job = static_cast<dns_job>(arg);
+    dns_resend_list iternode = job->iter;
+    dns_io di = job->di;
+    char const *to = NULL;
+
+    if (result == NULL && iternode->next != NULL) {
+        /* try the next service */
+        job->iter = iternode->next;
+        srv_lookup(job->di->resolver, job->iter->service, job->ascii_host,
+                   dnsrv_job_result, job);
+        return;
+    }
+
+    if (result != NULL) {
+        dns_resend_list_host_list iterhost = iternode->hosts;
+
+        /* play the dice, to select one of the s2s hosts */
+        /* XXX should we statically distribute to the hosts using a hash over
+         * the destination? */
+        int host_die =
+            iternode->weight_sum <= 1 ? 0 : rand() % (iternode->weight_sum);
+
+        /* find the host selected by our host_die */
+        while (host_die >= iterhost->weight && iterhost->next != NULL) {
+            /* try next host */
+            host_die -= iterhost->weight;
+            iterhost = iterhost->next;
+        }
+
+        log_debug2(ZONE, LOGT_IO, "Resolved %s(%s): %s\tresend to:%s",
+                   job->ascii_host, iternode->service, result, iterhost->host);
+        to = iterhost->host;
+    }
+
+    /* the job is finished, the host can be resolved again */
+    xhash_zap(di->jobs, job->host);
+    dnsrv_resolved(di, job->host, result, to);
+
+    pool_free(job->p);
+}
+
+/**
+ * start resolving a domain
+ *
+ * Nothing is done, if the domain is already being resolved (e.g. by a
+ * refresh of its cache entry), the running job resends the packets.
+ *
+ * @param d instance global data
+ * @param host the domain to resolve
+ */
+static void dnsrv_start_job(dns_io d, char const *host) {
+    if (xhash_get(d->jobs, host) != NULL) {
+        log_debug2(ZONE, LOGT_IO, "dnsrv: %s is already being resolved", host);
         return;
     }
 
+    /* the job keeps its own copy of the hostname, the packets might time out
+     * before the lookup finishes */
+    pool jp = pool_new();
+    dns_job job = static_cast<dns_job>(pmalloco(jp, sizeof(_dns_job)));
+    job->p = jp;
+    job->di = d;
+    job->host = pstrdup(jp, host);
+    job->ascii_host = job->host;
+    job->iter = d->svclist;
+#ifdef LIBIDN
+    char *ascii_hostname = NULL;
+    if (idna_to_ascii_8z(job->host, &ascii_hostname, 0) == IDNA_SUCCESS) {
+        log_debug2(ZONE, LOGT_IO, "dnsrv: IDN conversion %s to %s", job->host,
+                   ascii_hostname);
+        job->ascii_host = pstrdup(jp, ascii_hostname);
+    }
+    if (ascii_hostname != NULL)
+        free(ascii_hostname);
+#endif
+    xhash_put(d->jobs, job->host, job);
+
+    srv_lookup(d->resolver, job->iter->service, job->ascii_host,
+               dnsrv_job_result, job);
+}
+
+/* Hostname lookup requested */
+void dnsrv_lookup(dns_io d, dpacket p) {
+    dns_packet_list l, lnew;
+
     /* Attempt to lookup this hostname in the packet table */
     l = (dns_packet_list)xhash_get(d->packet_table, p->host);
 
@@ -319,27 +300,28 @@ void dnsrv_lookup(dns_io d, dpacket p) {
         return;
     }
 
+    /* nothing configured to resend to? */
+    if (d->svclist == NULL) {
+        deliver_fail(p, N_("DNS Resolver Error"));
+        return;
+    }
+
     /* insert the packet into the packet_table using the hostname
-       as the key and send a request to the coprocess */
+       as the key and start resolving */
     log_debug2(ZONE, LOGT_IO, "dnsrv: Creating lookup request queue for %s",
                p->host);
     l = static_cast<dns_packet_list>(pmalloco(p->p, sizeof(_dns_packet_list)));
     l->packet = p;
     l->stamp = time(NULL);
     xhash_put(d->packet_table, p->host, l);
-    req = xmlnode_new_tag_pool_ns(p->p, "host", NULL, NS_SERVER);
-    xmlnode_insert_cdata(req, p->host, -1);
 
-    reqs = xmlnode_serialize_string(req, xmppd::ns_decl_list(), 0);
-    log_debug2(ZONE, LOGT_IO, "dnsrv: Transmitting lookup request: %s", reqs);
-    pth_write(d->out, reqs, strlen(reqs));
+    dnsrv_start_job(d, p->host);
 }
 
 result dnsrv_deliver(instance i, dpacket p, void *args) {
     dns_io di = (dns_io)args;
-    xmlnode c;
-    int timeout = di->cache_timeout;
-    char *ip;
+    char *ip = NULL;
+    char *resendto = NULL;
     jid to;
 
     /* if we get a route packet, it has to be to *us* and have the child as the
@@ -365,150 +347,16 @@ result dnsrv_deliver(instance i, dpacket p, void *args) {
     }
 
     /* try the cache first */
-    if ((c = static_cast<xmlnode>(xhash_get(di->cache_table, p->host))) !=
-        NULL) {
-        /* if there's no IP, cached failed lookup, time those out 10 times
-         * faster! (weird, I know, *shrug*) */
-        if ((ip = xmlnode_get_attrib_ns(c, "ip", NULL)) == NULL)
-            timeout = timeout / 10;
-
-        char const *cache_time_str = xmlnode_get_attrib_ns(c, "t", NULL);
-        time_t cache_time = 0;
-        if (cache_time_str) {
-            std::istringstream cache_time_stream(cache_time_str);
-            cache_time_stream >> cache_time;
-        }
-        if (std::time(NULL) - cache_time > timeout) {
-            /* timed out of the cache, lookup again */
-            xhash_zap(di->cache_table, p->host);
-            xmlnode_free(c);
-        } else {
-            /* yay, send back right from the cache */
-            dnsrv_resend(p->x, ip, xmlnode_get_attrib(c, "to"));
-            return r_DONE;
-        }
+    if (dnscache_get(di->cache, p->p, p->host, &ip, &resendto)) {
+        /* yay, send back right from the cache */
+        dnsrv_resend(p->x, ip, resendto);
+        return r_DONE;
     }
 
     dnsrv_lookup(di, p);
     return r_DONE;
 }
 
-void dnsrv_process_xstream_io(int type, xmlnode x, void *arg) {
-    dns_io di = (dns_io)arg;
-    char *hostname = NULL;
-    char *ipaddr = NULL;
-    char *resendhost = NULL;
-    dns_packet_list head = NULL;
-    dns_packet_list heado = NULL;
-
-    /* Node Format: <host ip="201.83.28.2">foo.org</host> */
-    if (type == XSTREAM_NODE) {
-        log_debug2(ZONE, LOGT_IO, "incoming resolution: %s",
-                   xmlnode_serialize_string(x, xmppd::ns_decl_list(), 0));
-        hostname = xmlnode_get_data(x);
-
-        /* whatever the response was, let's cache it */
-        xmlnode_free((xmlnode)xhash_get(
-            di->cache_table,
-            hostname)); /* free any old cache, shouldn't ever be any */
-
-        std::ostringstream now;
-        now << std::time(NULL);
-
-        xmlnode_put_attrib(x, "t", now.str().c_str());
-        xhash_put(di->cache_table, hostname, (void *)x);
-
-        /* Get the hostname and look it up in the hashtable */
-        head =
-            static_cast<dns_packet_list>(xhash_get(di->packet_table, hostname));
-        /* Process the packet list */
-        if (head != NULL) {
-            ipaddr = xmlnode_get_attrib_ns(x, "ip", NULL);
-            resendhost = xmlnode_get_attrib_ns(x, "to", NULL);
-
-            /* Remove the list from the hashtable */
-            xhash_zap(di->packet_table, hostname);
-
-            /* Walk the list and insert IPs */
-            while (head != NULL) {
-                heado = head;
-                /* Move to next.. */
-                head = head->next;
-                /* Deliver the packet */
-                dnsrv_resend(heado->packet->x, ipaddr, resendhost);
-            }
-        } else {
-            /* Host name was not found, something is _TERRIBLY_ wrong! */
-            log_debug2(ZONE, LOGT_IO, "Resolved unknown host/ip request: %s\n",
-                       xmlnode_serialize_string(x, xmppd::ns_decl_list(), 0));
-        }
-
-        return; /* we cached x above, so we don't free it below :) */
-    }
-    xmlnode_free(x);
-}
-
-void *dnsrv_process_io(void *threadarg) {
-    /* Get DNS IO info */
-    dns_io di = (dns_io)threadarg;
-    int readlen = 0;
-    char readbuf[1024];
-    xstream xs = NULL;
-
-    /* Allocate an xstream for talking to the process */
-    xs = xstream_new(di->mempool, dnsrv_process_xstream_io, di);
-
-    /* Loop forever */
-    while (1) {
-        /* Hostname lookup completed from coprocess */
-        readlen = pth_read(di->in, readbuf, sizeof(readbuf));
-        if (readlen <= 0) {
-            log_debug2(ZONE, LOGT_IO | LOGT_STRANGE,
-                       "dnsrv: Read error on coprocess: %d %s", errno,
-                       strerror(errno));
-            break;
-        }
-
-        if (xstream_eat(xs, readbuf, readlen) > XSTREAM_NODE)
-            break;
-    }
-
-    /* Cleanup */
-    close(di->in);
-    close(di->out);
-    di->out = 0;
-    waitpid(di->pid, &readlen, WNOHANG); /* reap any dead children */
-
-    /* silly to restart it if it died cuz we're shutting down, pretty hackish to
-     * do it this way tho... must be hackish when the comment is longer than the
-     * code itself, but I'm rambling */
-    /* removing dependancy from jabberd__signalflag to get it more clear
-     * I guess we do not need this anyway. If we are restarting the child
-    process
-     * while we are shutting down, the child process will get a SIGPIPE soon
-    after
-     * and terminate again.
-    if(jabberd__signalflag == SIGTERM || jabberd__signalflag == SIGINT) return
-    NULL;
-    */
-
-    log_debug2(ZONE, LOGT_INIT, "child being restarted...");
-
-    /* Fork out resolver function/process */
-    di->pid = dnsrv_fork_and_capture(dnsrv_child_main, di);
-
-    /* Start new IO thread */
-    pth_spawn(PTH_ATTR_DEFAULT, dnsrv_process_io, (void *)di);
-    return NULL;
-}
-
-void *dnsrv_thread(void *arg) {
-    dns_io di = (dns_io)arg;
-    /* Fork out resolver function/process */
-    di->pid = dnsrv_fork_and_capture(dnsrv_child_main, di);
-    return NULL;
-}
-
 /* callback for walking the connecting hash tree */
 void _dnsrv_beat_packets(xht h, const char *key, void *data, void *arg) {
     dns_io di = (dns_io)arg;
@@ -551,6 +399,66 @@ result dnsrv_beat_packets(void *arg) {
     return r_DONE;
 }
 
+/**
+ * callback for dnscache_expire(): resolve a used domain again before its
+ * cache entry expires
+ *
+ * @param host the domain to resolve
+ * @param arg instance global data
+ */
+static void dnsrv_refresh(char const *host, void *arg) {
+    dns_io di = (dns_io)arg;
+
+    /* already resolving it? */
+    if (xhash_get(di->jobs, host) != NULL)
+        return;
+
+    log_debug2(ZONE, LOGT_IO, "dnsrv: refreshing cache entry for %s", host);
+    dnsrv_start_job(di, host);
+}
+
+/**
+ * drop expired entries from the cache and refresh hot entries
+ *
+ * @param arg instance global data
+ * @return always r_DONE
+ */
+static result dnsrv_beat_cache(void *arg) {
+    dns_io di = (dns_io)arg;
+    dnscache_expire(di->cache, di->cache_refresh, dnsrv_refresh, arg);
+    return r_DONE;
+}
+
+/**
+ * add the statistics of the cache to the metrics
+ *
+ * @param m the metrics to add to
+ * @param arg instance global data
+ */
+static void dnsrv_metrics(metrics m, void *arg) {
+    dns_io di = (dns_io)arg;
+    std::string labels = metrics_label("instance", di->i->id);
+
+    metrics_add(m, "dnsrv_cache_hits_total", "counter",
+                "Lookups answered from the DNS cache.", labels,
+                dnscache_hits(di->cache));
+    metrics_add(m, "dnsrv_cache_misses_total", "counter",
+                "Lookups not found in the DNS cache.", labels,
+                dnscache_misses(di->cache));
+    metrics_add(m, "dnsrv_cache_evictions_total", "counter",
+                "Entries dropped from the full DNS cache.", labels,
+                dnscache_evictions(di->cache));
+    metrics_add(m, "dnsrv_cache_refreshes_total", "counter",
+                "DNS cache entries resolved again before they expired.",
+                labels, dnscache_refreshes(di->cache));
+    metrics_add(m, "dnsrv_cache_entries", "gauge",
+                "Entries in the DNS cache.", labels,
+                dnscache_entries(di->cache));
+    metrics_add(m, "dnsrv_cache_bytes", "gauge",
+                "Estimated memory used by the DNS cache.", labels,
+                dnscache_bytes(di->cache));
+}
+
 extern "C" void dnsrv(instance i, xmlnode x) {
     xdbcache xc = NULL;
     xmlnode config = NULL;
@@ -563,6 +471,7 @@ extern "C" void dnsrv(instance i, xmlnode x) {
     dns_io di = static_cast<dns_io>(pmalloco(i->p, sizeof(_dns_io)));
 
     di->mempool = i->p;
+    di->i = i;
 
     /* Load config from xdb */
     xc = xdb_cache(i);
@@ -644,33 +553,30 @@ extern "C" void dnsrv(instance i, xmlnode x) {
     di->packet_table =
         xhash_new(j_atoi(xmlnode_get_attrib_ns(config, "queuemax", NULL), 101));
     pool_cleanup(i->p, (pool_cleaner)xhash_free, di->packet_table);
+    di->jobs = xhash_new(101);
+    pool_cleanup(i->p, (pool_cleaner)xhash_free, di->jobs);
     di->packet_timeout =
         j_atoi(xmlnode_get_attrib_ns(config, "queuetimeout", NULL), 60);
     register_beat(di->packet_timeout, dnsrv_beat_packets, (void *)di);
 
     /* Setup the internal hostname cache */
-    di->cache_table = xhash_new(
-        j_atoi(xmlnode_get_attrib_ns(config, "cachemax", NULL), 1999));
-    pool_cleanup(i->p, (pool_cleaner)xhash_free, di->cache_table);
+    di->cache = dnscache_new(
+        j_atoi(xmlnode_get_attrib_ns(config, "cachemax", NULL), 1999),
+        j_atoi(xmlnode_get_attrib_ns(config, "cachememory", NULL), 1048576));
+    pool_cleanup(i->p, (pool_cleaner)dnscache_free, di->cache);
     di->cache_timeout =
         j_atoi(xmlnode_get_attrib_ns(config, "cachetimeout", NULL),
                3600); /* 1 hour dns cache? XXX would be nice to get the right
                          value from dns! */
+    di->cache_refresh =
+        j_atoi(xmlnode_get_attrib_ns(config, "cacherefresh", NULL), 60);
+    register_beat(10, dnsrv_beat_cache, (void *)di);
+    register_metrics(dnsrv_metrics, (void *)di);
 
-    xmlnode_free(config);
-
-    /* spawn a thread that get's forked, and wait for it since it sets up the
-     * fd's */
-    pth_join(pth_spawn(PTH_ATTR_DEFAULT, dnsrv_thread, (void *)di), NULL);
+    /* Setup the resolver doing the actual DNS queries */
+    di->resolver = srv_resolver_new(i->p, config);
 
-    if (di->pid < 0) {
-        log_error(i->id,
-                  "dnsrv failed to start, unable to fork and/or create pipes");
-        return;
-    }
-
-    /* Start IO thread */
-    pth_spawn(PTH_ATTR_DEFAULT, dnsrv_process_io, di);
+    xmlnode_free(config);
 
     /* Register an incoming packet handler */
     register_phandler(i, o_DELIVER, dnsrv_deliver, (void *)di);
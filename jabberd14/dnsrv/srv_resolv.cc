@@ -31,14 +31,24 @@
 
 #include "jabberd.h"
 
+#include <namespaces.hh>
+#include <socket.hh>
+
 #include <arpa/inet.h>
-#include <netdb.h>
-#include <netinet/in.h>
-#define BIND_8_COMPAT
 #include <arpa/nameser.h>
+#include <cerrno>
+#include <fcntl.h>
+#include <gcrypt.h>
+#include <netinet/in.h>
 #include <resolv.h>
 #include <sys/types.h>
-#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <set>
+#include <vector>
 
 #include "srv_resolv.h"
 
@@ -48,439 +58,884 @@
  *
  * This file implements resolving of services in the DNS using the protocol
  * defined in RFC 2782.
+ *
+ * The resolving is done asynchronously inside the server process: queries are
+ * sent as UDP datagrams to the nameservers, using sockets that are managed by
+ * mio. This allows to resolve many domains at the same time. Queries that are
+ * not answered in time (or answered with a server failure) are sent again to
+ * the next nameserver. Truncated answers are queried again over TCP.
+ *
+ * Each query is sent from its own socket bound to a random port and gets an
+ * unpredictable id, an answer is only accepted on this socket and with this
+ * id, which makes it hard to inject forged answers. Address records are only
+ * taken for the queried name (or its aliases), addresses of SRV targets from
+ * the additional section only for targets inside the queried domain.
+ *
+ * The nameservers are taken from the &lt;nameserver/&gt; elements in the
+ * configuration of the dnsrv component (format: ip, ip:port, or [ip]:port), if
+ * there are none from /etc/resolv.conf.
+ */
+
+/**
+ * @brief a host providing a service
+ *
+ * For SRV lookups this is built from a SRV record, for lookups without a
+ * service it is the domain itself.
+ */
+typedef struct {
+    int priority;                       /**< priority of the SRV record */
+    int weight;                         /**< weight of the SRV record */
+    int port;                           /**< port, 0 for no port */
+    std::string host;                   /**< the host to connect to */
+    std::vector<std::string> addresses6; /**< IPv6 addresses of the host */
+    std::vector<std::string> addresses4; /**< IPv4 addresses of the host */
+} _srv_target;
+
+/**
+ * @brief a running srv_lookup()
  */
+typedef struct srv_job_struct {
+    srv_resolver r;      /**< the resolver */
+    std::string service; /**< the service to resolve, empty for AAAA/A only */
+    std::string domain;  /**< the domain to resolve */
+    srv_lookup_cb cb;    /**< callback to call with the result */
+    void *arg;           /**< argument for the callback */
+    std::vector<_srv_target> targets; /**< the hosts providing the service */
+    int pending; /**< number of queries, that are not yet finished */
+} _srv_job, *srv_job;
 
-#ifndef T_SRV
-#define T_SRV 33
-#endif
+/**
+ * @brief a DNS query waiting for its answer
+ */
+typedef struct {
+    srv_job job;        /**< the lookup this query is for */
+    uint16_t id;        /**< the id of the query */
+    std::string name;   /**< the queried name (lowercase) */
+    int type;           /**< the queried record type */
+    size_t target;      /**< index of the target in job (AAAA/A queries) */
+    size_t server;      /**< index of the nameserver we asked */
+    int tries;          /**< how often the query has been sent */
+    time_t sent;        /**< when the query has been sent the last time */
+    bool tcp;           /**< if the query is sent over TCP (answer truncated) */
+    mio socket;         /**< the socket the query has been sent on, or NULL */
+    std::string in;     /**< data received over TCP, not yet a whole message */
+    std::string packet; /**< the query datagram */
+} _srv_query;
 
 /**
- * @brief representation of a SRV DNS record
+ * @brief the asynchronous resolver
+ */
+struct srv_resolver_struct {
+    std::vector<std::string> hosts; /**< addresses of the nameservers */
+    std::vector<std::string> ports; /**< ports of the nameservers */
+    std::map<uint16_t, _srv_query> queries; /**< queries by their id */
+    std::map<mio, uint16_t> sockets; /**< query ids by their socket */
+    int timeout; /**< seconds to wait for an answer before resending */
+    int retries; /**< how often a query is resent */
+    bool freed;  /**< the pool has been freed, the beat deletes the resolver */
+};
+
+static void srv_job_answer(_srv_query const &q, ns_msg *msg);
+
+/**
+ * get an unpredictable number for query ids and source ports
  *
- * This structure is used to build an ordered double linked list of SRV DNS
- * records for a service on a domain
+ * @return the random number
  */
-typedef struct __srv_list {
-    int priority; /**< priority value in this record */
-    char *port;   /**< port value in this record */
-    char *host;   /**< host name where this record points to */
-    struct __srv_list
-        *next; /**< next value in the list (higher priority value) */
-    struct __srv_list
-        *last; /**< previous value in the list (lower priority value) */
-} * srv_list, _srv_list;
+static uint16_t srv_random16() {
+    uint16_t value = 0;
+
+    gcry_create_nonce(&value, sizeof(value));
+    return value;
+}
 
 /**
- * convert an IPv4 (AF_INET) address to its textual representation using memory
- * pools
+ * normalize a domain name for comparison
  *
- * @param p the pool to be used
- * @param addrptr the address that should be printed
- * @return the address as a string
+ * @param name the name
+ * @return lowercase name without trailing dot
  */
-char *srv_inet_ntoa(pool p, unsigned char *addrptr) {
-    char result[16];
-    result[15] = '\0';
-    snprintf(result, sizeof(result), "%d.%d.%d.%d", addrptr[0], addrptr[1],
-             addrptr[2], addrptr[3]);
-    return pstrdup(p, result);
+static std::string srv_normalize(std::string name) {
+    if (!name.empty() && name[name.length() - 1] == '.')
+        name.erase(name.length() - 1);
+    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+    return name;
 }
 
 /**
- * convert an internet address to its textual representation using memory pools
+ * add a nameserver to the resolver
  *
- * @param p the pool to be used
- * @param addrptr the address that should be printed
- * @param af the address family of addrptr
- * @return the address as a string
+ * @param r the resolver
+ * @param server address of the nameserver (ip, ip:port, [ip], or [ip]:port)
  */
-char *srv_inet_ntop(pool p, const unsigned char *addrptr, int af) {
-    char result[INET6_ADDRSTRLEN];
-    inet_ntop(af, addrptr, result, sizeof(result));
-    return pstrdup(p, result);
+static void srv_resolver_add_server(srv_resolver r, std::string server) {
+    std::string port = "53";
+    std::string::size_type col = std::string::npos;
+
+    if (server.empty())
+        return;
+
+    if (server[0] == '[') {
+        std::string::size_type end = server.find(']');
+        if (end == std::string::npos)
+            return;
+        if (end + 1 < server.length() && server[end + 1] == ':')
+            port = server.substr(end + 2);
+        server = server.substr(1, end - 1);
+    } else if ((col = server.find(':')) != std::string::npos &&
+               server.find(':', col + 1) == std::string::npos) {
+        /* exactly one colon: IPv4 address with port */
+        port = server.substr(col + 1);
+        server.erase(col);
+    }
+
+    log_debug2(ZONE, LOGT_INIT, "using nameserver %s port %s", server.c_str(),
+               port.c_str());
+    r->hosts.push_back(server);
+    r->ports.push_back(port);
 }
 
 /**
- * convert a (numerical) port number to a string using memory pools
+ * close the socket a query has been sent on
  *
- * @param p the pool to be used
- * @param port the port that should be converted
- * @return the port number as a string
+ * @param r the resolver
+ * @param q the query
  */
-char *srv_port2str(pool p, unsigned short port) {
-    char *result = static_cast<char *>(pmalloco(p, 6));
-    snprintf(result, 6, "%d", port);
-    return result;
+static void srv_query_close(srv_resolver r, _srv_query &q) {
+    if (q.socket == NULL)
+        return;
+
+    r->sockets.erase(q.socket);
+    mio_reset(q.socket, NULL, NULL);
+    mio_close(q.socket);
+    q.socket = NULL;
+    q.in.clear();
 }
 
 /**
- * put a value in an xhash and join it with the previous value if there has been
- * already one in the hash
+ * free the resolver
  *
- * If there is no entry for this key, the function just enters the value.
- * If there is already an entry for this key, the function will append a ","
- * and the old value to the new value and insert it into the hash.
+ * The running lookups are dropped without calling their callbacks, as they
+ * belong to the component that is freed. The resolver itself is deleted by
+ * the next beat, which still references it.
  *
- * @param p memory pool to be used
- * @param ht the hash table
- * @param key the key in the hash
- * @param value the value that should be inserted
+ * @param arg the resolver
  */
-void srv_xhash_join(pool p, xht ht, const char *key, char *value) {
-    void *old = xhash_get(ht, key);
-    if (old == NULL) {
-        xhash_put(ht, key, value);
+static void srv_resolver_free(void *arg) {
+    srv_resolver r = static_cast<srv_resolver>(arg);
+    std::set<srv_job> jobs;
+
+    for (std::map<uint16_t, _srv_query>::iterator q = r->queries.begin();
+         q != r->queries.end(); ++q) {
+        srv_query_close(r, q->second);
+        jobs.insert(q->second.job);
+    }
+    r->queries.clear();
+
+    for (std::set<srv_job>::iterator job = jobs.begin(); job != jobs.end();
+         ++job)
+        delete *job;
+
+    r->freed = true;
+}
+
+/**
+ * open a socket to a nameserver
+ *
+ * UDP sockets are bound to a random port, TCP sockets get the (random)
+ * port of the kernel. The socket is connected without blocking, mio writes
+ * the query when the connection is established.
+ *
+ * IPv6 sockets are used, as they can reach IPv4 nameservers as well. On hosts
+ * without IPv6 support an IPv4 socket is used for IPv4 nameservers.
+ *
+ * @param r the resolver
+ * @param server index of the nameserver
+ * @param tcp true for a TCP socket, false for UDP
+ * @return the file descriptor, -1 on failure
+ */
+static int srv_resolver_socket(srv_resolver r, size_t server, bool tcp) {
+    struct sockaddr_in6 sa;
+    struct sockaddr_in sa4;
+    struct sockaddr *addr = (struct sockaddr *)&sa;
+    socklen_t addrlen = sizeof(sa);
+    struct in6_addr *saddr = make_addr_ipv6(r->hosts[server].c_str());
+    int fd = -1;
+
+    if (saddr == NULL) {
+        log_warn(NULL, "dnsrv cannot use nameserver %s: not an IP address",
+                 r->hosts[server].c_str());
+        return -1;
+    }
+
+    bzero((void *)&sa, sizeof(sa));
+    sa.sin6_family = AF_INET6;
+    sa.sin6_addr = *saddr;
+    bzero((void *)&sa4, sizeof(sa4));
+    sa4.sin_family = AF_INET;
+    memcpy(&sa4.sin_addr, &saddr->s6_addr[12], 4);
+
+    fd = socket(PF_INET6, tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
+    if (fd < 0 && errno == EAFNOSUPPORT && IN6_IS_ADDR_V4MAPPED(saddr)) {
+        addr = (struct sockaddr *)&sa4;
+        addrlen = sizeof(sa4);
+
+        fd = socket(PF_INET, tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
+    }
+    if (fd < 0) {
+        log_warn(NULL, "dnsrv could not open socket to nameserver %s: %s",
+                 r->hosts[server].c_str(), strerror(errno));
+        return -1;
+    }
+
+    /* bind to the wildcard address of the socket's family, on a random port;
+     * if all tried ports are in use, the kernel selects one on connect */
+    for (int tries = 0; !tcp && tries < 8; tries++) {
+        struct sockaddr_storage local;
+        uint16_t port = htons(1024 + srv_random16() % (65536 - 1024));
+
+        bzero((void *)&local, sizeof(local));
+        local.ss_family = addr->sa_family;
+        if (addr->sa_family == AF_INET6)
+            ((struct sockaddr_in6 *)&local)->sin6_port = port;
+        else
+            ((struct sockaddr_in *)&local)->sin_port = port;
+        if (bind(fd, (struct sockaddr *)&local, addrlen) == 0 ||
+            errno != EADDRINUSE)
+            break;
+    }
+
+    sa.sin6_port = sa4.sin_port = htons(j_atoi(r->ports[server].c_str(), 53));
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    if (connect(fd, addr, addrlen) < 0 &&
+        errno != EINPROGRESS) {
+        log_warn(NULL, "dnsrv could not connect to nameserver %s: %s",
+                 r->hosts[server].c_str(), strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void srv_resolver_mio_cb(mio m, int state, void *arg, xmlnode x,
+                                char *buffer, int bufsz);
+
+/**
+ * (re)send a query to its nameserver
+ *
+ * Each try uses a new socket, and by this a new source port.
+ *
+ * @param r the resolver
+ * @param q the query
+ */
+static void srv_query_send(srv_resolver r, _srv_query &q) {
+    int fd = -1;
+
+    srv_query_close(r, q);
+
+    q.tries++;
+    q.sent = time(NULL);
+
+    /* if the socket could not be opened, the query times out and is tried
+     * with the next nameserver */
+    fd = srv_resolver_socket(r, q.server, q.tcp);
+    if (fd < 0)
         return;
+
+    q.socket = mio_new(fd, srv_resolver_mio_cb, (void *)r, MIO_CONNECT_RAW);
+    r->sockets[q.socket] = q.id;
+
+    if (q.tcp) {
+        /* over TCP the message is preceded by its length */
+        unsigned char length[2];
+
+        ns_put16(q.packet.length(), length);
+        mio_write(q.socket, NULL, reinterpret_cast<char *>(length), 2);
+    } else {
+        /* a datagram has to be read at once, do not limit reading by karma */
+        mio_karma(q.socket, 100, 100, 0, 0, 0, 100);
     }
-    std::ostringstream join;
-    join << value << "," << static_cast<char *>(old);
-    xhash_put(ht, key, pstrdup(p, join.str().c_str()));
+    mio_write(q.socket, NULL, q.packet.data(), q.packet.length());
 }
 
 /**
- * helper function that lookups AAAA and A records in the dns
+ * process a DNS message received for a query
  *
- * this function will lookup AAAA and A records and return the IP addresses as a
- * comma separated list
+ * @param r the resolver
+ * @param id the id of the query
+ * @param data the message
+ * @param len length of the message
+ */
+static void srv_query_answer(srv_resolver r, uint16_t id,
+                             unsigned char const *data, int len) {
+    std::map<uint16_t, _srv_query>::iterator query = r->queries.find(id);
+    ns_msg msg;
+    ns_rr rr;
+
+    if (query == r->queries.end())
+        return;
+
+    if (ns_initparse(data, len, &msg) < 0) {
+        log_debug2(ZONE, LOGT_IO, "dropping unparsable DNS answer");
+        return;
+    }
+
+    /* check that the answer is for the query */
+    if (ns_msg_id(msg) != id || ns_msg_count(msg, ns_s_qd) != 1 ||
+        ns_parserr(&msg, ns_s_qd, 0, &rr) < 0 ||
+        ns_rr_type(rr) != query->second.type ||
+        srv_normalize(ns_rr_name(rr)) != query->second.name) {
+        log_debug2(ZONE, LOGT_IO, "dropping unexpected DNS answer");
+        return;
+    }
+
+    /* the answer did not fit in a datagram, ask again over TCP */
+    if (ns_msg_getflag(msg, ns_f_tc) && !query->second.tcp) {
+        log_debug2(ZONE, LOGT_IO, "answer for %s truncated, using TCP",
+                   query->second.name.c_str());
+        query->second.tcp = true;
+        srv_query_send(r, query->second);
+        return;
+    }
+
+    /* server failures are handled like timeouts, the query is resent to the
+     * next nameserver on the next beat */
+    if (ns_msg_getflag(msg, ns_f_rcode) == ns_r_servfail ||
+        ns_msg_getflag(msg, ns_f_rcode) == ns_r_refused) {
+        log_debug2(ZONE, LOGT_IO, "nameserver %s failed to resolve %s",
+                   r->hosts[query->second.server].c_str(),
+                   query->second.name.c_str());
+        srv_query_close(r, query->second);
+        query->second.sent = 0;
+        return;
+    }
+
+    srv_query_close(r, query->second);
+    _srv_query q = query->second;
+    r->queries.erase(query);
+    srv_job_answer(q, ns_msg_getflag(msg, ns_f_rcode) == ns_r_noerror ? &msg
+                                                                     : NULL);
+}
+
+/**
+ * mio callback for the sockets of the queries
  *
- * @return 0 in case of success, non zero on error
+ * @param m the socket
+ * @param state the mio event
+ * @param arg the resolver
+ * @param x unused/ignored
+ * @param buffer the received data
+ * @param bufsz size of the data
  */
-static int srv_lookup_aaaa_a(std::ostream &result, const char *domain) {
-    int first_result = 1;
-    int error_code;
-    struct addrinfo hints;
-    struct addrinfo *addr_res;
-    struct addrinfo *addr_iter;
-    char addr_str[INET6_ADDRSTRLEN];
-
-    log_debug2(ZONE, LOGT_IO, "Standard resolution of %s", domain);
-
-    /* setup the hints what we want to get */
-    bzero(&hints, sizeof(hints));
-    hints.ai_family = PF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    addr_res = NULL;
-
-    /* start resolving */
-    error_code = getaddrinfo(domain, NULL, &hints, &addr_res);
-    if (error_code) {
-        log_debug2(ZONE, LOGT_IO, "Error while resolving %s: %s", domain,
-                   gai_strerror(error_code));
-        if (addr_res) {
-            freeaddrinfo(addr_res);
-        }
-        return 1;
+static void srv_resolver_mio_cb(mio m, int state, void *arg, xmlnode x,
+                                char *buffer, int bufsz) {
+    srv_resolver r = static_cast<srv_resolver>(arg);
+
+    if (r == NULL)
+        return;
+
+    std::map<mio, uint16_t>::iterator socket = r->sockets.find(m);
+    if (socket == r->sockets.end())
+        return;
+    uint16_t id = socket->second;
+    std::map<uint16_t, _srv_query>::iterator query = r->queries.find(id);
+    if (query == r->queries.end())
+        return;
+    _srv_query &q = query->second;
+
+    if (state == MIO_CLOSED) {
+        /* resent to the next nameserver on the next beat */
+        r->sockets.erase(socket);
+        q.socket = NULL;
+        q.in.clear();
+        q.sent = 0;
+        return;
     }
 
-    /* iterate through all results to find IPv6 and IPv4 results */
-    for (addr_iter = addr_res; addr_iter != NULL;
-         addr_iter = addr_iter->ai_next) {
-        switch (addr_iter->ai_family) {
-            case PF_INET:
-                inet_ntop(AF_INET,
-                          (char *)&((struct sockaddr_in *)addr_iter->ai_addr)
-                              ->sin_addr,
-                          addr_str, sizeof(addr_str));
-                if (!first_result) {
-                    result << "," << addr_str;
-                } else {
-                    first_result = 0;
-                    result << addr_str;
-                }
-                break;
-            case PF_INET6:
-                inet_ntop(AF_INET6,
-                          (char *)&((struct sockaddr_in6 *)addr_iter->ai_addr)
-                              ->sin6_addr,
-                          addr_str, sizeof(addr_str));
-                if (!first_result) {
-                    result << "," << addr_str;
-                } else {
-                    first_result = 0;
-                    result << addr_str;
-                }
-        }
+    if (state != MIO_BUFFER || buffer == NULL)
+        return;
+
+    if (!q.tcp) {
+        srv_query_answer(r, id, reinterpret_cast<unsigned char *>(buffer),
+                         bufsz);
+        return;
     }
 
-    /* free memory */
-    if (addr_res) {
-        freeaddrinfo(addr_res);
+    /* over TCP the message is preceded by its length */
+    q.in.append(buffer, bufsz);
+    if (q.in.length() < 2)
+        return;
+    size_t len =
+        ns_get16(reinterpret_cast<unsigned char const *>(q.in.data()));
+    if (q.in.length() < len + 2)
+        return;
+
+    std::string message = q.in.substr(2, len);
+    q.in.clear();
+    srv_query_answer(
+        r, id, reinterpret_cast<unsigned char const *>(message.data()), len);
+}
+
+/**
+ * start a DNS query
+ *
+ * @param job the lookup the query is for
+ * @param name the name to query
+ * @param type the record type to query
+ * @param target the index of the target in job (for AAAA/A queries)
+ * @return 0 on success, non zero if the query could not be built
+ */
+static int srv_query_new(srv_job job, std::string const &name, int type,
+                         size_t target) {
+    srv_resolver r = job->r;
+    unsigned char packet[NS_PACKETSZ];
+    uint16_t id = 0;
+    int len = 0;
+
+    if (r->hosts.empty())
+        return 1;
+
+    len = res_mkquery(ns_o_query, name.c_str(), ns_c_in, type, NULL, 0, NULL,
+                      packet, sizeof(packet));
+    if (len < 0) {
+        log_debug2(ZONE, LOGT_IO, "could not build query for %s",
+                   name.c_str());
+        return 1;
     }
 
+    /* select an unused unpredictable id */
+    do {
+        id = srv_random16();
+    } while (r->queries.find(id) != r->queries.end());
+    ns_put16(id, packet);
+
+    _srv_query &q = r->queries[id];
+    q.job = job;
+    q.id = id;
+    q.name = srv_normalize(name);
+    q.type = type;
+    q.target = target;
+    q.server = 0;
+    q.tries = 0;
+    q.tcp = false;
+    q.socket = NULL;
+    q.packet = std::string(reinterpret_cast<char *>(packet), len);
+    job->pending++;
+
+    log_debug2(ZONE, LOGT_IO, "querying %s (type %i) as id %u", name.c_str(),
+               type, id);
+    srv_query_send(r, q);
     return 0;
 }
 
 /**
- * do a DNS lookup
+ * start AAAA and A queries for a target of a lookup
  *
- * This function implements a SRV DNS lookup and falls back to normal AAAA/A
- * resolution if no service has been given by the caller.
+ * @param job the lookup
+ * @param target index of the target
+ */
+static void srv_job_resolve_target(srv_job job, size_t target) {
+    srv_query_new(job, job->targets[target].host, ns_t_aaaa, target);
+    srv_query_new(job, job->targets[target].host, ns_t_a, target);
+}
+
+/**
+ * order the targets of a SRV lookup as defined by RFC 2782
  *
- * @param p memory pool to be used by this function
- * @param service which service should be looked up (e.g. "_xmpp-server._tcp")
- * @param domain which domain should be looked up
- * @return comma separated list of results containing IPv4 and IPv6 addresses
- * with or without ports
+ * The targets are ordered by priority, targets of the same priority are
+ * ordered randomly, with a probability proportional to their weight for each
+ * position.
  *
- * @todo The function honors the priority values of a SRV record but not the
- * weight values. Implement handling of weights!
+ * @param targets the targets to order
  */
-char *srv_lookup(pool p, const char *service, const char *domain) {
-    unsigned char reply[1024]; /* Reply buffer */
-    int replylen = 0;
-    char host[1024];
-    register HEADER *rheader; /* Reply header*/
-    unsigned char *rrptr;     /* Current Resource record ptr */
-    int exprc;                /* dn_expand return code */
-    int rrtype;
-    long rrpayloadsz;
-    srv_list svrlist = NULL;
-    srv_list tempnode = NULL;
-    srv_list iternode = NULL;
-    xht arr_table; /* Hash of A records (name, ip) */
-    int result_is_empty = 1;
-    char *ipname;
-    char *ipaddr;
-
-    /* If no service is specified, use a standard gethostbyname call */
-    if (service == NULL) {
-        std::ostringstream result;
-        if (srv_lookup_aaaa_a(result, domain) == 0) {
-            return pstrdup(p, result.str().c_str());
-        } else {
-            return NULL;
+static void srv_order_targets(std::vector<_srv_target> &targets) {
+    std::vector<_srv_target> ordered;
+    std::vector<_srv_target> group;
+
+    std::stable_sort(targets.begin(), targets.end(),
+                     [](_srv_target const &a, _srv_target const &b) {
+                         return a.priority < b.priority;
+                     });
+
+    for (size_t start = 0; start < targets.size();) {
+        size_t end = start;
+
+        /* the targets of the same priority, zero weights first */
+        group.clear();
+        while (end < targets.size() &&
+               targets[end].priority == targets[start].priority) {
+            if (targets[end].weight == 0)
+                group.insert(group.begin(), targets[end]);
+            else
+                group.push_back(targets[end]);
+            end++;
         }
+
+        while (!group.empty()) {
+            int sum = 0;
+            int running = 0;
+            size_t selected = 0;
+
+            for (size_t n = 0; n < group.size(); n++)
+                sum += group[n].weight;
+            int die = rand() % (sum + 1);
+
+            for (selected = 0; selected < group.size() - 1; selected++) {
+                running += group[selected].weight;
+                if (running >= die)
+                    break;
+            }
+
+            ordered.push_back(group[selected]);
+            group.erase(group.begin() + selected);
+        }
+
+        start = end;
     }
 
-    log_debug2(ZONE, LOGT_IO, "srv: SRV resolution of %s.%s", service, domain);
+    targets.swap(ordered);
+}
 
-    /* Setup A record hash table */
-    arr_table = xhash_new(11);
+/**
+ * all queries of a lookup are finished, pass the result to the callback
+ *
+ * @param job the lookup
+ */
+static void srv_job_finish(srv_job job) {
+    std::ostringstream result;
+    bool first = true;
+
+    for (std::vector<_srv_target>::const_iterator target =
+             job->targets.begin();
+         target != job->targets.end(); ++target) {
+        for (std::vector<std::string>::const_iterator addr =
+                 target->addresses6.begin();
+             addr != target->addresses6.end(); ++addr) {
+            result << (first ? "" : ",");
+            if (target->port > 0)
+                result << "[" << *addr << "]:" << target->port;
+            else
+                result << *addr;
+            first = false;
+        }
+        for (std::vector<std::string>::const_iterator addr =
+                 target->addresses4.begin();
+             addr != target->addresses4.end(); ++addr) {
+            result << (first ? "" : ",") << *addr;
+            if (target->port > 0)
+                result << ":" << target->port;
+            first = false;
+        }
+    }
 
-    /* Initialize lookup system if needed (check global _res structure) */
-    if (((_res.options & RES_INIT) == 0) && (res_init() == -1)) {
-        log_debug2(ZONE, LOGT_IO, "srv: initialization failed on res_init.");
-        return NULL;
+    log_debug2(ZONE, LOGT_IO, "resolved %s%s%s: %s", job->service.c_str(),
+               job->service.empty() ? "" : ".", job->domain.c_str(),
+               result.str().c_str());
+
+    (*job->cb)(first ? NULL : result.str().c_str(), job->arg);
+    delete job;
+}
+
+/**
+ * check if a name is inside a domain (or the domain itself)
+ *
+ * @param name the name (normalized)
+ * @param domain the domain (normalized)
+ * @return true if the name is inside the domain
+ */
+static bool srv_in_bailiwick(std::string const &name,
+                             std::string const &domain) {
+    if (name.length() == domain.length())
+        return name == domain;
+
+    return name.length() > domain.length() &&
+           name[name.length() - domain.length() - 1] == '.' &&
+           name.compare(name.length() - domain.length(), domain.length(),
+                        domain) == 0;
+}
+
+/**
+ * add the address records of a DNS message to a target
+ *
+ * Only records owned by the given name are taken. In the answer section, the
+ * names this name is an alias for (CNAME records) are accepted as well.
+ *
+ * @param msg the DNS message
+ * @param section the section of the message to take the records from
+ * @param name only take records of this name
+ * @param target the target to add the addresses to
+ */
+static void srv_add_addresses(ns_msg *msg, ns_sect section,
+                              std::string const &name, _srv_target &target) {
+    char addr[INET6_ADDRSTRLEN];
+    std::set<std::string> names;
+    ns_rr rr;
+
+    names.insert(name);
+
+    /* the CNAME records of a chain may come in any order */
+    for (int pass = 0; section == ns_s_an && pass < ns_msg_count(*msg, section);
+         pass++) {
+        size_t known = names.size();
+
+        for (int n = 0; n < ns_msg_count(*msg, section); n++) {
+            char alias[NS_MAXDNAME];
+
+            if (ns_parserr(msg, section, n, &rr) < 0)
+                break;
+            if (ns_rr_type(rr) != ns_t_cname ||
+                names.find(srv_normalize(ns_rr_name(rr))) == names.end())
+                continue;
+            if (dn_expand(ns_msg_base(*msg), ns_msg_end(*msg), ns_rr_rdata(rr),
+                          alias, sizeof(alias)) < 0)
+                continue;
+            names.insert(srv_normalize(alias));
+        }
+
+        if (names.size() == known)
+            break;
+    }
+
+    for (int n = 0; n < ns_msg_count(*msg, section); n++) {
+        if (ns_parserr(msg, section, n, &rr) < 0)
+            break;
+        if (names.find(srv_normalize(ns_rr_name(rr))) == names.end())
+            continue;
+
+        if (ns_rr_type(rr) == ns_t_aaaa && ns_rr_rdlen(rr) == 16) {
+            inet_ntop(AF_INET6, ns_rr_rdata(rr), addr, sizeof(addr));
+            target.addresses6.push_back(addr);
+        } else if (ns_rr_type(rr) == ns_t_a && ns_rr_rdlen(rr) == 4) {
+            inet_ntop(AF_INET, ns_rr_rdata(rr), addr, sizeof(addr));
+            target.addresses4.push_back(addr);
+        }
     }
+}
 
-    /* Run a SRV query against the specified domain */
-    replylen = res_querydomain(service, domain, C_IN,   /* Class */
-                               T_SRV,                   /* Type */
-                               (unsigned char *)&reply, /* Answer buffer */
-                               sizeof(reply));          /* Answer buffer sz */
-
-    /* Setup a pointer to the reply header */
-    rheader = (HEADER *)reply;
-
-    /* Process SRV response if all conditions are met per RFC 2052:
-     * 1.) reply has some data available
-     * 2.) no error occurred
-     * 3.) there are 1 or more answers available */
-    if ((replylen > 0) && (ntohs(rheader->rcode) == NOERROR) &&
-        (ntohs(rheader->ancount) > 0)) {
-        /* Parse out the Question section, and get to the following
-         * RRs (see RFC 1035-4.1.2) */
-        exprc = dn_expand(reply,                  /* Msg ptr */
-                          reply + replylen,       /* End of msg ptr */
-                          reply + sizeof(HEADER), /* Offset into msg */
-                          host, sizeof(host)); /* Dest buffer for expansion */
-        if (exprc < 0) {
+/**
+ * process the answer to a SRV query
+ *
+ * @param job the lookup
+ * @param msg the answer, NULL if the query failed
+ */
+static void srv_job_srv_answer(srv_job job, ns_msg *msg) {
+    char host[NS_MAXDNAME];
+    ns_rr rr;
+
+    for (int n = 0; msg != NULL && n < ns_msg_count(*msg, ns_s_an); n++) {
+        if (ns_parserr(msg, ns_s_an, n, &rr) < 0)
+            break;
+        if (ns_rr_type(rr) != ns_t_srv || ns_rr_rdlen(rr) < 7)
+            continue;
+        if (dn_expand(ns_msg_base(*msg), ns_msg_end(*msg), ns_rr_rdata(rr) + 6,
+                      host, sizeof(host)) < 0)
+            continue;
+
+        /* a target of "." means the service is not available */
+        if (host[0] == '\0' || (host[0] == '.' && host[1] == '\0'))
+            continue;
+
+        _srv_target target;
+        target.priority = ns_get16(ns_rr_rdata(rr));
+        target.weight = ns_get16(ns_rr_rdata(rr) + 2);
+        target.port = ns_get16(ns_rr_rdata(rr) + 4);
+        target.host = srv_normalize(host);
+        log_debug2(ZONE, LOGT_IO, "found SRV record pointing to %s",
+                   target.host.c_str());
+        job->targets.push_back(target);
+    }
+
+    srv_order_targets(job->targets);
+
+    /* take the addresses from the additional section, or query them; the
+     * additional records are only trusted for targets inside the queried
+     * domain, as the nameserver of the domain is not authoritative for other
+     * names */
+    for (size_t n = 0; n < job->targets.size(); n++) {
+        if (srv_in_bailiwick(job->targets[n].host, srv_normalize(job->domain)))
+            srv_add_addresses(msg, ns_s_ar, job->targets[n].host,
+                              job->targets[n]);
+        if (job->targets[n].addresses6.empty() &&
+            job->targets[n].addresses4.empty()) {
             log_debug2(ZONE, LOGT_IO,
-                       "srv: DN expansion failed for Question section.");
-            return NULL;
+                       "'%s' not in additional section of DNS reply, "
+                       "looking it up using AAAA/A query",
+                       job->targets[n].host.c_str());
+            srv_job_resolve_target(job, n);
         }
+    }
+}
 
-        /* Determine offset of the first RR */
-        rrptr = reply + sizeof(HEADER) + exprc + 4;
-
-        /* Walk the RRs, building a list of targets */
-        while (rrptr < (reply + replylen)) {
-            /* Expand the domain name */
-            exprc =
-                dn_expand(reply, reply + replylen, rrptr, host, sizeof(host));
-            if (exprc < 0) {
-                log_debug2(ZONE, LOGT_IO,
-                           "srv: Whoa nelly! DN expansion failed for RR.");
-                return NULL;
-            }
+/**
+ * process the answer to a query
+ *
+ * @param q the query
+ * @param msg the answer, NULL if the query failed
+ */
+static void srv_job_answer(_srv_query const &q, ns_msg *msg) {
+    srv_job job = q.job;
 
-            /* Jump to RR info */
-            rrptr += exprc;
-            rrtype = (rrptr[0] << 8 | rrptr[1]); /* Extract RR type */
-            rrpayloadsz =
-                (rrptr[8] << 8 | rrptr[9]); /* Extract RR payload size */
-            rrptr += 10;
-
-            /* Process the RR */
-            switch (rrtype) {
-                /* AAAA records should be hashed for the duration of this lookup
-                 */
-                case T_AAAA:
-                    /* Allocate a new string to hold the IP address */
-                    ipaddr = srv_inet_ntop(p, rrptr, AF_INET6);
-                    /* Copy the domain name */
-                    ipname = pstrdup(p, host);
-
-                    /* Insert name/ip into hash table for future reference */
-                    srv_xhash_join(p, arr_table, ipname, ipaddr);
+    job->pending--;
 
-                    break;
-                /* A records should be hashed for the duration of this lookup */
-                case T_A:
-                    /* Allocate a new string to hold the IP address */
-                    ipaddr = srv_inet_ntoa(p, rrptr);
-                    /* Copy the domain name */
-                    ipname = pstrdup(p, host);
+    if (q.type == ns_t_srv)
+        srv_job_srv_answer(job, msg);
+    else if (msg != NULL)
+        srv_add_addresses(msg, ns_s_an, q.name, job->targets[q.target]);
 
-                    /* Insert name/ip into hash table for future reference */
-                    srv_xhash_join(p, arr_table, ipname, ipaddr);
+    if (job->pending == 0)
+        srv_job_finish(job);
+}
 
-                    break;
+/**
+ * heartbeat function, that resends queries that have not been answered in
+ * time, and fails queries after the last retry
+ *
+ * @param arg the resolver
+ * @return r_UNREG after the resolver has been freed, r_DONE else
+ */
+static result srv_resolver_beat(void *arg) {
+    srv_resolver r = static_cast<srv_resolver>(arg);
+    std::vector<uint16_t> failed;
+    time_t now = time(NULL);
+
+    if (r->freed) {
+        delete r;
+        return r_UNREG;
+    }
+
+    for (std::map<uint16_t, _srv_query>::iterator q = r->queries.begin();
+         q != r->queries.end(); ++q) {
+        if (now - q->second.sent < r->timeout)
+            continue;
 
-                /* SRV records should be stored in a sorted list */
-                case T_SRV:
-                    /* Expand the target name */
-                    exprc = dn_expand(reply, reply + replylen, rrptr + 6, host,
-                                      sizeof(host));
-                    if (exprc < 0) {
-                        log_debug2(ZONE, LOGT_IO,
-                                   "srv: DN expansion failed for SRV.");
-                        return NULL;
-                    }
-
-                    /* Create a new node */
-                    tempnode =
-                        static_cast<srv_list>(pmalloco(p, sizeof(_srv_list)));
-                    tempnode->priority = (rrptr[0] << 8 | rrptr[1]);
-                    tempnode->port =
-                        srv_port2str(p, (rrptr[4] << 8 | rrptr[5]));
-                    tempnode->host = pstrdup(p, host);
-
-                    log_debug2(ZONE, LOGT_IO, "found SRV record pointing to %s",
-                               tempnode->host);
-
-                    /* Insert the node in the list */
-                    if (svrlist == NULL) {
-                        /* first result */
-                        svrlist = tempnode;
-                    } else {
-                        srv_list iternode_before = NULL;
-
-                        /* insert result in ordered list */
-                        iternode = svrlist; /* HEAD of list (smallest priority
-                                               value) */
-
-                        /* find element that stays in front of the new one */
-                        /* XXX for elements with the same priority we should use
-                         * the weight to order the elements in the list. We are
-                         * now just ignoring the weight resulting in an equal
-                         * distribution across results of the same priority */
-                        while (iternode != NULL &&
-                               iternode->priority < tempnode->priority) {
-                            iternode_before = iternode; /* keep pointer to the
-                                                           element before */
-                            iternode =
-                                iternode->next; /* switch to next element */
-                        }
-
-                        /* iternode now either points to NULL (insert as last
-                         * element) or it points to the element after the new
-                         * one
-                         *
-                         * iternode_before now either point to NULL (insert as
-                         * first element) or it points to the element in front
-                         * of the new one */
-
-                        /* insert the new element in the list */
-
-                        /* update pointers in the new element */
-                        tempnode->next = iternode;
-                        tempnode->last = iternode_before;
-
-                        /* update pointer in the previous element */
-                        if (iternode_before != NULL) {
-                            iternode_before->next = tempnode;
-                        } else {
-                            /* we are the first element */
-                            svrlist = tempnode;
-                        }
-
-                        /* update pointer in the following element */
-                        if (iternode != NULL) {
-                            iternode->last = tempnode;
-                        }
-                    }
-            } /* end..switch */
-
-            /* Increment to next RR */
-            rrptr += rrpayloadsz;
+        if (q->second.tries > r->retries) {
+            failed.push_back(q->first);
+            continue;
         }
 
-        /* Now, walk the nicely sorted list and resolve the target's A records,
-         * sticking the resolved name in
-         * a spooler -- hopefully these have been pre-cached, and arrived along
-         * with the SRV reply */
-        std::ostringstream result;
-
-        iternode = svrlist;
-        while (iternode != NULL) {
-            log_debug2(ZONE, LOGT_IO, "processing SRV record pointing to %s",
-                       iternode->host);
-
-            /* Check the AAAA/A record hash table first.. */
-            ipaddr = (char *)xhash_get(arr_table, iternode->host);
-
-            /* it hasn't been in the additional section, we have to lookup the
-             * IP address */
-            if (ipaddr == NULL) {
-                std::ostringstream temp_result;
-
-                log_debug2(ZONE, LOGT_IO,
-                           "'%s' not in additional section of DNS reply, "
-                           "looking it up using AAAA/A query",
-                           iternode->host);
-                srv_lookup_aaaa_a(temp_result, iternode->host);
-                ipaddr = pstrdup(p, temp_result.str().c_str());
-            }
+        /* try the next nameserver */
+        q->second.server = (q->second.server + 1) % r->hosts.size();
+        log_debug2(ZONE, LOGT_IO, "resending query for %s to %s",
+                   q->second.name.c_str(), r->hosts[q->second.server].c_str());
+        srv_query_send(r, q->second);
+    }
 
-            if (j_strlen(ipaddr) > 0) {
-                /* copy the ipaddr as we will modify it */
-                char *ptrptr, *token, *ipaddr_copy = strdup(ipaddr);
-
-                /* if there has been a result already, we have to separate by a
-                 * "," */
-                if (!result_is_empty) {
-                    result << ",";
-                } else {
-                    result_is_empty = 0;
-                }
-
-                /* add the port number for each address */
-                token = strtok_r(ipaddr_copy, ",", &ptrptr);
-                while (token != NULL) {
-                    if (strchr(token, ':')) {
-                        /* IPv6 format */
-                        result << "[" << token << "]:" << iternode->port;
-                    } else {
-                        /* IPv4 format */
-                        result << token << ":" << iternode->port;
-                    }
-                    /* get next token */
-                    token = strtok_r(NULL, ",", &ptrptr);
-                    if (token) {
-                        result << ","; // separate results by ','
-                    }
-                }
-                /* free our tokenized copy */
-                free(ipaddr_copy);
-            }
-            iternode = iternode->next;
+    for (std::vector<uint16_t>::const_iterator id = failed.begin();
+         id != failed.end(); ++id) {
+        std::map<uint16_t, _srv_query>::iterator query = r->queries.find(*id);
+        if (query == r->queries.end())
+            continue;
+
+        log_debug2(ZONE, LOGT_IO, "query for %s timed out",
+                   query->second.name.c_str());
+        srv_query_close(r, query->second);
+        _srv_query q = query->second;
+        r->queries.erase(query);
+        srv_job_answer(q, NULL);
+    }
+
+    return r_DONE;
+}
+
+/**
+ * create the asynchronous resolver
+ *
+ * @param p memory pool, the resolver is freed with it
+ * @param config the configuration of the dnsrv component
+ * @return the resolver
+ */
+srv_resolver srv_resolver_new(pool p, xmlnode config) {
+    srv_resolver r = new srv_resolver_struct;
+    xmlnode cur = NULL;
+
+    r->freed = false;
+    pool_cleanup(p, srv_resolver_free, r);
+
+    r->timeout = j_atoi(xmlnode_get_attrib_ns(config, "dnstimeout", NULL), 3);
+    if (r->timeout < 1)
+        r->timeout = 1;
+    r->retries = j_atoi(xmlnode_get_attrib_ns(config, "dnsretries", NULL), 2);
+
+    /* the configured nameservers */
+    for (cur = xmlnode_get_firstchild(config); cur != NULL;
+         cur = xmlnode_get_nextsibling(cur)) {
+        if (j_strcmp(xmlnode_get_localname(cur), "nameserver") == 0 &&
+            j_strcmp(xmlnode_get_namespace(cur), NS_JABBERD_CONFIG_DNSRV) ==
+                0 &&
+            xmlnode_get_data(cur) != NULL)
+            srv_resolver_add_server(r, xmlnode_get_data(cur));
+    }
+
+    /* or the system's nameservers */
+    if (r->hosts.empty()) {
+        std::ifstream resolv_conf("/etc/resolv.conf");
+        std::string line;
+
+        while (std::getline(resolv_conf, line)) {
+            std::istringstream fields(line);
+            std::string keyword;
+            std::string server;
+
+            fields >> keyword >> server;
+            if (keyword == "nameserver")
+                srv_resolver_add_server(r, server);
         }
-        /* Finally, turn the fully resolved list into a string <ip>:<host>,...
-         */
-        return pstrdup(p, result.str().c_str());
     }
-    /* Otherwise, return NULL -- it's for the caller to finish up by using
-     * standard A records */
-    return NULL;
+
+    if (r->hosts.empty())
+        srv_resolver_add_server(r, "127.0.0.1");
+
+    register_beat(1, srv_resolver_beat, (void *)r);
+
+    return r;
+}
+
+/**
+ * do a DNS lookup
+ *
+ * This function implements a SRV DNS lookup and falls back to normal AAAA/A
+ * resolution if no service has been given by the caller. The result is passed
+ * to the callback, when all queries are finished.
+ *
+ * @param r the resolver
+ * @param service which service should be looked up (e.g. "_xmpp-server._tcp"),
+ * NULL for AAAA/A lookups
+ * @param domain which domain should be looked up
+ * @param cb the callback, that gets the comma separated list of results
+ * containing IPv4 and IPv6 addresses with (SRV lookup) or without ports
+ * @param arg argument for the callback
+ */
+void srv_lookup(srv_resolver r, const char *service, const char *domain,
+                srv_lookup_cb cb, void *arg) {
+    srv_job job = new _srv_job;
+
+    job->r = r;
+    job->service = service ? service : "";
+    job->domain = domain ? domain : "";
+    job->cb = cb;
+    job->arg = arg;
+    job->pending = 0;
+
+    if (service == NULL) {
+        log_debug2(ZONE, LOGT_IO, "Standard resolution of %s", domain);
+
+        _srv_target target;
+        target.priority = 0;
+        target.weight = 0;
+        target.port = 0;
+        target.host = job->domain;
+        job->targets.push_back(target);
+
+        srv_job_resolve_target(job, 0);
+    } else {
+        log_debug2(ZONE, LOGT_IO, "srv: SRV resolution of %s.%s", service,
+                   domain);
+        srv_query_new(job, job->service + "." + job->domain, ns_t_srv, 0);
+    }
+
+    /* no query could be started */
+    if (job->pending == 0)
+        srv_job_finish(job);
 }
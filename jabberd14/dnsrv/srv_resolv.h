@@ -49,6 +49,20 @@
 #ifndef INCL_SRV_RESOLV_H
 #define INCL_SRV_RESOLV_H
 
-char *srv_lookup(pool p, const char *service, const char *domain);
+/**
+ * callback, that gets the result of srv_lookup()
+ *
+ * @param result comma separated list of IPv4 and IPv6 addresses with or
+ * without ports, NULL if nothing could be resolved
+ * @param arg the argument passed to srv_lookup()
+ */
+typedef void (*srv_lookup_cb)(char const *result, void *arg);
+
+/** the asynchronous resolver, see srv_resolv.cc */
+typedef struct srv_resolver_struct *srv_resolver;
+
+srv_resolver srv_resolver_new(pool p, xmlnode config);
+void srv_lookup(srv_resolver r, const char *service, const char *domain,
+                srv_lookup_cb cb, void *arg);
 
 #endif
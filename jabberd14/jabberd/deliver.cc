@@ -157,6 +157,7 @@ deliver()
 #include <set>
 
 extern xmlnode greymatter__;
+extern xht instance__ids;
 
 int deliver__flag =
     0; /**< 0 = pause delivery on startup and queue for later delivery, 1 =
@@ -170,6 +171,10 @@ xht filter_namespaces =
 std::list<Glib::ustring> filter_expressions; /**< xpath expressions used for
                                                 logging routed packets */
 
+unsigned long deliver__routed[p_ROUTE + 1]; /**< packets routed, by type */
+unsigned long deliver__failed[p_ROUTE + 1]; /**< packets that could not be
+                                               delivered, by type */
+
 /**
  * queue item for the list of queued messages for later delivery, used while
  * ::deliver__flag = 0
@@ -468,6 +473,7 @@ static instance deliver_intersect(ilist a, ilist b) {
 
 // forward reference
 static void deliver_instance(instance i, dpacket p);
+static void deliver_metrics(metrics m, void *arg);
 
 /**
  * special case handler for xdb calls @-internal
@@ -861,6 +867,11 @@ void deliver(dpacket p, instance i) {
     if (p == NULL)
         return;
 
+    trace_stamp(p->p, trace_PROCESS);
+
+    if (i != NULL)
+        i->packets_out[p->type]++;
+
     // log-dump the packet?
     if (p->type != p_LOG && filter_namespaces) {
         for (std::list<Glib::ustring>::const_iterator cur =
@@ -918,6 +929,8 @@ void deliver(dpacket p, instance i) {
     log_debug2(ZONE, LOGT_DELIVER, "DELIVER %d:%s %s", p->type, p->host,
                xmlnode_serialize_string(p->x, xmppd::ns_decl_list(), 0));
 
+    deliver__routed[p->type]++;
+
     b = NULL;
     a = deliver_hashmatch(deliver_hashtable(p->type), p->host);
     if (p->type == p_XDB)
@@ -960,6 +973,7 @@ void deliver_init(pool p) {
     register_config(p, "ns", deliver_config_ns, NULL);
     register_config(p, "logtype", deliver_config_logtype, NULL);
     register_config(p, "uplink", deliver_config_uplink, NULL);
+    register_metrics(deliver_metrics, NULL);
 }
 
 /**
@@ -1075,6 +1089,8 @@ void deliver_fail(dpacket p, const char *err) {
     if (p == NULL)
         return;
 
+    deliver__failed[p->type]++;
+
     switch (p->type) {
         case p_LOG:
             /* stderr and drop */
@@ -1279,6 +1295,9 @@ static void deliver_instance(instance i, dpacket p) {
 
     log_debug2(ZONE, LOGT_DELIVER, "delivering to instance '%s'", i->id);
 
+    if (p != NULL)
+        i->packets_in[p->type]++;
+
     /* try all the handlers */
     hlast = h = i->hds;
 
@@ -1292,14 +1311,40 @@ static void deliver_instance(instance i, dpacket p) {
         return;
     }
 
+    trace_stamp(p->p, trace_ROUTE);
+
     while (h != NULL) {
-        /* there may be multiple delivery handlers, make a backup copy first if
-         * we have to */
-        if (h->o == o_DELIVER && h->next != NULL)
-            pig = dpacket_copy(p);
+        bool shared = false;
+        int refs_before = 0;
+
+        /* there may be multiple delivery handlers: let them share the packet
+         * instead of copying it for each of them, a copy is only made if a
+         * handler modifies or keeps the packet */
+        if (h->o == o_DELIVER && h->next != NULL) {
+            shared = xmlnode_share(p->x);
+            if (shared) {
+                refs_before = pool_refcount(p->p);
+                pool_addref(p->p);
+            } else {
+                /* already shared by an outer delivery, make a backup copy */
+                pig = dpacket_copy(p);
+            }
+        }
 
         /* call the handler */
-        if ((r = (h->f)(i, p, h->arg)) == r_ERR) {
+        r = (h->f)(i, p, h->arg);
+
+        /* check if the shared packet has been modified or kept */
+        xmlnode pristine = shared ? xmlnode_unshare(p->x) : NULL;
+        bool released = shared && pool_refcount(p->p) <= refs_before;
+
+        if (r == r_ERR) {
+            if (pristine)
+                xmlnode_free(pristine);
+            if (shared && !released)
+                pool_free(p->p); /* drop our reference */
+            else if (pig)
+                pool_free(pig->p);
             deliver_fail(p, N_("Internal Delivery Error"));
             return;
         }
@@ -1317,14 +1362,42 @@ static void deliver_instance(instance i, dpacket p) {
         if (h->o == o_COND && r == r_LAST)
             return;
 
+        /* deal with the shared packet */
+        if (shared) {
+            if (released) {
+                /* the handler is done with the packet, we hold the last
+                 * reference now */
+                if (pristine) {
+                    /* ... but it has been modified, continue with the copy */
+                    pool_free(p->p);
+                    p = dpacket_new(pristine);
+                }
+            } else if (r == r_DONE) {
+                /* they ate it and keep it, the other handlers need a copy */
+                pig = pristine ? dpacket_new(pristine) : dpacket_copy(p);
+                pool_free(p->p); /* drop our reference */
+                p = pig;
+                pig = NULL;
+            } else {
+                /* they never used it */
+                pool_free(p->p); /* drop our reference */
+                if (pristine)
+                    xmlnode_free(pristine);
+            }
+
+            if (p == NULL)
+                return;
+        }
+
         /* deal with that backup copy we made */
-        if (h->o == o_DELIVER && h->next != NULL) {
+        if (pig != NULL) {
             if (r == r_DONE) {
                 /* they ate it, use copy */
                 p = pig;
                 pig = NULL;
             } else {
                 pool_free(pig->p); /* they never used it, trash copy */
+                pig = NULL;
             }
         }
 
@@ -1499,76 +1572,66 @@ void register_routing_update_callback(instance i, register_notify f,
         last->next = newn;
 }
 
-#ifdef POOL_DEBUG
-class instance_statistics {
-  private:
-    int count;
-    size_t pool_sum;
-    size_t biggest_pool;
-    std::string biggest_pool_name;
-
-  public:
-    instance_statistics();
-    void update(instance i);
-    std::string getSummary();
-};
-
-instance_statistics::instance_statistics()
-    : count(0), pool_sum(0), biggest_pool(0){};
-
-void instance_statistics::update(instance i) {
-    size_t this_instances_size = pool_size(i->p);
-
-    count++;
-    pool_sum += this_instances_size;
-
-    if (this_instances_size > biggest_pool) {
-        biggest_pool = this_instances_size;
-        biggest_pool_name = i->id;
-    }
-}
+/**
+ * names of the packet types, as used for the metrics
+ */
+static char const *deliver_ptype_names[p_ROUTE + 1] = {"none", "norm", "xdb",
+                                                      "log", "route"};
 
-std::string instance_statistics::getSummary() {
-    std::ostringstream result;
+/**
+ * add the metrics of a single instance
+ *
+ * @param h the hash of all instances (ignored)
+ * @param key the id of the instance
+ * @param value the instance
+ * @param arg the metrics to add to
+ */
+static void _deliver_instance_metrics_walker(xht h, const char *key,
+                                             void *value, void *arg) {
+    metrics m = static_cast<metrics>(arg);
+    instance i = static_cast<instance>(value);
 
-    result << "Instances: " << count << " / Mem in pools: " << pool_sum
-           << " / biggest: " << biggest_pool << " " << biggest_pool_name;
+    // sanity check
+    if (m == NULL || i == NULL)
+        return;
 
-    return result.str();
-}
+    std::string instance_label = metrics_label("instance", i->id);
 
-static void _deliver_instance_stat_walker(xht hash, const char *key,
-                                          void *value, void *arg) {
-    instance_statistics *stats = static_cast<instance_statistics *>(arg);
-    ilist il = static_cast<ilist>(value);
+    for (int type = p_NORM; type <= p_ROUTE; type++) {
+        std::string labels = instance_label + "," +
+                             metrics_label("type", deliver_ptype_names[type]);
 
-    // sanity check
-    if (stats == NULL || il == NULL) {
-        return;
+        metrics_add(m, "jabberd_instance_packets_in_total", "counter",
+                    "Packets delivered to an instance.", labels,
+                    i->packets_in[type]);
+        metrics_add(m, "jabberd_instance_packets_out_total", "counter",
+                    "Packets sent by an instance.", labels,
+                    i->packets_out[type]);
     }
 
-    while (il != NULL) {
-        stats->update(il->i);
-        il = il->next;
-    }
+    metrics_add(m, "jabberd_instance_pool_bytes", "gauge",
+                "Size of the memory pool of an instance.", instance_label,
+                pool_size(i->p));
 }
 
-void deliver_pool_debug() {
-    instance_statistics *stats = new instance_statistics;
-
-    xhash_walk(deliver_hashtable(p_LOG), _deliver_instance_stat_walker, stats);
-    xhash_walk(deliver_hashtable(p_XDB), _deliver_instance_stat_walker, stats);
-    xhash_walk(deliver_hashtable(p_NORM), _deliver_instance_stat_walker, stats);
-
-    static char own_pid[32] = "";
-    if (own_pid[0] == '\0') {
-        snprintf(own_pid, sizeof(own_pid), "%i deliver_pool_debug", getpid());
+/**
+ * add the metrics of the XML router
+ *
+ * @param m the metrics to add to
+ * @param arg unused/ignored
+ */
+static void deliver_metrics(metrics m, void *arg) {
+    for (int type = p_NORM; type <= p_ROUTE; type++) {
+        std::string labels = metrics_label("type", deliver_ptype_names[type]);
+
+        metrics_add(m, "jabberd_router_packets_total", "counter",
+                    "Packets routed by the XML router.", labels,
+                    deliver__routed[type]);
+        metrics_add(m, "jabberd_router_failed_total", "counter",
+                    "Packets that could not be delivered.", labels,
+                    deliver__failed[type]);
     }
 
-    log_notice(own_pid, "%s", stats->getSummary().c_str());
-
-    delete stats;
+    if (instance__ids != NULL)
+        xhash_walk(instance__ids, _deliver_instance_metrics_walker, m);
 }
-#else
-void deliver_pool_debug() {}
-#endif
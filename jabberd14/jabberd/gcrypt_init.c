@@ -24,20 +24,20 @@
  * @file gcrypt_init.c
  * @brief Init the gcrypt library
  *
- * This would be part of mio_tls.cc, but the code produced by the macro cannot be compiled with a C++ compiler, so I have to place this in a C file.
+ * This used to install the libpth thread callbacks of gcrypt, which had to be
+ * done by a macro, that cannot be compiled with a C++ compiler.
  */
 
 #include <gcrypt.h>
-#include <pth.h>
-#include <errno.h>
-
-/* prepare gcrypt for libpth */
-GCRY_THREAD_OPTION_PTH_IMPL;
 
 /**
- * Tell gcrypt we are using libpth
+ * Initialize gcrypt
+ *
+ * The TLS handshakes are done by native threads, the rest of the server runs
+ * in libpth threads. Since version 1.6 gcrypt always uses native thread
+ * locking, which protects against both (configure requires this version). The
+ * libpth callbacks of older versions did not protect against native threads.
  */
 void mio_tls_gcrypt_init() {
-    /* prepare gcrypt with libpth */
-    gcry_control(GCRYCTL_SET_THREAD_CBS, &gcry_threads_pth);
+    gcry_check_version(GCRYPT_VERSION);
 }
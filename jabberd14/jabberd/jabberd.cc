@@ -93,7 +93,6 @@ jabberd_struct jabberd = {NULL, NULL, 0, NULL,
                           NULL}; /**< global data for the jabberd */
 
 void xmlnode_stat();
-void deliver_pool_debug();
 
 /**
  * the entry point to jabberd
@@ -318,6 +317,7 @@ int main(int argc, const char **argv) {
     signal(SIGHUP, _jabberd_signal);
     signal(SIGINT, _jabberd_signal);
     signal(SIGTERM, _jabberd_signal);
+    signal(SIGUSR2, _jabberd_signal);
 
     /* init pth */
     pth_init();
@@ -328,6 +328,9 @@ int main(int argc, const char **argv) {
     /* register a function that regularily checks the signal flag */
     register_beat(1, jabberd_signal_handler, &jabberd);
 
+    /* init stanza latency tracing */
+    trace_init();
+
     /* init MIO */
     mio_init();
 
@@ -361,7 +364,6 @@ int main(int argc, const char **argv) {
 #ifdef POOL_DEBUG
         pool_stat(0);
         xmlnode_stat();
-        deliver_pool_debug();
 #endif
         pth_sleep(60);
     };
@@ -415,6 +417,9 @@ static void _jabberd_restart(jabberd_struct *j) {
 
     /* XXX do more smarts on new config */
 
+    /* tracing can be reconfigured at runtime */
+    trace_init();
+
     log_debug2(ZONE, LOGT_CONFIG, "reload process complete");
 }
 
@@ -518,6 +523,10 @@ static result jabberd_signal_handler(void *arg) {
             _jabberd_restart(j);
             j->signalflag = 0;
             break;
+        case SIGUSR2:
+            trace_dump();
+            j->signalflag = 0;
+            break;
         default:
             _jabberd_shutdown();
     }
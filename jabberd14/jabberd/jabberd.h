@@ -124,6 +124,7 @@
 #include <config.h>
 #endif
 
+#include <dnscache.hh>
 #include <jid.hh>
 #include <jpacket.hh>
 #include <jutil.hh>
@@ -133,6 +134,7 @@
 #include <xstream.hh>
 
 #include <set>
+#include <string>
 
 #include <gnutls/gnutls.h>
 #include <gnutls/x509.h>
@@ -192,7 +194,13 @@ typedef struct dpacket_struct {
     xmlnode x;
 } * dpacket, _dpacket;
 
-/** Delivery handler function callback definition */
+/**
+ * Delivery handler function callback definition
+ *
+ * If multiple o_DELIVER handlers are registered for an instance, they may get
+ * passed the same packet. The packet is copied (copy-on-write) if a handler
+ * modifies it using the xmlnode functions or keeps it after returning.
+ */
 typedef result (*phandler)(instance id, dpacket p, void *arg);
 
 /** Delivery handler list. See register_phandler(). */
@@ -232,6 +240,10 @@ struct instance_struct {
                                name, value is init function */
     std::set<Glib::ustring> *static_hosts; /**< set of host that are fixed
                                               configured for this host */
+    unsigned long packets_in[p_ROUTE + 1];  /**< packets delivered to the
+                                               instance, by packet type */
+    unsigned long packets_out[p_ROUTE + 1]; /**< packets sent by the instance,
+                                               by packet type */
 };
 
 /** Config file handler function callback definition */
@@ -344,6 +356,69 @@ void log_record(char const *id, char const *type, char const *action,
 void log_generic(char const *logtype, char const *id, char const *type,
                  char const *action, char const *msgfmt, ...);
 
+/*** stanza latency tracing ***/
+
+/** stages a traced stanza passes, used to account the latencies */
+typedef enum {
+    trace_PARSE,   /**< parsing the stanza from a stream */
+    trace_PROCESS, /**< processing inside a component */
+    trace_ROUTE,   /**< routing by the XML router */
+    trace_QUEUE,   /**< waiting in a thread queue (mtq) */
+    trace_MAPI,    /**< handling in the session manager's module API */
+    trace_XDB,     /**< waiting for an xdb result */
+    trace_WRITE,   /**< waiting in the write queue of a connection */
+    trace_TOTAL,   /**< whole lifetime of the stanza */
+    trace_STAGES   /**< number of stages, not a stage itself */
+} trace_stage;
+
+extern int trace__sample;
+void trace_init(void);
+void _trace_begin(pool p);
+void _trace_stamp(pool p, trace_stage stage);
+unsigned long long _trace_timer(pool p);
+void _trace_timer_done(unsigned long long start, trace_stage stage);
+void trace_dump(void);
+
+/** start tracing a stanza, if tracing is enabled */
+static inline void trace_begin(pool p) {
+    if (trace__sample)
+        _trace_begin(p);
+}
+
+/** account the time since the last stamp to a stage, if tracing is enabled */
+static inline void trace_stamp(pool p, trace_stage stage) {
+    if (trace__sample)
+        _trace_stamp(p, stage);
+}
+
+/** start timing a stage of a stanza, 0 if not traced */
+static inline unsigned long long trace_timer(pool p) {
+    return trace__sample ? _trace_timer(p) : 0;
+}
+
+/** account a timed stage, if tracing is enabled */
+static inline void trace_timer_done(unsigned long long start,
+                                    trace_stage stage) {
+    if (trace__sample)
+        _trace_timer_done(start, stage);
+}
+
+/*** metrics ***/
+
+/** metrics collected for one request, see metrics.cc */
+typedef struct metrics_struct *metrics;
+
+/** metrics callback definition, adds the metrics of a module using
+ * metrics_add() */
+typedef void (*metrics_handler)(metrics m, void *arg);
+
+void register_metrics(metrics_handler f, void *arg);
+void metrics_add(metrics m, char const *name, char const *type,
+                 char const *help, std::string const &labels, double value);
+std::string metrics_label(char const *name, char const *value);
+std::string metrics_render(void);
+unsigned long long metrics_now(void);
+
 /*** xdb utilities ***/
 
 /** Ring for handling cached structures */
@@ -505,6 +580,10 @@ typedef struct mio_st {
         int recall_handshake_when_writeable : 1; /**< recall the handshake
                                                     function, when the socket
                                                     allows writing again */
+        int recall_handshake_when_notified : 1;  /**< recall the handshake
+                                                    function, when a worker
+                                                    thread signalled through
+                                                    the wakeup pipe */
     } flags;
 
     struct karma k;     /**< karma for this socket, used to limit bandwidth of a
@@ -549,6 +628,8 @@ typedef struct mio_main_st {
     char const *webserver_path; /**< location where small HTTP requests are
                                    handled from */
     char const *flash_policy;   /**< location of the flash policy file */
+    int metrics_port; /**< local port on which metrics are served (-1 if
+                         disabled) */
 
 } _ios, *ios;
 
@@ -581,7 +662,8 @@ void _mio_raw_parser(mio m, const void *buf, size_t bufsz);
 #define MIO_RAW_PARSER (mio_parser_func) & _mio_raw_parser
 
 void mio_xml_reset(mio m);
-int mio_xml_starttls(mio m, int originator, const char *identity);
+int mio_xml_starttls(mio m, int originator, const char *identity,
+                     const char *peer);
 void _mio_xml_parser(mio m, const void *buf, size_t bufsz);
 #define MIO_XML_PARSER (mio_parser_func) & _mio_xml_parser
 
@@ -594,7 +676,8 @@ void _mio_xml_parser(mio m, const void *buf, size_t bufsz);
 /* TLS functions */
 void mio_ssl_init(xmlnode x);
 bool mio_tls_early_init();
-int mio_ssl_starttls(mio m, int originator, const char *identity);
+int mio_ssl_starttls(mio m, int originator, const char *identity,
+                     const char *peer);
 int mio_ssl_starttls_possible(mio m, const char *identity);
 int mio_ssl_verify(mio m, const char *id_on_xmppAddr);
 ssize_t _mio_ssl_read(mio m, void *buf, size_t count);
@@ -602,6 +685,7 @@ ssize_t _mio_ssl_write(mio m, const void *buf, size_t count);
 int _mio_ssl_accepted(mio m);
 void mio_tls_get_characteristics(mio m, char *buffer, size_t len);
 void mio_tls_get_certtype(mio m, char *buffer, size_t len);
+void _mio_wakeup_from_thread(void);
 #define MIO_SSL_READ _mio_ssl_read
 #define MIO_SSL_WRITE _mio_ssl_write
 #define MIO_SSL_ACCEPTED _mio_ssl_accepted
@@ -654,9 +738,15 @@ void mio_rate(mio m, int rate_time, int max_points);
 /* Pops the next xmlnode from the queue, or NULL if no more nodes */
 xmlnode mio_cleanup(mio m);
 
+/** a pending mio_connect(), that can be canceled */
+typedef struct mio_connect_st *mio_connecting;
+
 /* Connects to an ip */
-void mio_connect(char *host, int port, mio_std_cb cb, void *cb_arg, int timeout,
-                 mio_handlers mh);
+mio_connecting mio_connect(char *host, int port, mio_std_cb cb, void *cb_arg,
+                           int timeout, mio_handlers mh);
+
+/* Aborts a connect, that did not call its callback yet */
+void mio_connect_cancel(mio_connecting cd);
 
 /* Starts listening on a port/ip, returns NULL if failed to listen */
 mio mio_listen(int port, char const *sourceip, mio_std_cb cb, void *cb_arg,
@@ -0,0 +1,270 @@
+/*
+ * Copyrights
+ *
+ * Copyright (c) 2008/2009 Matthias Wimmer
+ *
+ * This file is part of jabberd14.
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ */
+
+/**
+ * @file dnscache.cc
+ * @brief bounded cache of DNS results
+ *
+ * The cache maps domains to the addresses they resolved to (and the component
+ * the stanzas have to be resent to). Failed lookups are cached as well, as
+ * negative entries without address.
+ *
+ * The cache is bounded by the number of entries and by the (estimated) memory
+ * used for them. If one of the limits is reached, the least recently used
+ * entry is dropped. dnscache_expire() has to be called regularly to drop
+ * expired entries, and to refresh entries, that have been used and will
+ * expire soon, before they are missed by the next lookup.
+ */
+
+#include <dnscache.hh>
+
+#include <cstring>
+
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+//----[ internal types ]-------------------------------------------------------
+
+/**
+ * an entry in the DNS cache
+ */
+struct dnscache_entry {
+    std::string ip;      /**< resolved addresses, empty for failed lookups */
+    std::string to;      /**< where to resend to */
+    bool negative;       /**< true if the lookup failed */
+    std::time_t expires; /**< when the entry expires */
+    bool used;           /**< entry has been used since it has been stored */
+    bool refreshing;     /**< a refresh has been requested */
+    std::size_t bytes;   /**< estimated memory used by the entry */
+    std::list<std::string>::iterator lru_position; /**< position in lru */
+};
+
+struct dnscache_struct {
+    std::unordered_map<std::string, dnscache_entry> entries; /**< the cache */
+    std::list<std::string> lru; /**< keys, least recently used first */
+    std::size_t max_entries;    /**< maximum number of entries */
+    std::size_t max_bytes;      /**< maximum memory for entries */
+    std::size_t bytes;          /**< memory currently used by the entries */
+    unsigned long hits;         /**< lookups answered by the cache */
+    unsigned long misses;       /**< lookups not answered by the cache */
+    unsigned long evictions;    /**< entries dropped because of the limits */
+    unsigned long refreshes;    /**< refreshes requested */
+};
+
+//-----------------------------------------------------------------------------
+
+/**
+ * remove an entry from the cache
+ *
+ * @param c the cache
+ * @param entry the entry to remove
+ */
+static void dnscache_remove(
+    dnscache c,
+    std::unordered_map<std::string, dnscache_entry>::iterator entry) {
+    c->bytes -= entry->second.bytes;
+    c->lru.erase(entry->second.lru_position);
+    c->entries.erase(entry);
+}
+
+/**
+ * create a new DNS cache
+ *
+ * @param max_entries maximum number of entries in the cache
+ * @param max_bytes maximum memory to use for the entries (0 for no limit)
+ * @return the new cache (has to be freed with dnscache_free())
+ */
+dnscache dnscache_new(std::size_t max_entries, std::size_t max_bytes) {
+    dnscache c = new _dnscache;
+
+    c->max_entries = max_entries;
+    c->max_bytes = max_bytes;
+    c->bytes = 0;
+    c->hits = c->misses = c->evictions = c->refreshes = 0;
+
+    return c;
+}
+
+/**
+ * free a DNS cache
+ *
+ * @param c the cache to free
+ */
+void dnscache_free(dnscache c) { delete c; }
+
+/**
+ * put the result of a lookup in the cache
+ *
+ * An existing entry for the domain gets replaced, unless the lookup failed
+ * and the entry still has valid addresses (a failed refresh keeps the last
+ * known addresses until they expire).
+ *
+ * @param c the cache
+ * @param host the domain that has been resolved
+ * @param ip the resolved addresses, NULL if the lookup failed
+ * @param to where stanzas to this domain are resent to (may be NULL)
+ * @param ttl how many seconds the entry is valid
+ */
+void dnscache_put(dnscache c, char const *host, char const *ip,
+                  char const *to, int ttl) {
+    if (c == NULL || host == NULL || ttl <= 0 || c->max_entries == 0)
+        return;
+
+    std::unordered_map<std::string, dnscache_entry>::iterator existing =
+        c->entries.find(host);
+    if (existing != c->entries.end()) {
+        if (ip == NULL && !existing->second.negative &&
+            existing->second.expires > std::time(NULL))
+            return;
+        dnscache_remove(c, existing);
+    }
+
+    dnscache_entry entry;
+    entry.ip = ip == NULL ? "" : ip;
+    entry.to = to == NULL ? "" : to;
+    entry.negative = ip == NULL;
+    entry.expires = std::time(NULL) + ttl;
+    entry.used = false;
+    entry.refreshing = false;
+    /* the key is stored twice: in the map and in the lru list */
+    entry.bytes = sizeof(dnscache_entry) + 2 * std::strlen(host) +
+                  entry.ip.size() + entry.to.size();
+
+    /* make room for the new entry */
+    while (!c->lru.empty() &&
+           (c->entries.size() >= c->max_entries ||
+            (c->max_bytes > 0 && c->bytes + entry.bytes > c->max_bytes))) {
+        dnscache_remove(c, c->entries.find(c->lru.front()));
+        c->evictions++;
+    }
+
+    entry.lru_position = c->lru.insert(c->lru.end(), host);
+    c->bytes += entry.bytes;
+    c->entries[host] = entry;
+}
+
+/**
+ * get the result of a lookup from the cache
+ *
+ * @param c the cache
+ * @param p memory pool used to allocate the returned strings
+ * @param host the domain to look up
+ * @param ip where to store the cached addresses (NULL for a failed lookup)
+ * @param to where to store the cached resend destination (may be NULL)
+ * @return 1 if the domain has been found in the cache, 0 else
+ */
+int dnscache_get(dnscache c, pool p, char const *host, char **ip, char **to) {
+    if (c == NULL || host == NULL)
+        return 0;
+
+    std::unordered_map<std::string, dnscache_entry>::iterator entry =
+        c->entries.find(host);
+
+    if (entry == c->entries.end()) {
+        c->misses++;
+        return 0;
+    }
+
+    /* expired? */
+    if (entry->second.expires <= std::time(NULL)) {
+        dnscache_remove(c, entry);
+        c->misses++;
+        return 0;
+    }
+
+    /* mark as recently used */
+    c->lru.splice(c->lru.end(), c->lru, entry->second.lru_position);
+    entry->second.used = true;
+    c->hits++;
+
+    if (ip != NULL)
+        *ip = entry->second.negative ? NULL
+                                     : pstrdup(p, entry->second.ip.c_str());
+    if (to != NULL)
+        *to = entry->second.to.empty() ? NULL
+                                       : pstrdup(p, entry->second.to.c_str());
+    return 1;
+}
+
+/**
+ * drop expired entries and request refreshes of used entries expiring soon
+ *
+ * Each entry is refreshed at most once, and only if it has been used since
+ * it has been stored. Failed lookups are not refreshed.
+ *
+ * @param c the cache
+ * @param ahead refresh entries expiring within this number of seconds
+ * @param cb callback to start the refresh (NULL to only drop expired entries)
+ * @param arg argument passed to the callback
+ */
+void dnscache_expire(dnscache c, int ahead, dnscache_refresh_cb cb,
+                     void *arg) {
+    if (c == NULL)
+        return;
+
+    std::time_t now = std::time(NULL);
+    std::vector<std::string> refresh;
+
+    std::unordered_map<std::string, dnscache_entry>::iterator p =
+        c->entries.begin();
+    while (p != c->entries.end()) {
+        std::unordered_map<std::string, dnscache_entry>::iterator cur = p++;
+
+        if (cur->second.expires <= now) {
+            dnscache_remove(c, cur);
+            continue;
+        }
+
+        if (cb == NULL || !cur->second.used || cur->second.refreshing ||
+            cur->second.negative || cur->second.expires > now + ahead)
+            continue;
+
+        cur->second.refreshing = true;
+        refresh.push_back(cur->first);
+    }
+
+    /* the callback might modify the cache, so call it after walking */
+    for (std::vector<std::string>::const_iterator host = refresh.begin();
+         host != refresh.end(); ++host) {
+        c->refreshes++;
+        cb(host->c_str(), arg);
+    }
+}
+
+unsigned long dnscache_hits(dnscache c) { return c == NULL ? 0 : c->hits; }
+unsigned long dnscache_misses(dnscache c) {
+    return c == NULL ? 0 : c->misses;
+}
+unsigned long dnscache_evictions(dnscache c) {
+    return c == NULL ? 0 : c->evictions;
+}
+unsigned long dnscache_refreshes(dnscache c) {
+    return c == NULL ? 0 : c->refreshes;
+}
+std::size_t dnscache_entries(dnscache c) {
+    return c == NULL ? 0 : c->entries.size();
+}
+std::size_t dnscache_bytes(dnscache c) { return c == NULL ? 0 : c->bytes; }
@@ -0,0 +1,59 @@
+/*
+ * Copyrights
+ *
+ * Copyright (c) 2008/2009 Matthias Wimmer
+ *
+ * This file is part of jabberd14.
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ */
+
+#ifndef __DNSCACHE_HH
+#define __DNSCACHE_HH
+
+#include <pool.hh>
+
+#include <cstddef>
+#include <ctime>
+
+/** a bounded cache of DNS results, see dnscache.cc */
+typedef struct dnscache_struct *dnscache, _dnscache;
+
+/**
+ * callback to refresh a cache entry, that is used and expires soon
+ *
+ * @param host the domain to resolve again
+ * @param arg the argument passed to dnscache_expire()
+ */
+typedef void (*dnscache_refresh_cb)(char const *host, void *arg);
+
+dnscache dnscache_new(std::size_t max_entries, std::size_t max_bytes);
+void dnscache_free(dnscache c);
+void dnscache_put(dnscache c, char const *host, char const *ip,
+                  char const *to, int ttl);
+int dnscache_get(dnscache c, pool p, char const *host, char **ip, char **to);
+void dnscache_expire(dnscache c, int ahead, dnscache_refresh_cb cb,
+                     void *arg);
+
+unsigned long dnscache_hits(dnscache c);
+unsigned long dnscache_misses(dnscache c);
+unsigned long dnscache_evictions(dnscache c);
+unsigned long dnscache_refreshes(dnscache c);
+std::size_t dnscache_entries(dnscache c);
+std::size_t dnscache_bytes(dnscache c);
+
+#endif // __DNSCACHE_HH
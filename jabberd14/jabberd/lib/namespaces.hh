@@ -36,6 +36,7 @@
 #define NS_CLIENT "jabber:client"
 #define NS_SERVER "jabber:server"
 #define NS_DIALBACK "jabber:server:dialback"
+#define NS_DIALBACK_FEATURES "urn:xmpp:features:dialback"
 #define NS_COMPONENT_ACCEPT "jabber:component:accept"
 #define NS_AUTH "jabber:iq:auth"
 #define NS_AUTH_CRYPT "jabber:iq:auth:crypt"
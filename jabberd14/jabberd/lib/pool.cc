@@ -48,6 +48,7 @@
 
 #include <pool.hh>
 
+#include <atomic>
 #include <cstdlib>
 #include <cstdio>
 #include <cstring>
@@ -76,6 +77,8 @@ struct pfree {
    of pool entries (pfree) */
 struct pool_struct {
     int size;
+    int refs; /**< additional references, see pool_addref() */
+    void *shared; /**< state of xmlnode_share(), NULL if not shared */
     struct pfree *cleanup;
     struct pheap *heap;
 #ifdef POOL_DEBUG
@@ -86,6 +89,12 @@ struct pool_struct {
 
 //-----------------------------------------------------------------------------
 
+/* pools are also used by the TLS handshake worker threads, the statistics
+ * are therefore updated atomically */
+static std::atomic<long> pool__count(0); /**< how many pools currently exist */
+static std::atomic<long>
+    pool__bytes(0); /**< sum of the sizes of all existing pools */
+
 #ifdef POOL_DEBUG
 int pool__total = 0; /**< how many memory blocks are allocated */
 int pool__ltotal = 0;
@@ -168,6 +177,9 @@ pool _pool_new(char const *const zone, int const line) {
     p->cleanup = NULL;
     p->heap = NULL;
     p->size = 0;
+    p->refs = 0;
+    p->shared = NULL;
+    pool__count.fetch_add(1, std::memory_order_relaxed);
 
 #ifdef POOL_DEBUG
     p->lsize = -1;
@@ -272,6 +284,7 @@ struct pheap *_pool_heap(pool p, int size) {
     ret->block = _retried__malloc(size);
     ret->size = size;
     p->size += size;
+    pool__bytes.fetch_add(size, std::memory_order_relaxed);
     ret->used = 0;
 
     /* append to the cleanup list */
@@ -321,6 +334,7 @@ static void *pmalloc(pool p, int const size) {
     if (p->heap == NULL || size > (p->heap->size / 2)) {
         block = _retried__malloc(size);
         p->size += size;
+        pool__bytes.fetch_add(size, std::memory_order_relaxed);
         _pool_cleanup_append(p, _pool_free(p, _pool__free, block));
         return block;
     }
@@ -390,9 +404,82 @@ int pool_size(_pool const *const p) {
     return p->size;
 }
 
+/**
+ * attach the sharing state of the tree in a pool (see xmlnode_share())
+ *
+ * @param p the pool
+ * @param shared the sharing state, NULL if the tree is not shared anymore
+ */
+void pool_set_shared(pool p, void *shared) {
+    if (p == NULL)
+        return;
+
+    p->shared = shared;
+}
+
+/**
+ * get the sharing state of the tree in a pool
+ *
+ * @param p the pool
+ * @return the state set by pool_set_shared(), NULL if the tree is not shared
+ */
+void *pool_get_shared(_pool const *const p) {
+    if (p == NULL)
+        return NULL;
+
+    return p->shared;
+}
+
+/**
+ * add a reference to a pool
+ *
+ * Each reference added with this function has to be released by an additional
+ * call to pool_free(). The pool only gets freed when the last reference has
+ * been released. This allows to share data allocated in a pool (e.g. a
+ * packet) between multiple owners without copying it.
+ *
+ * @param p the pool to add a reference to
+ */
+void pool_addref(pool p) {
+    if (p == NULL)
+        return;
+
+    p->refs++;
+}
+
+/**
+ * get the number of additional references to a pool
+ *
+ * @param p the pool
+ * @return number of references added with pool_addref(), that have not yet
+ * been released by pool_free()
+ */
+int pool_refcount(_pool const *const p) {
+    if (p == NULL)
+        return 0;
+
+    return p->refs;
+}
+
+/**
+ * get the memory usage of all memory pools
+ *
+ * @param count where to store the number of existing pools (may be NULL)
+ * @param bytes where to store the sum of the sizes of all pools (may be NULL)
+ */
+void pool_usage(long *count, long *bytes) {
+    if (count != NULL)
+        *count = pool__count.load(std::memory_order_relaxed);
+    if (bytes != NULL)
+        *bytes = pool__bytes.load(std::memory_order_relaxed);
+}
+
 /**
  * free a pool (and all memory that is allocated in it)
  *
+ * If additional references have been added to the pool using pool_addref(),
+ * only one of these references is released.
+ *
  * @param p which pool to free
  */
 void pool_free(pool p) {
@@ -401,6 +488,12 @@ void pool_free(pool p) {
     if (p == NULL)
         return;
 
+    /* still referenced by someone else? */
+    if (p->refs > 0) {
+        p->refs--;
+        return;
+    }
+
     cur = p->cleanup;
     while (cur != NULL) {
         (*cur->f)(cur->arg);
@@ -413,6 +506,8 @@ void pool_free(pool p) {
     xhash_zap(pool__disturbed, p->name);
 #endif
 
+    pool__count.fetch_sub(1, std::memory_order_relaxed);
+    pool__bytes.fetch_sub(p->size, std::memory_order_relaxed);
     _pool__free(p);
 }
 
@@ -57,6 +57,11 @@ char *pstrdup(pool p, char const *src);
 void pool_stat(int full);
 void pool_cleanup(pool p, pool_cleaner f, void *arg);
 void pool_free(pool p);
+void pool_addref(pool p);
+int pool_refcount(_pool const *p);
 int pool_size(_pool const *p);
+void pool_set_shared(pool p, void *shared);
+void *pool_get_shared(_pool const *p);
+void pool_usage(long *count, long *bytes);
 
 #endif // __POOL_H
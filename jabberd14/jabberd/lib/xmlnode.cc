@@ -81,6 +81,33 @@ static xmlnode_t const *xmlnode_get_firstattrib_const(xmlnode_t const *parent);
 static xmlnode_t const *xmlnode_get_firstchild_const(xmlnode_t const *parent);
 static xmlnode_t const *xmlnode_get_nextsibling_const(xmlnode_t const *sibling);
 
+/**
+ * state of a tree that is currently shared as a read-only view (see
+ * xmlnode_share()), attached to the memory pool of the tree
+ */
+typedef struct {
+    xmlnode root;     /**< the root element of the shared tree */
+    xmlnode pristine; /**< copy of the tree taken before the first
+                         modification, NULL as long as it is not modified */
+} _xmlnode_shared, *xmlnode_shared;
+
+/**
+ * prepare the modification of a node: if the node is part of a shared tree,
+ * a pristine copy of the tree is taken first
+ *
+ * @param node the node that is about to be modified
+ */
+static inline void _xmlnode_prepare_modify(xmlnode node) {
+    if (node == NULL)
+        return;
+
+    xmlnode_shared shared = static_cast<xmlnode_shared>(pool_get_shared(node->p));
+    if (shared == NULL || shared->pristine != NULL)
+        return;
+
+    shared->pristine = xmlnode_dup(shared->root);
+}
+
 /* Internal routines */
 
 /**
@@ -173,6 +200,8 @@ static xmlnode _xmlnode_insert(xmlnode parent, const char *name,
     if (parent == NULL || (type != NTYPE_CDATA && name == NULL))
         return NULL;
 
+    _xmlnode_prepare_modify(parent);
+
     /* If parent->firstchild is NULL, simply create a new node for the first
      * child */
     if (parent->firstchild == NULL) {
@@ -1138,6 +1167,8 @@ void xmlnode_change_namespace(xmlnode node, const char *ns_iri) {
     if (node == NULL)
         return;
 
+    _xmlnode_prepare_modify(node);
+
     /* update the namespace */
     node->ns_iri = ns_iri ? pstrdup(xmlnode_pool(node), ns_iri) : NULL;
 
@@ -1167,6 +1198,8 @@ void xmlnode_put_attrib(xmlnode owner, const char *name, const char *value) {
     if (name == NULL)
         return;
 
+    _xmlnode_prepare_modify(owner);
+
     /* namespace declaration? */
     if (j_strncmp(name, "xmlns:", 6) == 0) {
         /* 'jabber:client' and 'jabber:component:accept' are represented as
@@ -1228,6 +1261,8 @@ void xmlnode_put_attrib_ns(xmlnode owner, const char *name, const char *prefix,
     if (owner == NULL || name == NULL || value == NULL)
         return;
 
+    _xmlnode_prepare_modify(owner);
+
     /* 'jabber:client' and 'jabber:component:accept' are represented as
      * 'jabber:server' internally */
     if (j_strcmp(ns_iri, NS_CLIENT) == 0)
@@ -1535,6 +1570,8 @@ void xmlnode_hide(xmlnode child) {
     if (child == NULL || child->parent == NULL)
         return;
 
+    _xmlnode_prepare_modify(child);
+
     parent = child->parent;
 
     /* first fix up at the child level */
@@ -1589,6 +1626,8 @@ void xmlnode_hide_attrib_ns(xmlnode parent, const char *name,
     if (attrib == NULL)
         return;
 
+    _xmlnode_prepare_modify(parent);
+
     /* first fix up at the child level */
     _xmlnode_hide_sibling(attrib);
 
@@ -1806,6 +1845,8 @@ xmlnode xmlnode_wrap_ns(xmlnode x, const char *name, const char *prefix,
     if (x == NULL || name == NULL)
         return NULL;
 
+    _xmlnode_prepare_modify(x);
+
     wrap = xmlnode_new_tag_pool_ns(x->p, name, prefix, ns_iri);
     if (wrap == NULL)
         return NULL;
@@ -1821,6 +1862,52 @@ xmlnode xmlnode_wrap_ns(xmlnode x, const char *name, const char *prefix,
     return wrap;
 }
 
+/**
+ * start sharing an xmlnode tree as a read-only view
+ *
+ * While a tree is shared, it can be passed to multiple users without copying
+ * it. If one of the users modifies the tree using one of the xmlnode
+ * functions, a pristine copy of the tree is taken before the modification is
+ * done. This copy is returned by xmlnode_unshare().
+ *
+ * @note modifications done by writing directly to strings returned by the
+ * xmlnode functions are not detected
+ *
+ * @param x the root element of the tree to share
+ * @return true if sharing has been started, false if the tree is already shared
+ */
+bool xmlnode_share(xmlnode x) {
+    if (x == NULL || pool_get_shared(x->p) != NULL)
+        return false;
+
+    xmlnode_shared shared =
+        static_cast<xmlnode_shared>(pmalloco(x->p, sizeof(_xmlnode_shared)));
+    shared->root = x;
+    pool_set_shared(x->p, shared);
+    return true;
+}
+
+/**
+ * stop sharing an xmlnode tree
+ *
+ * @param x the root element of the tree, that has been passed to
+ * xmlnode_share()
+ * @return NULL if the tree has not been modified while it has been shared,
+ * else a pristine copy of the tree as it was before the first modification
+ * (using its own memory pool, that has to be freed by the caller)
+ */
+xmlnode xmlnode_unshare(xmlnode x) {
+    if (x == NULL)
+        return NULL;
+
+    xmlnode_shared shared = static_cast<xmlnode_shared>(pool_get_shared(x->p));
+    if (shared == NULL)
+        return NULL;
+
+    pool_set_shared(x->p, NULL);
+    return shared->pristine;
+}
+
 /**
  * free the memory allocated by an xmlnode tree
  *
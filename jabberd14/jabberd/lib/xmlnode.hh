@@ -103,6 +103,10 @@ void xmlnode_insert_node(xmlnode parent, xmlnode node);
 xmlnode xmlnode_dup(xmlnode x); /* duplicate x */
 xmlnode xmlnode_dup_pool(pool p, xmlnode x);
 
+/* Copy-on-write sharing of trees */
+bool xmlnode_share(xmlnode x);
+xmlnode xmlnode_unshare(xmlnode x);
+
 /* Node Memory Pool */
 pool xmlnode_pool(xmlnode node);
 
@@ -0,0 +1,228 @@
+/*
+ * Copyrights
+ *
+ * Portions created by or assigned to Jabber.com, Inc. are
+ * Copyright (c) 1999-2002 Jabber.com, Inc.  All Rights Reserved.  Contact
+ * information for Jabber.com, Inc. is available at http://www.jabber.com/.
+ *
+ * Portions Copyright (c) 1998-1999 Jeremie Miller.
+ *
+ * Portions Copyright (c) 2006-2007 Matthias Wimmer
+ *
+ * This file is part of jabberd14.
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ */
+
+/**
+ * @file metrics.cc
+ * @brief collecting metrics of the running server in the Prometheus text format
+ *
+ * Modules that want to export metrics register a callback using
+ * register_metrics(). When the metrics are requested (using an HTTP GET request
+ * for /metrics on the port configured by the <metrics/> element in the <io/>
+ * section, see mio_xml.cc), all registered callbacks are called. They add
+ * their current values using metrics_add(). The values are grouped by the
+ * metric name, so that multiple instances of a module can add values for the
+ * same metric.
+ *
+ * The counters themselves are maintained by the modules all the time, they
+ * are only read when rendering the metrics.
+ */
+
+#include "jabberd.h"
+
+#include <list>
+#include <sstream>
+#include <time.h>
+
+/**
+ * values of one metric
+ */
+typedef struct {
+    std::string type;           /**< counter or gauge */
+    std::string help;           /**< description of the metric */
+    std::ostringstream samples; /**< rendered samples */
+} _metrics_family;
+
+/**
+ * metrics collected for one request
+ */
+struct metrics_struct {
+    std::list<std::string> order; /**< metric names in order of appearance */
+    std::map<std::string, _metrics_family> families; /**< metrics by name */
+};
+
+/**
+ * registered callback
+ */
+typedef struct {
+    metrics_handler f; /**< the callback */
+    void *arg;         /**< argument to pass to the callback */
+} _metrics_callback;
+
+/** list of all registered callbacks */
+static std::list<_metrics_callback> metrics__callbacks;
+
+/** when metrics have been initialized (see metrics_now()) */
+static unsigned long long metrics__started = 0;
+
+/**
+ * get the current time of the monotonic clock
+ *
+ * @return time in microseconds
+ */
+unsigned long long metrics_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<unsigned long long>(ts.tv_sec) * 1000000ULL +
+           ts.tv_nsec / 1000;
+}
+
+/**
+ * metrics of the process itself
+ *
+ * @param m where to add the metrics
+ * @param arg unused/ignored
+ */
+static void _metrics_process(metrics m, void *arg) {
+    long count = 0;
+    long bytes = 0;
+
+    pool_usage(&count, &bytes);
+
+    metrics_add(m, "jabberd_uptime_seconds", "gauge",
+                "Seconds since the metrics have been initialized.", "",
+                (metrics_now() - metrics__started) / 1000000ULL);
+    metrics_add(m, "jabberd_pools", "gauge", "Number of existing memory pools.",
+                "", count);
+    metrics_add(m, "jabberd_pool_bytes", "gauge",
+                "Bytes allocated by all memory pools.", "", bytes);
+}
+
+/**
+ * register a function, that adds metrics of a module
+ *
+ * @param f the function to call when metrics are requested
+ * @param arg argument to pass to the function
+ */
+void register_metrics(metrics_handler f, void *arg) {
+    _metrics_callback callback;
+
+    if (metrics__callbacks.empty()) {
+        metrics__started = metrics_now();
+        callback.f = _metrics_process;
+        callback.arg = NULL;
+        metrics__callbacks.push_back(callback);
+    }
+
+    callback.f = f;
+    callback.arg = arg;
+    metrics__callbacks.push_back(callback);
+}
+
+/**
+ * build a label for a metric, escaping the value
+ *
+ * @param name the name of the label
+ * @param value the value of the label
+ * @return the label in the form name="value"
+ */
+std::string metrics_label(char const *name, char const *value) {
+    std::string result(name);
+
+    result += "=\"";
+    for (; value != NULL && *value != '\0'; value++) {
+        switch (*value) {
+            case '\\':
+                result += "\\\\";
+                break;
+            case '"':
+                result += "\\\"";
+                break;
+            case '\n':
+                result += "\\n";
+                break;
+            default:
+                result += *value;
+        }
+    }
+    result += '"';
+
+    return result;
+}
+
+/**
+ * add a value for a metric
+ *
+ * @param m the metrics of the request
+ * @param name name of the metric
+ * @param type type of the metric ("counter" or "gauge")
+ * @param help description of the metric
+ * @param labels labels of this value (comma separated list, built by
+ * metrics_label()), empty string for no labels
+ * @param value the value
+ */
+void metrics_add(metrics m, char const *name, char const *type,
+                 char const *help, std::string const &labels, double value) {
+    char value_str[32] = "";
+
+    if (m == NULL || name == NULL)
+        return;
+
+    if (m->families.find(name) == m->families.end()) {
+        m->order.push_back(name);
+        m->families[name].type = type;
+        m->families[name].help = help;
+    }
+    _metrics_family &family = m->families[name];
+
+    snprintf(value_str, sizeof(value_str), "%.15g", value);
+
+    family.samples << name;
+    if (!labels.empty())
+        family.samples << '{' << labels << '}';
+    family.samples << ' ' << value_str << '\n';
+}
+
+/**
+ * collect the current metrics of all modules
+ *
+ * @return the metrics in the Prometheus text exposition format
+ */
+std::string metrics_render(void) {
+    struct metrics_struct m;
+    std::ostringstream result;
+
+    for (std::list<_metrics_callback>::const_iterator cur =
+             metrics__callbacks.begin();
+         cur != metrics__callbacks.end(); ++cur) {
+        (*cur->f)(&m, cur->arg);
+    }
+
+    for (std::list<std::string>::const_iterator name = m.order.begin();
+         name != m.order.end(); ++name) {
+        _metrics_family const &family = m.families[*name];
+
+        result << "# HELP " << *name << ' ' << family.help << '\n';
+        result << "# TYPE " << *name << ' ' << family.type << '\n';
+        result << family.samples.str();
+    }
+
+    return result.str();
+}
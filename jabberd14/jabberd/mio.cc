@@ -51,6 +51,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <map>
 
 /********************************************************
  *************  Internal MIO Functions  *****************
@@ -71,7 +72,9 @@ typedef struct mio_connect_st {
                         switch between raw and TLS-protected connections, XML
                         streams or byte streams */
     pth_t t;         /**< thread for this connection */
-    int connected;   /**< flag if the socket is connected */
+    int connected;   /**< flag if the socket is connected (set after the
+                        callback has been called) */
+    int canceled;    /**< mio_connect_cancel() has been called */
 } _connect_data, *connect_data;
 
 /* global object */
@@ -235,6 +238,22 @@ static void _wakeup_mio_loop(void) {
     }
 }
 
+/**
+ * wake up the mio loop from a native thread (e.g. a TLS handshake worker)
+ *
+ * Only uses a plain write() on the wakeup pipe, as native threads must not
+ * call into libpth.
+ */
+void _mio_wakeup_from_thread(void) {
+    if (mio__data == NULL)
+        return;
+
+    ssize_t res = write(mio__data->zzz[1], " ", 1);
+    if (res < 1) {
+        /* pipe full: the loop will wake up anyway */
+    }
+}
+
 /**
  * callback for Heartbeat, increments karma, and signals the
  * select loop, whenever a socket's punishment is over
@@ -278,6 +297,63 @@ static result _karma_heartbeat(void *arg) {
     return r_DONE;
 }
 
+/**
+ * add the metrics of the managed sockets
+ *
+ * Write queue sizes are reported for the sockets accepted on each listening
+ * port (port 0 for the connections we opened), and as a total for all
+ * sockets. Reporting them for each socket would create a series for every
+ * connection.
+ *
+ * @param m the metrics to add to
+ * @param arg unused/ignored
+ */
+static void _mio_metrics(metrics m, void *arg) {
+    int sockets = 0;
+    int listeners = 0;
+    long queued_total = 0;
+    std::map<int, long> queued_port;
+
+    if (mio__data == NULL)
+        return;
+
+    for (mio cur = mio__data->master__list; cur != NULL; cur = cur->next) {
+        long queued = 0;
+
+        if (cur->type == type_LISTEN) {
+            listeners++;
+            continue;
+        }
+        sockets++;
+
+        for (mio_wbq q = cur->queue; q != NULL; q = q->next)
+            queued += q->len;
+        queued_total += queued;
+
+        if (queued > 0)
+            queued_port[cur->our_port] += queued;
+    }
+
+    for (std::map<int, long>::const_iterator port = queued_port.begin();
+         port != queued_port.end(); ++port) {
+        char port_str[16] = "";
+
+        snprintf(port_str, sizeof(port_str), "%i", port->first);
+        metrics_add(m, "jabberd_mio_write_queue_bytes", "gauge",
+                    "Bytes waiting in the write queues of the sockets of a "
+                    "listening port (0 for outgoing connections).",
+                    metrics_label("port", port_str), port->second);
+    }
+
+    metrics_add(m, "jabberd_mio_sockets", "gauge",
+                "Connected sockets managed by mio.", "", sockets);
+    metrics_add(m, "jabberd_mio_listeners", "gauge",
+                "Listening sockets managed by mio.", "", listeners);
+    metrics_add(m, "jabberd_mio_write_queue_bytes_total", "gauge",
+                "Bytes waiting in the write queues of all sockets.", "",
+                queued_total);
+}
+
 /**
  * unlinks a socket from the master list
  *
@@ -370,6 +446,8 @@ int _mio_write_dump(mio m) {
         m->queue = m->queue->next;
         if (m->queue == NULL)
             m->tail = NULL;
+        if (cur->type == queue_XMLNODE)
+            trace_stamp(cur->p, trace_WRITE);
         pool_free(cur->p);
     }
     return 0;
@@ -507,6 +585,7 @@ static mio _mio_accept(mio m) {
     newm->peer_ip = pstrdup(newm->p, addr_str);
     newm->peer_port = ntohs(serv_addr.sin6_port);
     newm->our_ip = pstrdup(newm->p, m->our_ip);
+    newm->our_port = m->our_port;
 
     /* copy karma settings */
     mio_karma2(newm, &m->k);
@@ -685,9 +764,11 @@ static void *_mio_connect(void *arg) {
 
     log_debug2(ZONE, LOGT_IO, "calling the connect handler for mio object %X",
                newm);
-    if (_mio_connect_helper(newm, (struct sockaddr *)&sa, sizeof sa) < 0) {
+    if (cd->canceled ||
+        _mio_connect_helper(newm, (struct sockaddr *)&sa, sizeof sa) < 0) {
         /* get the error message */
-        newm->connect_errmsg = strerror(errno);
+        newm->connect_errmsg =
+            cd->canceled ? "connect canceled" : strerror(errno);
 
         if (cd->cb != NULL)
             (*cd->cb)(newm, MIO_CLOSED, cd->cb_arg, NULL, NULL, 0);
@@ -707,15 +788,11 @@ static void *_mio_connect(void *arg) {
     flags |= O_NONBLOCK;
     fcntl(newm->fd, F_SETFL, flags);
 
-    /* XXX pthreads race condition.. cd->connected may be checked in the
-     * timeout, and cd freed before these calls */
-
     /* set the default karma values */
     mio_karma2(newm, mio__data->k);
 
     /* add to the select loop */
     _mio_link(newm);
-    cd->connected = 1;
 
     /* notify the select loop */
     _wakeup_mio_loop();
@@ -724,6 +801,10 @@ static void *_mio_connect(void *arg) {
     if (newm->cb != NULL)
         (*newm->cb)(newm, MIO_NEW, newm->cb_arg, NULL, NULL, 0);
 
+    /* only now cd may be freed by _mio_connect_timeout(), the callback might
+     * still have canceled other connects */
+    cd->connected = 1;
+
     return NULL;
 }
 
@@ -791,6 +872,7 @@ static void _mio_do_handshake(mio m) {
     if (m->mh == NULL || m->mh->handshake == NULL) {
         m->flags.recall_handshake_when_readable = 0;
         m->flags.recall_handshake_when_writeable = 0;
+        m->flags.recall_handshake_when_notified = 0;
         return;
     }
 
@@ -800,9 +882,15 @@ static void _mio_do_handshake(mio m) {
         mio_close(m);
     }
 
+    /* the peer may have sent data together with its last handshake message */
+    if (handshake_ret > 0 && m->state != state_CLOSE) {
+        _mio_read_from_socket(m);
+    }
+
     /* handshake finished now? */
     if (!m->flags.recall_handshake_when_readable &&
-        !m->flags.recall_handshake_when_writeable) {
+        !m->flags.recall_handshake_when_writeable &&
+        !m->flags.recall_handshake_when_notified) {
         log_debug2(ZONE, LOGT_IO, "handshake for socket %i has finished",
                    m->fd);
     }
@@ -860,6 +948,12 @@ static void _mio_loop_process_a_socket(mio m, int *maxfd, fd_set *rfds,
         return;
     }
 
+    /* handshake returned by a worker thread? (we are woken up using zzz) */
+    if (m->flags.recall_handshake_when_notified) {
+        _mio_do_handshake(m);
+        return;
+    }
+
     /* handle recall-flags */
     if (m->flags.recall_write_when_writeable) {
         int write_return = 0;
@@ -1008,6 +1102,10 @@ static void *_mio_main(void *arg) {
         FD_ZERO(&wfds);
         FD_ZERO(&rfds);
         for (cur = mio__data->master__list; cur != NULL; cur = cur->next) {
+            /* sockets used by a handshake worker are left alone */
+            if (cur->flags.recall_handshake_when_notified)
+                continue;
+
             /* check if we want to get write events for this socket */
             if (cur->queue != NULL || cur->flags.recall_write_when_writeable ||
                 cur->flags.recall_read_when_writeable ||
@@ -1049,6 +1147,14 @@ static void *_mio_main(void *arg) {
             if (cur->state != state_CLOSE) {
                 _mio_loop_process_a_socket(cur, &maxfd, &rfds, &wfds, retval);
             }
+            /* a closed socket cannot be freed while a handshake worker still
+             * uses it */
+            if (cur->state == state_CLOSE &&
+                cur->flags.recall_handshake_when_notified) {
+                _mio_do_handshake(cur);
+                if (cur->flags.recall_handshake_when_notified)
+                    continue;
+            }
             /* if the mio socket is closed, close it on the socket layer */
             if (cur->state == state_CLOSE) {
                 _mio_close(cur);
@@ -1099,6 +1205,7 @@ void mio_init(void) {
 
     if (mio__data == NULL) {
         register_beat(KARMA_HEARTBEAT, _karma_heartbeat, NULL);
+        register_metrics(_mio_metrics, NULL);
 
         /* malloc our instance object */
         p = pool_new();
@@ -1137,6 +1244,20 @@ void mio_init(void) {
                 xmlnode_get_data(xmlnode_get_list_item(
                     xmlnode_get_tags(io, "flash-policy", namespaces), 0)));
 
+    // metrics are served on the admin port, if configured
+    xmlnode metrics_node = xmlnode_get_list_item(
+        xmlnode_get_tags(io, "metrics", namespaces), 0);
+    mio__data->metrics_port =
+        metrics_node == NULL
+            ? -1
+            : j_atoi(xmlnode_get_attrib_ns(metrics_node, "port", NULL), -1);
+    if (metrics_node != NULL && mio__data->metrics_port <= 0) {
+        // never expose the metrics on the public ports by accident
+        log_alert(NULL, "<metrics/> needs the port attribute set to the "
+                        "admin port, metrics are disabled");
+        mio__data->metrics_port = -1;
+    }
+
     if (karma != NULL) {
         mio__data->k->val =
             j_atoi(xmlnode_get_data(xmlnode_get_list_item(
@@ -1316,10 +1437,12 @@ void mio_write(mio m, xmlnode stanza, char const *buffer, int len) {
     }
 
     /* create the pool for this wbq */
-    if (stanza != NULL)
+    if (stanza != NULL) {
         p = xmlnode_pool(stanza);
-    else
+        trace_stamp(p, trace_PROCESS);
+    } else {
         p = pool_new();
+    }
 
     /* create the wbq */
     newwbq = static_cast<mio_wbq>(pmalloco(p, sizeof(_mio_wbq)));
@@ -1526,16 +1649,18 @@ xmlnode mio_cleanup(mio m) {
  * using the default value)
  * @param mh the ::mio_handlers used to select the desired type of socket (e.g.
  * an XML stream or a TLS protected socket)
+ * @return handle to cancel the connect, valid until the callback has been
+ * called with MIO_NEW or MIO_CLOSED (NULL if the connect has not been started)
  */
-void mio_connect(char *host, int port, mio_std_cb cb, void *cb_arg, int timeout,
-                 mio_handlers mh) {
+mio_connecting mio_connect(char *host, int port, mio_std_cb cb, void *cb_arg,
+                           int timeout, mio_handlers mh) {
     connect_data cd = NULL;
     pool p = NULL;
     pth_attr_t attr;
 
     /* verify data */
     if (host == NULL || port == 0)
-        return;
+        return NULL;
 
     if (timeout <= 0)
         timeout = 30; /* default timeout */
@@ -1566,6 +1691,27 @@ void mio_connect(char *host, int port, mio_std_cb cb, void *cb_arg, int timeout,
     pth_attr_destroy(attr);
 
     register_beat(timeout, _mio_connect_timeout, (void *)cd);
+
+    return cd;
+}
+
+/**
+ * abort a connect started by mio_connect()
+ *
+ * The callback of the connect gets called with MIO_CLOSED. Nothing is done
+ * if the callback has already been called.
+ *
+ * @param cd the handle returned by mio_connect()
+ */
+void mio_connect_cancel(mio_connecting cd) {
+    if (cd == NULL || cd->connected != 0 || cd->canceled)
+        return;
+
+    cd->canceled = 1;
+
+    /* stops pth_connect_ev() the same way as _mio_connect_timeout() does */
+    if (cd->t != NULL)
+        pth_raise(cd->t, SIGUSR2);
 }
 
 /**
@@ -1609,6 +1755,7 @@ mio mio_listen(int port, char const *listen_host, mio_std_cb cb, void *arg,
     newm = static_cast<mio>(mio_new(fd, cb, arg, mh));
     newm->type = type_LISTEN;
     newm->our_ip = pstrdup(newm->p, listen_host);
+    newm->our_port = port;
 
     log_debug2(ZONE, LOGT_IO, "mio starting to listen on %d [%s]", port,
                listen_host);
@@ -39,17 +39,22 @@
 
 #include <fcntl.h>
 #include <gcrypt.h>
+#include <gnutls/crypto.h>
 #include <iostream>
 #include <libtasn1.h>
 #include <list>
 #include <map>
+#include <poll.h>
+#include <pthread.h>
 #include <set>
 #include <sstream>
 #include <string>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <vector>
 
-// Tell gcrypt that we are using libpth - had to move this to a plain C file
+// Initialize gcrypt - had to move this to a plain C file
 extern "C" void mio_tls_gcrypt_init();
 
 extern const ASN1_ARRAY_TYPE subjectAltName_asn1_tab[];
@@ -72,6 +77,710 @@ pool mio_tls_pool = NULL;
  */
 ASN1_TYPE mio_tls_asn1_tree = ASN1_TYPE_EMPTY;
 
+/**
+ * an entry in a ::mio_tls_session_store
+ */
+typedef struct {
+    time_t stamp;     /**< when the session has been stored */
+    std::string data; /**< the session data as exported by GnuTLS */
+    std::list<std::string>::iterator lru_position; /**< position in lru */
+} mio_tls_session_entry;
+
+/**
+ * bounded in-memory store for TLS session data
+ *
+ * Used on the server side as session database for GnuTLS (key is the session
+ * id), and on the client side to keep the sessions to resume when connecting
+ * to the same peer again (key is our identity and the address of the peer).
+ */
+typedef struct {
+    std::map<std::string, mio_tls_session_entry> entries; /**< the sessions */
+    std::list<std::string> lru; /**< keys, least recently used first */
+    size_t max_entries;         /**< maximum number of entries, 0 disables */
+} mio_tls_session_store;
+
+/** session database of the server side */
+static mio_tls_session_store mio_tls_server_sessions = {
+    std::map<std::string, mio_tls_session_entry>(), std::list<std::string>(),
+    1000};
+
+/** sessions to resume for outgoing connections */
+static mio_tls_session_store mio_tls_client_sessions = {
+    std::map<std::string, mio_tls_session_entry>(), std::list<std::string>(),
+    1000};
+
+/** how long sessions can be resumed (in seconds) */
+static int mio_tls_session_timeout = 3600;
+
+/** master key of the session tickets, data is NULL if tickets are disabled */
+static gnutls_datum_t mio_tls_ticket_key = {NULL, 0};
+
+/**
+ * statistics about TLS handshakes, index 0 for incoming, 1 for outgoing
+ * connections
+ */
+static unsigned long mio_tls_handshakes[2] = {0, 0};
+
+/** handshakes, that resumed a previous session, index as mio_tls_handshakes */
+static unsigned long mio_tls_resumed[2] = {0, 0};
+
+/**
+ * protects the session stores, as GnuTLS calls the session database from the
+ * handshake worker threads
+ */
+static pthread_mutex_t mio_tls_sessions_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * data we keep for each TLS session, set as the session pointer
+ */
+typedef struct {
+    char const *resume_key; /**< key in mio_tls_client_sessions for outgoing
+                               connections, NULL for incoming connections */
+    gnutls_certificate_credentials_t
+        credentials; /**< credentials used for the session */
+} mio_tls_session_info;
+
+/**
+ * a cached result of verifying a peer's certificate
+ */
+typedef struct {
+    int result;     /**< result of the verification */
+    time_t expires; /**< when the result has to be verified again */
+    std::list<std::string>::iterator lru_position; /**< position in lru */
+} mio_tls_verify_entry;
+
+/**
+ * cached results of certificate verifications
+ *
+ * key is the fingerprint of the certificate chain, the credentials used to
+ * verify and the identity it has been verified for
+ */
+static std::map<std::string, mio_tls_verify_entry> mio_tls_verify_cache;
+
+/** keys of mio_tls_verify_cache, least recently used first */
+static std::list<std::string> mio_tls_verify_lru;
+
+/** maximum number of cached verification results, 0 disables the cache */
+static size_t mio_tls_verify_cache_size = 1000;
+
+/** maximum time in seconds a verification result is cached */
+static int mio_tls_verify_ttl = 300;
+
+/** verifications answered from / not found in mio_tls_verify_cache */
+static unsigned long mio_tls_verify_hits = 0, mio_tls_verify_misses = 0;
+
+/**
+ * CA and CRL files used by the credentials, with their modification time when
+ * they have been loaded
+ */
+static std::map<std::string, time_t> mio_tls_watched_files;
+
+/**
+ * remember a CA or CRL file, so that cached verification results can be
+ * dropped when the file changes
+ *
+ * @param file the file that has been loaded
+ */
+static void mio_tls_watch_file(char const *file) {
+    struct stat file_stat;
+
+    mio_tls_watched_files[file] =
+        stat(file, &file_stat) == 0 ? file_stat.st_mtime : 0;
+}
+
+/**
+ * drop all cached verification results
+ */
+static void mio_tls_verify_cache_clear() {
+    mio_tls_verify_cache.clear();
+    mio_tls_verify_lru.clear();
+}
+
+/**
+ * check if one of the CA or CRL files has been changed, and drop the cached
+ * verification results in that case
+ *
+ * @param arg unused
+ * @return always r_DONE
+ */
+static result mio_tls_check_watched_files(void *arg) {
+    bool changed = false;
+
+    for (std::map<std::string, time_t>::iterator p =
+             mio_tls_watched_files.begin();
+         p != mio_tls_watched_files.end(); ++p) {
+        struct stat file_stat;
+        time_t mtime = stat(p->first.c_str(), &file_stat) == 0
+                           ? file_stat.st_mtime
+                           : 0;
+        if (mtime != p->second) {
+            log_notice(NULL,
+                       "%s has been changed, dropping cached certificate "
+                       "verifications",
+                       p->first.c_str());
+            p->second = mtime;
+            changed = true;
+        }
+    }
+
+    if (changed)
+        mio_tls_verify_cache_clear();
+
+    return r_DONE;
+}
+
+/**
+ * a TLS handshake, that is computed by worker threads
+ *
+ * The mio loop does all I/O of the handshake: it writes what GnuTLS produced
+ * (out) and reads what the peer sent (in). A worker only runs
+ * gnutls_handshake() on these buffers, until it needs more data from the
+ * peer. After the handshake the session uses the socket directly.
+ */
+typedef struct {
+    mio m;                    /**< the connection */
+    gnutls_session_t session; /**< the session to do the handshake for */
+    int fd;                   /**< the socket of the session */
+    std::string in;           /**< data from the peer, not yet used by GnuTLS */
+    std::string out;          /**< data from GnuTLS, not yet written */
+    bool handshaking;         /**< GnuTLS does its I/O on the buffers */
+    bool running;             /**< queued for or running in a worker */
+    int result;               /**< result of the last gnutls_handshake() */
+} mio_tls_handshake_job;
+
+/** number of worker threads doing handshakes, 0 to do them in the mio loop */
+static int mio_tls_handshake_threads = 0;
+
+/** protects mio_tls_handshake_queue, mio_tls_handshakes_running and the
+ * running and result fields of the jobs */
+static pthread_mutex_t mio_tls_handshake_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** signals the workers, that there are new jobs in the queue */
+static pthread_cond_t mio_tls_handshake_cond = PTHREAD_COND_INITIALIZER;
+
+/** handshakes waiting for a worker */
+static std::list<mio_tls_handshake_job *> mio_tls_handshake_queue;
+
+/** number of handshakes computed by workers right now */
+static size_t mio_tls_handshakes_running = 0;
+
+/** the unfinished handshakes done by workers, key is the mio (only used by
+ * the mio loop) */
+static std::map<mio, mio_tls_handshake_job *> mio_tls_handshake_jobs;
+
+/**
+ * remove a session from a session store
+ *
+ * @param store the store to remove from
+ * @param key the key of the session
+ */
+static void mio_tls_session_remove(mio_tls_session_store *store,
+                                   std::string const &key) {
+    std::map<std::string, mio_tls_session_entry>::iterator entry =
+        store->entries.find(key);
+    if (entry == store->entries.end())
+        return;
+
+    store->lru.erase(entry->second.lru_position);
+    store->entries.erase(entry);
+}
+
+/**
+ * put session data into a session store, dropping the least recently used
+ * session if the store is full
+ *
+ * @param store the store to put the session in
+ * @param key the key of the session
+ * @param data the session data
+ */
+static void mio_tls_session_put(mio_tls_session_store *store,
+                                std::string const &key,
+                                gnutls_datum_t const &data) {
+    if (store->max_entries == 0 || data.data == NULL || data.size == 0)
+        return;
+
+    mio_tls_session_remove(store, key);
+    while (!store->lru.empty() && store->entries.size() >= store->max_entries)
+        mio_tls_session_remove(store, store->lru.front());
+
+    mio_tls_session_entry &entry = store->entries[key];
+    entry.stamp = time(NULL);
+    entry.data.assign(reinterpret_cast<char const *>(data.data), data.size);
+    entry.lru_position = store->lru.insert(store->lru.end(), key);
+}
+
+/**
+ * get session data from a session store
+ *
+ * @param store the store to search in
+ * @param key the key of the session
+ * @return the session entry, NULL if there is no (valid) session for the key
+ */
+static mio_tls_session_entry *
+mio_tls_session_get(mio_tls_session_store *store, std::string const &key) {
+    std::map<std::string, mio_tls_session_entry>::iterator entry =
+        store->entries.find(key);
+    if (entry == store->entries.end())
+        return NULL;
+
+    if (time(NULL) - entry->second.stamp > mio_tls_session_timeout) {
+        mio_tls_session_remove(store, key);
+        return NULL;
+    }
+
+    store->lru.splice(store->lru.end(), store->lru,
+                      entry->second.lru_position);
+    return &entry->second;
+}
+
+/**
+ * GnuTLS callback to store a session in the server side session database
+ */
+static int mio_tls_db_store(void *ptr, gnutls_datum_t key,
+                            gnutls_datum_t data) {
+    pthread_mutex_lock(&mio_tls_sessions_mutex);
+    mio_tls_session_put(
+        static_cast<mio_tls_session_store *>(ptr),
+        std::string(reinterpret_cast<char const *>(key.data), key.size), data);
+    pthread_mutex_unlock(&mio_tls_sessions_mutex);
+    return 0;
+}
+
+/**
+ * GnuTLS callback to retrieve a session from the server side session database
+ */
+static gnutls_datum_t mio_tls_db_retrieve(void *ptr, gnutls_datum_t key) {
+    gnutls_datum_t result = {NULL, 0};
+
+    pthread_mutex_lock(&mio_tls_sessions_mutex);
+    mio_tls_session_entry *entry = mio_tls_session_get(
+        static_cast<mio_tls_session_store *>(ptr),
+        std::string(reinterpret_cast<char const *>(key.data), key.size));
+
+    if (entry != NULL) {
+        result.data =
+            static_cast<unsigned char *>(gnutls_malloc(entry->data.size()));
+        if (result.data != NULL) {
+            memcpy(result.data, entry->data.data(), entry->data.size());
+            result.size = entry->data.size();
+        }
+    }
+    pthread_mutex_unlock(&mio_tls_sessions_mutex);
+
+    return result;
+}
+
+/**
+ * GnuTLS callback to remove a session from the server side session database
+ */
+static int mio_tls_db_remove(void *ptr, gnutls_datum_t key) {
+    pthread_mutex_lock(&mio_tls_sessions_mutex);
+    mio_tls_session_remove(
+        static_cast<mio_tls_session_store *>(ptr),
+        std::string(reinterpret_cast<char const *>(key.data), key.size));
+    pthread_mutex_unlock(&mio_tls_sessions_mutex);
+    return 0;
+}
+
+/**
+ * keep the session of an outgoing connection, so that it can be resumed when
+ * connecting to the same peer again
+ *
+ * @param session the session to keep
+ */
+static void mio_tls_save_client_session(gnutls_session_t session) {
+    mio_tls_session_info *info =
+        static_cast<mio_tls_session_info *>(gnutls_session_get_ptr(session));
+    gnutls_datum_t data = {NULL, 0};
+
+    if (info == NULL || info->resume_key == NULL ||
+        mio_tls_client_sessions.max_entries == 0)
+        return;
+
+    if (gnutls_session_get_data2(session, &data) != 0)
+        return;
+    pthread_mutex_lock(&mio_tls_sessions_mutex);
+    mio_tls_session_put(&mio_tls_client_sessions, info->resume_key, data);
+    pthread_mutex_unlock(&mio_tls_sessions_mutex);
+    gnutls_free(data.data);
+}
+
+/**
+ * update the statistics after a completed handshake
+ *
+ * @param m the connection the handshake has been completed on
+ */
+static void mio_tls_handshake_done(mio m) {
+    gnutls_session_t session = static_cast<gnutls_session_t>(m->ssl);
+    mio_tls_session_info *info =
+        static_cast<mio_tls_session_info *>(gnutls_session_get_ptr(session));
+    int outgoing = info != NULL && info->resume_key != NULL ? 1 : 0;
+
+    mio_tls_handshakes[outgoing]++;
+    if (gnutls_session_is_resumed(session)) {
+        mio_tls_resumed[outgoing]++;
+        log_debug2(ZONE, LOGT_IO, "resumed TLS session on fd #%i", m->fd);
+    }
+
+    if (outgoing)
+        mio_tls_save_client_session(session);
+}
+
+/**
+ * generate the master key of the session tickets
+ *
+ * The key that actually encrypts the tickets is derived from it by GnuTLS
+ * and rotated automatically depending on the session timeout. Tickets
+ * issued with the previous key are still accepted, so a rotation does not
+ * end the resumption of all sessions at once.
+ */
+static void mio_tls_generate_ticket_key() {
+    if (gnutls_session_ticket_key_generate(&mio_tls_ticket_key) != 0) {
+        log_warn(NULL, "Could not generate the TLS session ticket key");
+        mio_tls_ticket_key.data = NULL;
+        mio_tls_ticket_key.size = 0;
+    }
+}
+
+/**
+ * add the TLS resumption statistics to the metrics
+ *
+ * @param m the metrics to add to
+ * @param arg unused
+ */
+static void mio_tls_metrics(metrics m, void *arg) {
+    for (int outgoing = 0; outgoing <= 1; outgoing++) {
+        std::string labels =
+            metrics_label("direction", outgoing ? "outgoing" : "incoming");
+
+        metrics_add(m, "tls_handshakes_total", "counter",
+                    "Completed TLS handshakes.", labels,
+                    mio_tls_handshakes[outgoing]);
+        metrics_add(m, "tls_resumed_total", "counter",
+                    "TLS handshakes, that resumed a previous session.", labels,
+                    mio_tls_resumed[outgoing]);
+    }
+    pthread_mutex_lock(&mio_tls_sessions_mutex);
+    size_t server_sessions = mio_tls_server_sessions.entries.size();
+    size_t client_sessions = mio_tls_client_sessions.entries.size();
+    pthread_mutex_unlock(&mio_tls_sessions_mutex);
+    metrics_add(m, "tls_session_cache_entries", "gauge",
+                "TLS sessions cached for resumption.",
+                metrics_label("direction", "incoming"), server_sessions);
+    metrics_add(m, "tls_session_cache_entries", "gauge",
+                "TLS sessions cached for resumption.",
+                metrics_label("direction", "outgoing"), client_sessions);
+
+    metrics_add(m, "tls_verify_cache_hits_total", "counter",
+                "Certificate verifications answered from the cache.", "",
+                mio_tls_verify_hits);
+    metrics_add(m, "tls_verify_cache_misses_total", "counter",
+                "Certificate verifications not found in the cache.", "",
+                mio_tls_verify_misses);
+    metrics_add(m, "tls_verify_cache_entries", "gauge",
+                "Cached certificate verification results.", "",
+                mio_tls_verify_cache.size());
+
+    pthread_mutex_lock(&mio_tls_handshake_mutex);
+    size_t queued = mio_tls_handshake_queue.size();
+    size_t running = mio_tls_handshakes_running;
+    pthread_mutex_unlock(&mio_tls_handshake_mutex);
+    metrics_add(m, "tls_handshakes_queued", "gauge",
+                "TLS handshakes waiting for a worker thread.", "", queued);
+    metrics_add(m, "tls_handshakes_running", "gauge",
+                "TLS handshakes done by worker threads right now.", "",
+                running);
+}
+
+/**
+ * GnuTLS pull function of sessions with a handshake done by workers
+ *
+ * During the handshake this runs in a worker thread and only uses the
+ * buffer. Data the peer sent together with its last handshake message is
+ * passed before reading from the socket again.
+ *
+ * @param ptr the job of the session
+ * @param data where to store the data
+ * @param len size of data
+ * @return number of bytes received, -1 on error
+ */
+static ssize_t mio_tls_job_pull(gnutls_transport_ptr_t ptr, void *data,
+                                size_t len) {
+    mio_tls_handshake_job *job = static_cast<mio_tls_handshake_job *>(ptr);
+
+    if (!job->in.empty()) {
+        size_t available = job->in.length() < len ? job->in.length() : len;
+        memcpy(data, job->in.data(), available);
+        job->in.erase(0, available);
+        return available;
+    }
+
+    if (job->handshaking) {
+        gnutls_transport_set_errno(job->session, EAGAIN);
+        return -1;
+    }
+
+    return recv(job->fd, data, len, 0);
+}
+
+/**
+ * GnuTLS pull timeout function of sessions with a handshake done by workers
+ *
+ * @param ptr the job of the session
+ * @param ms how long to wait for data
+ * @return >0 if data is available, 0 on timeout, -1 on error
+ */
+static int mio_tls_job_pull_timeout(gnutls_transport_ptr_t ptr,
+                                    unsigned int ms) {
+    mio_tls_handshake_job *job = static_cast<mio_tls_handshake_job *>(ptr);
+
+    if (!job->in.empty())
+        return 1;
+    if (job->handshaking)
+        return 0;
+
+    struct pollfd pfd;
+    pfd.fd = job->fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return poll(&pfd, 1, ms);
+}
+
+/**
+ * GnuTLS push function of sessions with a handshake done by workers
+ *
+ * @param ptr the job of the session
+ * @param data the data to send
+ * @param len length of data
+ * @return number of bytes sent, -1 on error
+ */
+static ssize_t mio_tls_job_push(gnutls_transport_ptr_t ptr, const void *data,
+                                size_t len) {
+    mio_tls_handshake_job *job = static_cast<mio_tls_handshake_job *>(ptr);
+
+    if (job->handshaking) {
+        job->out.append(static_cast<const char *>(data), len);
+        return len;
+    }
+
+    return send(job->fd, data, len, 0);
+}
+
+/**
+ * main function of the threads doing TLS handshakes
+ *
+ * Takes jobs from mio_tls_handshake_queue, runs gnutls_handshake() until it
+ * needs more data or has finished (no I/O is done), and notifies the mio
+ * loop using the wakeup pipe. This runs in a native thread, it must not use
+ * libpth, memory pools or logging.
+ *
+ * @param arg unused
+ * @return never returns
+ */
+static void *mio_tls_handshake_worker(void *arg) {
+    while (true) {
+        pthread_mutex_lock(&mio_tls_handshake_mutex);
+        while (mio_tls_handshake_queue.empty())
+            pthread_cond_wait(&mio_tls_handshake_cond,
+                              &mio_tls_handshake_mutex);
+        mio_tls_handshake_job *job = mio_tls_handshake_queue.front();
+        mio_tls_handshake_queue.pop_front();
+        mio_tls_handshakes_running++;
+        pthread_mutex_unlock(&mio_tls_handshake_mutex);
+
+        int result = gnutls_handshake(job->session);
+
+        pthread_mutex_lock(&mio_tls_handshake_mutex);
+        job->result = result;
+        job->running = false;
+        mio_tls_handshakes_running--;
+        pthread_mutex_unlock(&mio_tls_handshake_mutex);
+
+        _mio_wakeup_from_thread();
+    }
+    return NULL;
+}
+
+/**
+ * start the worker threads doing TLS handshakes
+ *
+ * @param threads number of threads to start
+ */
+static void mio_tls_start_handshake_workers(int threads) {
+    for (int i = 0; i < threads; i++) {
+        pthread_t thread;
+        int ret =
+            pthread_create(&thread, NULL, mio_tls_handshake_worker, NULL);
+        if (ret != 0) {
+            log_warn(NULL, "Could not start TLS handshake thread: %s",
+                     strerror(ret));
+            break;
+        }
+        pthread_detach(thread);
+        mio_tls_handshake_threads++;
+    }
+    log_debug2(ZONE, LOGT_INIT, "started %i TLS handshake threads",
+               mio_tls_handshake_threads);
+}
+
+/**
+ * free a handshake job, when the connection is freed
+ *
+ * The job is the transport of the session as long as the connection exists.
+ *
+ * @param arg the job
+ */
+static void mio_tls_handshake_free(void *arg) {
+    mio_tls_handshake_job *job = static_cast<mio_tls_handshake_job *>(arg);
+
+    std::map<mio, mio_tls_handshake_job *>::iterator p =
+        mio_tls_handshake_jobs.find(job->m);
+    if (p != mio_tls_handshake_jobs.end() && p->second == job)
+        mio_tls_handshake_jobs.erase(p);
+    delete job;
+}
+
+/**
+ * pass a handshake job to the worker threads
+ *
+ * The mio loop leaves the socket alone, until the worker signals that it
+ * returned the job. Then the handshake function is recalled, which continues
+ * using mio_tls_step_handshake().
+ *
+ * @param m the connection
+ * @param job the handshake
+ */
+static void mio_tls_dispatch_handshake(mio m, mio_tls_handshake_job *job) {
+    m->flags.recall_handshake_when_readable = 0;
+    m->flags.recall_handshake_when_writeable = 0;
+    m->flags.recall_handshake_when_notified = 1;
+
+    pthread_mutex_lock(&mio_tls_handshake_mutex);
+    job->running = true;
+    mio_tls_handshake_queue.push_back(job);
+    pthread_cond_signal(&mio_tls_handshake_cond);
+    pthread_mutex_unlock(&mio_tls_handshake_mutex);
+}
+
+/**
+ * start a handshake, that is computed by worker threads
+ *
+ * The session gets transport functions working on the buffers of the job.
+ * If we are the server, we wait for the first message of the peer. If we
+ * are the client, the job is passed to a worker at once, as we have to send
+ * the first message (the ClientHello).
+ *
+ * @param m the connection
+ * @param session the session to do the handshake for
+ * @param originator 1 if we are the client of the handshake
+ */
+static void mio_tls_queue_handshake(mio m, gnutls_session_t session,
+                                    int originator) {
+    mio_tls_handshake_job *job = new mio_tls_handshake_job;
+    job->m = m;
+    job->session = session;
+    job->fd = m->fd;
+    job->handshaking = true;
+    job->running = false;
+    job->result = GNUTLS_E_AGAIN;
+
+    gnutls_transport_set_ptr(session, job);
+    gnutls_transport_set_pull_function(session, mio_tls_job_pull);
+    gnutls_transport_set_pull_timeout_function(session,
+                                               mio_tls_job_pull_timeout);
+    gnutls_transport_set_push_function(session, mio_tls_job_push);
+    pool_cleanup(m->p, mio_tls_handshake_free, job);
+    mio_tls_handshake_jobs[m] = job;
+
+    log_debug2(ZONE, LOGT_IO, "TLS handshake for fd #%i done by workers",
+               m->fd);
+
+    if (originator) {
+        mio_tls_dispatch_handshake(m, job);
+        return;
+    }
+
+    m->flags.recall_handshake_when_readable = 1;
+    m->flags.recall_handshake_when_writeable = 0;
+    m->flags.recall_handshake_when_notified = 0;
+}
+
+/**
+ * do the I/O for a handshake computed by worker threads
+ *
+ * Writes the data the worker produced, then either finishes the handshake,
+ * or reads data from the peer and passes the job to the workers again.
+ *
+ * @param m the connection
+ * @param job the handshake
+ * @return -1 on error, 0 if the handshake did not finish yet, 1 on success
+ */
+static int mio_tls_step_handshake(mio m, mio_tls_handshake_job *job) {
+    pthread_mutex_lock(&mio_tls_handshake_mutex);
+    bool running = job->running;
+    int ret = job->result;
+    pthread_mutex_unlock(&mio_tls_handshake_mutex);
+
+    if (running)
+        return 0;
+
+    m->flags.recall_handshake_when_readable = 0;
+    m->flags.recall_handshake_when_writeable = 0;
+    m->flags.recall_handshake_when_notified = 0;
+
+    /* the connection has been closed while a worker had the job */
+    if (m->state == state_CLOSE)
+        return -1;
+
+    while (!job->out.empty()) {
+        ssize_t written = send(job->fd, job->out.data(), job->out.length(), 0);
+        if (written < 0 && (errno == EAGAIN || errno == EINTR)) {
+            m->flags.recall_handshake_when_writeable = 1;
+            return 0;
+        }
+        if (written < 0) {
+            log_debug2(ZONE, LOGT_IO, "TLS handshake failed for fd #%i: %s",
+                       m->fd, strerror(errno));
+            return -1;
+        }
+        job->out.erase(0, written);
+    }
+
+    if (ret >= 0) {
+        job->handshaking = false;
+        mio_tls_handshake_jobs.erase(m);
+        m->mh->handshake = NULL;
+        m->k.val = 100;
+        log_debug2(ZONE, LOGT_IO, "TLS handshake finished for fd #%i", m->fd);
+        mio_tls_handshake_done(m);
+        return 1;
+    }
+
+    if (ret != GNUTLS_E_AGAIN && ret != GNUTLS_E_INTERRUPTED) {
+        log_debug2(ZONE, LOGT_IO, "TLS handshake failed for fd #%i: %s",
+                   m->fd, gnutls_strerror(ret));
+        return -1;
+    }
+
+    /* GnuTLS needs more data from the peer */
+    char buf[8192];
+    ssize_t len = recv(job->fd, buf, sizeof(buf), 0);
+    if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+        m->flags.recall_handshake_when_readable = 1;
+        return 0;
+    }
+    if (len <= 0) {
+        log_debug2(ZONE, LOGT_IO, "connection closed during TLS handshake "
+                                  "(fd #%i)",
+                   m->fd);
+        return -1;
+    }
+    job->in.append(buf, len);
+
+    mio_tls_dispatch_handshake(m, job);
+    return 0;
+}
+
 /**
  * close the TLS connection
  *
@@ -83,6 +792,10 @@ static void mio_tls_close(mio m, bool close_read) {
     if (!m || !m->ssl)
         return;
 
+    // with TLS 1.3 the session ticket is only received after the handshake
+    if (m->mh->handshake == NULL)
+        mio_tls_save_client_session(static_cast<gnutls_session_t>(m->ssl));
+
     gnutls_bye(static_cast<gnutls_session_t>(m->ssl),
                close_read ? GNUTLS_SHUT_RDWR : GNUTLS_SHUT_WR);
     if (close_read) {
@@ -245,6 +958,7 @@ static void mio_tls_process_credentials(
             }
 
             // load the CA's certificate
+            mio_tls_watch_file(file);
             ret = gnutls_certificate_set_x509_trust_file(
                 current_credentials, file,
                 format_der ? GNUTLS_X509_FMT_DER : GNUTLS_X509_FMT_PEM);
@@ -370,6 +1084,7 @@ static void mio_tls_process_credentials(
     for (crl_p = crl_files_pem.begin(); crl_p != crl_files_pem.end(); ++crl_p) {
         char const *file_to_load = crl_p->c_str();
 
+        mio_tls_watch_file(file_to_load);
         ret = gnutls_certificate_set_x509_crl_file(
             current_credentials, file_to_load, GNUTLS_X509_FMT_PEM);
         if (ret < 0) {
@@ -380,6 +1095,7 @@ static void mio_tls_process_credentials(
     for (crl_p = crl_files_der.begin(); crl_p != crl_files_der.end(); ++crl_p) {
         char const *file_to_load = crl_p->c_str();
 
+        mio_tls_watch_file(file_to_load);
         ret = gnutls_certificate_set_x509_crl_file(
             current_credentials, file_to_load, GNUTLS_X509_FMT_DER);
         if (ret < 0) {
@@ -393,6 +1109,7 @@ static void mio_tls_process_credentials(
         std::list<std::string>::const_iterator p;
         for (p = default_cacertfile_pem.begin();
              p != default_cacertfile_pem.end(); ++p) {
+            mio_tls_watch_file(p->c_str());
             ret = gnutls_certificate_set_x509_trust_file(
                 current_credentials, p->c_str(), GNUTLS_X509_FMT_PEM);
             if (ret < 0) {
@@ -403,6 +1120,7 @@ static void mio_tls_process_credentials(
         }
         for (p = default_cacertfile_der.begin();
              p != default_cacertfile_der.end(); ++p) {
+            mio_tls_watch_file(p->c_str());
             ret = gnutls_certificate_set_x509_trust_file(
                 current_credentials, p->c_str(), GNUTLS_X509_FMT_DER);
             if (ret < 0) {
@@ -516,6 +1234,7 @@ mio_tls_process_key(xmlnode x,
     std::list<std::string>::const_iterator p;
     for (p = default_cacertfile_pem.begin(); p != default_cacertfile_pem.end();
          ++p) {
+        mio_tls_watch_file(p->c_str());
         ret = gnutls_certificate_set_x509_trust_file(
             current_credentials, p->c_str(), GNUTLS_X509_FMT_PEM);
         if (ret < 0) {
@@ -525,6 +1244,7 @@ mio_tls_process_key(xmlnode x,
     }
     for (p = default_cacertfile_der.begin(); p != default_cacertfile_der.end();
          ++p) {
+        mio_tls_watch_file(p->c_str());
         ret = gnutls_certificate_set_x509_trust_file(
             current_credentials, p->c_str(), GNUTLS_X509_FMT_DER);
         if (ret < 0) {
@@ -548,7 +1268,7 @@ mio_tls_process_key(xmlnode x,
  * @return true on success, false on failure
  */
 bool mio_tls_early_init() {
-    // prepare gcrypt with libpth
+    // prepare gcrypt
     mio_tls_gcrypt_init();
 
     /* initialize the GNU TLS library */
@@ -599,6 +1319,8 @@ void mio_ssl_init(xmlnode x) {
     std::list<std::string> crl_files_pem;
     std::list<std::string> crl_files_der;
     bool dhparams_der = false;
+    bool tickets = true;
+    int handshake_threads = 4;
     for (cur = xmlnode_get_firstchild(x); cur != NULL;
          cur = xmlnode_get_nextsibling(cur)) {
         if (xmlnode_get_type(cur) != NTYPE_TAG) {
@@ -640,6 +1362,33 @@ void mio_ssl_init(xmlnode x) {
             continue;
         }
 
+        if (j_strcmp(xmlnode_get_localname(cur), "verifycache") == 0) {
+            mio_tls_verify_cache_size =
+                j_atoi(xmlnode_get_attrib_ns(cur, "size", NULL), 1000);
+            mio_tls_verify_ttl =
+                j_atoi(xmlnode_get_attrib_ns(cur, "ttl", NULL), 300);
+            continue;
+        }
+
+        if (j_strcmp(xmlnode_get_localname(cur), "handshakethreads") == 0) {
+            handshake_threads = j_atoi(xmlnode_get_data(cur), 4);
+            continue;
+        }
+
+        if (j_strcmp(xmlnode_get_localname(cur), "resumption") == 0) {
+            mio_tls_server_sessions.max_entries = j_atoi(
+                xmlnode_get_attrib_ns(cur, "cachesize", NULL), 1000);
+            mio_tls_client_sessions.max_entries =
+                mio_tls_server_sessions.max_entries;
+            mio_tls_session_timeout =
+                j_atoi(xmlnode_get_attrib_ns(cur, "timeout", NULL), 3600);
+            tickets =
+                j_strcmp(xmlnode_get_attrib_ns(cur, "tickets", NULL), "no") !=
+                0;
+
+            continue;
+        }
+
         if (j_strcmp(xmlnode_get_localname(cur), "crlfile") == 0) {
             char const *const crlfile_data = xmlnode_get_data(cur);
             char const *const crlfile_type =
@@ -657,6 +1406,11 @@ void mio_ssl_init(xmlnode x) {
         }
     }
 
+    /* the credentials get (re)loaded, forget what we verified with the old
+     * ones */
+    mio_tls_verify_cache_clear();
+    mio_tls_watched_files.clear();
+
     /* create DH parameters */
     ret = gnutls_dh_params_init(&mio_tls_dh_params);
     if (ret < 0) {
@@ -727,6 +1481,23 @@ void mio_ssl_init(xmlnode x) {
         }
     }
 
+    /* things that are only done once, not when reloading the configuration */
+    static bool started = false;
+    if (!started) {
+        started = true;
+
+        /* session tickets, GnuTLS rotates the key derived from this one */
+        if (tickets)
+            mio_tls_generate_ticket_key();
+        register_metrics(mio_tls_metrics, NULL);
+
+        /* drop cached verifications if CA or CRL files change */
+        register_beat(60, mio_tls_check_watched_files, NULL);
+
+        /* threads doing the expensive part of new TLS sessions */
+        mio_tls_start_handshake_workers(handshake_threads);
+    }
+
     xhash_free(namespaces);
     namespaces = NULL;
 }
@@ -875,6 +1646,12 @@ ssize_t _mio_ssl_write(mio m, const void *buf, size_t count) {
 int _mio_tls_cont_handshake_server(mio m) {
     int ret = 0;
 
+    /* handshake computed by worker threads */
+    std::map<mio, mio_tls_handshake_job *>::iterator job =
+        mio_tls_handshake_jobs.find(m);
+    if (job != mio_tls_handshake_jobs.end())
+        return mio_tls_step_handshake(m, job->second);
+
     /* we are recalled, if neccessary we set the flags again */
     m->flags.recall_handshake_when_readable = 0;
     m->flags.recall_handshake_when_writeable = 0;
@@ -884,6 +1661,7 @@ int _mio_tls_cont_handshake_server(mio m) {
     if (ret >= 0) {
         /* reset the handler for handshake */
         m->mh->handshake = NULL;
+        mio_tls_handshake_done(m);
         log_debug2(ZONE, LOGT_IO, "TLS handshake finished for fd #%i", m->fd);
         return 1;
     } else if (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED) {
@@ -917,7 +1695,7 @@ int _mio_tls_cont_handshake_server(mio m) {
  * @return -1 on error, 0 if the handshake has not yet finished, 1 on success
  */
 int _mio_ssl_accepted(mio m) {
-    return mio_ssl_starttls(m, 0, m->our_ip) == 0 ? 1 : -1;
+    return mio_ssl_starttls(m, 0, m->our_ip, NULL) == 0 ? 1 : -1;
 }
 
 /**
@@ -969,9 +1747,12 @@ int mio_ssl_starttls_possible(mio m, const char *identity) {
  * @param m the connection on which the TLS layer should be established
  * @param originator 1 if this side is the originating side, 0 else
  * @param identity our own identity (selector for the used certificate)
+ * @param peer the domain we expect the peer to be (only for originators,
+ * sessions are only resumed with the same domain), NULL if unknown
  * @return 0 on success, non-zero on failure
  */
-int mio_ssl_starttls(mio m, int originator, const char *identity) {
+int mio_ssl_starttls(mio m, int originator, const char *identity,
+                     const char *peer) {
     gnutls_session_t session = NULL;
     gnutls_certificate_credentials_t used_credentials = NULL;
     int ret = 0;
@@ -1040,6 +1821,41 @@ int mio_ssl_starttls(mio m, int originator, const char *identity) {
     }
     gnutls_dh_set_prime_bits(session, 1024);
 
+    mio_tls_session_info *info = static_cast<mio_tls_session_info *>(
+        pmalloco(m->p, sizeof(mio_tls_session_info)));
+    info->credentials = used_credentials;
+    gnutls_session_set_ptr(session, info);
+
+    /* session resumption */
+    if (originator) {
+        /* sessions are resumed for the same identity, peer domain and peer
+         * address */
+        std::ostringstream key;
+        key << (identity ? identity : "") << "/" << (peer ? peer : "") << "/"
+            << m->peer_ip << ":" << m->peer_port;
+        info->resume_key = pstrdup(m->p, key.str().c_str());
+
+        mio_tls_session_entry *entry =
+            mio_tls_session_get(&mio_tls_client_sessions, key.str());
+        if (entry != NULL) {
+            gnutls_session_set_data(session, entry->data.data(),
+                                    entry->data.size());
+        }
+    } else {
+        if (mio_tls_server_sessions.max_entries > 0) {
+            gnutls_db_set_retrieve_function(session, mio_tls_db_retrieve);
+            gnutls_db_set_store_function(session, mio_tls_db_store);
+            gnutls_db_set_remove_function(session, mio_tls_db_remove);
+            gnutls_db_set_ptr(session, &mio_tls_server_sessions);
+        }
+        /* lifetime of cached sessions and tickets, and the period in which
+         * GnuTLS rotates the ticket key */
+        gnutls_db_set_cache_expiration(session, mio_tls_session_timeout);
+        if (mio_tls_ticket_key.data != NULL) {
+            gnutls_session_ticket_enable_server(session, &mio_tls_ticket_key);
+        }
+    }
+
     /* associate with the socket */
     gnutls_transport_set_int(session, m->fd);
 
@@ -1050,7 +1866,14 @@ int mio_ssl_starttls(mio m, int originator, const char *identity) {
     // close the TLS layer on connection shutdown
     m->mh->close = mio_tls_close;
 
-    /* TLS handshake */
+    /* TLS handshake: let worker threads compute it if we have them */
+    if (mio_tls_handshake_threads > 0) {
+        m->mh->handshake = _mio_tls_cont_handshake_server;
+        m->ssl = session;
+        pool_cleanup(m->p, _mio_ssl_cleanup, (void *)session);
+        mio_tls_queue_handshake(m, session, originator);
+        return 0;
+    }
     m->flags.recall_handshake_when_readable = 0;
     m->flags.recall_handshake_when_writeable = 0;
     ret = gnutls_handshake(session);
@@ -1087,6 +1910,7 @@ int mio_ssl_starttls(mio m, int originator, const char *identity) {
     m->ssl = session;
     log_debug2(ZONE, LOGT_EXECFLOW, "m->ssl is now %X, session=%X", m->ssl,
                session);
+    mio_tls_handshake_done(m);
 
     pool_cleanup(m->p, _mio_ssl_cleanup, (void *)session);
 
@@ -1604,14 +2428,14 @@ static int mio_tls_check_x509(mio m, char const *id_on_xmppAddr,
 }
 
 /**
- * verify the SSL/TLS certificate of the peer for the given MIO connection
+ * verify the SSL/TLS certificate of the peer without using the cache
  *
  * @param m the connection for which the peer should be verified
  * @param id_on_xmppAddr the JabberID, that the certificate should be checked
  * for, if NULL it is only checked if the certificate is valid and trusted
  * @return 0 the certificate is invalid, 1 the certificate is valid
  */
-int mio_ssl_verify(mio m, const char *id_on_xmppAddr) {
+static int mio_tls_verify_peer(mio m, const char *id_on_xmppAddr) {
     int ret = 0;
     unsigned int status = 0;
     const gnutls_datum_t *cert_list = NULL;
@@ -1730,6 +2554,123 @@ int mio_ssl_verify(mio m, const char *id_on_xmppAddr) {
     }
 }
 
+/**
+ * build the key for mio_tls_verify_cache for the peer certificate of a
+ * connection
+ *
+ * @param m the connection
+ * @param id_on_xmppAddr the identity the certificate is checked for
+ * @param expires where to store until when a result may be cached
+ * @return the key, empty if the result cannot be cached
+ */
+static std::string mio_tls_verify_cache_key(mio m, const char *id_on_xmppAddr,
+                                            time_t *expires) {
+    gnutls_session_t session = static_cast<gnutls_session_t>(m->ssl);
+    mio_tls_session_info *info =
+        static_cast<mio_tls_session_info *>(gnutls_session_get_ptr(session));
+    const gnutls_datum_t *cert_list = NULL;
+    unsigned int cert_list_size = 0;
+    std::ostringstream key;
+
+    if (mio_tls_verify_cache_size == 0 || info == NULL ||
+        gnutls_certificate_type_get(session) != GNUTLS_CRT_X509)
+        return "";
+
+    cert_list = gnutls_certificate_get_peers(session, &cert_list_size);
+    if (cert_list == NULL || cert_list_size == 0)
+        return "";
+
+    *expires = time(NULL) + mio_tls_verify_ttl;
+    key << std::hex;
+    for (unsigned int i = 0; i < cert_list_size; i++) {
+        unsigned char digest[32];
+        if (gnutls_hash_fast(GNUTLS_DIG_SHA256, cert_list[i].data,
+                             cert_list[i].size, digest) < 0)
+            return "";
+        for (unsigned int j = 0; j < sizeof(digest); j++)
+            key << static_cast<int>(digest[j] >> 4)
+                << static_cast<int>(digest[j] & 0xf);
+        key << ':';
+
+        /* do not cache beyond the expiration of a certificate */
+        gnutls_x509_crt_t cert = NULL;
+        if (gnutls_x509_crt_init(&cert) < 0)
+            return "";
+        if (gnutls_x509_crt_import(cert, &cert_list[i], GNUTLS_X509_FMT_DER) >=
+            0) {
+            time_t cert_expires = gnutls_x509_crt_get_expiration_time(cert);
+            if (cert_expires != (time_t)-1 && cert_expires < *expires)
+                *expires = cert_expires;
+        }
+        gnutls_x509_crt_deinit(cert);
+    }
+    key << static_cast<void *>(info->credentials) << ' '
+        << (id_on_xmppAddr ? id_on_xmppAddr : "");
+
+    return key.str();
+}
+
+/**
+ * verify the SSL/TLS certificate of the peer for the given MIO connection
+ *
+ * The result is cached by the fingerprint of the certificate chain and the
+ * identity, see mio_tls_verify_cache.
+ *
+ * @param m the connection for which the peer should be verified
+ * @param id_on_xmppAddr the JabberID, that the certificate should be checked
+ * for, if NULL it is only checked if the certificate is valid and trusted
+ * @return 0 the certificate is invalid, 1 the certificate is valid
+ */
+int mio_ssl_verify(mio m, const char *id_on_xmppAddr) {
+    time_t expires = 0;
+    std::string cache_key;
+
+    /* sanity checks */
+    if (m == NULL || m->ssl == NULL) {
+        return 0;
+    }
+
+    /* did we verify this certificate already? */
+    cache_key = mio_tls_verify_cache_key(m, id_on_xmppAddr, &expires);
+    if (!cache_key.empty()) {
+        std::map<std::string, mio_tls_verify_entry>::iterator cached =
+            mio_tls_verify_cache.find(cache_key);
+        if (cached != mio_tls_verify_cache.end()) {
+            if (cached->second.expires > time(NULL)) {
+                mio_tls_verify_hits++;
+                mio_tls_verify_lru.splice(mio_tls_verify_lru.end(),
+                                          mio_tls_verify_lru,
+                                          cached->second.lru_position);
+                log_debug2(ZONE, LOGT_AUTH,
+                           "using cached certificate verification for %s: %i",
+                           id_on_xmppAddr, cached->second.result);
+                return cached->second.result;
+            }
+            mio_tls_verify_lru.erase(cached->second.lru_position);
+            mio_tls_verify_cache.erase(cached);
+        }
+        mio_tls_verify_misses++;
+    }
+
+    int result = mio_tls_verify_peer(m, id_on_xmppAddr);
+
+    /* keep the result */
+    if (!cache_key.empty() && expires > time(NULL)) {
+        while (!mio_tls_verify_lru.empty() &&
+               mio_tls_verify_cache.size() >= mio_tls_verify_cache_size) {
+            mio_tls_verify_cache.erase(mio_tls_verify_lru.front());
+            mio_tls_verify_lru.pop_front();
+        }
+        mio_tls_verify_entry &entry = mio_tls_verify_cache[cache_key];
+        entry.result = result;
+        entry.expires = expires;
+        entry.lru_position =
+            mio_tls_verify_lru.insert(mio_tls_verify_lru.end(), cache_key);
+    }
+
+    return result;
+}
+
 /**
  * get some information on what protocols are used inside the TLS layer
  *
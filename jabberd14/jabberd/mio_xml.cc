@@ -120,6 +120,10 @@ static void _mio_xstream_startElement(void *_m, const char *name,
             ns_iri.c_str());
         xmlnode_put_expat_attribs(m->stacknode, attribs, *m->in_stanza);
 
+        /* start tracing stanzas, but not the stream root */
+        if (m->flags.root != 0)
+            trace_begin(p);
+
         /* If the root is 0, this must be the root node.. */
         if (m->flags.root == 0) {
             m->root_lang = pstrdup(m->p, xmlnode_get_lang(m->stacknode));
@@ -224,6 +228,8 @@ static void _mio_xstream_endElement(void *_m, const char *name) {
                 xmlnode_put_attrib_ns(m->stacknode, "lang", "xml", NS_XML,
                                       m->root_lang);
 
+            trace_stamp(xmlnode_pool(m->stacknode), trace_PARSE);
+
             if (m->cb != NULL)
                 (*m->cb)(m, MIO_XML_NODE, m->cb_arg, m->stacknode, NULL, 0);
             else
@@ -407,6 +413,34 @@ void _mio_xml_parser(mio m, const void *vbuf, size_t bufsz) {
             log_debug2(ZONE, LOGT_IO, "handling HTTP-GET path=%s, protocol=%s",
                        request_path.c_str(), request_protocol.c_str());
 
+            // metrics requested on the admin port?
+            if (request_path == "/metrics" && mio__data->metrics_port > 0 &&
+                mio__data->metrics_port == m->our_port) {
+                std::string message = metrics_render();
+
+                std::ostringstream http_result;
+                http_result << (request_protocol == "" ||
+                                        request_protocol == "HTTP/1.0"
+                                    ? "HTTP/1.0"
+                                    : "HTTP/1.1")
+                            << " 200 OK\r\n";
+                http_result << "Server: " PACKAGE " " VERSION "\r\n";
+                http_result << "Connection: close\r\n";
+                http_result << "Content-Length: " << message.length()
+                            << "\r\n";
+                http_result << "Content-Type: text/plain; version=0.0.4; "
+                               "charset=utf-8\r\n";
+                http_result << "\r\n";
+                http_result << message;
+
+                mio_write(m, NULL, http_result.str().c_str(),
+                          http_result.str().length());
+                mio_close(m);
+
+                // we handled the request
+                return;
+            }
+
             // internal mini webserver enabled?
             if (mio__data->webserver_path) {
                 char request_path_copy[1024] = "";
@@ -652,9 +686,11 @@ void mio_xml_reset(mio m) {
  * @param m the connection
  * @param originator 1 if we are the originator, 0 else
  * @param identity identity to use for selecting the certificate
+ * @param peer the domain we expect the peer to be, NULL if unknown
  * @return 0 on success, non-zero on failure
  */
-int mio_xml_starttls(mio m, int originator, const char *identity) {
+int mio_xml_starttls(mio m, int originator, const char *identity,
+                     const char *peer) {
     int result = 0;
 
     /* flush the write queue */
@@ -665,7 +701,7 @@ int mio_xml_starttls(mio m, int originator, const char *identity) {
     }
 
     /* start the TLS layer on the connection */
-    result = mio_ssl_starttls(m, originator, identity);
+    result = mio_ssl_starttls(m, originator, identity, peer);
     if (result != 0) {
         log_debug2(
             ZONE, LOGT_IO,
@@ -98,6 +98,7 @@ typedef struct mtqcall_struct {
     void *arg;          /**< the data for this call */
     mtq q; /**< set if this call is part of a queue, else its an unsyncronized
               call */
+    pool p; /**< memory pool of the job, used for tracing stanzas */
 } _mtqcall, *mtqcall;
 
 typedef struct mtqmaster_struct {
@@ -106,6 +107,11 @@ typedef struct mtqmaster_struct {
                          thread. If set the job is in mp and has to be gotten from
                          there when a thread gets free */
     pth_msgport_t mp; /**< message port, that contains the overlowed jobs */
+    unsigned long jobs;      /**< number of jobs, that have been sent */
+    unsigned long overflows; /**< number of jobs, that had to wait for a free
+                                thread */
+    int overflow_peak; /**< maximum number of jobs, that had to wait at the same
+                          time */
 } * mtqmaster, _mtqmaster;
 
 /**
@@ -116,6 +122,37 @@ typedef struct mtqmaster_struct {
  */
 mtqmaster mtq__master = NULL;
 
+/**
+ * add the metrics of the managed threads
+ *
+ * @param m the metrics to add to
+ * @param arg unused/ignored
+ */
+static void mtq_metrics(metrics m, void *arg) {
+    int busy = 0;
+
+    if (mtq__master == NULL)
+        return;
+
+    for (int n = 0; n < MTQ_THREADS; n++)
+        if (mtq__master->all[n]->busy)
+            busy++;
+
+    metrics_add(m, "jabberd_mtq_threads_busy", "gauge",
+                "Managed threads currently executing a job.", "", busy);
+    metrics_add(m, "jabberd_mtq_jobs_total", "counter",
+                "Jobs sent to the managed threads.", "", mtq__master->jobs);
+    metrics_add(m, "jabberd_mtq_overflows_total", "counter",
+                "Jobs that had to wait for a free managed thread.", "",
+                mtq__master->overflows);
+    metrics_add(m, "jabberd_mtq_overflow_depth", "gauge",
+                "Jobs currently waiting for a free managed thread.", "",
+                pth_msgport_pending(mtq__master->mp));
+    metrics_add(m, "jabberd_mtq_overflow_peak", "gauge",
+                "Maximum number of jobs waiting for a free managed thread.",
+                "", mtq__master->overflow_peak);
+}
+
 /**
  * cleanup a queue when it get's free'd
  */
@@ -223,6 +260,7 @@ static void *mtq_main(void *arg) {
         /* check for a simple "one-off" call */
         if (c->q == NULL) {
             log_debug2(ZONE, LOGT_THREAD, "%X one call %X", t->id, c->arg);
+            trace_stamp(c->p, trace_QUEUE);
             (*(c->f))(c->arg);
             continue;
         }
@@ -233,6 +271,7 @@ static void *mtq_main(void *arg) {
         t->q->t = t;
         while ((c = (mtqcall)pth_msgport_get(t->q->mp)) != NULL) {
             log_debug2(ZONE, LOGT_THREAD, "%X queue call %X", t->id, c->arg);
+            trace_stamp(c->p, trace_QUEUE);
             (*(c->f))(c->arg);
             if (t->q == NULL)
                 break;
@@ -280,7 +319,7 @@ void mtq_send(mtq q, pool p, mtq_callback f, void *arg) {
 
     /* initialization stuff */
     if (mtq__master == NULL) {
-        mtq__master = new _mtqmaster;
+        mtq__master = new _mtqmaster();
         mtq__master->mp = pth_msgport_create("mtq__master");
         for (n = 0; n < MTQ_THREADS; n++) {
             newp = pool_new();
@@ -293,7 +332,9 @@ void mtq_send(mtq q, pool p, mtq_callback f, void *arg) {
             pth_attr_destroy(attr);
             mtq__master->all[n] = t; /* assign it as available */
         }
+        register_metrics(mtq_metrics, NULL);
     }
+    mtq__master->jobs++;
 
     /* find a waiting thread */
     for (n = 0; n < MTQ_THREADS; n++)
@@ -312,12 +353,17 @@ void mtq_send(mtq q, pool p, mtq_callback f, void *arg) {
          * for messages, then it will set this variable to 0 and not
          * check the overflow mp until another item overflows it */
         mtq__master->overflow++;
+        mtq__master->overflows++;
+        if (pth_msgport_pending(mp) >= mtq__master->overflow_peak)
+            mtq__master->overflow_peak = pth_msgport_pending(mp) + 1;
     }
 
     /* track this call */
     c = static_cast<mtqcall>(pmalloco(p, sizeof(_mtqcall)));
     c->f = f;
     c->arg = arg;
+    c->p = p;
+    trace_stamp(p, trace_PROCESS);
 
     /* if we don't have a queue, just send it */
     if (q == NULL) {
@@ -0,0 +1,395 @@
+/*
+ * Copyrights
+ *
+ * Portions created by or assigned to Jabber.com, Inc. are
+ * Copyright (c) 1999-2002 Jabber.com, Inc.  All Rights Reserved.  Contact
+ * information for Jabber.com, Inc. is available at http://www.jabber.com/.
+ *
+ * Portions Copyright (c) 1998-1999 Jeremie Miller.
+ *
+ * Portions Copyright (c) 2006-2007 Matthias Wimmer
+ *
+ * This file is part of jabberd14.
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ */
+
+/**
+ * @file trace.cc
+ * @brief sampled tracing of the latency of stanzas passing the server
+ *
+ * If enabled using the <trace/> element inside the <global/> section of the
+ * configuration file, every n-th stanza read from a connection is traced on its
+ * way through the server. At several points (parsing finished, delivery by the
+ * router, dequeueing in a thread queue, writing to a socket, ...) the
+ * monotonic clock is read and the time passed since the previous point is
+ * accounted to the stage that just finished. Additionally the time spent in
+ * the session manager's module API and waiting for xdb results is timed.
+ *
+ * The trace data is attached to the memory pool of the stanza. As the same
+ * pool is used by the xmlnode, the ::dpacket and the jpacket built for a
+ * stanza, the trace follows the stanza across components without the need of
+ * changing these structures. The trace is finished, when the pool gets freed.
+ *
+ * The times are collected in log-linear histograms (eight sub-buckets for each
+ * power of two, similar to HDR histograms), which are logged periodically
+ * using log_record() and can be dumped on demand by sending SIGUSR2 to the
+ * server.
+ *
+ * If tracing is disabled, the instrumentation points only check the global
+ * ::trace__sample variable.
+ */
+
+#include "jabberd.h"
+
+#include <namespaces.hh>
+
+#include <time.h>
+
+extern xmlnode greymatter__;
+
+/** number of buckets with exact values */
+#define TRACE_LINEAR 16
+
+/** number of sub-buckets for each power of two */
+#define TRACE_SUB 8
+
+/** total number of buckets in a histogram */
+#define TRACE_BUCKETS (TRACE_LINEAR + (64 - 4) * TRACE_SUB)
+
+/**
+ * sample every n-th stanza (0 if tracing is disabled)
+ */
+int trace__sample = 0;
+
+/**
+ * histogram of the latencies of one stage
+ */
+typedef struct {
+    unsigned long long count; /**< number of values in the histogram */
+    unsigned long long sum;   /**< sum of all values (microseconds) */
+    unsigned long long max;   /**< maximum value (microseconds) */
+    unsigned long long buckets[TRACE_BUCKETS]; /**< the buckets */
+} _trace_histogram, *trace_histogram;
+
+/**
+ * state of a stanza, that is currently traced
+ */
+typedef struct {
+    unsigned long long start; /**< when the stanza has been started to read */
+    unsigned long long last;  /**< when the last stage has been finished */
+} _trace_entry;
+
+/** names of the stages, as used for logging */
+static char const *trace__names[trace_STAGES] = {
+    "parse", "process", "route", "queue", "mapi", "xdb", "write", "total"};
+
+/** histograms since the last periodic log record */
+static _trace_histogram trace__stats[trace_STAGES];
+
+/** stanzas that are currently traced, keyed by their memory pool */
+static std::map<pool, _trace_entry> trace__active;
+
+/** counter used for sampling stanzas */
+static unsigned long trace__counter = 0;
+
+/** counter used for sampling operations not related to a stanza, kept apart
+ * so that they do not shift which stanzas get sampled */
+static unsigned long trace__timer_counter = 0;
+
+/** interval of periodic log records in seconds (0 to disable) */
+static int trace__interval = 0;
+
+/** if the heartbeat for periodic log records has already been registered */
+static int trace__beat_registered = 0;
+
+/** seconds since the last periodic log record */
+static int trace__elapsed = 0;
+
+/**
+ * get the current time of the monotonic clock
+ *
+ * @return time in microseconds
+ */
+static unsigned long long _trace_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<unsigned long long>(ts.tv_sec) * 1000000ULL +
+           ts.tv_nsec / 1000;
+}
+
+/**
+ * get the index of the bucket for a value
+ *
+ * @param value the value to get the bucket for
+ * @return index of the bucket
+ */
+static int _trace_bucket(unsigned long long value) {
+    int msb = 0;
+
+    if (value < TRACE_LINEAR)
+        return value;
+
+    msb = 63 - __builtin_clzll(value);
+    return TRACE_LINEAR + (msb - 4) * TRACE_SUB +
+           ((value >> (msb - 3)) & (TRACE_SUB - 1));
+}
+
+/**
+ * get the highest value, that is counted in a bucket
+ *
+ * @param bucket index of the bucket
+ * @return highest value of this bucket
+ */
+static unsigned long long _trace_bucket_value(int bucket) {
+    int msb = 0;
+    int sub = 0;
+
+    if (bucket < TRACE_LINEAR)
+        return bucket;
+
+    msb = (bucket - TRACE_LINEAR) / TRACE_SUB + 4;
+    sub = (bucket - TRACE_LINEAR) % TRACE_SUB;
+    return (static_cast<unsigned long long>(TRACE_SUB + sub + 1)
+            << (msb - 3)) -
+           1;
+}
+
+/**
+ * account a latency value to a stage
+ *
+ * @param stage the stage to account the value to
+ * @param usec the latency in microseconds
+ */
+static void _trace_record(trace_stage stage, unsigned long long usec) {
+    trace_histogram h = &trace__stats[stage];
+
+    h->count++;
+    h->sum += usec;
+    if (usec > h->max)
+        h->max = usec;
+    h->buckets[_trace_bucket(usec)]++;
+}
+
+/**
+ * get a percentile of a histogram
+ *
+ * @param h the histogram
+ * @param permille which percentile to get (in 1/1000)
+ * @return upper bound of the bucket containing the percentile
+ */
+static unsigned long long _trace_percentile(trace_histogram h, int permille) {
+    unsigned long long wanted = (h->count * permille + 999) / 1000;
+    unsigned long long seen = 0;
+
+    for (int bucket = 0; bucket < TRACE_BUCKETS; bucket++) {
+        seen += h->buckets[bucket];
+        if (seen >= wanted && seen > 0) {
+            unsigned long long value = _trace_bucket_value(bucket);
+            return value > h->max ? h->max : value;
+        }
+    }
+    return h->max;
+}
+
+/**
+ * log the collected histograms
+ *
+ * @param action the action to use in the log records
+ */
+static void _trace_log(char const *action) {
+    for (int stage = 0; stage < trace_STAGES; stage++) {
+        trace_histogram h = &trace__stats[stage];
+
+        if (h->count == 0)
+            continue;
+
+        log_record("trace", trace__names[stage], action,
+                   "n=%llu avg=%llu p50=%llu p90=%llu p99=%llu p999=%llu "
+                   "max=%llu (usec), %u in flight",
+                   h->count, h->sum / h->count, _trace_percentile(h, 500),
+                   _trace_percentile(h, 900), _trace_percentile(h, 990),
+                   _trace_percentile(h, 999), h->max,
+                   static_cast<unsigned>(trace__active.size()));
+    }
+}
+
+/**
+ * heartbeat writing the periodic log records and resetting the histograms
+ *
+ * The beat is called every second and checks the configured interval itself,
+ * so that a changed interval is used after the configuration got reloaded.
+ *
+ * @param arg unused/ignored
+ * @return always r_DONE
+ */
+static result _trace_beat(void *arg) {
+    if (trace__sample == 0 || trace__interval <= 0)
+        return r_DONE;
+
+    if (++trace__elapsed < trace__interval)
+        return r_DONE;
+    trace__elapsed = 0;
+
+    _trace_log("periodic");
+    memset(trace__stats, 0, sizeof(trace__stats));
+    return r_DONE;
+}
+
+/**
+ * finish the trace of a stanza when its memory pool gets freed
+ *
+ * @param arg the memory pool of the stanza
+ */
+static void _trace_finish(void *arg) {
+    std::map<pool, _trace_entry>::iterator entry =
+        trace__active.find(static_cast<pool>(arg));
+
+    if (entry == trace__active.end())
+        return;
+
+    _trace_record(trace_TOTAL, _trace_now() - entry->second.start);
+    trace__active.erase(entry);
+}
+
+/**
+ * read the tracing configuration
+ *
+ * The configuration is read from the <trace/> element inside the <global/>
+ * section of the configuration file. Its attributes are 'sample' (trace every
+ * n-th stanza) and 'interval' (seconds between periodic log records).
+ */
+void trace_init(void) {
+    xht namespaces = NULL;
+    xmlnode trace = NULL;
+    char const *value = NULL;
+
+    namespaces = xhash_new(3);
+    xhash_put(namespaces, "", const_cast<char *>(NS_JABBERD_CONFIGFILE));
+    trace = xmlnode_get_list_item(
+        xmlnode_get_tags(greymatter__, "global/trace", namespaces), 0);
+    xhash_free(namespaces);
+
+    trace__sample = 0;
+    if (trace == NULL)
+        return;
+
+    value = xmlnode_get_attrib_ns(trace, "sample", NULL);
+    trace__sample = j_atoi(value, 100);
+    if (trace__sample < 0)
+        trace__sample = 0;
+
+    value = xmlnode_get_attrib_ns(trace, "interval", NULL);
+    trace__interval = j_atoi(value, 300);
+
+    trace__elapsed = 0;
+    if (trace__sample > 0 && trace__interval > 0 && !trace__beat_registered) {
+        register_beat(1, _trace_beat, NULL);
+        trace__beat_registered = 1;
+    }
+
+    log_notice(NULL, "tracing every %i. stanza, logging every %i seconds",
+               trace__sample, trace__interval);
+}
+
+/**
+ * start tracing a stanza (if it is selected by sampling)
+ *
+ * Do not call directly, use trace_begin() which checks if tracing is enabled.
+ *
+ * @param p memory pool of the stanza
+ */
+void _trace_begin(pool p) {
+    _trace_entry entry;
+
+    if (p == NULL || trace__sample <= 0)
+        return;
+    if (++trace__counter % trace__sample != 0)
+        return;
+
+    entry.start = entry.last = _trace_now();
+    trace__active[p] = entry;
+    pool_cleanup(p, _trace_finish, p);
+}
+
+/**
+ * mark that a stage has been finished for a stanza
+ *
+ * Do not call directly, use trace_stamp() which checks if tracing is enabled.
+ *
+ * @param p memory pool of the stanza
+ * @param stage the stage, that has been finished
+ */
+void _trace_stamp(pool p, trace_stage stage) {
+    std::map<pool, _trace_entry>::iterator entry = trace__active.find(p);
+    unsigned long long now = 0;
+
+    if (entry == trace__active.end())
+        return;
+
+    now = _trace_now();
+    _trace_record(stage, now - entry->second.last);
+    entry->second.last = now;
+}
+
+/**
+ * start timing an operation, that is accounted to a stage on its own
+ *
+ * @param p memory pool of the stanza the operation is done for, NULL if the
+ * operation is not related to a stanza and should be selected by sampling
+ * @return start time, 0 if the operation should not be timed
+ */
+unsigned long long _trace_timer(pool p) {
+    if (trace__sample <= 0)
+        return 0;
+
+    if (p == NULL) {
+        if (++trace__timer_counter % trace__sample != 0)
+            return 0;
+    } else if (trace__active.find(p) == trace__active.end()) {
+        return 0;
+    }
+
+    return _trace_now();
+}
+
+/**
+ * finish timing an operation
+ *
+ * @param start the value returned by _trace_timer()
+ * @param stage the stage to account the time to
+ */
+void _trace_timer_done(unsigned long long start, trace_stage stage) {
+    if (start == 0)
+        return;
+
+    _trace_record(stage, _trace_now() - start);
+}
+
+/**
+ * log the histograms collected since the last periodic log record, without
+ * resetting them
+ */
+void trace_dump(void) {
+    if (trace__sample == 0) {
+        log_notice(NULL, "tracing is disabled, nothing to dump");
+        return;
+    }
+
+    _trace_log("dump");
+}
@@ -37,6 +37,41 @@
 
 #include <namespaces.hh>
 
+static unsigned long xdb__requests = 0; /**< number of xdb requests sent */
+static unsigned long xdb__resends = 0;  /**< number of resent xdb requests */
+static unsigned long xdb__timeouts = 0; /**< requests that timed out */
+static int xdb__pending = 0; /**< requests currently waiting for a result */
+static unsigned long long xdb__wait_usec =
+    0; /**< accumulated time waiting for results */
+static unsigned long xdb__waits =
+    0; /**< number of finished waits added to xdb__wait_usec */
+
+/**
+ * add the metrics of xdb requests
+ *
+ * @param m the metrics to add to
+ * @param arg unused/ignored
+ */
+static void xdb_metrics(metrics m, void *arg) {
+    metrics_add(m, "jabberd_xdb_requests_total", "counter",
+                "Xdb requests sent by components.", "", xdb__requests);
+    metrics_add(m, "jabberd_xdb_resends_total", "counter",
+                "Xdb requests resent because of a missing result.", "",
+                xdb__resends);
+    metrics_add(m, "jabberd_xdb_timeouts_total", "counter",
+                "Xdb requests that did not get a result.", "", xdb__timeouts);
+    metrics_add(m, "jabberd_xdb_pending", "gauge",
+                "Xdb requests currently waiting for a result.", "",
+                xdb__pending);
+    metrics_add(m, "jabberd_xdb_wait_seconds_total", "counter",
+                "Time spent waiting for xdb results.", "",
+                xdb__wait_usec / 1000000.0);
+    metrics_add(m, "jabberd_xdb_waits_total", "counter",
+                "Xdb requests that finished waiting for a result, to average "
+                "jabberd_xdb_wait_seconds_total.",
+                "", xdb__waits);
+}
+
 /**
  * ::o_PRECOND packet handler that filters the packets incoming for the instance
  * to look for xdb packets
@@ -171,6 +206,7 @@ static result xdb_thump(void *arg) {
 
             /* make sure it's null as a flag for xdb_set's */
             cur->data = NULL;
+            xdb__timeouts++;
 
             /* free the thread! */
             if (cur->preblock) {
@@ -183,8 +219,10 @@ static result xdb_thump(void *arg) {
         }
 
         /* resend the waiting ones every so often */
-        if ((now - cur->sent) > 10)
+        if ((now - cur->sent) > 10) {
             xdb_deliver(xc->i, cur);
+            xdb__resends++;
+        }
 
         /* cur could have been free'd already on it's thread */
         cur = next;
@@ -207,6 +245,7 @@ static result xdb_thump(void *arg) {
  */
 xdbcache xdb_cache(instance id) {
     xdbcache newx;
+    static bool metrics_registered = false;
 
     // sanity check
     if (id == NULL) {
@@ -227,6 +266,11 @@ xdbcache xdb_cache(instance id) {
     /* heartbeat to keep a watchful eye on xdb_cache */
     register_beat(10, xdb_thump, (void *)newx);
 
+    if (!metrics_registered) {
+        register_metrics(xdb_metrics, NULL);
+        metrics_registered = true;
+    }
+
     return newx;
 }
 
@@ -242,6 +286,8 @@ xdbcache xdb_cache(instance id) {
  */
 xmlnode xdb_get(xdbcache xc, jid owner, const char *ns) {
     _xdbcache newx;
+    unsigned long long timer = 0;
+    unsigned long long started = 0;
     xmlnode x;
     /* pth_cond_t cond = PTH_COND_INIT; */
 
@@ -270,6 +316,10 @@ xmlnode xdb_get(xdbcache xc, jid owner, const char *ns) {
     xc->next = &newx;
 
     /* send it on it's way, holding the lock */
+    timer = trace_timer(NULL);
+    started = metrics_now();
+    xdb__requests++;
+    xdb__pending++;
     xdb_deliver(xc->i, &newx);
 
     log_debug2(ZONE, LOGT_STORAGE | LOGT_THREAD, "xdb_get() waiting for %s %s",
@@ -277,6 +327,10 @@ xmlnode xdb_get(xdbcache xc, jid owner, const char *ns) {
     if (newx.preblock)
         pth_cond_await(&(newx.cond), &(xc->mutex), NULL); /* blocks thread */
     pth_mutex_release(&(xc->mutex));
+    trace_timer_done(timer, trace_XDB);
+    xdb__pending--;
+    xdb__wait_usec += metrics_now() - started;
+    xdb__waits++;
 
     /* we got signalled */
     log_debug2(ZONE, LOGT_STORAGE | LOGT_THREAD,
@@ -308,6 +362,8 @@ static int _xdb_act(xdbcache xc, jid owner, const char *ns, char const *act,
                     char const *match, char const *matchpath, xht namespaces,
                     xmlnode data) {
     _xdbcache newx;
+    unsigned long long timer = 0;
+    unsigned long long started = 0;
 
     if (xc == NULL || owner == NULL || ns == NULL) {
         fprintf(stderr, "Programming Error: xdb_set() called with NULL\n");
@@ -338,6 +394,10 @@ static int _xdb_act(xdbcache xc, jid owner, const char *ns, char const *act,
     xc->next = &newx;
 
     /* send it on it's way */
+    timer = trace_timer(NULL);
+    started = metrics_now();
+    xdb__requests++;
+    xdb__pending++;
     xdb_deliver(xc->i, &newx);
 
     /* wait for the condition var */
@@ -347,6 +407,10 @@ static int _xdb_act(xdbcache xc, jid owner, const char *ns, char const *act,
     if (newx.preblock)
         pth_cond_await(&(newx.cond), &(xc->mutex), NULL); /* blocks thread */
     pth_mutex_release(&(xc->mutex));
+    trace_timer_done(timer, trace_XDB);
+    xdb__pending--;
+    xdb__wait_usec += metrics_now() - started;
+    xdb__waits++;
 
     /* we got signalled */
     log_debug2(ZONE, LOGT_STORAGE | LOGT_THREAD,
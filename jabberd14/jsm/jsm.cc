@@ -350,6 +350,9 @@ extern "C" void jsm(instance i, xmlnode x) {
                          60),
                   js_users_gc, (void *)si);
 
+    /* export statistics about users and sessions */
+    register_metrics(js_users_metrics, (void *)si);
+
     /* free the configuration xmlnode */
     xmlnode_free(config);
 }
@@ -565,6 +565,11 @@ struct jsmi_struct {
     char *statefile;  /**< to which file to store serialization data */
     char *auth; /**< forward authentication request to this component, if not
                    NULL */
+    long users_loaded;   /**< number of users currently loaded */
+    long sessions_count; /**< number of sessions currently existing */
+    class js_users_statistics
+        *users_stats; /**< memory statistics of the users and sessions, as
+                         collected by the last js_users_gc() run */
 };
 
 /** User data structure/list. See js_user(). */
@@ -648,10 +653,12 @@ session js_session_primary(udata user);
 void js_session_to(session s, jpacket p);
 void js_session_from(session s, jpacket p);
 void js_session_free_aux_data(void *arg);
+void js_session_count(session s);
 
 void js_server_main(void *arg);
 void js_offline_main(void *arg);
 result js_users_gc(void *arg);
+void js_users_metrics(metrics m, void *arg);
 
 /** structure used to pass a session manager instance and a packet using only
  * one pointer */
@@ -214,6 +214,7 @@ int js_mapi_call2(jsmi si, event e, jpacket packet, udata user, session s,
                   xmlnode serialization_node) {
     mlist l;
     _mapi m; /* mapi structure to be passed to the call back */
+    unsigned long long timer = packet != NULL ? trace_timer(packet->p) : 0;
 
     log_debug2(ZONE, LOGT_EXECFLOW, "mapi_call %d", e);
 
@@ -252,6 +253,7 @@ int js_mapi_call2(jsmi si, event e, jpacket packet, udata user, session s,
             /* this module handled the packet */
             case M_HANDLED:
                 _js_mapi_process_additional_result(&m);
+                trace_timer_done(timer, trace_MAPI);
                 return 1;
             default:;
         }
@@ -259,6 +261,8 @@ int js_mapi_call2(jsmi si, event e, jpacket packet, udata user, session s,
 
     log_debug2(ZONE, LOGT_EXECFLOW, "mapi_call returning unhandled");
 
+    trace_timer_done(timer, trace_MAPI);
+
     /* did the modules generate a co-generated result? */
     if (_js_mapi_process_additional_result(&m)) {
         xmlnode_free(m.packet->x);
@@ -247,6 +247,7 @@ static void _jsm_deserialize_session(jsmi si, const jid user_jid,
     /* create aux_data hash */
     s->aux_data = xhash_new(17);
     pool_cleanup(s->p, js_session_free_aux_data, s);
+    js_session_count(s);
 
     s->id = jid_new(p, jid_full(user_jid));
     jid_set(s->id, resource, JID_RESOURCE);
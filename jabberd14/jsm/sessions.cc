@@ -147,6 +147,25 @@ static void _js_create_session_id(char resultbuffer[9], xht existing_sessions) {
     }
 }
 
+/**
+ * decrement the number of existing sessions, when a session is freed
+ *
+ * @param arg the session manager instance
+ */
+static void js_session_uncount(void *arg) {
+    static_cast<jsmi>(arg)->sessions_count--;
+}
+
+/**
+ * count a new session, until its memory pool gets freed
+ *
+ * @param s the new session
+ */
+void js_session_count(session s) {
+    s->si->sessions_count++;
+    pool_cleanup(s->p, js_session_uncount, s->si);
+}
+
 /**
  * delete the aux hash if a session structure is freed
  */
@@ -199,6 +218,7 @@ session js_session_new(jsmi si, dpacket dp) {
     /* create aux_data hash */
     s->aux_data = xhash_new(17);
     pool_cleanup(s->p, js_session_free_aux_data, s);
+    js_session_count(s);
 
     /* save authorative remote session id */
     s->sid = jid_new(p, xmlnode_get_attrib_ns(dp->x, "from", NULL));
@@ -304,6 +324,7 @@ session js_sc_session_new(jsmi si, dpacket dp, xmlnode sc_session) {
     /* create aux_data hash */
     s->aux_data = xhash_new(17);
     pool_cleanup(s->p, js_session_free_aux_data, s);
+    js_session_count(s);
 
     s->id = user_id;
     s->res = pstrdup(s->p, user_id->get_resource().c_str());
@@ -40,14 +40,51 @@
  * anymore and the function to load user records to memory.
  */
 
+/**
+ * memory statistics about the users and sessions of a session manager
+ * instance
+ *
+ * They are collected while js_users_gc() walks the users anyway, and
+ * reported until the next run.
+ */
+class js_users_statistics {
+  private:
+    int hosts;
+
+    size_t users_pool_sum;
+    size_t biggest_user_pool;
+
+    size_t sessions_pool_sum;
+    size_t biggest_session_pool;
+
+    void updateSession(session s);
+
+  public:
+    js_users_statistics();
+    void hostUpdate();
+    void updateUser(udata user);
+    void addMetrics(metrics m, std::string const &labels);
+};
+
 /**
  * structure used to pass a hashtable and a counter to _js_users_del()
  */
 typedef struct ht_count_struct {
     xht ht;     /**< hashtable containing the users of a host */
     int *count; /**< reference to the counter for the number of online users */
+    js_users_statistics
+        *stats; /**< statistics collected for the users, that are kept */
 } * ht_count, _ht_count;
 
+/**
+ * structure used to pass the user counter and the statistics to
+ * _js_hosts_del()
+ */
+typedef struct gc_walk_struct {
+    int count;                  /**< number of online users */
+    js_users_statistics *stats; /**< statistics collected during the walk */
+} _gc_walk, *gc_walk;
+
 /**
  * call-back for deleting user from the hash table
  *
@@ -68,8 +105,10 @@ void _js_users_del(xht h, const char *key, void *data, void *arg) {
      * is positive, or if there are active sessions
      * we can't free it, so return immediately
      */
-    if (u->ref > 0 || (u->sessions != NULL && ++*(htc->count)))
+    if (u->ref > 0 || (u->sessions != NULL && ++*(htc->count))) {
+        htc->stats->updateUser(u);
         return;
+    }
 
     log_debug2(ZONE, LOGT_SESSION, "freeing %s", u->id->get_node().c_str());
 
@@ -83,71 +122,45 @@ void _js_users_del(xht h, const char *key, void *data, void *arg) {
  * @param h the hash table containing all hosts
  * @param key the host for which the callback ist called
  * @param data the hashtable containing the users of this host
- * @param arg pointer to the user counter
+ * @param arg pointer to the ::_gc_walk structure
  */
 void _js_hosts_del(xht h, const char *key, void *data, void *arg) {
+    gc_walk walk = static_cast<gc_walk>(arg);
     _ht_count htc;
     htc.ht = (xht)data;
-    htc.count = (int *)arg;
+    htc.count = &walk->count;
+    htc.stats = walk->stats;
+
+    walk->stats->hostUpdate();
 
     log_debug2(ZONE, LOGT_SESSION, "checking users for host %s", (char *)key);
 
     xhash_walk(htc.ht, _js_users_del, &htc);
 }
 
-#ifdef POOL_DEBUG
-class js_pool_debug_stats {
-  private:
-    int hosts;
+js_users_statistics::js_users_statistics()
+    : hosts(0), users_pool_sum(0), biggest_user_pool(0), sessions_pool_sum(0),
+      biggest_session_pool(0) {}
 
-    int users;
-    size_t users_pool_sum;
-    size_t biggest_user_pool;
-    std::string biggest_user;
-
-    int sessions;
-    size_t sessions_pool_sum;
-    size_t biggest_session_pool;
-    std::string biggest_session;
-
-    void updateSession(session s);
-
-  public:
-    js_pool_debug_stats();
-    void hostUpdate();
-    void updateUser(udata user);
-    std::string getSummary();
-};
-
-js_pool_debug_stats::js_pool_debug_stats()
-    : hosts(0), users(0), users_pool_sum(0), biggest_user_pool(0), sessions(0),
-      sessions_pool_sum(0), biggest_session_pool(0) {}
-
-void js_pool_debug_stats::hostUpdate() { hosts++; }
-
-void js_pool_debug_stats::updateSession(session s) {
-    sessions++;
+void js_users_statistics::hostUpdate() { hosts++; }
 
+void js_users_statistics::updateSession(session s) {
     size_t session_pool_size = pool_size(s->p);
 
     sessions_pool_sum += session_pool_size;
 
     if (session_pool_size > biggest_session_pool) {
         biggest_session_pool = session_pool_size;
-        biggest_session = jid_full(s->id);
     }
 }
 
-void js_pool_debug_stats::updateUser(udata user) {
-    users++;
-
+void js_users_statistics::updateUser(udata user) {
     size_t user_pool_size = pool_size(user->p);
 
     users_pool_sum += user_pool_size;
 
     if (user_pool_size > biggest_user_pool) {
         biggest_user_pool = user_pool_size;
-        biggest_user = jid_full(user->id);
     }
 
     session iter = user->sessions;
@@ -157,47 +170,56 @@ void js_pool_debug_stats::updateUser(udata user) {
     }
 }
 
-std::string js_pool_debug_stats::getSummary() {
-    std::ostringstream result;
-
-    result << "hosts: " << hosts << " / users: " << users << " "
-           << users_pool_sum << " / biggest user: " << biggest_user << " "
-           << biggest_user_pool;
-    result << " / sessions: " << sessions << " " << sessions_pool_sum
-           << " / biggest session: " << biggest_session << " "
-           << biggest_session_pool;
-
-    return result.str();
+void js_users_statistics::addMetrics(metrics m, std::string const &labels) {
+    metrics_add(m, "jsm_hosts", "gauge",
+                "Hosts handled by a session manager.", labels, hosts);
+    metrics_add(m, "jsm_users_pool_bytes", "gauge",
+                "Size of the memory pools of all loaded users.", labels,
+                users_pool_sum);
+    metrics_add(m, "jsm_user_pool_bytes_max", "gauge",
+                "Size of the biggest memory pool of a loaded user.", labels,
+                biggest_user_pool);
+    metrics_add(m, "jsm_sessions_pool_bytes", "gauge",
+                "Size of the memory pools of all sessions.", labels,
+                sessions_pool_sum);
+    metrics_add(m, "jsm_session_pool_bytes_max", "gauge",
+                "Size of the biggest memory pool of a session.", labels,
+                biggest_session_pool);
 }
 
-static void js_users_pool_debug_walk(xht hash, const char *key, void *value,
-                                     void *arg) {
-    js_pool_debug_stats *stats = static_cast<js_pool_debug_stats *>(arg);
-    udata user = static_cast<udata>(value);
-
-    // sanity check
-    if (stats == NULL || user == NULL) {
-        return;
-    }
-
-    stats->updateUser(user);
+/**
+ * add the metrics about the users and sessions of a session manager instance
+ *
+ * @param m the metrics to add to
+ * @param arg the session manager internal data
+ */
+void js_users_metrics(metrics m, void *arg) {
+    jsmi si = (jsmi)arg;
+    std::string labels = metrics_label("instance", si->i->id);
+
+    /* counted when users and sessions are created and freed, no need to walk
+     * them on each request */
+    metrics_add(m, "jsm_users", "gauge", "Users loaded by a session manager.",
+                labels, si->users_loaded);
+    metrics_add(m, "jsm_sessions", "gauge",
+                "Sessions handled by a session manager.", labels,
+                si->sessions_count);
+
+    if (si->users_stats != NULL)
+        si->users_stats->addMetrics(m, labels);
 }
 
-static void js_hosts_pool_debug_walk(xht hash, const char *key, void *value,
-                                     void *arg) {
-    js_pool_debug_stats *stats = static_cast<js_pool_debug_stats *>(arg);
-    xht users = static_cast<xht>(value);
-
-    // sanity check
-    if (stats == NULL || users == NULL) {
-        return;
-    }
-
-    stats->hostUpdate();
+/**
+ * free the statistics collected by js_users_gc()
+ *
+ * @param arg pointer to the jsmi_struct::users_stats member
+ */
+static void js_users_statistics_free(void *arg) {
+    js_users_statistics **stats = static_cast<js_users_statistics **>(arg);
 
-    xhash_walk(users, js_users_pool_debug_walk, stats);
+    delete *stats;
+    *stats = NULL;
 }
-#endif
 
 /**
  *  js_users_gc is a heartbeat that flushes old users from memory.
@@ -208,25 +230,29 @@ static void js_hosts_pool_debug_walk(xht hash, const char *key, void *value,
 result js_users_gc(void *arg) {
     jsmi si = (jsmi)arg;
 
-    /* free user struct if we can */
-    int js__usercount = 0;
-    xhash_walk(si->hosts, _js_hosts_del, &js__usercount);
-    log_debug2(ZONE, LOGT_STATUS, "%d\ttotal users", js__usercount);
-
-#ifdef POOL_DEBUG
-    js_pool_debug_stats *stats = new js_pool_debug_stats;
-    xhash_walk(si->hosts, js_hosts_pool_debug_walk, stats);
-    static char own_pid[32] = "";
-    if (own_pid[0] == '\0') {
-        snprintf(own_pid, sizeof(own_pid), "%i jsm_pool_debug", getpid());
-    }
-    log_notice(own_pid, "%s", stats->getSummary().c_str());
-    delete stats;
-#endif
+    /* free user struct if we can, and collect the statistics of the others */
+    _gc_walk walk;
+    walk.count = 0;
+    walk.stats = new js_users_statistics();
+    xhash_walk(si->hosts, _js_hosts_del, &walk);
+    log_debug2(ZONE, LOGT_STATUS, "%d\ttotal users", walk.count);
+
+    if (si->users_stats == NULL)
+        pool_cleanup(si->p, js_users_statistics_free, &si->users_stats);
+    else
+        delete si->users_stats;
+    si->users_stats = walk.stats;
 
     return r_DONE;
 }
 
+/**
+ * decrement the number of loaded users, when a user is freed
+ *
+ * @param arg the session manager instance
+ */
+static void js_user_uncount(void *arg) { static_cast<jsmi>(arg)->users_loaded--; }
+
 void js_user_free_aux_data(void *arg) {
     xht aux_data = (xht)arg;
 
@@ -301,6 +327,8 @@ udata js_user(jsmi si, jid id, xht ht) {
     newu->si = si;
     newu->aux_data = xhash_new(17);
     pool_cleanup(p, js_user_free_aux_data, newu->aux_data);
+    si->users_loaded++;
+    pool_cleanup(p, js_user_uncount, si);
     newu->id = jid_new(p, jid_full(uid));
     if (x)
         xmlnode_free(x);
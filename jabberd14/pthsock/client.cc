@@ -485,8 +485,8 @@ static void pthsock_client_read(mio m, int flag, void *arg, xmlnode x,
 
                         /* start TLS on this connection */
                         if (mio_xml_starttls(
-                                m, 0, cd->session_id->get_domain().c_str()) !=
-                            0) {
+                                m, 0, cd->session_id->get_domain().c_str(),
+                                NULL) != 0) {
                             /* starttls failed */
                             mio_close(m);
                         }
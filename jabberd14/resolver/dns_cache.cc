@@ -0,0 +1,204 @@
+/*
+ * Copyrights
+ *
+ * Copyright (c) 2008/2009 Matthias Wimmer
+ *
+ * This file is part of jabberd14.
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ */
+
+/**
+ * @file dns_cache.cc
+ * @brief cache for DNS results of the resolver
+ *
+ * Results of SRV, AAAA and A queries are cached for their TTL, so that most
+ * destinations can be resolved without asking the lwresd again.
+ */
+
+#include <resolver.h>
+
+namespace xmppd {
+namespace resolver {
+dns_cache::dns_cache()
+    : hits(0), misses(0), max_entries(1000), min_ttl(60), max_ttl(86400),
+      negative_ttl(300), failure_ttl(30) {}
+
+void dns_cache::configure(size_t max_entries, uint32_t min_ttl,
+                          uint32_t max_ttl, uint32_t negative_ttl,
+                          uint32_t failure_ttl) {
+    this->max_entries = max_entries;
+    this->min_ttl = min_ttl;
+    this->max_ttl = max_ttl < min_ttl ? min_ttl : max_ttl;
+    this->negative_ttl = negative_ttl;
+    this->failure_ttl = failure_ttl;
+
+    // drop entries exceeding the new size
+    while (entries.size() > max_entries) {
+        entries.erase(lru.front());
+        lru.pop_front();
+    }
+}
+
+std::string dns_cache::make_key(std::string const &name, ::ns_type type) {
+    std::ostringstream key;
+    key << type << ' ' << Glib::ustring(name).lowercase();
+    return key.str();
+}
+
+std::pair<std::string, ::ns_type>
+dns_cache::split_key(std::string const &key) {
+    std::string::size_type space = key.find(' ');
+    int type = 0;
+    std::istringstream type_stream(key.substr(0, space));
+    type_stream >> type;
+
+    return std::pair<std::string, ::ns_type>(key.substr(space + 1),
+                                             static_cast<::ns_type>(type));
+}
+
+void dns_cache::store(std::string const &name, ::ns_type type,
+                      xmppd::lwresc::lwresult const &result) {
+    if (max_entries == 0)
+        return;
+
+    dns_cache_entry new_entry;
+    new_entry.negative = true;
+    new_entry.hits = 0;
+
+    switch (result.getResult()) {
+        case xmppd::lwresc::lwresult::res_success: {
+            xmppd::lwresc::lwresult_rrset const *rrSet =
+                dynamic_cast<xmppd::lwresc::lwresult_rrset const *>(
+                    result.getRData());
+            if (rrSet == NULL) {
+                return;
+            }
+
+            std::vector<xmppd::lwresc::rrecord *> rrs = rrSet->getRR();
+            for (std::vector<xmppd::lwresc::rrecord *>::const_iterator p =
+                     rrs.begin();
+                 p != rrs.end(); ++p) {
+                dns_cache_record record;
+                record.prio = 0;
+                record.weight = 0;
+                record.port = 0;
+
+                if (xmppd::lwresc::srv_record const *rr =
+                        dynamic_cast<xmppd::lwresc::srv_record const *>(*p)) {
+                    record.target = rr->getDName();
+                    record.prio = rr->getPrio();
+                    record.weight = rr->getWeight();
+                    record.port = rr->getPort();
+                } else if (xmppd::lwresc::aaaa_record const *rr =
+                               dynamic_cast<xmppd::lwresc::aaaa_record const *>(
+                                   *p)) {
+                    record.target = rr->getAddress();
+                } else if (xmppd::lwresc::a_record const *rr =
+                               dynamic_cast<xmppd::lwresc::a_record const *>(
+                                   *p)) {
+                    record.target = rr->getAddress();
+                } else {
+                    continue;
+                }
+                new_entry.records.push_back(record);
+            }
+
+            new_entry.negative = new_entry.records.empty();
+            new_entry.ttl = rrSet->getTTL();
+            if (new_entry.ttl < min_ttl)
+                new_entry.ttl = min_ttl;
+            if (new_entry.ttl > max_ttl)
+                new_entry.ttl = max_ttl;
+            break;
+        }
+        case xmppd::lwresc::lwresult::res_notfound:
+        case xmppd::lwresc::lwresult::res_typenotfound:
+            new_entry.ttl = negative_ttl;
+            break;
+        default:
+            new_entry.ttl = failure_ttl;
+    }
+
+    if (new_entry.ttl == 0)
+        return;
+    new_entry.expires = std::time(NULL) + new_entry.ttl;
+
+    // replace an existing entry, or make room for a new one
+    std::string key = make_key(name, type);
+    std::map<std::string, dns_cache_entry>::iterator existing =
+        entries.find(key);
+    if (existing != entries.end()) {
+        lru.erase(existing->second.lru_position);
+        entries.erase(existing);
+    } else if (entries.size() >= max_entries) {
+        entries.erase(lru.front());
+        lru.pop_front();
+    }
+
+    new_entry.lru_position = lru.insert(lru.end(), key);
+    entries[key] = new_entry;
+}
+
+dns_cache_entry const *dns_cache::lookup(std::string const &name,
+                                         ::ns_type type) {
+    std::map<std::string, dns_cache_entry>::iterator entry =
+        entries.find(make_key(name, type));
+
+    if (entry == entries.end()) {
+        misses++;
+        return NULL;
+    }
+
+    // expired?
+    if (entry->second.expires <= std::time(NULL)) {
+        lru.erase(entry->second.lru_position);
+        entries.erase(entry);
+        misses++;
+        return NULL;
+    }
+
+    // mark as recently used
+    lru.splice(lru.end(), lru, entry->second.lru_position);
+    entry->second.hits++;
+    hits++;
+
+    return &(entry->second);
+}
+
+std::list<std::pair<std::string, ::ns_type>>
+dns_cache::get_refresh_candidates(time_t within) {
+    std::list<std::pair<std::string, ::ns_type>> result;
+    time_t now = std::time(NULL);
+
+    for (std::map<std::string, dns_cache_entry>::iterator p = entries.begin();
+         p != entries.end(); ++p) {
+        // only refresh entries, that have been used, and only once
+        if (p->second.hits == 0 || p->second.expires <= now ||
+            p->second.expires > now + within) {
+            continue;
+        }
+        p->second.hits = 0;
+        result.push_back(split_key(p->first));
+    }
+
+    return result;
+}
+
+size_t dns_cache::size() const { return entries.size(); }
+} // namespace resolver
+} // namespace xmppd
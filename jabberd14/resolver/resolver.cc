@@ -43,6 +43,8 @@ resolver::resolver(instance i, xmlnode x)
     configurate();
 
     open_lwresd_socket();
+
+    register_metrics(metrics_callback, this);
 }
 
 void resolver::open_lwresd_socket() {
@@ -140,11 +142,130 @@ void resolver::configurate() {
     }
     set_heartbeat_interval(queue_timeout);
 
+    // configuration of the DNS cache
+    xmlnode cache_config = xmlnode_get_list_item(
+        xmlnode_get_tags(config, "dnsrv:cache", namespaces), 0);
+    cache.configure(
+        j_atoi(xmlnode_get_attrib_ns(cache_config, "size", NULL), 1000),
+        j_atoi(xmlnode_get_attrib_ns(cache_config, "minttl", NULL), 60),
+        j_atoi(xmlnode_get_attrib_ns(cache_config, "maxttl", NULL), 86400),
+        j_atoi(xmlnode_get_attrib_ns(cache_config, "negativettl", NULL), 300),
+        j_atoi(xmlnode_get_attrib_ns(cache_config, "failurettl", NULL), 30));
+
     // free temp resources
     xhash_free(namespaces);
     namespaces = NULL;
 }
 
+dns_cache &resolver::get_cache() { return cache; }
+
+bool resolver::resolve_from_cache(Glib::ustring const &destination,
+                                  Glib::ustring &ips,
+                                  Glib::ustring &resend_host) {
+    for (std::list<resend_service>::const_iterator service =
+             resend_services.begin();
+         service != resend_services.end(); ++service) {
+        std::list<std::pair<std::string, uint16_t>> hosts;
+
+        if (service->is_explicit_service()) {
+            std::ostringstream name_to_resolve;
+            name_to_resolve << std::string(service->get_service_prefix())
+                            << "." << std::string(destination);
+
+            dns_cache_entry const *srv =
+                cache.lookup(name_to_resolve.str(), ns_t_srv);
+            if (srv == NULL) {
+                return false;
+            }
+            if (srv->negative) {
+                // try next service
+                continue;
+            }
+            for (std::vector<dns_cache_record>::const_iterator p =
+                     srv->records.begin();
+                 p != srv->records.end(); ++p) {
+                hosts.push_back(
+                    std::pair<std::string, uint16_t>(p->target, p->port));
+            }
+        } else {
+            hosts.push_back(std::pair<std::string, uint16_t>(destination, 5269));
+        }
+
+        // AAAA and A results of the providing hosts
+        std::ostringstream result;
+        for (std::list<std::pair<std::string, uint16_t>>::const_iterator host =
+                 hosts.begin();
+             host != hosts.end(); ++host) {
+            dns_cache_entry const *aaaa = cache.lookup(host->first, ns_t_aaaa);
+            dns_cache_entry const *a = cache.lookup(host->first, ns_t_a);
+            if (aaaa == NULL || a == NULL) {
+                return false;
+            }
+
+            for (std::vector<dns_cache_record>::const_iterator p =
+                     aaaa->records.begin();
+                 p != aaaa->records.end(); ++p) {
+                result << ",[" << p->target << "]:" << host->second;
+            }
+            for (std::vector<dns_cache_record>::const_iterator p =
+                     a->records.begin();
+                 p != a->records.end(); ++p) {
+                result << "," << p->target << ":" << host->second;
+            }
+        }
+
+        ips = result.str().length() < 1 ? "" : result.str().substr(1);
+        resend_host = service->get_resend_host().full();
+        return true;
+    }
+
+    // no service left, let a resolver_job handle this
+    return false;
+}
+
+void resolver::refresh_cache_entry(std::string const &name, ::ns_type type) {
+    xmppd::lwresc::rrsetbyname query(name, ns_c_in, type);
+
+    register_result_callback(
+        query.getSerial(),
+        sigc::bind(
+            sigc::mem_fun(*this, &xmppd::resolver::resolver::on_refresh_result),
+            name, static_cast<int>(type)));
+    send_query(query);
+}
+
+void resolver::on_refresh_result(xmppd::lwresc::lwresult const &result,
+                                 std::string name, int type) {
+    cache.store(name, static_cast<::ns_type>(type), result);
+}
+
+void resolver::on_heartbeat() {
+    // query frequently used entries again, that would expire before the next
+    // heartbeat
+    std::list<std::pair<std::string, ::ns_type>> candidates =
+        cache.get_refresh_candidates(queue_timeout);
+    for (std::list<std::pair<std::string, ::ns_type>>::const_iterator p =
+             candidates.begin();
+         p != candidates.end(); ++p) {
+        refresh_cache_entry(p->first, p->second);
+    }
+}
+
+void resolver::metrics_callback(metrics m, void *arg) {
+    resolver *self = static_cast<resolver *>(arg);
+    std::string labels =
+        metrics_label("instance", self->get_instance_id().c_str());
+
+    metrics_add(m, "resolver_cache_hits_total", "counter",
+                "DNS lookups answered from the cache.", labels,
+                self->cache.hits);
+    metrics_add(m, "resolver_cache_misses_total", "counter",
+                "DNS lookups not answered from the cache.", labels,
+                self->cache.misses);
+    metrics_add(m, "resolver_cache_entries", "gauge",
+                "DNS results currently cached.", labels, self->cache.size());
+}
+
 void resolver::send_query(xmppd::lwresc::lwquery const &query) {
     // get binary representation of the query
     std::ostringstream query_bin;
@@ -194,6 +315,14 @@ result resolver::on_stanza_packet(dpacket dp) {
         return r_DONE;
     }
 
+    // can the destination be resolved using cached results only?
+    Glib::ustring ips;
+    Glib::ustring resend_host;
+    if (resolve_from_cache(dp->host, ips, resend_host)) {
+        resend_packet(dp->x, ips, resend_host);
+        return r_DONE;
+    }
+
     // is there already a resolve request pending for this domain? Just add to
     // queue for this resolving
     if (pending_jobs.find(dp->host) != pending_jobs.end()) {
@@ -88,6 +88,187 @@ class resend_service {
     int weight_sum;
 };
 
+/**
+ * @brief a single record of a cached DNS result
+ *
+ * For A and AAAA records only the address is used, for SRV records all fields.
+ */
+struct dns_cache_record {
+    /**
+     * the address (A/AAAA) or the target host (SRV)
+     */
+    std::string target;
+
+    /**
+     * priority of a SRV record
+     */
+    uint16_t prio;
+
+    /**
+     * weight of a SRV record
+     */
+    uint16_t weight;
+
+    /**
+     * port of a SRV record
+     */
+    uint16_t port;
+};
+
+/**
+ * @brief a cached DNS result
+ */
+struct dns_cache_entry {
+    /**
+     * the records of the result, empty for a negative result
+     */
+    std::vector<dns_cache_record> records;
+
+    /**
+     * when the entry expires
+     */
+    time_t expires;
+
+    /**
+     * the TTL the entry has been stored with (after clamping)
+     */
+    uint32_t ttl;
+
+    /**
+     * true if the name or record type did not exist, or resolving failed
+     */
+    bool negative;
+
+    /**
+     * how often the entry has been used since it has been stored
+     */
+    unsigned hits;
+
+    /**
+     * position of the key in the LRU list of the cache
+     */
+    std::list<std::string>::iterator lru_position;
+};
+
+/**
+ * @brief cache for results of SRV, AAAA and A queries
+ *
+ * The cache honors the TTL of the results (clamped to a configured minimum
+ * and maximum), stores negative results for a configured time, and keeps at
+ * most a configured number of entries, dropping the least recently used ones.
+ */
+class dns_cache {
+  public:
+    /**
+     * construct an empty cache with the default settings
+     */
+    dns_cache();
+
+    /**
+     * configure the cache
+     *
+     * @param max_entries maximum number of cached results, 0 disables caching
+     * @param min_ttl minimum time to cache positive results
+     * @param max_ttl maximum time to cache positive results
+     * @param negative_ttl time to cache not existing names and record types
+     * @param failure_ttl time to cache failed queries
+     */
+    void configure(size_t max_entries, uint32_t min_ttl, uint32_t max_ttl,
+                   uint32_t negative_ttl, uint32_t failure_ttl);
+
+    /**
+     * store the result of a query
+     *
+     * @param name the name that has been queried
+     * @param type the record type that has been queried
+     * @param result the result to store
+     */
+    void store(std::string const &name, ::ns_type type,
+               xmppd::lwresc::lwresult const &result);
+
+    /**
+     * get a cached result
+     *
+     * @param name the name to look up
+     * @param type the record type to look up
+     * @return the cached result, NULL if there is no unexpired result
+     */
+    dns_cache_entry const *lookup(std::string const &name, ::ns_type type);
+
+    /**
+     * get the queries of frequently used entries, that expire soon
+     *
+     * The entries are reported only once, until they get stored again.
+     *
+     * @param within how many seconds the entries have to expire
+     * @return list of names and record types to query again
+     */
+    std::list<std::pair<std::string, ::ns_type>>
+    get_refresh_candidates(time_t within);
+
+    /**
+     * number of lookups answered from the cache
+     */
+    unsigned long hits;
+
+    /**
+     * number of lookups not answered from the cache
+     */
+    unsigned long misses;
+
+    /**
+     * number of entries currently cached
+     */
+    size_t size() const;
+
+  private:
+    /**
+     * build the key of an entry
+     */
+    static std::string make_key(std::string const &name, ::ns_type type);
+
+    /**
+     * split a key of an entry into name and record type
+     */
+    static std::pair<std::string, ::ns_type>
+    split_key(std::string const &key);
+
+    /**
+     * the cached entries
+     */
+    std::map<std::string, dns_cache_entry> entries;
+
+    /**
+     * keys of the entries, least recently used first
+     */
+    std::list<std::string> lru;
+
+    /**
+     * maximum number of cached entries
+     */
+    size_t max_entries;
+
+    /**
+     * minimum time to cache positive results
+     */
+    uint32_t min_ttl;
+
+    /**
+     * maximum time to cache positive results
+     */
+    uint32_t max_ttl;
+
+    /**
+     * time to cache not existing names and record types
+     */
+    uint32_t negative_ttl;
+
+    /**
+     * time to cache failed queries
+     */
+    uint32_t failure_ttl;
+};
+
 // forward declaration
 class resolver;
 
@@ -307,6 +488,13 @@ class resolver : public instance_base {
      */
     void send_query(xmppd::lwresc::lwquery const &query);
 
+    /**
+     * get the cache of DNS results
+     *
+     * @return the cache
+     */
+    dns_cache &get_cache();
+
     /**
      * registers a callback function for query results
      */
@@ -335,6 +523,49 @@ class resolver : public instance_base {
      */
     void handle_completed_job(resolver_job &job);
 
+    /**
+     * resolve a destination using only cached results
+     *
+     * @param destination the domain to resolve
+     * @param ips where to store the resolving result
+     * @param resend_host where to store the service to send the packets to
+     * @return true if the destination could be resolved from the cache, false
+     * if a resolver_job is needed
+     */
+    bool resolve_from_cache(Glib::ustring const &destination,
+                            Glib::ustring &ips, Glib::ustring &resend_host);
+
+    /**
+     * query a cached entry again before it expires
+     *
+     * @param name the name to query
+     * @param type the record type to query
+     */
+    void refresh_cache_entry(std::string const &name, ::ns_type type);
+
+    /**
+     * store the result of refreshing a cache entry
+     *
+     * @param result the query result
+     * @param name the name that has been queried
+     * @param type the record type that has been queried
+     */
+    void on_refresh_result(xmppd::lwresc::lwresult const &result,
+                           std::string name, int type);
+
+    /**
+     * refresh frequently used cache entries, that expire soon
+     */
+    void on_heartbeat();
+
+    /**
+     * add the metrics of the resolver
+     *
+     * @param m the metrics to add to
+     * @param arg the resolver instance
+     */
+    static void metrics_callback(metrics m, void *arg);
+
     /**
      * handle received stanzas
      *
@@ -425,6 +656,11 @@ class resolver : public instance_base {
      */
     xmppd::xhash<std::shared_ptr<resolver_job>> pending_jobs;
 
+    /**
+     * cache of DNS results
+     */
+    dns_cache cache;
+
     /**
      * map containing the listeners for resolver results
      *
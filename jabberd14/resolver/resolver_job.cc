@@ -112,6 +112,9 @@ void resolver_job::start_resolving_service() {
 }
 
 void resolver_job::on_a_query_result(xmppd::lwresc::lwresult const &result) {
+    // keep the result for later resolvings
+    owner.get_cache().store(current_providing_host->first, ns_t_a, result);
+
     // did we successfully get a result?
     if (result.getResult() == xmppd::lwresc::lwresult::res_success) {
         // we got a result, process it
@@ -169,6 +172,9 @@ void resolver_job::resolve_current_providing_host_a() {
 }
 
 void resolver_job::on_aaaa_query_result(xmppd::lwresc::lwresult const &result) {
+    // keep the result for later resolvings
+    owner.get_cache().store(current_providing_host->first, ns_t_aaaa, result);
+
     // did we successfully get a result?
     if (result.getResult() == xmppd::lwresc::lwresult::res_success) {
         // we got a result, process it
@@ -242,6 +248,12 @@ void resolver_job::resolve_providing_hosts() {
 }
 
 void resolver_job::on_srv_query_result(xmppd::lwresc::lwresult const &result) {
+    // keep the result for later resolvings
+    std::ostringstream resolved_name;
+    resolved_name << std::string(current_service->get_service_prefix()) << "."
+                  << std::string(destination);
+    owner.get_cache().store(resolved_name.str(), ns_t_srv, result);
+
     // did we successfully get a result?
     if (result.getResult() != xmppd::lwresc::lwresult::res_success) {
         // try next service
@@ -0,0 +1,363 @@
+/*
+ * Licence
+ *
+ * Copyright (c) 2006 Matthias Wimmer,
+ *                    mailto:m@tthias.eu, xmpp:mawis@amessage.info
+ *
+ * You can use the content of this file using one of the following licences:
+ *
+ * - Version 1.0 of the Jabber Open Source Licence ("JOSL")
+ * - GNU GENERAL PUBLIC LICENSE, Version 2 or any newer version of this licence at your choice
+ * - Apache Licence, Version 2.0
+ * - GNU Lesser General Public License, Version 2.1 or any newer version of this licence at your choice
+ * - Mozilla Public License 1.1
+ */
+
+/**
+ * @file mio-bench.cc
+ * @brief benchmark of the mio backends
+ *
+ * A number of connections (socket pairs) is registered in mio, all of them
+ * waiting for data. In each round some of the connections get a short
+ * message, that the handler echos back. The time mio_run() needs until all
+ * messages have been echoed is measured. The handler reads with mio_recv(),
+ * so the io_uring backend receives into its provided buffers.
+ *
+ * The mio backend is selected at compile time, so this program is built once
+ * for each backend (xmppd-mio-bench-uring, xmppd-mio-bench-epoll-et,
+ * xmppd-mio-bench-epoll, xmppd-mio-bench-poll and xmppd-mio-bench-select).
+ * The select backend is limited to FD_SETSIZE file descriptors, larger
+ * scenarios are skipped. The io_uring backend falls back to epoll on kernels
+ * without io_uring, the results are named after the backend really used.
+ *
+ * The largest scenario (50000 idle and 5000 active connections) needs
+ * 110000 file descriptors, it is skipped if the hard limit is lower.
+ *
+ * Usage: xmppd-mio-bench-BACKEND [--min-time=sec] [--format=console|json]
+ *
+ * Use 'make bench' to build and run the benchmarks for all backends. The JSON
+ * results are written to mio-bench-BACKEND.json in the build directory.
+ */
+
+#include "../mio/mio.h"
+
+#include <sys/resource.h>
+#include <sys/select.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#if defined(MIO_URING)
+#   define BENCH_BACKEND "uring"
+#elif defined(MIO_EPOLL_ET)
+#   define BENCH_BACKEND "epoll-et"
+#elif defined(MIO_EPOLL)
+#   define BENCH_BACKEND "epoll"
+#elif defined(MIO_POLL)
+#   define BENCH_BACKEND "poll"
+#elif defined(MIO_SELECT)
+#   define BENCH_BACKEND "select"
+#else
+#   error "no mio backend selected"
+#endif
+
+/** size of a message sent to a connection */
+#define BENCH_MSG_SIZE 64
+
+/**
+ * a scenario that is measured
+ */
+typedef struct {
+    int connections;	/**< number of connections registered in mio */
+    int active;		/**< connections getting a message each round */
+} bench_scenario;
+
+static bench_scenario bench_scenarios[] = {
+    { 100, 100 },
+    { 1000, 1000 },
+    { 1000, 10 },
+    { 10000, 100 },
+    { 10000, 10000 },
+    { 55000, 5000 },
+    { 0, 0 }
+};
+
+/**
+ * a connection handled by mio
+ */
+typedef struct {
+    int fd;		/**< our end of the connection, handled by mio */
+    int peer;		/**< the other end, used to send messages */
+    int unsent;		/**< bytes received, that have not been echoed yet */
+} bench_conn;
+
+/**
+ * the result of a scenario
+ */
+typedef struct {
+    std::string name;	/**< name of the scenario */
+    long iterations;	/**< number of messages echoed */
+    double real_ns;	/**< wall clock time per message */
+    double cpu_ns;	/**< CPU time per message */
+    long runs;		/**< calls of mio_run() */
+} bench_result;
+
+/** bytes echoed by the handler */
+static long bench_echoed = 0;
+
+/**
+ * get the time of a clock
+ *
+ * @param clock which clock to read
+ * @return time in nanoseconds
+ */
+static unsigned long long bench_now(clockid_t clock) {
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return static_cast<unsigned long long>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * the mio handler: echo everything that is received
+ */
+static int bench_handler(mio_t m, mio_action_t a, int fd, const void *data, void *arg) {
+    bench_conn *c = static_cast<bench_conn*>(arg);
+    char buf[BENCH_MSG_SIZE * 4];
+    int len;
+
+    switch (a) {
+	case action_READ:
+	    /* read until the socket would block */
+	    while ((len = mio_recv(m, fd, buf, sizeof(buf))) > 0)
+		c->unsent += len;
+	    if (len == 0)
+		return 0;
+	    if (c->unsent > 0)
+		mio_write(m, fd);
+	    return 1;
+
+	case action_WRITE:
+	    while (c->unsent > 0) {
+		len = write(fd, buf, c->unsent < static_cast<int>(sizeof(buf)) ? c->unsent : sizeof(buf));
+		if (len <= 0)
+		    return 1;
+		c->unsent -= len;
+		bench_echoed += len;
+	    }
+	    return 0;
+
+	default:
+	    return 0;
+    }
+}
+
+/**
+ * run a scenario for at least the minimum time
+ *
+ * @param scenario the scenario to run
+ * @param min_time minimum time to run in seconds
+ * @param result where to store the result
+ * @return 0 on success, -1 if the scenario could not be run
+ */
+static int bench_run(bench_scenario const &scenario, double min_time, bench_result &result) {
+    std::vector<bench_conn> conns(scenario.connections);
+    struct rlimit limit;
+    char msg[BENCH_MSG_SIZE];
+    char buf[BENCH_MSG_SIZE * 4];
+    unsigned long long real = 0, cpu = 0, start_real, start_cpu;
+    long messages = 0, runs = 0;
+    int next = 0;
+    std::string backend;
+    mio_t m;
+
+    getrlimit(RLIMIT_NOFILE, &limit);
+    if (limit.rlim_cur > 131072)
+	limit.rlim_cur = 131072;
+#ifdef MIO_SELECT
+    if (limit.rlim_cur > FD_SETSIZE)
+	limit.rlim_cur = FD_SETSIZE;
+#endif
+    if (scenario.connections * 2 + 16 > static_cast<long>(limit.rlim_cur))
+	return -1;
+
+    if ((m = mio_new(limit.rlim_cur)) == NULL)
+	return -1;
+    backend = mio_backend(m);
+
+    for (int i = 0; i < scenario.connections; i++) {
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+	    perror("socketpair");
+	    exit(1);
+	}
+	conns[i].fd = sv[0];
+	conns[i].peer = sv[1];
+	conns[i].unsent = 0;
+	fcntl(sv[1], F_SETFL, fcntl(sv[1], F_GETFL, 0) | O_NONBLOCK);
+	mio_fd(m, sv[0], bench_handler, &conns[i]);
+	mio_recv_buffered(m, sv[0]);
+	mio_read(m, sv[0]);
+    }
+    memset(msg, 'x', sizeof(msg));
+
+    while (real < min_time * 1000000000.0) {
+	long expected;
+
+	/* send a message to the next active connections */
+	for (int i = 0; i < scenario.active; i++) {
+	    write(conns[next].peer, msg, sizeof(msg));
+	    next = (next + 1) % scenario.connections;
+	}
+	expected = bench_echoed + static_cast<long>(scenario.active) * sizeof(msg);
+
+	/* let mio echo them */
+	start_real = bench_now(CLOCK_MONOTONIC);
+	start_cpu = bench_now(CLOCK_PROCESS_CPUTIME_ID);
+	while (bench_echoed < expected) {
+	    long before = bench_echoed;
+	    unsigned long long run_start = bench_now(CLOCK_MONOTONIC);
+
+	    mio_run(m, 1);
+	    runs++;
+
+	    /* nothing happened for a whole timeout: events got lost */
+	    if (bench_echoed == before && bench_now(CLOCK_MONOTONIC) - run_start >= 1000000000ULL) {
+		std::cerr << "mio stalled, " << (expected - bench_echoed) << " bytes not echoed" << std::endl;
+		exit(1);
+	    }
+	}
+	real += bench_now(CLOCK_MONOTONIC) - start_real;
+	cpu += bench_now(CLOCK_PROCESS_CPUTIME_ID) - start_cpu;
+	messages += scenario.active;
+
+	/* drain the echos */
+	for (int i = 0; i < scenario.connections; i++)
+	    while (read(conns[i].peer, buf, sizeof(buf)) > 0)
+		;
+    }
+
+    for (int i = 0; i < scenario.connections; i++) {
+	mio_close(m, conns[i].fd);
+	close(conns[i].peer);
+    }
+    mio_free(m);
+
+    char name[128];
+    snprintf(name, sizeof(name), "mio/%s/connections:%d/active:%d", backend.c_str(), scenario.connections, scenario.active);
+    result.name = name;
+    result.iterations = messages;
+    result.real_ns = static_cast<double>(real) / messages;
+    result.cpu_ns = static_cast<double>(cpu) / messages;
+    result.runs = runs;
+    return 0;
+}
+
+/**
+ * escape a string for use in JSON
+ */
+static std::string bench_json_string(std::string const &s) {
+    std::string result("\"");
+
+    for (std::string::const_iterator c = s.begin(); c != s.end(); ++c) {
+	if (*c == '"' || *c == '\\')
+	    result += '\\';
+	result += *c;
+    }
+    return result + "\"";
+}
+
+/**
+ * print the results as JSON (format of Google Benchmark)
+ */
+static void bench_print_json(std::vector<bench_result> const &results) {
+    char hostname[256] = "";
+    char date[64] = "";
+    time_t now = time(NULL);
+
+    gethostname(hostname, sizeof(hostname) - 1);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", localtime(&now));
+
+    std::cout << "{\n  \"context\": {\n";
+    std::cout << "    \"date\": " << bench_json_string(date) << ",\n";
+    std::cout << "    \"host_name\": " << bench_json_string(hostname) << ",\n";
+    std::cout << "    \"executable\": \"xmppd-mio-bench-" BENCH_BACKEND "\",\n";
+    std::cout << "    \"num_cpus\": " << sysconf(_SC_NPROCESSORS_ONLN) << "\n";
+    std::cout << "  },\n  \"benchmarks\": [";
+    for (std::vector<bench_result>::const_iterator r = results.begin(); r != results.end(); ++r) {
+	std::cout << (r == results.begin() ? "\n" : ",\n");
+	std::cout << "    {\n      \"name\": " << bench_json_string(r->name) << ",\n";
+	std::cout << "      \"run_type\": \"iteration\",\n";
+	std::cout << "      \"iterations\": " << r->iterations << ",\n";
+	std::cout << "      \"real_time\": " << r->real_ns << ",\n";
+	std::cout << "      \"cpu_time\": " << r->cpu_ns << ",\n";
+	std::cout << "      \"mio_runs\": " << r->runs << ",\n";
+	std::cout << "      \"time_unit\": \"ns\"\n    }";
+    }
+    std::cout << "\n  ]\n}\n";
+}
+
+/**
+ * print a single result as a table row
+ */
+static void bench_print_console(bench_result const &r) {
+    char line[256];
+
+    snprintf(line, sizeof(line), "%-48s %12.1f ns %12.1f ns %12ld %10ld", r.name.c_str(), r.real_ns, r.cpu_ns, r.iterations, r.runs);
+    std::cout << line << std::endl;
+}
+
+int main(int argc, char const **argv) {
+    std::string format("console");
+    double min_time = 0.5;
+    std::vector<bench_result> results;
+    struct rlimit limit;
+
+    for (int i = 1; i < argc; i++) {
+	std::string arg(argv[i]);
+
+	if (arg.compare(0, 11, "--min-time=") == 0)
+	    min_time = atof(arg.substr(11).c_str());
+	else if (arg.compare(0, 9, "--format=") == 0)
+	    format = arg.substr(9);
+	else {
+	    std::cerr << "Usage: " << argv[0] << " [--min-time=sec] [--format=console|json]" << std::endl;
+	    return 1;
+	}
+    }
+
+    /* we need many file descriptors for the larger scenarios */
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+	limit.rlim_cur = limit.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    if (format == "console") {
+	char header[256];
+	snprintf(header, sizeof(header), "%-48s %15s %15s %12s %10s", "Benchmark", "Time/msg", "CPU/msg", "Messages", "mio_run()");
+	std::cout << header << std::endl;
+    }
+
+    for (int i = 0; bench_scenarios[i].connections > 0; i++) {
+	bench_result r;
+
+	if (bench_run(bench_scenarios[i], min_time, r) != 0) {
+	    if (format == "console")
+		std::cout << "skipping " << bench_scenarios[i].connections << " connections: not enough file descriptors" << std::endl;
+	    continue;
+	}
+	results.push_back(r);
+	if (format == "console")
+	    bench_print_console(r);
+    }
+
+    if (format == "json")
+	bench_print_json(results);
+
+    return 0;
+}
@@ -47,6 +47,7 @@
 
 #include <sstream>
 #include <stdexcept>
+#include <cctype>
 
 /**
  * check if the host is contained in a list of hosts
@@ -223,6 +224,10 @@ int _client_check_tls_possible(conn_t c, const Glib::ustring& host) {
     if (c->ssl != NULL)
 	return 0;
 
+    /* a WebSocket is secured by using TLS below it (wss:), not by STARTTLS */
+    if (c->websocket != websocket_NONE)
+	return 0;
+
     /* is there an SSL context? */
     if (c->c2s->ssl_ctx == NULL)
 	return 0;
@@ -252,10 +257,16 @@ void _client_stream_send_root(conn_t c) {
     c->sid = sid.str();
 
     /* generate the header element */
-    header = chunk_new_free(c->c2s->nads);
-    nad_append_elem(header->nad, c->type == type_FLASH ? "flash:stream" : "stream:stream", 0);
-    nad_append_attr(header->nad, "xmlns", "jabber:client");
-    nad_append_attr(header->nad, "xmlns:stream", "http://etherx.jabber.org/streams");
+    header = chunk_new_free(c->c2s->chunks);
+    if (c->websocket == websocket_OPEN) {
+	/* over a WebSocket it is an open element, complete in its own message */
+	nad_append_elem(header->nad, "open", 0);
+	nad_append_attr(header->nad, "xmlns", WEBSOCKET_FRAMING_NS);
+    } else {
+	nad_append_elem(header->nad, c->type == type_FLASH ? "flash:stream" : "stream:stream", 0);
+	nad_append_attr(header->nad, "xmlns", "jabber:client");
+	nad_append_attr(header->nad, "xmlns:stream", "http://etherx.jabber.org/streams");
+    }
     if (c->type == type_FLASH)
 	nad_append_attr(header->nad, "xmlns:flash", "http://www.jabber.com/streams/flash");
     nad_append_attr(header->nad, "from", c->local_id.c_str());
@@ -263,17 +274,21 @@ void _client_stream_send_root(conn_t c) {
     if (c->type == type_XMPP)
 	nad_append_attr(header->nad, "version", "1.0");
 
-    c->root_element = c->type == type_FLASH ? root_element_FLASH : root_element_NORMAL;
+    c->root_element = c->websocket == websocket_OPEN ? root_element_WEBSOCKET : c->type == type_FLASH ? root_element_FLASH : root_element_NORMAL;
 
     /* sent it to the client */
-    chunk_write_typed(c, header, "", "", "", c->type == type_FLASH ? chunk_NORMAL : chunk_OPEN);
+    chunk_write_typed(c, header, "", "", "", c->type == type_FLASH || c->websocket == websocket_OPEN ? chunk_NORMAL : chunk_OPEN);
 
     /* send stream features */
     if (c->type == type_XMPP) {
-	stream_features = chunk_new_free(c->c2s->nads);
+	stream_features = chunk_new_free(c->c2s->chunks);
 
 	nad_append_elem(stream_features->nad, "stream:features", 0);
 
+	/* each WebSocket message has to declare its namespaces */
+	if (c->websocket == websocket_OPEN)
+	    nad_append_attr(stream_features->nad, "xmlns:stream", "http://etherx.jabber.org/streams");
+
 	if (c->sasl_state == state_auth_NONE && _client_check_in_hostlist(c->c2s->local_noregister, c->local_id) == c->c2s->local_noregister.end()) {
 	    nad_append_elem(stream_features->nad, "register", 1);
 	    nad_append_attr(stream_features->nad, "xmlns", "http://jabber.org/features/iq-register");
@@ -362,7 +377,7 @@ static void _client_stream_root(conn_t c, const char *_name, const char **atts)
 	c->flash_hack = 1;
     } else
 #endif
-	if (name != "stream:stream") {
+	if (name != (c->websocket == websocket_OPEN ? "open" : "stream:stream")) {
 
 	    conn_error(c, STREAM_ERR_BAD_FORMAT, "Wrong root element for this XMPP stream.");
 
@@ -379,6 +394,15 @@ static void _client_stream_root(conn_t c, const char *_name, const char **atts)
 	    if(_client_root_attribute_to(c, atts[i+1]))
 		return;
 	    got_to_attrib = 1;
+	} else if (Glib::ustring(atts[i]) == "xmlns" && c->websocket == websocket_OPEN) {
+	    /* the stanzas declare their namespace themselves */
+	    if (Glib::ustring(atts[i+1]) != WEBSOCKET_FRAMING_NS) {
+		conn_error(c, STREAM_ERR_INVALID_NAMESPACE, "Invalid namespace, should be using " WEBSOCKET_FRAMING_NS);
+		c->depth = -1;
+		return;
+	    }
+	    got_stanza_namespace = 1;
+	    got_stream_namespace = 1;
 	} else if (Glib::ustring(atts[i]) == "xmlns") {
 	    if (_client_root_attribute_xmlns(c, atts[i+1]))
 		return;
@@ -505,6 +529,19 @@ void _client_startElement(void *arg, const char* name, const char** atts)
     if(c->nad == NULL)
         c->nad = nad_new(c->c2s->nads);
 
+    /* a new stanza: keep its bytes, if its start tag is in the buffer being parsed */
+    if (c->depth == 1) {
+	XML_Index start = XML_GetCurrentByteIndex(c->expat);
+
+	c->raw.clear();
+	c->raw_complete = 0;
+	c->raw_from = -1;
+	if (c->raw_usable && c->parse_buf != NULL && start >= c->parse_base) {
+	    c->raw_from = start;
+	    c->raw_tag_end = start + XML_GetCurrentByteCount(c->expat);
+	}
+    }
+
     /* append new element data to nad */
     nad_append_elem(c->nad, name, c->depth);
     for (i=0; atts[i] != '\0'; i += 2)
@@ -537,7 +574,22 @@ void _client_endElement(void *arg, const char* name)
     /* if we are now on level 1, a stanza has been finished */
     if(c->depth == 1)
     {
+	/* complete the kept bytes of the stanza, an empty element ends with its start tag */
+	if (c->raw_from >= 0) {
+	    int count = XML_GetCurrentByteCount(c->expat);
+	    XML_Index end = count > 0 ? XML_GetCurrentByteIndex(c->expat) + count : c->raw_tag_end;
+
+	    /* expat may report the end tag after the bytes following it have been kept */
+	    if (end <= c->raw_from)
+		c->raw.erase(c->raw.length() - (c->raw_from - end));
+	    else
+		c->raw.append(c->parse_buf + (c->raw_from - c->parse_base), end - c->raw_from);
+	    c->raw_complete = 1;
+	    c->raw_from = -1;
+	}
+
         _client_process(c);
+	c->raw_complete = 0;
         if(c->nad != NULL)
         {   
             nad_free(c->nad);
@@ -550,6 +602,28 @@ void _client_endElement(void *arg, const char* name)
         c->depth = -1; /* we can't close here, expat gets free'd on close :) */
 }
 
+/**
+ * our callback for expat where it can signal the XML declaration
+ *
+ * The bytes of stanzas are only forwarded as they have been received, if
+ * the stream is encoded in UTF-8 (as is the route to the session manager).
+ * The client parsers are created for UTF-8 (overriding byte order marks
+ * and the declaration), so this only keeps a stream declaring a different
+ * encoding from being spliced, before expat rejects its first non-ASCII
+ * byte.
+ *
+ * @param arg the connection for which this expat instance is parsing
+ * @param version the XML version in the declaration
+ * @param encoding the declared encoding, NULL if none has been declared
+ * @param standalone the standalone declaration
+ */
+void _client_xmlDecl(void *arg, const XML_Char *version, const XML_Char *encoding, int standalone) {
+    conn_t c = (conn_t)arg;
+
+    if (encoding != NULL && strcasecmp(encoding, "UTF-8") != 0)
+	c->raw_usable = 0;
+}
+
 /**
  * our callback for expat where it can signal read CDATA
  *
@@ -598,6 +672,9 @@ int _client_process_stoneage_auth(conn_t c, chunk_t chunk) {
 
 	c->smid->set_node(std::string(NAD_CDATA(chunk->nad, elem), NAD_CDATA_L(chunk->nad, elem)));
 
+	/* the user is known now, use the user's link to the session manager */
+	connect_assign(c, c->smid);
+
 	/* and the resource, for sets */
 	if(attr2 >= 0 && std::string(NAD_AVAL(chunk->nad, attr2), NAD_AVAL_L(chunk->nad, attr2)) == "set") {
 	    elem = nad_find_elem(chunk->nad, 0, "resource", 2);
@@ -611,8 +688,10 @@ int _client_process_stoneage_auth(conn_t c, chunk_t chunk) {
 
 	    /* add the stream id to digest packets */
 	    elem = nad_find_elem(chunk->nad, 0, "digest", 2);
-	    if(elem >= 0 && c->sid.length() > 0)
+	    if(elem >= 0 && c->sid.length() > 0) {
 		nad_set_attr(chunk->nad, elem, "sid", c->sid.c_str());
+		chunk->raw = 0;
+	    }
 	    
 	    /* we're in the auth state */
 	    c->state = state_AUTH;
@@ -634,6 +713,7 @@ int _client_process_stoneage_auth(conn_t c, chunk_t chunk) {
 	}
 
 	c->smid->set_node(std::string(NAD_CDATA(chunk->nad, elem), NAD_CDATA_L(chunk->nad, elem)));
+	connect_assign(c, c->smid);
     }
 
     /* if we have not returned yet, there is now a chunk that
@@ -671,7 +751,7 @@ void _client_do_sasl_step(conn_t c, chunk_t chunk) {
 	if (sasl_result != SASL_OK) {
 	    chunk_t failure = NULL;
 	    c->c2s->log->level(LOG_NOTICE) << "Problem decoding BASE64 data: " << sasl_errdetail(c->sasl_conn);
-	    failure = chunk_new_free(c->c2s->nads);
+	    failure = chunk_new_free(c->c2s->chunks);
 	    nad_append_elem(failure->nad, "failure", 0);
 	    nad_append_attr(failure->nad, "xmlns", "urn:ietf:params:xml:ns:xmpp-sasl");
 	    nad_append_elem(failure->nad, "incorrect-encoding", 1);
@@ -694,7 +774,7 @@ void _client_do_sasl_step(conn_t c, chunk_t chunk) {
     switch (sasl_result) {
 	case SASL_CONTINUE:
 	case SASL_OK:
-	    response = chunk_new_free(c->c2s->nads);
+	    response = chunk_new_free(c->c2s->chunks);
 	    nad_append_elem(response->nad, sasl_result == SASL_CONTINUE ? "challenge" : "success", 0);
 	    nad_append_attr(response->nad, "xmlns", "urn:ietf:params:xml:ns:xmpp-sasl");
 	    if (server_out_len > 0) {
@@ -747,6 +827,9 @@ void _client_do_sasl_step(conn_t c, chunk_t chunk) {
 		    if (c->authzid.points_to_NULL()) {
 			/* no -> close connection */
 			c->depth = -1;
+		    } else {
+			/* use the user's link to the session manager */
+			connect_assign(c, c->authzid);
 		    }
 		} else {
 		    c->depth = -1; /* internal error? flag to close the connection */
@@ -756,7 +839,7 @@ void _client_do_sasl_step(conn_t c, chunk_t chunk) {
 	    break;
 	case SASL_NOMECH:
 	    c->c2s->log->level(LOG_NOTICE) << "SASL authentication failure: " << sasl_errdetail(c->sasl_conn);
-	    response = chunk_new_free(c->c2s->nads);
+	    response = chunk_new_free(c->c2s->chunks);
 	    nad_append_elem(response->nad, "failure", 0);
 	    nad_append_attr(response->nad, "xmlns", "urn:ietf:params:xml:ns:xmpp-sasl");
 	    nad_append_elem(response->nad, "invalid-mechanism", 1);
@@ -770,7 +853,7 @@ void _client_do_sasl_step(conn_t c, chunk_t chunk) {
 	case SASL_BADVERS:
 	case SASL_NOVERIFY:
 	    c->c2s->log->level(LOG_NOTICE) << "SASL authentication failure: " << sasl_errdetail(c->sasl_conn);
-	    response = chunk_new_free(c->c2s->nads);
+	    response = chunk_new_free(c->c2s->chunks);
 	    nad_append_elem(response->nad, "failure", 0);
 	    nad_append_attr(response->nad, "xmlns", "urn:ietf:params:xml:ns:xmpp-sasl");
 	    nad_append_elem(response->nad, "temporary-auth-failure", 1);
@@ -779,7 +862,7 @@ void _client_do_sasl_step(conn_t c, chunk_t chunk) {
 	    break;
 	case SASL_NOAUTHZ:
 	    c->c2s->log->level(LOG_NOTICE) << "SASL authentication failure: " << sasl_errdetail(c->sasl_conn);
-	    response = chunk_new_free(c->c2s->nads);
+	    response = chunk_new_free(c->c2s->chunks);
 	    nad_append_elem(response->nad, "failure", 0);
 	    nad_append_attr(response->nad, "xmlns", "urn:ietf:params:xml:ns:xmpp-sasl");
 	    nad_append_elem(response->nad, "invalid-authzid", 1);
@@ -789,7 +872,7 @@ void _client_do_sasl_step(conn_t c, chunk_t chunk) {
 	case SASL_TOOWEAK:
 	case SASL_ENCRYPT:
 	    c->c2s->log->level(LOG_NOTICE) << "SASL authentication failure: " << sasl_errdetail(c->sasl_conn);
-	    response = chunk_new_free(c->c2s->nads);
+	    response = chunk_new_free(c->c2s->chunks);
 	    nad_append_elem(response->nad, "failure", 0);
 	    nad_append_attr(response->nad, "xmlns", "urn:ietf:params:xml:ns:xmpp-sasl");
 	    nad_append_elem(response->nad, "mechanism-too-weak", 1);
@@ -798,7 +881,7 @@ void _client_do_sasl_step(conn_t c, chunk_t chunk) {
 	    break;
 	default:
 	    c->c2s->log->level(LOG_NOTICE) << "SASL authentication failure: " << sasl_errdetail(c->sasl_conn);
-	    response = chunk_new_free(c->c2s->nads);
+	    response = chunk_new_free(c->c2s->chunks);
 	    nad_append_elem(response->nad, "failure", 0);
 	    nad_append_attr(response->nad, "xmlns", "urn:ietf:params:xml:ns:xmpp-sasl");
 	    nad_append_elem(response->nad, "not-authorized", 1);
@@ -821,6 +904,13 @@ void _client_process(conn_t c) {
 
     if (chunk->nad == NULL)
         return;
+
+    /* the packet can be forwarded as it has been received, as long as it is not modified */
+    if (c->raw_complete) {
+	chunk->bytes.swap(c->raw);
+	chunk->raw = 1;
+	c->raw_complete = 0;
+    }
     
     DBG("tag(" << std::string(NAD_ENAME(chunk->nad, 0), NAD_ENAME_L(chunk->nad, 0)) << ")");
 
@@ -835,7 +925,7 @@ void _client_process(conn_t c) {
 	chunk_t response = NULL;
 #ifdef USE_SSL
 	if (!_client_check_tls_possible(c, c->local_id)) {
-	    response = chunk_new_free(c->c2s->nads);
+	    response = chunk_new_free(c->c2s->chunks);
 	    nad_append_elem(response->nad, "failure", 0);
 	    nad_append_attr(response->nad, "xmlns", "urn:ietf:params:xml:ns:xmpp-tls");
 	    chunk_write(c, response, "", "", "");
@@ -843,7 +933,7 @@ void _client_process(conn_t c) {
 	    c->depth = -1;	/* flag to close the connection */
 	    return;
 	}
-	response = chunk_new_free(c->c2s->nads);
+	response = chunk_new_free(c->c2s->chunks);
 	nad_append_elem(response->nad, "proceed", 0);
 	nad_append_attr(response->nad, "xmlns", "urn:ietf:params:xml:ns:xmpp-tls");
 	chunk_write(c, response, "", "", "");
@@ -853,7 +943,7 @@ void _client_process(conn_t c) {
 	SSL_accept(c->ssl);
 	c->reset_stream = 1;
 #else
-	response = chunk_new_free(c->c2s->nads);
+	response = chunk_new_free(c->c2s->chunks);
 	nad_append_elem(response->nad, "failure", 0);
 	nad_append_attr(response->nad, "xmlns", "urn:ietf:params:xml:ns:xmpp-tls");
 	chunk_write(c, response, "", "", "");
@@ -879,7 +969,7 @@ void _client_process(conn_t c) {
 	if (mech_attr < 0) {
 	    chunk_t failure = NULL;
 
-	    failure = chunk_new_free(c->c2s->nads);
+	    failure = chunk_new_free(c->c2s->chunks);
 	    nad_append_elem(failure->nad, "failure", 0);
 	    nad_append_attr(failure->nad, "xmlns", "urn:ietf:params:xml:ns:xmpp-sasl");
 	    nad_append_elem(failure->nad, "invalid-mechanism", 1);
@@ -900,7 +990,7 @@ void _client_process(conn_t c) {
 		chunk_t failure = NULL;
 
 		c->c2s->log->level(LOG_NOTICE) << "Problem decoding BASE64 data: " << sasl_errdetail(c->sasl_conn);
-		failure = chunk_new_free(c->c2s->nads);
+		failure = chunk_new_free(c->c2s->chunks);
 		nad_append_elem(failure->nad, "failure", 0);
 		nad_append_attr(failure->nad, "xmlns", "urn:ietf:params:xml:ns:xmpp-sasl");
 		nad_append_elem(failure->nad, "incorrect-encoding", 1);
@@ -929,7 +1019,7 @@ void _client_process(conn_t c) {
 	switch (sasl_result) {
 	    case SASL_CONTINUE:
 	    case SASL_OK:
-		response = chunk_new_free(c->c2s->nads);
+		response = chunk_new_free(c->c2s->chunks);
 		nad_append_elem(response->nad, sasl_result == SASL_CONTINUE ? "challenge" : "success", 0);
 		nad_append_attr(response->nad, "xmlns", "urn:ietf:params:xml:ns:xmpp-sasl");
 		if (server_out_len > 0) {
@@ -954,7 +1044,7 @@ void _client_process(conn_t c) {
 		break;
 	    case SASL_NOMECH:
 		c->c2s->log->level(LOG_NOTICE) << "SASL authentication failure: " << sasl_errdetail(c->sasl_conn);
-		response = chunk_new_free(c->c2s->nads);
+		response = chunk_new_free(c->c2s->chunks);
 		nad_append_elem(response->nad, "failure", 0);
 		nad_append_attr(response->nad, "xmlns", "urn:ietf:params:xml:ns:xmpp-sasl");
 		nad_append_elem(response->nad, "invalid-mechanism", 1);
@@ -969,7 +1059,7 @@ void _client_process(conn_t c) {
 	    case SASL_BADVERS:
 	    case SASL_NOVERIFY:
 		c->c2s->log->level(LOG_NOTICE) << "SASL authentication failure: " << sasl_errdetail(c->sasl_conn);
-		response = chunk_new_free(c->c2s->nads);
+		response = chunk_new_free(c->c2s->chunks);
 		nad_append_elem(response->nad, "failure", 0);
 		nad_append_attr(response->nad, "xmlns", "urn:ietf:params:xml:ns:xmpp-sasl");
 		nad_append_elem(response->nad, "temporary-auth-failure", 1);
@@ -978,7 +1068,7 @@ void _client_process(conn_t c) {
 		break;
 	    case SASL_NOAUTHZ:
 		c->c2s->log->level(LOG_NOTICE) << "SASL authentication failure: " << sasl_errdetail(c->sasl_conn);
-		response = chunk_new_free(c->c2s->nads);
+		response = chunk_new_free(c->c2s->chunks);
 		nad_append_elem(response->nad, "failure", 0);
 		nad_append_attr(response->nad, "xmlns", "urn:ietf:params:xml:ns:xmpp-sasl");
 		nad_append_elem(response->nad, "invalid-authzid", 1);
@@ -988,7 +1078,7 @@ void _client_process(conn_t c) {
 	    case SASL_TOOWEAK:
 	    case SASL_ENCRYPT:
 		c->c2s->log->level(LOG_NOTICE) << "SASL authentication failure: " << sasl_errdetail(c->sasl_conn);
-		response = chunk_new_free(c->c2s->nads);
+		response = chunk_new_free(c->c2s->chunks);
 		nad_append_elem(response->nad, "failure", 0);
 		nad_append_attr(response->nad, "xmlns", "urn:ietf:params:xml:ns:xmpp-sasl");
 		nad_append_elem(response->nad, "mechanism-too-weak", 1);
@@ -997,7 +1087,7 @@ void _client_process(conn_t c) {
 		break;
 	    default:
 		c->c2s->log->level(LOG_NOTICE) << "SASL authentication failure: " << sasl_errdetail(c->sasl_conn);
-		response = chunk_new_free(c->c2s->nads);
+		response = chunk_new_free(c->c2s->chunks);
 		nad_append_elem(response->nad, "failure", 0);
 		nad_append_attr(response->nad, "xmlns", "urn:ietf:params:xml:ns:xmpp-sasl");
 		nad_append_elem(response->nad, "not-authorized", 1);
@@ -1005,7 +1095,7 @@ void _client_process(conn_t c) {
 		c->depth = -1;	/* flag to close the connection */
 	}
 #else
-	response = chunk_new_free(c->c2s->nads);
+	response = chunk_new_free(c->c2s->chunks);
 	nad_append_elem(response->nad, "failure", 0);
 	nad_append_attr(response->nad, "xmlns", "urn:ietf:params:xml:ns:xmpp-sasl");
 	nad_append_elem(response->nad, "temporary-auth-failure", 1);
@@ -1056,7 +1146,7 @@ void _client_process(conn_t c) {
 	    }
 
 	    /* send the client the confirmation */
-	    response = chunk_new_free(c->c2s->nads);
+	    response = chunk_new_free(c->c2s->chunks);
 	    nad_append_elem(response->nad, "iq", 0);
 	    nad_append_attr(response->nad, "type", "result");
 	    if (id_attr >= 0) {
@@ -1085,7 +1175,6 @@ void _client_process(conn_t c) {
 	session_element = nad_find_elem(chunk->nad, 0, "session", 1);
 	type_attr = nad_find_attr(chunk->nad, 0, "type", "set");
 	if (session_element >= 0 && type_attr >= 0) {
-	    static unsigned int id_serial = 0;
 	    std::ostringstream id_serial_str;
 	    int id_attr = -1;
 
@@ -1098,10 +1187,10 @@ void _client_process(conn_t c) {
 	    /* start the session by sending the sm a notification */
 
 	    /* prepare id data */
-	    id_serial_str << std::hex << id_serial++;
+	    id_serial_str << std::hex << c->c2s->sc_id_serial++;
 
 	    /* start the session on the session manager */
-	    client_send_sc_command(c->c2s->sm, c->smid->get_domain(), c->myid->full(), "start", c->authzid, id_serial_str.str(), "", c->myid->get_node());
+	    client_send_sc_command(c, c->smid->get_domain(), c->myid->full(), "start", c->authzid, id_serial_str.str(), "", c->myid->get_node());
 	    return;
 	}
     }
@@ -1121,14 +1210,15 @@ void _client_process(conn_t c) {
 		nad_set_attr(chunk->nad, 0, "xmlns:sc", "http://jabberd.jabberstudio.org/ns/session/1.0");
 		nad_set_attr(chunk->nad, 0, "sc:sm", c->sc_sm.c_str());
 		nad_set_attr(chunk->nad, 0, "sc:c2s", c->myid->get_node().c_str());
+		chunk->raw = 0;
 	    }
-            chunk_write(c->c2s->sm, chunk, c->smid->full(), c->myid->full(), "");
+            connect_write(c, chunk, c->smid->full(), c->myid->full(), "");
             break;
 
         /* anything that goes out before authentication gets flagged type='auth' */
         case state_NONE:
         case state_AUTH:
-            chunk_write(c->c2s->sm, chunk, c->smid->full(), c->myid->full(), "auth");
+            connect_write(c, chunk, c->smid->full(), c->myid->full(), "auth");
             break;
 
         default:
@@ -1233,7 +1323,7 @@ static int _client_io_accept(mio_t m, int fd, const Glib::ustring& ip_port, xmpp
 	    sasl_dispose(&(c->sasl_conn));
 	    c->sasl_conn = NULL;
 	}
-	sasl_result = sasl_server_new(c2s->sasl_service.c_str(), c2s->sasl_fqdn.c_str(), c2s->sasl_defaultrealm.c_str(), local_ip_port.str().c_str(), remote_ip_port.c_str(), NULL, 0, &(c->sasl_conn));
+	sasl_result = sasl_server_new(c2s->sasl_service.c_str(), c2s->sasl_fqdn.c_str(), c2s->sasl_defaultrealm.c_str(), local_ip_port.str().c_str(), remote_ip_port.c_str(), c2s->sasl_callbacks, 0, &(c->sasl_conn));
 	if (sasl_result != SASL_OK) {
 	    c2s->log->level(LOG_ERR) << "Error initializing SASL context: " << sasl_errdetail(c->sasl_conn);
 	} else {
@@ -1254,6 +1344,9 @@ static int _client_io_accept(mio_t m, int fd, const Glib::ustring& ip_port, xmpp
 #endif
     }
 
+    /* select a link to the session manager, until we know the user */
+    connect_assign(c, NULL);
+
     /* put us in the pre-auth hash */
     (c->c2s->pending)[c->myid->full()] = c;
 
@@ -1261,6 +1354,7 @@ static int _client_io_accept(mio_t m, int fd, const Glib::ustring& ip_port, xmpp
     XML_SetUserData(c->expat, (void*)c);
     XML_SetElementHandler(c->expat, _client_startElement, _client_endElement);
     XML_SetCharacterDataHandler(c->expat, _client_charData);
+    XML_SetXmlDeclHandler(c->expat, _client_xmlDecl);
 
     /* we are now waiting for the stream */
     c->state = state_NEGO;
@@ -1339,12 +1433,15 @@ int _client_autodetect_tls(int fd, conn_t c) {
 void _client_replace_parser(conn_t c) {
     if (c->expat != NULL)
 	XML_ParserFree(c->expat);
-    c->expat = XML_ParserCreate(NULL);
+    c->expat = XML_ParserCreate("UTF-8");
+    c->parse_base = 0;
+    c->raw_from = -1;
 
     /* set up expat callbacks */
     XML_SetUserData(c->expat, (void*)c);
     XML_SetElementHandler(c->expat, _client_startElement, _client_endElement);
     XML_SetCharacterDataHandler(c->expat, _client_charData);
+    XML_SetXmlDeclHandler(c->expat, _client_xmlDecl);
 }
 
 #ifdef FLASH_HACK
@@ -1361,12 +1458,185 @@ void _client_replace_parser_flash(conn_t c) {
     DBG("Flash Hack... get rid of the old Parser, and make a new one... stupid Flash...");
     _client_replace_parser(c);
     XML_Parse(c->expat, "<stream:stream>", 15, 0);
+    c->parse_base = 15;
 
     /* we do not have to replace expat again */
     c->flash_hack = 0;
 }
 #endif
 
+/**
+ * reset the stream after the security layer changed, a new stream root is expected
+ *
+ * @param c the connection to reset
+ */
+static void _client_reset_stream(conn_t c) {
+    DBG("resetting stream");
+    c->reset_stream = 0;
+    c->state = state_NONE;
+    c->type = type_NORMAL;
+    c->root_element = root_element_NONE;
+    c->local_id = "";
+    c->sid = "";
+    _client_replace_parser(c);
+    c->depth = 0;
+}
+
+/**
+ * pass the content of a WebSocket text message to the XML parser
+ *
+ * Each message contains a complete element. The stream is opened by an empty
+ * &lt;open/&gt; element and closed by an empty &lt;close/&gt; element, which
+ * are passed to the parser as a start tag and the end tag of this start tag,
+ * so that the parser sees the same document as for a stream over TCP.
+ *
+ * @param c the connection the message has been received on
+ * @param data the (unmasked) payload of the frame
+ * @param len length of the payload
+ * @param first if this is the first frame of the message
+ * @param last if this is the last frame of the message
+ * @return 0 if the connection has been closed, 1 else
+ */
+static int _client_websocket_text(conn_t c, char *data, int len, int first, int last) {
+    int start = 0;
+
+    if (len == 0)
+	return 1;
+
+    if (first) {
+	while (start < len && isspace(static_cast<unsigned char>(data[start])))
+	    start++;
+    }
+
+    if (first && len-start >= 6 && strncmp(data+start, "<open", 5) == 0 && (isspace(static_cast<unsigned char>(data[start+5])) || data[start+5] == '/')) {
+	char end_start_tag[] = ">";
+
+	/* the client restarts the stream after authentication */
+	if (c->reset_stream > 0)
+	    _client_reset_stream(c);
+
+	while (len > start && isspace(static_cast<unsigned char>(data[len-1])))
+	    len--;
+	if (!last || len-start < 7 || data[len-2] != '/' || data[len-1] != '>') {
+	    conn_close(c, STREAM_ERR_BAD_FORMAT, "<open/> has to be an empty element in its own message");
+	    return 0;
+	}
+
+	/* pass it as the start tag of the stream root */
+	if (conn_read(c, data+start, len-start-2) == 0)
+	    return 0;
+	return conn_read(c, end_start_tag, 1);
+    }
+
+    if (first && len-start >= 7 && strncmp(data+start, "<close", 6) == 0 && (isspace(static_cast<unsigned char>(data[start+6])) || data[start+6] == '/')) {
+	char end_tag[] = "</open>";
+
+	/* closing the stream root, the footer we send back is the <close/> element */
+	return conn_read(c, end_tag, sizeof(end_tag)-1);
+    }
+
+    return conn_read(c, data, len);
+}
+
+/**
+ * process data read from a client, removing the WebSocket framing if used
+ *
+ * @param c the connection the data has been read from
+ * @param buf the data that has been read
+ * @param len the return value of the read call
+ * @return 0 if the connection has been closed, 1 if data can be processed, 2 if reading would block
+ */
+static int _client_read(conn_t c, char *buf, int len) {
+    if (c->websocket == websocket_OPEN && len > 0)
+	return websocket_read(c, buf, len, _client_websocket_text);
+
+    return conn_read(c, buf, len);
+}
+
+/**
+ * read the HTTP upgrade request of a WebSocket connection
+ *
+ * If the request is not a valid upgrade request for XMPP, the client gets
+ * redirected to the configured HTTP server, or the request is rejected.
+ *
+ * @param fd the file descriptor of the connection
+ * @param c the connection we are reading the upgrade request from
+ */
+static void _client_websocket_handshake(int fd, conn_t c) {
+    char buf[1024];
+    int len = 0;
+    int result = 0;
+
+    do {
+	len = _read_actual(c, fd, buf, sizeof(buf));
+	if (len <= 0) {
+	    /* closes the connection or waits for more data */
+	    conn_read(c, buf, len);
+	    return;
+	}
+	result = websocket_handshake(c, buf, len);
+    } while (result == 0);
+
+    if (result > 0) {
+	DBG("WebSocket established on fd " << fd);
+
+	/* we are now waiting for the stream to start and the client to authenticate */
+	c->state = state_NONE;
+
+#ifdef WITH_SASL
+	/* RFC 7395 has no place for a SASL security layer, do not offer one */
+	if (c->sasl_conn != NULL) {
+	    sasl_security_properties_t secprops;
+	    secprops.min_ssf = c->c2s->sasl_min_ssf;
+	    secprops.max_ssf = 0;
+	    secprops.maxbufsize = 0;
+	    secprops.property_names = NULL;
+	    secprops.property_values = NULL;
+	    secprops.security_flags = c->c2s->sasl_sec_flags;
+	    if (sasl_setprop(c->sasl_conn, SASL_SEC_PROPS, &secprops) != SASL_OK)
+		c->c2s->log->level(LOG_ERR) << "Error setting SASL security properties: " << sasl_errdetail(c->sasl_conn);
+	}
+#endif
+
+	/* the client already sent its first frame */
+	if (!c->ws_in.empty())
+	    websocket_read(c, buf, 0, _client_websocket_text);
+	return;
+    }
+
+    c->websocket = websocket_NONE;
+    c->ws_in = "";
+
+    chunk_t http_response = chunk_new_empty(c->c2s->chunks);
+    std::ostringstream http_data;
+
+    /* If we configured http client forwarding to a real http server */
+    if (c->c2s->http_forward.length() > 0) {
+	http_data << "HTTP/1.0 301 Found\r\n"
+	    "Location: " << c->c2s->http_forward << "\r\n"
+	    "Server: " PACKAGE " " VERSION "\r\n"
+	    "Expires: Mon, 16 Jun 1980 00:00:00 GMT\r\n"
+	    "Pragma: no-cache\r\n"
+	    "Cache-control: private\r\n"
+	    "Connection: close\r\n\r\n";
+
+	DBG("This is an incoming HTTP connection - forwarding to: " << c->c2s->http_forward);
+    } else {
+	http_data << "HTTP/1.1 400 Bad Request\r\n"
+	    "Server: " PACKAGE " " VERSION "\r\n"
+	    "Sec-WebSocket-Version: 13\r\n"
+	    "Connection: close\r\n\r\n";
+
+	DBG("This is an incoming HTTP connection, but no WebSocket upgrade for XMPP");
+    }
+
+    http_response->bytes = http_data.str();
+    chunk_write(c, http_response, "", "", "");
+
+    /* close connection */
+    mio_close(c->c2s->mio, c->fd);
+}
+
 /**
  * detect the protocol variant that is used for this connection
  *
@@ -1377,14 +1647,36 @@ void _client_detect_variant(int fd, conn_t c) {
     int firstlen;
     char first[2];
 
+    /* continue reading the upgrade request */
+    if (c->websocket == websocket_HANDSHAKE) {
+	_client_websocket_handshake(fd, c);
+	return;
+    }
+
 #ifdef USE_SSL
     /* if SSL/TLS is already active, it's stone-age jabber over
-     * SSL/TLS
+     * SSL/TLS or a secure WebSocket
      *
-     * We do not accept anything special on such a connection,
-     * no HTTP header and no flash hack.
+     * We do not accept anything else on such a connection,
+     * no HTTP redirect and no flash hack.
      */
     if (c->ssl != NULL) {
+	firstlen = _peek_actual(c, fd, first, 1);
+	if (firstlen <= 0) {
+	    int ssl_error = SSL_get_error(c->ssl, firstlen);
+
+	    /* wait for the TLS handshake to complete */
+	    if (ssl_error != SSL_ERROR_WANT_READ && ssl_error != SSL_ERROR_WANT_WRITE)
+		mio_close(c->c2s->mio, c->fd);
+	    return;
+	}
+
+	if (first[0] == 'G') {
+	    c->websocket = websocket_HANDSHAKE;
+	    _client_websocket_handshake(fd, c);
+	    return;
+	}
+
 	/* we finished variant detection and are now waiting for
 	 * the stream to start and the client to authenticate and*/
 	c->state = state_NONE;
@@ -1399,30 +1691,12 @@ void _client_detect_variant(int fd, conn_t c) {
     while((firstlen = _peek_actual(c,fd,first,1)) == -1) { }
     DBG("char("<< first[0] << ")");
     
-    /* If the first char is G then it's for HTTP (GET ....)
-       and if we configured http client forwarding to a real http server */
-    if (first[0] == 'G' && c->c2s->http_forward.length() > 0)
+    /* If the first char is G then it's for HTTP (GET ....), either
+     * a WebSocket or a browser we redirect to a real http server */
+    if (first[0] == 'G')
     {
-	chunk_t http_response = NULL;
-	std::ostringstream http_data;
-
-	http_data << "HTTP/1.0 301 Found\r\n"
-	    "Location: " << c->c2s->http_forward << "\r\n"
-	    "Server: " PACKAGE " " VERSION "\r\n"
-	    "Expires: Mon, 16 Jun 1980 00:00:00 GMT\r\n"
-	    "Pragma: no-cache\r\n"
-	    "Cache-control: private\r\n"
-	    "Connection: close\r\n\r\n";
-
-	DBG("This is an incoming HTTP connection - forwarding to: " << c->c2s->http_forward);
-	
-	http_response = chunk_new(NULL);
-	http_response->bytes = http_data.str();
-	chunk_write(c, http_response, "", "", "");
-	
-	/* close connection */
-        mio_close(c->c2s->mio, c->fd);
-	
+	c->websocket = websocket_HANDSHAKE;
+	_client_websocket_handshake(fd, c);
 	return;
     }
 
@@ -1446,7 +1720,7 @@ void _client_detect_variant(int fd, conn_t c) {
 	
 	DBG("This is an incoming HTTP connection");
 
-	http_response = chunk_new(NULL);
+	http_response = chunk_new_empty(c->c2s->chunks);
 	http_response->bytes = http_data.str();
 	chunk_write(c, http_response, "", "", "");
 	
@@ -1530,17 +1804,8 @@ int _client_io_read(mio_t m, int fd, conn_t c) {
 	_client_replace_parser_flash(c);
 #endif
 
-    if (c->reset_stream > 0) {
-	DBG("resetting stream");
-	c->reset_stream = 0;
-	c->state = state_NONE;
-	c->type = type_NORMAL;
-	c->root_element = root_element_NONE;
-	c->local_id = "";
-	c->sid = "";
-	_client_replace_parser(c);
-	c->depth = 0;
-    }
+    if (c->reset_stream > 0)
+	_client_reset_stream(c);
     
     DBG("io action_READ with fd " << fd << " in state " << c->state);
 
@@ -1564,7 +1829,7 @@ int _client_io_read(mio_t m, int fd, conn_t c) {
 		 */
 		len = _read_actual(c, fd, buf, 10);
 		/* process what has been read */
-		if((ret = conn_read(c, buf, len)) == 0) return 0;
+		if((ret = _client_read(c, buf, len)) == 0) return 0;
 		/* come back again if no more data */
 		if(ret == 2 || len < 10) return 1;
 	    }
@@ -1577,6 +1842,12 @@ int _client_io_read(mio_t m, int fd, conn_t c) {
 
 	/* the session has been started, bandwidth is limited */
 	case state_OPEN:
+	    /* nothing peeks at the socket anymore, the backend may receive for us */
+#ifdef USE_SSL
+	    if (c->ssl == NULL)
+#endif
+		mio_recv_buffered(m, fd);
+
 	    /* read a chunk at a time */
 	    read_len = conn_max_read_len(c);
 
@@ -1598,7 +1869,7 @@ int _client_io_read(mio_t m, int fd, conn_t c) {
 	    len = _read_actual(c, fd, buf, read_len);
 
 	    /* process what has been read */
-	    return conn_read(c, buf, len);
+	    return _client_read(c, buf, len);
 
 	/* to make gcc happy */
 	default:
@@ -1621,7 +1892,13 @@ int _client_io_idle(int fd, conn_t c) {
     if (c->state != state_OPEN)
 	return 0;
 
-    idle_chunk = chunk_new(NULL);
+    /* whitespace is not allowed between the messages of a WebSocket */
+    if (c->websocket == websocket_OPEN) {
+	websocket_write_control(c, WEBSOCKET_OPCODE_PING, "", 0);
+	return 0;
+    }
+
+    idle_chunk = chunk_new_empty(c->c2s->chunks);
     idle_chunk->bytes = " ";
     chunk_write(c, idle_chunk, "", "", "");
     return 0;
@@ -1630,7 +1907,7 @@ int _client_io_idle(int fd, conn_t c) {
 /**
  * send a command using the new session control protocol to the session manager
  *
- * @param sm_conn the connection to send the command on
+ * @param sm_conn the connection the command is sent for (it is sent on the session manager link of this connection)
  * @param to the address to send the command to
  * @param from the address to send the command from
  * @param action the action to send ("start", "end", "create", or "delete")
@@ -1649,7 +1926,7 @@ void client_send_sc_command(conn_t sm_conn, const Glib::ustring& to, const Glib:
     }
 
     /* create new nad containing the command */
-    chunk = chunk_new_free(sm_conn->c2s->nads);
+    chunk = chunk_new_free(sm_conn->c2s->chunks);
     nad_append_elem(chunk->nad, "sc:session", 0);
     nad_append_attr(chunk->nad, "xmlns:sc", "http://jabberd.jabberstudio.org/ns/session/1.0");
     nad_append_attr(chunk->nad, "action", action.c_str());
@@ -1663,7 +1940,7 @@ void client_send_sc_command(conn_t sm_conn, const Glib::ustring& to, const Glib:
 	nad_append_attr(chunk->nad, "id", id.c_str());
 
     /* send */
-    chunk_write(sm_conn->c2s->sm, chunk, to, from, "");
+    connect_write(sm_conn, chunk, to, from, "");
 }
 
 /**
@@ -1687,13 +1964,24 @@ void _client_io_close(int fd, conn_t c) {
 
 	/* if we will not bounce anything while using old sc protocol, we have to close the session explicitly */
 	if (c->writeq.empty() && c->sc_sm.length() > 0) {
-	    chunk_write(c->c2s->sm, chunk_new(c), c->smid->full(), c->myid->full(), "error");
+	    connect_write(c, chunk_new(c), c->smid->full(), c->myid->full(), "error");
 	}
 
 	/* bounce write queue back to sm and close session */
 	while (!c->writeq.empty()) {
-	    chunk_write(c->c2s->sm, c->writeq.front(), c->smid->full(), c->myid->full(), "error");
-	    c->writeq.pop();
+	    chunk_t bounce = c->writeq.front();
+	    c->writeq.pop_front();
+
+	    /* WebSocket control frames are not stanzas */
+	    if (bounce->nad == NULL) {
+		chunk_free(bounce);
+		continue;
+	    }
+
+	    /* the framing was for the client */
+	    bounce->head = "";
+	    bounce->tail = "";
+	    connect_write(c, bounce, c->smid->full(), c->myid->full(), "error");
 	}
 
 	/* close session using the new protocol */
@@ -1720,7 +2008,7 @@ void _client_io_close(int fd, conn_t c) {
 	c->c2s->log->level(LOG_NOTICE) << "user " << c->userid->full() << " on fd " << c->fd << " disconnected, in=" << c->in_bytes << " B, out= " << c->out_bytes << " B, stanzas_in=" << c->in_stanzas << ", stanzas_out=" << c->out_stanzas;
 
 	/* send a notification message if requested */
-	connectionstate_send(c->c2s->config, c->c2s->sm, c, 0);
+	connectionstate_send(c->c2s->config, connect_get(c), c, 0);
     }
 
     conn_free(c);
@@ -41,11 +41,24 @@
 #include "jadc2s.h"
 
 #include <sstream>
+#include <sys/uio.h>
+#include <limits.h>
+
+#ifndef IOV_MAX
+# ifdef UIO_MAXIOV
+#  define IOV_MAX UIO_MAXIOV
+# else
+#  define IOV_MAX 16
+# endif
+#endif
 
 /* this file contains some simple utils for the conn_t data type */
 
 /* forward declaration */
+#ifdef USE_SSL
 static int _write_actual(conn_t c, int fd, const char *buf, size_t count);
+#endif
+static int _writev_actual(conn_t c, int fd, const struct iovec *iov, int iovcnt);
 
 /* create a new blank conn (!caller must set expat callbacks and mio afterwards) */
 conn_t conn_new(xmppd::pointer<c2s_st> c2s, int fd)
@@ -64,6 +77,7 @@ conn_t conn_new(xmppd::pointer<c2s_st> c2s, int fd)
     c->c2s = c2s;
     c->fd = fd;
     c->last_read = 0;
+    c->karma_wake = 0;
     c->read_bytes = 0;
     c->sid = "";
     c->root_element = root_element_NONE;
@@ -72,9 +86,25 @@ conn_t conn_new(xmppd::pointer<c2s_st> c2s, int fd)
     c->sasl_state = state_auth_NONE;
     c->type = type_NORMAL;
     c->start = time(NULL);
-    c->expat = XML_ParserCreate(NULL);
-    while (!c->writeq.empty())
-	c->writeq.pop();
+    c->expat = XML_ParserCreate("UTF-8");
+    c->parse_buf = NULL;
+    c->parse_base = 0;
+    c->raw_from = -1;
+    c->raw_tag_end = 0;
+    c->raw.clear();
+    c->raw_complete = 0;
+    c->raw_usable = 1;
+    c->writeq.clear();
+    c->writeq_offset = 0;
+#ifdef USE_SSL
+    c->tls_record.clear();
+#endif
+    c->sm_link = 0;
+    c->websocket = websocket_NONE;
+    c->ws_in.clear();
+    c->ws_fragmented = 0;
+    c->ws_message = 0;
+    c->ws_closing = 0;
 
     /* set up our id */
     c->myid = new xmppd::jid(c2s->used_jid_environment, c2s->sm_id);
@@ -92,6 +122,8 @@ conn_t conn_new(xmppd::pointer<c2s_st> c2s, int fd)
 
 #ifdef USE_SSL
     c->autodetect_tls = autodetect_NONE;
+    c->ktls_send = 0;
+    c->ktls_recv = 0;
 #endif
 
     DBG("set the defaults");
@@ -115,6 +147,15 @@ void conn_free(conn_t c)
 #endif
 #ifdef USE_SSL
     SSL_free(c->ssl);
+    c->ssl = NULL;
+
+    /* no longer offloaded */
+    if (c->ktls_send)
+	c->c2s->ktls_send--;
+    if (c->ktls_recv)
+	c->c2s->ktls_recv--;
+    c->ktls_send = 0;
+    c->ktls_recv = 0;
 #endif
 
     /* flag it as unused */
@@ -132,20 +173,30 @@ void conn_error(conn_t c, const Glib::ustring& condition, const Glib::ustring& e
     if (c->root_element == root_element_NONE)
     {
 	chunk_t root_element = NULL;
-	root_element = chunk_new_free(c->c2s->nads);
-	nad_append_elem(root_element->nad, c->type == type_FLASH ? "flash:stream" : "stream:stream", 0);
-	nad_append_attr(root_element->nad, "xmlns:stream", "http://etherx.jabber.org/streams");
+	root_element = chunk_new_free(c->c2s->chunks);
+	if (c->websocket == websocket_OPEN) {
+	    /* the open element of a WebSocket is complete in its message */
+	    nad_append_elem(root_element->nad, "open", 0);
+	    nad_append_attr(root_element->nad, "xmlns", WEBSOCKET_FRAMING_NS);
+	} else {
+	    nad_append_elem(root_element->nad, c->type == type_FLASH ? "flash:stream" : "stream:stream", 0);
+	    nad_append_attr(root_element->nad, "xmlns:stream", "http://etherx.jabber.org/streams");
+	}
 	if (c->type == type_FLASH)
 	    nad_append_attr(root_element->nad, "xmlns:flash", "http://www.jabber.com/streams/flash");
 	nad_append_attr(root_element->nad, "from", c->c2s->local_id.empty() ? "invalid" : c->c2s->local_id.begin()->value.c_str());
 	nad_append_attr(root_element->nad, "version", "1.0");
-	chunk_write_typed(c, root_element, "", "", "", c->type == type_FLASH ? chunk_NORMAL : chunk_OPEN);
+	chunk_write_typed(c, root_element, "", "", "", c->type == type_FLASH || c->websocket == websocket_OPEN ? chunk_NORMAL : chunk_OPEN);
     }
 
     DBG("sending stream error: " << condition << " " << err);
-    error = chunk_new_free(c->c2s->nads);
+    error = chunk_new_free(c->c2s->chunks);
     nad_append_elem(error->nad, "stream:error", 0);
 
+    /* each WebSocket message has to declare its namespaces */
+    if (c->websocket == websocket_OPEN)
+	nad_append_attr(error->nad, "xmlns:stream", "http://etherx.jabber.org/streams");
+
     /* send the condition (should be present!) */
     if(condition.length() > 0) {
 	nad_append_elem(error->nad, condition.c_str(), 1);
@@ -175,6 +226,7 @@ static void _log_ssl_io_error(xmppd::logging *l, SSL *ssl, int retcode, int fd,
 const char* _conn_root_element_name(root_element_t root_element) {
     return root_element == root_element_FLASH ? "flash:stream" :
 	root_element == root_element_NORMAL ? "stream:stream" :
+	root_element == root_element_WEBSOCKET ? "open" :
 	"";
 }
 
@@ -188,8 +240,14 @@ void conn_close(conn_t c, const Glib::ustring& condition, const Glib::ustring& e
 	conn_error(c, condition, err);
 
 	try {
-	    if (c && c->c2s->nads) {
-		footer = chunk_new_free(c->c2s->nads);
+	    if (c && c->c2s->nads && c->websocket == websocket_OPEN) {
+		/* over a WebSocket the stream is closed by a close element */
+		footer = chunk_new_free(c->c2s->chunks);
+		nad_append_elem(footer->nad, "close", 0);
+		nad_append_attr(footer->nad, "xmlns", WEBSOCKET_FRAMING_NS);
+		chunk_write(c, footer, "", "", "");
+	    } else if (c && c->c2s->nads) {
+		footer = chunk_new_free(c->c2s->chunks);
 		nad_append_elem(footer->nad, "stream:stream", 0);
 		chunk_write_typed(c, footer, "", "", "", chunk_CLOSE);
 	    }
@@ -216,22 +274,81 @@ void conn_close(conn_t c, const Glib::ustring& condition, const Glib::ustring& e
     }
 }
 
+/* create a chunk pool */
+chunk_pool_t chunk_pool_new(nad_cache_t nads) {
+    chunk_pool_t pool = new chunk_pool_st();
+
+    pool->nads = nads;
+    pool->free = NULL;
+    pool->free_count = 0;
+    pool->hits = 0;
+    pool->misses = 0;
+
+    return pool;
+}
+
+/* free a chunk pool and the chunks it keeps */
+void chunk_pool_free(chunk_pool_t pool) {
+    if (pool == NULL)
+	return;
+
+    while (pool->free != NULL) {
+	chunk_t chunk = pool->free;
+	pool->free = chunk->next;
+	delete chunk;
+    }
+
+    delete pool;
+}
+
+/**
+ * get a chunk from a pool, or allocate one if the pool is empty
+ *
+ * @param pool the pool, NULL to allocate a chunk that is not pooled
+ * @return the chunk, with no nad and no bytes
+ */
+static chunk_t _chunk_get(chunk_pool_t pool) {
+    chunk_t chunk = NULL;
+
+    if (pool != NULL && pool->free != NULL) {
+	chunk = pool->free;
+	pool->free = chunk->next;
+	pool->free_count--;
+	pool->hits++;
+    } else {
+	chunk = new chunk_st();
+	if (pool != NULL)
+	    pool->misses++;
+    }
+
+    chunk->nad = NULL;
+    chunk->packet_elem = 0;
+    chunk->raw = 0;
+    chunk->pool = pool;
+    chunk->next = NULL;
+
+    return chunk;
+}
+
 /* create a new chunk, using the nad from this conn */
 chunk_t chunk_new(conn_t c) {
     return chunk_new_packet(c, 0);
 }
 
-chunk_t chunk_new_free(nad_cache_t nads) {
-    chunk_t chunk = chunk_new(NULL);
-    if (chunk == NULL)
-	return NULL;
+chunk_t chunk_new_free(chunk_pool_t pool) {
+    chunk_t chunk = _chunk_get(pool);
 
-    chunk->nad = nad_new(nads);
+    chunk->nad = nad_new(pool->nads);
     return chunk;
 }
 
+/* create a new chunk without a nad, for writing raw bytes */
+chunk_t chunk_new_empty(chunk_pool_t pool) {
+    return _chunk_get(pool);
+}
+
 chunk_t chunk_new_packet(conn_t c, int packet_elem) {
-    chunk_t chunk = new chunk_st();
+    chunk_t chunk = _chunk_get(c != NULL ? c->c2s->chunks : NULL);
 
     /* nad gets tranferred from the conn to the chunk */
     if (c != NULL) {
@@ -248,9 +365,62 @@ chunk_t chunk_new_packet(conn_t c, int packet_elem) {
 /* free a chunk */
 void chunk_free(chunk_t chunk)
 {
-    nad_free(chunk->nad);
+    chunk_pool_t pool = chunk->pool;
 
-    delete chunk;
+    if (chunk->nad != NULL)
+	nad_free(chunk->nad);
+    chunk->nad = NULL;
+
+    /* pool full, or an oversized buffer we do not want to keep */
+    if (pool == NULL || pool->free_count >= CHUNK_POOL_SIZE || chunk->bytes.capacity() > CHUNK_POOL_MAX_BYTES) {
+	delete chunk;
+	return;
+    }
+
+    /* keep it, and the capacity of its buffer, for the next stanza */
+    chunk->bytes.clear();
+    chunk->head.clear();
+    chunk->tail.clear();
+    chunk->next = pool->free;
+    pool->free = chunk;
+    pool->free_count++;
+}
+
+/**
+ * append an attribute to a start tag, that is built as text
+ *
+ * @param tag the start tag
+ * @param name name of the attribute
+ * @param value value of the attribute, gets escaped
+ */
+static void _chunk_append_attr(std::string& tag, const char *name, const Glib::ustring& value) {
+    const std::string& raw_value = value.raw();
+
+    tag += ' ';
+    tag += name;
+    tag += "='";
+    for (std::string::const_iterator p = raw_value.begin(); p != raw_value.end(); ++p) {
+	switch (*p) {
+	    case '&':
+		tag += "&amp;";
+		break;
+	    case '<':
+		tag += "&lt;";
+		break;
+	    case '>':
+		tag += "&gt;";
+		break;
+	    case '\'':
+		tag += "&apos;";
+		break;
+	    case '"':
+		tag += "&quot;";
+		break;
+	    default:
+		tag += *p;
+	}
+    }
+    tag += '\'';
 }
 
 /* write a chunk to a conn */
@@ -269,8 +439,21 @@ void chunk_write_typed(conn_t c, chunk_t chunk, const Glib::ustring& to, const G
 
     elem = chunk->packet_elem;
 
+    /* an unmodified client packet: only the route tags are built, they are written around the received bytes */
+    if (chunk->raw && chunk_type == chunk_NORMAL) {
+	if (to.length() > 0) {
+	    chunk->head = "<route";
+	    _chunk_append_attr(chunk->head, "to", to);
+	    _chunk_append_attr(chunk->head, "from", from);
+	    if (type.length() > 0)
+		_chunk_append_attr(chunk->head, "type", type);
+	    chunk->head += '>';
+	    chunk->tail = "</route>";
+	}
+    }
+
     /* prepend optional route data */
-    if (to.length() > 0 && chunk->nad != NULL) {
+    else if (to.length() > 0 && chunk->nad != NULL) {
 	if (chunk->nad->ecur <= chunk->packet_elem) {
 	    elem = nad_append_elem(chunk->nad, "route", 1);
 	} else {
@@ -286,26 +469,27 @@ void chunk_write_typed(conn_t c, chunk_t chunk, const Glib::ustring& to, const G
     }
 
     /* turn the nad into xml */
-    if (chunk->nad != NULL) {
+    if (chunk->nad != NULL && !(chunk->raw && chunk_type == chunk_NORMAL)) {
 	std::string::size_type findpos = std::string::npos;
 
-	chunk->bytes = nad_print(chunk->nad, elem);
+	/* assign instead of replacing the buffer, to keep the capacity of a pooled chunk */
+	chunk->bytes.assign(nad_print(chunk->nad, elem));
 
-	/* only write start or end tag? */
+	/* only write start or end tag? (truncated in place, again to keep the buffer) */
 	switch (chunk_type) {
 	    case chunk_NORMAL:
 		break;
 	    case chunk_OPEN:
 		findpos = chunk->bytes.rfind("/>");
 		if (findpos != std::string::npos) {
-		    chunk->bytes = chunk->bytes.substr(0, findpos);
+		    chunk->bytes.erase(findpos);
 		    chunk->bytes += ">";
 		}
 		break;
 	    case chunk_CLOSE:
 		findpos = chunk->bytes.find_first_of(" \t/");
 		if (findpos != std::string::npos) {
-		    chunk->bytes = chunk->bytes.substr(0, findpos);
+		    chunk->bytes.erase(findpos);
 		    chunk->bytes += ">";
 		}
 		chunk->bytes.insert(1, "/");
@@ -313,14 +497,20 @@ void chunk_write_typed(conn_t c, chunk_t chunk, const Glib::ustring& to, const G
 	}
     }
 
-    /* need to SASL encode? */
+    /* need to SASL encode? (no security layer is negotiated on WebSockets) */
 #ifdef WITH_SASL
-    if (c->sasl_conn && c->sasl_state != state_auth_NONE && c->sasl_outbuf_size && *(c->sasl_outbuf_size) > 0) {
+    if (c->sasl_conn && c->sasl_state != state_auth_NONE && c->websocket == websocket_NONE && c->sasl_outbuf_size && *(c->sasl_outbuf_size) > 0) {
 	int sasl_result = 0;
 	std::string encoded_data;
 
 	DBG("chunk_write_typed() is encoding data using sasl_encode()");
 
+	/* the route tags are encoded together with the packet */
+	chunk->bytes.insert(0, chunk->head);
+	chunk->bytes += chunk->tail;
+	chunk->head.clear();
+	chunk->tail.clear();
+
 	/* we may have to encode using multiple calls, there is a maximum size we can pass to sasl_encode */
 	while (chunk->bytes.length() > 0) {
 	    unsigned encoding_now = chunk->bytes.length();
@@ -348,8 +538,12 @@ void chunk_write_typed(conn_t c, chunk_t chunk, const Glib::ustring& to, const G
     }
 #endif /* WITH_SASL */
 
+    /* each element in its own WebSocket message */
+    if (c->websocket == websocket_OPEN && chunk->head.length() + chunk->bytes.length() + chunk->tail.length() > 0)
+	websocket_frame(chunk);
+
     /* append to the outgoing write queue */
-    c->writeq.push(chunk);
+    c->writeq.push_back(chunk);
 
     /* tell mio to process write events on this fd */
     mio_write(c->c2s->mio, c->fd);
@@ -364,16 +558,10 @@ void chunk_write_typed(conn_t c, chunk_t chunk, const Glib::ustring& to, const G
 int conn_max_read_len(conn_t c)
 {
     xmppd::pointer<c2s_st> c2s = c->c2s;
-    int max_bits_per_sec = 1024;
-    try {
-	max_bits_per_sec = c2s->config->get_integer("io.max_bps");
-    } catch (Glib::ustring) {
-	DBG("Problem configuring io.max_bps setting.");
-    }
-    // START OLDCODE
+    int max_bits_per_sec = c2s->max_bps;
     time_t now;
     int bytes;
-    bad_conn_t bad_conn;
+    karma_timer_st timer;
 
     /* They have disabled this */
     if (max_bits_per_sec <= 0)
@@ -394,21 +582,11 @@ int conn_max_read_len(conn_t c)
     if (bytes > 0)
 	return bytes;
 
-    /* Create a new bad conn */
-    bad_conn = new bad_conn_st;
-    bad_conn->c = c;
-    bad_conn->last = now;
-    bad_conn->next = NULL;
-    /* Append it to the end of the bad conns list */
-    if (c2s->bad_conns == NULL)
-	c2s->bad_conns = bad_conn;
-    else
-	c2s->bad_conns_tail->next = bad_conn;
-    /* Update the tail */
-    c2s->bad_conns_tail = bad_conn;
-    
-    /* Reset the resolution */
-    c2s->timeout = 1;
+    /* wake them up, when their bytes get reset (the mio timeout is adjusted by check_karma()) */
+    timer.wake = c->last_read + 2;
+    timer.c = c;
+    c->karma_wake = timer.wake;
+    c2s->karma_timers.push(timer);
 
     return 0;
 }
@@ -455,11 +633,10 @@ int conn_read(conn_t c, char *buf, int len)
     
     while(cur_len < len && c->fd >= 0)
     {
-        /* Look for a shorter buffer based on \0 */
+        /* Look for a shorter buffer based on \0 (the buffer itself is not terminated) */
         char* new_buf = &buf[cur_len];
-        int max_len = strlen(new_buf);
-        if ((len - cur_len) < max_len)
-            max_len = (len - cur_len);
+        char* terminator = static_cast<char*>(memchr(new_buf, '\0', len - cur_len));
+        int max_len = terminator != NULL ? terminator - new_buf : len - cur_len;
         
         DBG("processing read data from " << c->fd << ": " << std::string(new_buf, max_len));
 
@@ -467,6 +644,7 @@ int conn_read(conn_t c, char *buf, int len)
         c->read_bytes += max_len;
     
         /* parse the xml baby */
+        c->parse_buf = new_buf;
         if(!XML_Parse(c->expat, new_buf, max_len, 0))
         {
             err = (char *)XML_ErrorString(XML_GetErrorCode(c->expat));
@@ -479,6 +657,14 @@ int conn_read(conn_t c, char *buf, int len)
 	if (c->fd < 0)
 	    return 0;
 
+	/* keep the bytes of a stanza, that continues in the next buffer */
+	if (c->raw_from >= 0) {
+	    c->raw.append(new_buf + (c->raw_from - c->parse_base), c->parse_base + max_len - c->raw_from);
+	    c->raw_from = c->parse_base + max_len;
+	}
+	c->parse_base += max_len;
+	c->parse_buf = NULL;
+
         /* oh darn */
 #ifdef FLASH_HACK
         if((err != NULL) && (c->flash_hack == 0))
@@ -504,6 +690,157 @@ int conn_read(conn_t c, char *buf, int len)
     return 1;
 }
 
+/**
+ * get the number of bytes, that have to be written for a chunk
+ *
+ * @param c the conn the chunk is written to
+ * @param chunk the chunk
+ * @return number of bytes
+ */
+static std::string::size_type _conn_chunk_length(conn_t c, chunk_t chunk) {
+    std::string::size_type length = chunk->head.length() + chunk->bytes.length() + chunk->tail.length();
+
+#ifdef FLASH_HACK
+    /* flash wants each packet to be terminated by a zero byte */
+    if (c->type == type_FLASH)
+	return length + 1;
+#endif
+    return length;
+}
+
+/**
+ * get the pieces of a chunk, that are written one after the other
+ *
+ * @param chunk the chunk
+ * @param segments where to store the head, the bytes, and the tail of the chunk
+ */
+static void _conn_chunk_segments(chunk_t chunk, const std::string *segments[3]) {
+    segments[0] = &chunk->head;
+    segments[1] = &chunk->bytes;
+    segments[2] = &chunk->tail;
+}
+
+/**
+ * remove written data from the write queue
+ *
+ * Chunks that have been written completely are freed, for a partially
+ * written chunk the offset is advanced.
+ *
+ * @param c the conn data has been written to
+ * @param len number of bytes that have been written
+ */
+static void _conn_writeq_consume(conn_t c, std::string::size_type len) {
+    while (!c->writeq.empty()) {
+	std::string::size_type left = _conn_chunk_length(c, c->writeq.front()) - c->writeq_offset;
+
+	if (len < left) {
+	    c->writeq_offset += len;
+	    return;
+	}
+
+	len -= left;
+	chunk_free(c->writeq.front());
+	c->writeq.pop_front();
+	c->writeq_offset = 0;
+    }
+}
+
+/**
+ * everything queued has been written to a conn
+ *
+ * If the conn only waited for its WebSocket Close frame to be written, the
+ * close handshake is complete now and the connection gets closed.
+ *
+ * @param c the conn
+ * @return 0 (no more write events needed)
+ */
+static int _conn_write_done(conn_t c) {
+    if (c->ws_closing)
+	mio_close(c->c2s->mio, c->fd);
+    return 0;
+}
+
+#ifdef USE_SSL
+/**
+ * write chunks to a TLS protected conn
+ *
+ * Several chunks are packed into one buffer, so that they get written as a
+ * single TLS record instead of one record for each chunk.
+ *
+ * @param c the conn to write to
+ * @return 0 if everything has been written or the conn has been closed, 2 if we would block
+ */
+static int _conn_write_tls(conn_t c) {
+    int len;
+
+    while (!c->tls_record.empty() || !c->writeq.empty()) {
+	/* pack new chunks, unless SSL_write() has to be repeated with the same record */
+	if (c->tls_record.empty()) {
+	    while (c->tls_record.length() < CONN_TLS_RECORD_SIZE && !c->writeq.empty()) {
+		const std::string *segments[3];
+		std::string::size_type offset = c->writeq_offset;
+
+		_conn_chunk_segments(c->writeq.front(), segments);
+		for (int i = 0; i < 3; i++) {
+		    if (offset < segments[i]->length())
+			c->tls_record.append(*segments[i], offset, std::string::npos);
+		    offset = offset > segments[i]->length() ? offset - segments[i]->length() : 0;
+		}
+#ifdef FLASH_HACK
+		if (c->type == type_FLASH)
+		    c->tls_record += '\0';
+#endif
+		chunk_free(c->writeq.front());
+		c->writeq.pop_front();
+		c->writeq_offset = 0;
+	    }
+	}
+
+	if (c->tls_record.empty())
+	    break;
+
+	len = _write_actual(c, c->fd, c->tls_record.data(), c->tls_record.length());
+
+	DBG("written to TLS layer, wlen=" << c->tls_record.length() << ", len=" << len);
+
+	if (len <= 0) {
+	    int ssl_error = SSL_get_error(c->ssl, len);
+
+	    if (ssl_error == SSL_ERROR_WANT_WRITE || ssl_error == SSL_ERROR_WANT_READ)
+		return 2; /* flag that we're blocking now */
+
+	    mio_close(c->c2s->mio, c->fd);
+	    return 0;
+	}
+
+	/* without SSL_MODE_ENABLE_PARTIAL_WRITE the record is written completely */
+	c->tls_record.clear();
+    }
+
+    return _conn_write_done(c);
+}
+#endif
+
+#ifdef USE_SSL
+/**
+ * check if OpenSSL has to write something before we may bypass it
+ *
+ * Even if the kernel encrypts the records, OpenSSL might still hold output:
+ * a record of an SSL_write() that has to be repeated, or data (e.g. of the
+ * handshake or a session ticket) it could not flush because the socket would
+ * have blocked. Bytes written directly to the socket must not overtake them.
+ *
+ * @param c the conn
+ * @return 1 if the conn has to be written using SSL_write(), 0 else
+ */
+static int _conn_ssl_write_pending(conn_t c) {
+    if (!c->ktls_send || !c->tls_record.empty())
+	return 1;
+
+    return SSL_want_write(c->ssl) || BIO_wpending(SSL_get_wbio(c->ssl)) > 0 ? 1 : 0;
+}
+#endif
+
 /* write chunks to this conn */
 int conn_write(conn_t c)
 {
@@ -511,14 +848,55 @@ int conn_write(conn_t c)
 
     DBG("conn_write()");
 
+#ifdef USE_SSL
+    /* if the kernel encrypts the records, we can write the chunks directly
+     * (unless OpenSSL has pending output, that has to be completed first) */
+    if (c->ssl != NULL && _conn_ssl_write_pending(c))
+	return _conn_write_tls(c);
+#endif
+
     /* try to write as much as we can */
     while (!c->writeq.empty()) {
-        DBG("writing data to " << c->fd << ": " << c->writeq.front()->bytes);
+	struct iovec iov[IOV_MAX];
+	int iovcnt = 0;
+	std::string::size_type offset = c->writeq_offset;
+	std::string::size_type total = 0;
+
+	/* gather as many chunks as we can pass to a single writev() */
+	for (std::deque<chunk_t>::iterator chunk = c->writeq.begin(); chunk != c->writeq.end() && iovcnt < IOV_MAX - 3; ++chunk) {
+	    const std::string *segments[3];
+
+	    /* the route tags of a raw packet are written around its bytes, without copying them together */
+	    _conn_chunk_segments(*chunk, segments);
+	    for (int i = 0; i < 3; i++) {
+		if (offset < segments[i]->length()) {
+		    iov[iovcnt].iov_base = const_cast<char*>(segments[i]->data() + offset);
+		    iov[iovcnt].iov_len = segments[i]->length() - offset;
+		    total += iov[iovcnt].iov_len;
+		    iovcnt++;
+		}
+		offset = offset > segments[i]->length() ? offset - segments[i]->length() : 0;
+	    }
+#ifdef FLASH_HACK
+	    if (c->type == type_FLASH) {
+		iov[iovcnt].iov_base = const_cast<char*>("");
+		iov[iovcnt].iov_len = 1;
+		total++;
+		iovcnt++;
+	    }
+#endif
+	    offset = 0;
+	}
 
-        /* write a bit from the current buffer */
-        len = _write_actual(c, c->fd, c->writeq.front()->bytes.c_str(), c->writeq.front()->bytes.length());
+	/* only empty chunks */
+	if (total == 0) {
+	    _conn_writeq_consume(c, 0);
+	    continue;
+	}
+
+	len = _writev_actual(c, c->fd, iov, iovcnt);
 
-	DBG("written to socket, wlen=" << c->writeq.front()->bytes.length() << ", len=" << len << ", errno=" << errno);
+	DBG("written to socket, wlen=" << total << ", len=" << len << ", errno=" << errno);
 
         /* we had an error on the write */
         if(len < 0)
@@ -529,20 +907,17 @@ int conn_write(conn_t c)
             mio_close(c->c2s->mio, c->fd);
             return 0;
         }
-        else if(len < c->writeq.front()->bytes.length()) /* we didnt' write it all, move the current buffer up */
-        { 
-	    c->writeq.front()->bytes.erase(0, len);
-            return 1;
-        }
-        else /* we wrote the entire node, kill it and move on */
-        {
-	    chunk_free(c->writeq.front());
-	    c->writeq.pop();
-        }
+
+	/* free what has been written, remember how far we got in the first remaining chunk */
+	_conn_writeq_consume(c, len);
+
+	/* we didn't write it all, wait until we can write again */
+	if (static_cast<std::string::size_type>(len) < total)
+	    return 1;
     } 
 
     DBG("end of conn_write()");
-    return 0;
+    return _conn_write_done(c);
 }
 
 #ifdef USE_SSL
@@ -582,6 +957,29 @@ static void _log_ssl_io_error(xmppd::logging *l, SSL *ssl, int retcode, int fd,
 }
 #endif
 
+#ifdef USE_SSL
+/**
+ * the SSL/TLS handshake of a connection has been finished
+ *
+ * Logs the negotiated protocol and counts the connection, if OpenSSL could
+ * pass the record layer to the kernel. Else OpenSSL keeps encrypting and
+ * decrypting the records itself for this connection.
+ *
+ * @param c the connection
+ */
+static void _conn_tls_established(conn_t c) {
+#ifdef SSL_OP_ENABLE_KTLS
+    c->ktls_send = BIO_get_ktls_send(SSL_get_wbio(c->ssl)) ? 1 : 0;
+    c->ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(c->ssl)) ? 1 : 0;
+    c->c2s->ktls_send += c->ktls_send;
+    c->c2s->ktls_recv += c->ktls_recv;
+#endif
+
+    c->c2s->log->level(LOG_NOTICE) << "SSL/TLS established on fd " << c->fd << ": " << SSL_get_version(c->ssl) << " " << SSL_get_cipher(c->ssl)
+	<< (c->ktls_send ? ", kTLS send" : "") << (c->ktls_recv ? ", kTLS recv" : "");
+}
+#endif
+
 int _read_actual(conn_t c, int fd, char *buf, size_t count)
 {
     int bytes_read;
@@ -594,12 +992,12 @@ int _read_actual(conn_t c, int fd, char *buf, size_t count)
 	if (bytes_read > 0)
 	    c->in_bytes += bytes_read;	/* XXX counting decrypted bytes */
 	if (!ssl_init_finished && SSL_is_init_finished(c->ssl))
-	    c->c2s->log->level(LOG_NOTICE) << "SSL/TLS established on fd " << c->fd << ": " << SSL_get_version(c->ssl) << " " << SSL_get_cipher(c->ssl);
+	    _conn_tls_established(c);
 	if (bytes_read <= 0)
 	    _log_ssl_io_error(c->c2s->log, c->ssl, bytes_read, c->fd, "SSL_read");
 
 #ifdef WITH_SASL
-	if (bytes_read > 0 && c->sasl_conn != NULL && c->sasl_state != state_auth_NONE) {
+	if (bytes_read > 0 && c->sasl_conn != NULL && c->sasl_state != state_auth_NONE && c->websocket == websocket_NONE) {
 	    int sasl_result = 0;
 	    const char *decoded_data = NULL;
 	    size_t decoded_len = 0;
@@ -616,11 +1014,11 @@ int _read_actual(conn_t c, int fd, char *buf, size_t count)
         return bytes_read;
     }
 #endif
-    bytes_read = read(fd, buf, count);
+    bytes_read = mio_recv(c->c2s->mio, fd, buf, count);
     if (bytes_read > 0)
 	c->in_bytes += bytes_read;
 #ifdef WITH_SASL
-    if (bytes_read > 0 && c->sasl_conn != NULL && c->sasl_state != state_auth_NONE) {
+    if (bytes_read > 0 && c->sasl_conn != NULL && c->sasl_state != state_auth_NONE && c->websocket == websocket_NONE) {
 	int sasl_result = 0;
 	const char *decoded_data = NULL;
 	size_t decoded_len = 0;
@@ -645,7 +1043,10 @@ int _peek_actual(conn_t c, int fd, char *buf, size_t count)
    
 #ifdef USE_SSL
     if(c->ssl != NULL) {
+	int ssl_init_finished = SSL_is_init_finished(c->ssl);
 	bytes_read = SSL_peek(c->ssl, buf, count);
+	if (!ssl_init_finished && SSL_is_init_finished(c->ssl))
+	    _conn_tls_established(c);
 	if (bytes_read <= 0)
 	    _log_ssl_io_error(c->c2s->log, c->ssl, bytes_read, c->fd, "SSL_peek");
 
@@ -657,55 +1058,37 @@ int _peek_actual(conn_t c, int fd, char *buf, size_t count)
 }
 
 
+#ifdef USE_SSL
 static int _write_actual(conn_t c, int fd, const char *buf, size_t count)
 {
     int written;
-    int truncated_write = 0;
+    int ssl_init_finished = SSL_is_init_finished(c->ssl);
 
     DBG("writing: " << std::string(buf, count));
 
-#ifdef WITH_SASL
-    if (c->sasl_conn && c->sasl_state != state_auth_NONE) {
-    }
-#endif
+    written = SSL_write(c->ssl, buf, count);
+    if (!ssl_init_finished && SSL_is_init_finished(c->ssl))
+	_conn_tls_established(c);
+    if (written > 0)
+	c->out_bytes += written; /* XXX counting before encryption */
+    else
+	_log_ssl_io_error(c->c2s->log, c->ssl, written, c->fd, "SSL_write");
 
-#ifdef USE_SSL
-    if(c->ssl != NULL) {
-        written = SSL_write(c->ssl, buf, count);
-	if (written > 0) {
-#ifdef FLASH_HACK
-	    if (c->type == type_FLASH) {
-		SSL_write(c->ssl, "\0", 1);
-		c->out_bytes += written+1; /* XXX counting before encryption */
-		return truncated_write ? *c->sasl_outbuf_size : written; /* XXX we currently do not handle SASL blocks that are only accepted half */
-	    }
+    DBG("written using OpenSSL");
+    return written;
+}
 #endif
 
-	    c->out_bytes += written;
-	}
-	else
-	    _log_ssl_io_error(c->c2s->log, c->ssl, written, c->fd, "SSL_write");
+static int _writev_actual(conn_t c, int fd, const struct iovec *iov, int iovcnt)
+{
+    int written;
 
-	DBG("written using OpenSSL");
-        return truncated_write ? *c->sasl_outbuf_size : written; /* XXX we currently do not handle SASL blocks, that are only half written to the socket */
-    }
-#endif
-        
-    written = write(fd, buf, count);
+    written = writev(fd, iov, iovcnt);
     if (written > 0)
-    {
-#ifdef FLASH_HACK
-	if ((c->type == type_FLASH)) {
-	    write(fd, "\0", 1);
-	    c->out_bytes += written+1;
-	    return truncated_write ? *c->sasl_outbuf_size : written; /* XXX we currently do not handle SASL blocks, that are only half written to the socket */
-	}
-#endif
-
 	c->out_bytes += written;
-    }
-    DBG("written - unencrypted");
-    return truncated_write ? *c->sasl_outbuf_size : written; /* XXX we currently do not handle SASL blocks, that are only half written to the socket */
+
+    DBG("written - unencrypted, " << iovcnt << " buffers");
+    return written;
 }
 
 static void connectionstate_fillnad(nad_t nad, Glib::ustring from, Glib::ustring to, Glib::ustring user, int is_login, const Glib::ustring &ip, const Glib::ustring& tls_version, const Glib::ustring& tls_cipher, const Glib::ustring& tls_size_secret, const Glib::ustring& tls_size_algorithm)
@@ -744,6 +1127,10 @@ void connectionstate_send(xmppd::pointer<xmppd::configuration> config, conn_t c,
     if (config->find("io.notifies") == config->end())
 	return;
 
+    // no link to the session manager?
+    if (c == NULL)
+	return;
+
     /* send the connection state update to each configured destination */
     std::list<xmppd::configuration_entry>::const_iterator p;
     for (p=(*config)["io.notifies"].begin(); p!=(*config)["io.notifies"].end(); ++p) {
@@ -773,11 +1160,13 @@ void connectionstate_send(xmppd::pointer<xmppd::configuration> config, conn_t c,
 }
 
 conn_st::conn_st(xmppd::pointer<c2s_st> c2s) : c2s(c2s), fd(-1), port(0),
-    read_bytes(0), last_read(0), state(state_NONE), type(type_NORMAL), start(0),
-    root_element(root_element_NONE), expat(NULL), depth(0), nad(NULL),
-    myid(NULL), smid(NULL), userid(NULL), authzid(NULL)
+    read_bytes(0), last_read(0), karma_wake(0), state(state_NONE), type(type_NORMAL), start(0),
+    root_element(root_element_NONE), sm_link(0), expat(NULL), depth(0), nad(NULL),
+    parse_buf(NULL), parse_base(0), raw_from(-1), raw_tag_end(0), raw_complete(0), raw_usable(1),
+    myid(NULL), smid(NULL), userid(NULL), authzid(NULL), writeq_offset(0),
+    websocket(websocket_NONE), ws_fragmented(0), ws_message(0), ws_closing(0)
 #ifdef USE_SSL
-    , ssl(NULL), autodetect_tls(autodetect_NONE)
+    , ssl(NULL), autodetect_tls(autodetect_NONE), ktls_send(0), ktls_recv(0)
 #endif
 {
 }
@@ -789,14 +1178,18 @@ void conn_st::reset() {
     port = 0;
     read_bytes = 0;
     last_read = 0;
+    karma_wake = 0;
     state = state_NONE;
     type = type_NORMAL;
     start = 0;
     root_element = root_element_NONE;
     local_id = "";
+    sm_link = 0;
 #ifdef USE_SSL
     ssl = NULL;
     autodetect_tls = autodetect_NONE;
+    ktls_send = 0;
+    ktls_recv = 0;
 #endif
     sid = "";
     sc_sm = "";
@@ -805,11 +1198,21 @@ void conn_st::reset() {
     smid = NULL;
     userid = NULL;
     authzid = NULL;
-    while (!writeq.empty())
-	writeq.pop();
+    writeq.clear();
+    writeq_offset = 0;
+#ifdef USE_SSL
+    tls_record.clear();
+#endif
     expat = NULL;
     depth = 0;
     nad = NULL;
+    parse_buf = NULL;
+    parse_base = 0;
+    raw_from = -1;
+    raw_tag_end = 0;
+    raw.clear();
+    raw_complete = 0;
+    raw_usable = 1;
 #ifdef FLASH_HACK
     flash_hack = 0;
 #endif
@@ -818,6 +1221,11 @@ void conn_st::reset() {
     in_stanzas = 0;
     out_stanzas = 0;
     reset_stream = 0;
+    websocket = websocket_NONE;
+    ws_in.clear();
+    ws_fragmented = 0;
+    ws_message = 0;
+    ws_closing = 0;
 #ifdef WITH_SASL
     sasl_conn = NULL;
     sasl_outbuf_size = NULL;
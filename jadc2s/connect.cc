@@ -42,6 +42,12 @@
 
 #include <sstream>
 
+/**
+ * seconds, after which we give up on a connection to the session manager,
+ * that has not been accepted
+ */
+#define CONNECT_TIMEOUT 30
+
 /**
  * get a value from an array of strings containing keys at the even positions, and values at the odd positions (expat's way to pass attributes)
  *
@@ -345,6 +351,42 @@ static void _connect_handle_sc_packet(conn_t sm_conn, int sc_element, conn_t cli
     }
 }
 
+/**
+ * the session manager accepted our handshake on a connection: it is the
+ * link now
+ *
+ * Packets, that were queued on the previous connection of the link, are
+ * sent on the new one.
+ *
+ * @param c the connection, that has been accepted
+ */
+static void _connect_link_up(conn_t c) {
+    sm_link_st &link = c->c2s->sm_links[c->sm_link];
+
+    link.c = c;
+    link.connecting = NULL;
+
+    /* the link is read by mio_recv() only, the backend may receive for us */
+    mio_recv_buffered(c->c2s->mio, c->fd);
+
+    if (link.down_since != 0) {
+	c->c2s->log->level(LOG_NOTICE) << "link " << link.id << " to the SM is up again after " << (time(NULL) - link.down_since) << " s";
+	link.reconnects++;
+    }
+    link.down_since = 0;
+    link.retries = 0;
+
+    c->c2s->log->level(LOG_NOTICE) << "connection to SM completed on fd " << c->fd;
+
+    /* a partially written chunk has to be written again completely */
+    while (!link.writeq.empty()) {
+	c->writeq.push_back(link.writeq.front());
+	link.writeq.pop_front();
+    }
+    if (!c->writeq.empty())
+	mio_write(c->c2s->mio, c->fd);
+}
+
 /* process completed nads */
 static void _connect_process(conn_t c) {
     chunk_t chunk = NULL;
@@ -363,6 +405,7 @@ static void _connect_process(conn_t c) {
         if (std::string(NAD_ENAME(c->nad, 0), NAD_ENAME_L(c->nad, 0)) == "handshake") {
             c->state = state_OPEN;
             DBG("handshake accepted, we're connected to the sm");
+	    _connect_link_up(c);
         }
         return;
     }
@@ -372,6 +415,7 @@ static void _connect_process(conn_t c) {
 	DBG("got non-route packet: " << std::string(NAD_ENAME(c->nad, 0), NAD_ENAME_L(c->nad, 0)));
 	return;
     }
+    c->in_stanzas++;
 
     /* get the target connection of the packet */
 
@@ -400,7 +444,7 @@ static void _connect_process(conn_t c) {
     }
 
     /* does not matter if old or new session control protocol: id should now have the target fd */
-    if (id >= c->c2s->max_fds || ((target = c->c2s->conns[id]) && (target->fd == -1 || target == c))) {
+    if (id >= c->c2s->max_fds || ((target = c->c2s->conns[id]) && (target->fd == -1 || connect_is_link(target)))) {
         DBG("dropping packet for invalid conn " << id << " (" << (uses_new_sc_protocol ? "new sc" : stanza_element >= 0 ? "old sc" : "sc:session") << ")");
         return;
     }
@@ -459,6 +503,7 @@ static void _connect_process(conn_t c) {
             /* auth was ok, send session request */
             DBG("client " << target->fd << "authorized, requesting session");
             chunk_write(c, chunk, target->smid->full().c_str(), pending->myid->full().c_str(), "session");
+	    c->out_stanzas++;
             pending->state = state_SESS;
 
 	    /* log the successfull login */
@@ -571,13 +616,349 @@ static void _connect_charData(void *arg, const char *str, int len)
 }
 
 
+/**
+ * find a session manager link, that is up
+ *
+ * The links are probed starting at the link selected by the hash value, so
+ * that the same hash value results in the same link as long as the links
+ * are up.
+ *
+ * @param c2s the jadc2s instance
+ * @param hash the hash value selecting the preferred link
+ * @return index of the link in c2s->sm_links, -1 if no link is up
+ */
+static int _connect_live_link(xmppd::pointer<c2s_st> c2s, unsigned int hash) {
+    unsigned int links = c2s->sm_links.size();
+
+    for (unsigned int i = 0; i < links; i++) {
+	unsigned int link = (hash + i) % links;
+
+	if (c2s->sm_links[link].c != NULL)
+	    return link;
+    }
+
+    return -1;
+}
+
+/**
+ * calculate a stable hash value for a user (FNV-1a of the bare JID)
+ *
+ * @param user the user
+ * @return the hash value
+ */
+static unsigned int _connect_user_hash(xmppd::pointer<xmppd::jid> user) {
+    std::string bare = user->get_node() + "@" + user->get_domain();
+    unsigned int hash = 2166136261U;
+
+    for (std::string::const_iterator p = bare.begin(); p != bare.end(); ++p) {
+	hash ^= static_cast<unsigned char>(*p);
+	hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+/**
+ * move a client connection to a session manager link
+ *
+ * The myid of the connection gets the id of the link as its domain, as the
+ * router routes the packets for the client to this id. If the connection is
+ * waiting for authentication, its key in the pending map is updated.
+ *
+ * @param c the client connection
+ * @param link index of the link in c->c2s->sm_links
+ */
+static void _connect_move(conn_t c, int link) {
+    xmppd::pointer<c2s_st> c2s = c->c2s;
+    std::map<Glib::ustring, conn_t>::iterator pending;
+
+    if (c->sm_link == link && c->myid->get_domain() == c2s->sm_links[link].id)
+	return;
+
+    DBG("moving fd " << c->fd << " to sm link " << c2s->sm_links[link].id);
+
+    pending = c2s->pending.find(c->myid->full());
+    if (pending != c2s->pending.end() && pending->second == c) {
+	c2s->pending.erase(pending);
+	c->myid->set_domain(c2s->sm_links[link].id);
+	c2s->pending[c->myid->full()] = c;
+    } else {
+	c->myid->set_domain(c2s->sm_links[link].id);
+    }
+    c->sm_link = link;
+}
+
+/**
+ * assign a client connection to one of the session manager links
+ *
+ * As long as the user is not known, the connection is assigned by its file
+ * descriptor. As soon as the user is known, all connections of the user
+ * use the same link (as long as this link is up). Connections, that already
+ * have a session, are not moved anymore.
+ *
+ * @param c the client connection
+ * @param user the user of the connection, NULL if not known yet
+ */
+void connect_assign(conn_t c, xmppd::pointer<xmppd::jid> user) {
+    unsigned int hash = 0;
+    int link = -1;
+
+    /* the session manager knows the connection by its myid, once it started a session */
+    if (c->state == state_SESS || c->state == state_OPEN)
+	return;
+
+    if (user.points_to_NULL() || !user->has_node())
+	hash = c->fd;
+    else
+	hash = _connect_user_hash(user);
+
+    link = _connect_live_link(c->c2s, hash);
+    if (link < 0)
+	link = hash % c->c2s->sm_links.size();
+
+    _connect_move(c, link);
+}
+
+/**
+ * get the session manager link a client connection sends its packets on
+ *
+ * If the link of the connection is down, another link is used.
+ *
+ * @param c the client connection (or a link, the link itself is returned then)
+ * @return the link, NULL if no link is up
+ */
+conn_t connect_get(conn_t c) {
+    int link = -1;
+
+    if (c->c2s->sm_links[c->sm_link].c != NULL)
+	return c->c2s->sm_links[c->sm_link].c;
+
+    link = _connect_live_link(c->c2s, c->sm_link);
+    return link < 0 ? NULL : c->c2s->sm_links[link].c;
+}
+
+/**
+ * check if a connection is one of our session manager links
+ *
+ * @param c the connection to check
+ * @return 1 if it is a link (or is set up for a link), 0 else
+ */
+int connect_is_link(conn_t c) {
+    sm_link_st &link = c->c2s->sm_links[c->sm_link];
+
+    return link.c == c || link.connecting == c;
+}
+
+/**
+ * send a packet of a client connection to the session manager
+ *
+ * The packet is sent on the link of the client connection, and dropped if
+ * there is no link, that is up.
+ *
+ * @param c the client connection
+ * @param chunk the packet
+ * @param to the address to route the packet to
+ * @param from the address to route the packet from
+ * @param type the type of the route
+ */
+void connect_write(conn_t c, chunk_t chunk, const Glib::ustring& to, const Glib::ustring& from, const Glib::ustring& type) {
+    conn_t sm_conn = connect_get(c);
+
+    if (sm_conn == NULL) {
+	DBG("no link to the session manager, dropping chunk of fd " << c->fd);
+	chunk_free(chunk);
+	return;
+    }
+
+    sm_conn->out_stanzas++;
+    chunk_write(sm_conn, chunk, to, from, type);
+}
+
+/**
+ * fail over the client connections of a session manager link, that is down
+ *
+ * The router routes the packets for these clients to the link's id, so their
+ * sessions cannot be continued. The sessions are ended (on another link) and
+ * the clients are disconnected. When they reconnect, they get assigned to a
+ * link that is up. Clients, that are still negotiating the stream, are just
+ * moved to another link.
+ *
+ * @param c2s the jadc2s instance
+ * @param link index of the link, that is down
+ * @return number of client connections, that have been failed over
+ */
+static int _connect_failover(xmppd::pointer<c2s_st> c2s, int link) {
+    std::vector<conn_st*>::iterator p;
+    int count = 0;
+
+    for (p = c2s->conns.begin(); p != c2s->conns.end(); ++p) {
+	if ((*p)->fd == -1 || (*p)->sm_link != link || connect_is_link(*p))
+	    continue;
+
+	if ((*p)->state == state_NEGO)
+	    connect_assign(*p, NULL);
+	else
+	    conn_close(*p, STREAM_ERR_REMOTE_CONNECTION_FAILED, "lost connection to the session manager");
+	count++;
+    }
+
+    return count;
+}
+
+/**
+ * an attempt to connect a session manager link failed
+ *
+ * If no other link is up, we cannot do anything before we are connected
+ * again, and give up after sm.retries failed attempts. Else the clients of
+ * the link are failed over to the other links.
+ *
+ * @param c2s the jadc2s instance
+ * @param i index of the link
+ */
+static void _connect_failed(xmppd::pointer<c2s_st> c2s, int i) {
+    sm_link_st &link = c2s->sm_links[i];
+    conn_t next = NULL;
+    int live = -1;
+
+    link.connecting = NULL;
+    link.retries++;
+
+    /* at startup c2s_run() checks, that we have a link */
+    if (link.down_since == 0 || c2s->shutting_down)
+	return;
+
+    live = _connect_live_link(c2s, i);
+    if (live < 0) {
+	if (link.retries >= c2s->config->get_integer("sm.retries")) {
+	    c2s->log->level(LOG_ERR) << "Unable to reconnect to the SM.";
+	    exit(1);
+	}
+	return;
+    }
+
+    if (_connect_failover(c2s, i) > 0)
+	c2s->log->level(LOG_ERR) << "cannot reconnect link " << link.id << " to the SM, failed over its sessions";
+
+    /* hand the old write queue to the link, that carries its traffic now */
+    next = c2s->sm_links[live].c;
+    while (!link.writeq.empty()) {
+	next->writeq.push_back(link.writeq.front());
+	link.writeq.pop_front();
+    }
+    if (!next->writeq.empty())
+	mio_write(c2s->mio, next->fd);
+}
+
+/**
+ * a session manager link has been closed: keep its counters and its
+ * write queue, and start to reconnect
+ *
+ * The sessions of the link can be continued, if it is reconnected at
+ * once. Else its clients are failed over by _connect_failed().
+ *
+ * @param c the connection of the link, that has been closed
+ */
+static void _connect_closed(conn_t c) {
+    xmppd::pointer<c2s_st> c2s = c->c2s;
+    sm_link_st &link = c2s->sm_links[c->sm_link];
+
+    /* keep the traffic counters of the link */
+    link.c = NULL;
+    link.in_bytes += c->in_bytes;
+    link.out_bytes += c->out_bytes;
+    link.in_stanzas += c->in_stanzas;
+    link.out_stanzas += c->out_stanzas;
+
+    if (c2s->shutting_down)
+	return;
+
+    /* keep the packets, that have not been sent, for the next connection */
+    while (!c->writeq.empty()) {
+	link.writeq.push_back(c->writeq.front());
+	c->writeq.pop_front();
+    }
+    c->writeq_offset = 0;
+
+    c2s->log->level(LOG_ERR) << "lost link " << link.id << " to the SM, reconnecting";
+    link.down_since = link.last_retry = time(NULL);
+    link.retries = 0;
+
+    /* try to connect again */
+    if (!connect_new(c2s, c->sm_link))
+	_connect_failed(c2s, c->sm_link);
+}
+
+/**
+ * try to reconnect session manager links, that are down
+ *
+ * Each link is retried every five seconds. Clients, that get assigned after
+ * the link is up again, will use it again. Connections, that have not been
+ * accepted after CONNECT_TIMEOUT seconds, are given up.
+ *
+ * @param c2s the jadc2s instance
+ */
+void connect_check_links(xmppd::pointer<c2s_st> c2s) {
+    time_t now = time(NULL);
+
+    for (unsigned int i = 0; i < c2s->sm_links.size(); i++) {
+	sm_link_st &link = c2s->sm_links[i];
+
+	if (link.connecting != NULL) {
+	    if (now - link.last_retry >= CONNECT_TIMEOUT) {
+		c2s->log->level(LOG_WARNING) << "connecting link " << link.id << " to the SM timed out";
+		mio_close(c2s->mio, link.connecting->fd);
+	    }
+	    continue;
+	}
+
+	if (link.c != NULL || link.down_since == 0 || now - link.last_retry < 5)
+	    continue;
+
+	link.last_retry = now;
+	if (!connect_new(c2s, i))
+	    _connect_failed(c2s, i);
+    }
+}
+
+/**
+ * write the state and traffic counters of the session manager links
+ *
+ * One line is written for each link.
+ *
+ * @param c2s the jadc2s instance
+ * @param out where to write the counters to
+ */
+void connect_write_stats(xmppd::pointer<c2s_st> c2s, std::ostream& out) {
+    std::vector<unsigned int> sessions(c2s->sm_links.size(), 0);
+    std::vector<conn_st*>::iterator p;
+
+    /* count the client connections on each link */
+    for (p = c2s->conns.begin(); p != c2s->conns.end(); ++p) {
+	if ((*p)->fd != -1 && !connect_is_link(*p))
+	    sessions[(*p)->sm_link]++;
+    }
+
+    for (unsigned int i = 0; i < c2s->sm_links.size(); i++) {
+	sm_link_st &link = c2s->sm_links[i];
+	conn_t c = link.c;
+
+	out << "link " << link.id << (c != NULL ? " up" : link.connecting != NULL ? " connecting" : " down")
+	    << " clients=" << sessions[i]
+	    << " queue=" << (c != NULL ? c->writeq.size() : 0)
+	    << " in_bytes=" << (link.in_bytes + (c != NULL ? c->in_bytes : 0))
+	    << " out_bytes=" << (link.out_bytes + (c != NULL ? c->out_bytes : 0))
+	    << " in_stanzas=" << (link.in_stanzas + (c != NULL ? c->in_stanzas : 0))
+	    << " out_stanzas=" << (link.out_stanzas + (c != NULL ? c->out_stanzas : 0))
+	    << " reconnects=" << link.reconnects << std::endl;
+    }
+}
+
 /* internal handler to read incoming data from the sm and parse/process it */
 static int _connect_io(mio_t m, mio_action_t a, int fd, const void *data, void *arg)
 {
     char buf[1024]; /* !!! make static when not threaded? move into conn_st? */
-    int len, ret, x, retries;
+    int len, ret;
     conn_t c = (conn_t)arg;
-    xmppd::pointer<c2s_st> c2s = NULL;
 
     DBG("io action " << a << " with fd " << fd);
 
@@ -588,7 +969,9 @@ static int _connect_io(mio_t m, mio_action_t a, int fd, const void *data, void *
         /* read as much data as we can from the sm */
         while(1)
         {
-            len = read(fd, buf, 1024);
+            len = mio_recv(m, fd, buf, 1024);
+	    if (len > 0)
+		c->in_bytes += len;
             if((ret = conn_read(c, buf, len)) != 1 || len < 1024) break;
         }
         return 1;
@@ -601,39 +984,25 @@ static int _connect_io(mio_t m, mio_action_t a, int fd, const void *data, void *
     case action_CLOSE:
 
         /* if we're closing before we're open, we've got issues */
-        if(c->state != state_OPEN) {
-            /* XXX handle this better */
-	    c->c2s->log->level(LOG_ERR) << "secret is wrong or SM kicked us off for some other reason";
-            exit(1);
-        }
-
-        DBG("reconnecting to sm");
-
-        /* try to connect again */
-	c2s = c->c2s;
-	if (!c2s->shutting_down) {
-	    retries = c2s->config->get_integer("sm.retries");
-	    for (x = 0; x < retries; x++) {
-		if (connect_new(c2s))
-		    break;
-		/* XXX: Make this an option? */
-		sleep(5);
+        if (c->c2s->sm_links[c->sm_link].connecting == c) {
+	    if (c->depth > 0)
+		c->c2s->log->level(LOG_ERR) << "secret is wrong or SM kicked us off for some other reason";
+	    else
+		c->c2s->log->level(LOG_ERR) << "failed to connect to SM as " << c->c2s->sm_links[c->sm_link].id;
+
+	    while (!c->writeq.empty()) {
+		chunk_free(c->writeq.front());
+		c->writeq.pop_front();
 	    }
+	    c->writeq_offset = 0;
 
-	    /* See if we were able to reconnect */
-	    if (x == retries) {
-		c2s->log->level(LOG_ERR) << "Unable to reconnect ot the SM.";
-		exit(1);
-	    }
+	    _connect_failed(c->c2s, c->sm_link);
 
-	    /* copy over old write queue if any */
-	    if (!c->writeq.empty()) {
-		while (!c->writeq.empty()) {
-		    c2s->sm->writeq = c->writeq;
-		}
-		mio_write(c2s->mio, c2s->sm->fd);
-	    }
-	}
+	    conn_free(c);
+	    break;
+        }
+
+	_connect_closed(c);
 
         conn_free(c);
         break;
@@ -646,22 +1015,34 @@ static int _connect_io(mio_t m, mio_action_t a, int fd, const void *data, void *
 }
 
 
-int connect_new(xmppd::pointer<c2s_st> c2s)
+/**
+ * start connecting a session manager link
+ *
+ * The connection is made by mio without blocking, and the handshake is
+ * done by _connect_io(). The link is up, when the session manager accepted
+ * the handshake (see _connect_link_up()), _connect_failed() is called if
+ * the connection fails.
+ *
+ * @param c2s the jadc2s instance
+ * @param link index of the link in c2s->sm_links
+ * @return 1 if connecting has been started, 0 on error
+ */
+int connect_new(xmppd::pointer<c2s_st> c2s, int link)
 {
-    int fd;
+    int fd = -1;
 #ifdef USE_IPV6
     std::ostringstream port;
     struct addrinfo hints, *addr_res, *addr_itr;
+    char iphost[INET6_ADDRSTRLEN];
 #else
-    unsigned long int ip = 0;
     struct hostent *h;
-    char iphost[16];
-    struct sockaddr_in sa;
+    char iphost[16] = "0.0.0.0";
 #endif
     conn_t c;
+    chunk_t header;
     char dummy[] = "<stream:stream xmlns='jabber:component:accept' xmlns:stream='http://etherx.jabber.org/streams' to='";
 
-    c2s->log->level(LOG_NOTICE) << "attempting connection to sm at " << c2s->sm_host << ":" << c2s->sm_port << " as " << c2s->sm_id;
+    c2s->log->level(LOG_NOTICE) << "attempting connection to sm at " << c2s->sm_host << ":" << c2s->sm_port << " as " << c2s->sm_links[link].id;
 
 #ifdef USE_IPV6
     /* prepare resolving of router address */
@@ -674,77 +1055,43 @@ int connect_new(xmppd::pointer<c2s_st> c2s)
     /* resolve all addresses */
     if (getaddrinfo(c2s->sm_host.c_str(), port.str().c_str(), &hints, &addr_res)) {
 	c2s->log->level(LOG_ERR) << "DNS lookup for " << c2s->sm_host << " failed";
-	exit(1);
+	return 0;
     }
 
-    /* iterate through the resolved addresses and try to connect */
+    /* use the first address, we can start to connect to */
     for (addr_itr = addr_res; addr_itr != NULL; addr_itr = addr_itr->ai_next) {
-	fd = socket(addr_itr->ai_family, addr_itr->ai_socktype, addr_itr->ai_protocol);
-	if (fd != -1) {
-	    if (connect(fd, addr_itr->ai_addr, addr_itr->ai_addrlen)) {
-		close(fd);
-		continue;
-	    }
+	if (getnameinfo(addr_itr->ai_addr, addr_itr->ai_addrlen, iphost, sizeof(iphost), NULL, 0, NI_NUMERICHOST))
+	    continue;
+	if ((fd = mio_connect(c2s->mio, c2s->sm_port, iphost, NULL, NULL)) >= 0)
 	    break;
-	}
     }
 
     /* free the result of the resolving */
     freeaddrinfo(addr_res);
-
-    if (addr_itr == NULL) {
-	c2s->log->level(LOG_ERR) << "failed to connect to router";
-	if (fd != -1) {
-	    close(fd);
-	}
-	return 0;
-    }
 #else
     /* get the ip to connect to */
     if (c2s->sm_host.length() > 0) {
         h = gethostbyname(c2s->sm_host.c_str());
         if (h == NULL) {
 	    c2s->log->level(LOG_ERR) << "DNS lookup for " << c2s->sm_host << " failed: " << hstrerror(h_errno);
-            exit(1);
+	    return 0;
         }
         inet_ntop(AF_INET, h->h_addr_list[0], iphost, 16);
-        ip = inet_addr(iphost);
 
         DBG("resolved: " <<  c2s->sm_host << " = " << iphost);
     }
 
-    /* attempt to create a socket */
-    if ((fd = socket(AF_INET,SOCK_STREAM,0)) < 0) {
-	c2s->log->level(LOG_ERR) << "failed to connect to SM: " << strerror(errno);
-        return 0;
-    }
-
-    /* set up and bind address info */
-    memset(&sa, 0, sizeof(sa));
-    sa.sin_family = AF_INET;
-    sa.sin_port = htons(c2s->sm_port);
-    if (ip > 0)
-	sa.sin_addr.s_addr = ip;
-
-    /* connect to the sm please */
-    if (connect(fd,(struct sockaddr*)&sa,sizeof(sa)) < 0) {
-	c2s->log->level(LOG_ERR) << "failed to connect to SM: " << strerror(errno);
-
-        close(fd);
-        return 0;
-    }
+    fd = mio_connect(c2s->mio, c2s->sm_port, iphost, NULL, NULL);
 #endif
 
-    /* make sure mio will take this fd */
-    if(mio_fd(c2s->mio, fd, NULL, NULL) < 0) {
+    if (fd < 0) {
 	c2s->log->level(LOG_ERR) << "failed to connect to SM: " << strerror(errno);
-
-        close(fd);
         return 0;
     }
 
     /* make our conn_t from this */
-    c2s->sm = c = conn_new(c2s, fd);
+    c = conn_new(c2s, fd);
+    c->sm_link = link;
     mio_app(c2s->mio, fd, _connect_io, (void*)c);
     mio_read(c2s->mio,fd);
 
@@ -753,19 +1100,68 @@ int connect_new(xmppd::pointer<c2s_st> c2s)
     XML_SetElementHandler(c->expat, _connect_startElement, _connect_endElement);
     XML_SetCharacterDataHandler(c->expat, _connect_charData);
 
-    /* send stream header */
-    write(fd,dummy,strlen(dummy));
-    write(fd, c2s->sm_id.c_str(), c2s->sm_id.length());
-    write(fd,"'>",2);
+    /* send stream header, mio writes it as soon as we are connected */
+    header = chunk_new_empty(c2s->chunks);
+    header->bytes = dummy;
+    header->bytes += c2s->sm_links[link].id.raw();
+    header->bytes += "'>";
+    c->writeq.push_back(header);
+    mio_write(c2s->mio, fd);
 
     /* keep the name of the root element */
     c->root_element = root_element_NORMAL;
 
-    /* loop reading until it's open or dead */
-    while (c->state != state_OPEN)
-	_connect_io(c2s->mio, action_READ, fd, NULL, (void*)c);    
-
-    c2s->log->level(LOG_NOTICE) << "connection to SM completed on fd " << fd;
+    c2s->sm_links[link].connecting = c;
 
     return 1;
 }
+
+/**
+ * connect the session manager links at startup
+ *
+ * All links are connected at the same time. This returns when each of them
+ * is up or has failed, links that failed are retried by
+ * connect_check_links().
+ *
+ * @param c2s the jadc2s instance
+ * @return number of links, that are up
+ */
+int connect_links(xmppd::pointer<c2s_st> c2s) {
+    time_t started = time(NULL);
+    int connecting = 0;
+    int links_up = 0;
+
+    for (unsigned int i = 0; i < c2s->sm_links.size(); i++) {
+	c2s->sm_links[i].last_retry = started;
+	if (connect_new(c2s, i))
+	    connecting++;
+    }
+
+    /* wait until the links are up or have failed */
+    while (connecting > 0 && time(NULL) - started < CONNECT_TIMEOUT) {
+	mio_run(c2s->mio, 1);
+
+	connecting = 0;
+	for (unsigned int i = 0; i < c2s->sm_links.size(); i++) {
+	    if (c2s->sm_links[i].connecting != NULL)
+		connecting++;
+	}
+    }
+
+    for (unsigned int i = 0; i < c2s->sm_links.size(); i++) {
+	sm_link_st &link = c2s->sm_links[i];
+
+	if (link.c != NULL) {
+	    links_up++;
+	    continue;
+	}
+
+	if (link.connecting != NULL)
+	    mio_close(c2s->mio, link.connecting->fd);
+
+	c2s->log->level(LOG_WARNING) << "Unable to connect to sm as " << link.id << ", retrying later";
+	link.down_since = link.last_retry = time(NULL);
+    }
+
+    return links_up;
+}
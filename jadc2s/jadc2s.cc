@@ -44,7 +44,7 @@
 #include <stdexcept>
 
 /* check jadc2s.h for an overview of this codebase */
-static int process_conns = 1;
+static volatile sig_atomic_t process_conns = 1;
 
 #ifdef WITH_SASL
 /* forward declarations */
@@ -58,6 +58,30 @@ static sasl_callback_t sasl_callbacks[] = {
     { SASL_CB_LIST_END, NULL, NULL }
 };
 
+/**
+ * mutex callbacks for cyrus sasl, the library is used by all worker threads
+ * and its default callbacks do no locking at all
+ */
+static void *_sasl_mutex_alloc(void) {
+    pthread_mutex_t *mutex = new pthread_mutex_t;
+
+    pthread_mutex_init(mutex, NULL);
+    return mutex;
+}
+
+static int _sasl_mutex_lock(void *mutex) {
+    return pthread_mutex_lock(static_cast<pthread_mutex_t*>(mutex)) == 0 ? SASL_OK : SASL_FAIL;
+}
+
+static int _sasl_mutex_unlock(void *mutex) {
+    return pthread_mutex_unlock(static_cast<pthread_mutex_t*>(mutex)) == 0 ? SASL_OK : SASL_FAIL;
+}
+
+static void _sasl_mutex_free(void *mutex) {
+    pthread_mutex_destroy(static_cast<pthread_mutex_t*>(mutex));
+    delete static_cast<pthread_mutex_t*>(mutex);
+}
+
 /**
  * callback for cyrus sasl, that stringpres XMPP user ids
  */
@@ -229,34 +253,34 @@ static int _sasl_proxy_auth_check(sasl_conn_t *conn, void *context, const char *
 #endif
 
 /***
-* Iterate over the bad conns list and reset people that are ok
+* Let the karma controlled conns, that are due, read again
+*
+* The mio timeout is set so that we do not sleep past the wake time of the
+* next conn.
+*
 * @param c2s The c2s instance to process from
 */
 static void check_karma(xmppd::pointer<c2s_st> c2s) {
-    bad_conn_t cur, next;
-    time_t start;
+    time_t now;
 
-    time(&start);
+    time(&now);
 
-    cur = c2s->bad_conns;
-    while ( (cur != NULL) && (cur->last < start) )
-    {
-        next = cur->next;
-        /* Let them read again */
-        mio_read(c2s->mio, cur->c->fd);
-        /* cleanup and move on in the list */
-	delete cur;
+    while (!c2s->karma_timers.empty() && c2s->karma_timers.top().wake <= now) {
+	conn_t c = c2s->karma_timers.top().c;
 
-        cur = next;
-    }
+	/* Let them read again, unless the conn has been closed (or reused) meanwhile */
+	if (c->fd != -1 && c->karma_wake == c2s->karma_timers.top().wake) {
+	    c->karma_wake = 0;
+	    mio_read(c2s->mio, c->fd);
+	}
 
-    /* update the pointer to the first bad connection */
-    c2s->bad_conns = cur;
-    if (c2s->bad_conns == NULL)
-    {
-	/* XXX Make this a config option? */
-	c2s->timeout = c2s->default_timeout;
+	c2s->karma_timers.pop();
     }
+
+    /* XXX Make this a config option? */
+    c2s->timeout = c2s->default_timeout;
+    if (!c2s->karma_timers.empty() && c2s->karma_timers.top().wake - now < c2s->timeout)
+	c2s->timeout = c2s->karma_timers.top().wake - now;
 }
 
 static void usage(void) {
@@ -335,14 +359,32 @@ static int daemonize(void) {
     return 0;
 }
 
-c2s_st::c2s_st(int argc, char* const* argv) : mio(NULL), shutting_down(0), local_port(0),
+c2s_shared_st::c2s_shared_st(int workers) : clients(workers, 0), stats(workers) {
+    for (int i = 0; i < CONNECTION_RATE_SHARDS; i++) {
+	pthread_mutex_init(&rate_shards[i].mutex, NULL);
+	memset(rate_shards[i].rates, 0, sizeof(rate_shards[i].rates));
+    }
+    pthread_mutex_init(&stats_mutex, NULL);
+}
+
+c2s_shared_st::~c2s_shared_st() {
+    for (int i = 0; i < CONNECTION_RATE_SHARDS; i++) {
+	pthread_mutex_destroy(&rate_shards[i].mutex);
+    }
+    pthread_mutex_destroy(&stats_mutex);
+}
+
+c2s_st::c2s_st(int argc, char* const* argv) : mio(NULL), shutting_down(0),
+    worker(0), workers(1), shared(NULL), local_port(0),
 #ifdef USE_SSL
     local_sslport(0), ssl_no_ssl_v2(0), ssl_no_ssl_v3(0), ssl_no_tls_v1(0),
-    ssl_enable_workarounds(0), ssl_enable_autodetect(0), ssl_ctx(NULL), tls_required(0),
+    ssl_enable_workarounds(0), ssl_enable_autodetect(0), ssl_no_ktls(0), ssl_ctx(NULL),
+    ktls_send(0), ktls_recv(0), tls_required(0),
 #endif
-    config(NULL), nads(NULL), connection_rate_times(0), connection_rate_seconds(0),
-    bad_conns(NULL), bad_conns_tail(NULL), timeout(0), default_timeout(0),
-    max_fds(0), num_clients(0), sm(NULL), rand_dev("/dev/urandom"), config_loaded(false)
+    config(NULL), nads(NULL), chunks(NULL), connection_rate_times(0), connection_rate_seconds(0),
+    max_bps(0), websocket_max_message(0), timeout(0), default_timeout(0),
+    max_fds(0), num_clients(0), sc_id_serial(0), rand_dev("/dev/urandom"), config_loaded(false),
+    config_file(CONFIG_DIR "/jadc2s.xml")
 {
     DBG("creating c2s_st instance");
 
@@ -353,9 +395,33 @@ c2s_st::c2s_st(int argc, char* const* argv) : mio(NULL), shutting_down(0), local
     // START OLDCODE
     if (!config_loaded) {
     // END OLDCODE
-        config = new xmppd::configuration(CONFIG_DIR "/jadc2s.xml");
+        config = new xmppd::configuration(config_file);
     }
 
+    set_config_defaults();
+}
+
+c2s_st::c2s_st(const c2s_st& first, int worker) : mio(NULL), shutting_down(0),
+    worker(worker), workers(first.workers), shared(first.shared), local_port(0),
+#ifdef USE_SSL
+    local_sslport(0), ssl_no_ssl_v2(0), ssl_no_ssl_v3(0), ssl_no_tls_v1(0),
+    ssl_enable_workarounds(0), ssl_enable_autodetect(0), ssl_no_ktls(0), ssl_ctx(first.ssl_ctx),
+    ktls_send(0), ktls_recv(0), tls_required(0),
+#endif
+    config(NULL), nads(NULL), chunks(NULL), connection_rate_times(0), connection_rate_seconds(0),
+    max_bps(0), websocket_max_message(0), timeout(0), default_timeout(0),
+    max_fds(0), num_clients(0), sc_id_serial(0), rand_dev(first.rand_dev), config_loaded(true),
+    config_file(first.config_file)
+{
+    DBG("creating c2s_st instance for worker " << worker);
+
+    // each worker has its own configuration instance, as it must not share managed pointers with other threads
+    config = new xmppd::configuration(config_file);
+
+    set_config_defaults();
+}
+
+void c2s_st::set_config_defaults() {
     // set configuration default values
     std::ostringstream sasl_sec_noanonymous;
     sasl_sec_noanonymous << SASL_SEC_NOANONYMOUS;
@@ -370,10 +436,11 @@ c2s_st::c2s_st(int argc, char* const* argv) : mio(NULL), shutting_down(0), local
     config->set_default("io.connection_limits.seconds", "0");
     config->set_default("io.max_bps", "1024");
     config->set_default("io.max_fds", "1023");
+    config->set_default("io.websocket_max_message", "262144");
+    config->set_default("io.workers", "1");
     config->set_default("local.port", "5222");
     config->set_default("local.ssl.port", "5223");
     config->set_default("sm.retries", "5");
-
 }
 
 /**
@@ -383,6 +450,18 @@ c2s_st::c2s_st(int argc, char* const* argv) : mio(NULL), shutting_down(0), local
  */
 void c2s_st::configurate(xmppd::pointer<c2s_st> xptr_to_self) {
     max_fds = config->get_integer("io.max_fds");
+    try {
+	workers = config->get_integer("io.workers");
+    } catch (Glib::ustring) {
+	throw std::invalid_argument("Problem with the io.workers setting");
+    }
+    if (workers < 1)
+	workers = 1;
+
+    // the data shared by the workers is created by the first worker
+    if (worker == 0)
+	shared = new c2s_shared_st(workers);
+
     // START OLDCODE
     /* conn setup */
     mio = mio_new(max_fds);
@@ -399,6 +478,7 @@ void c2s_st::configurate(xmppd::pointer<c2s_st> xptr_to_self) {
     /* nad cache */
     nads = nad_cache_new();
     DBG("nad_cache created");
+    chunks = chunk_pool_new(nads);
     // END OLDCODE
 
     /* session manager */
@@ -417,6 +497,34 @@ void c2s_st::configurate(xmppd::pointer<c2s_st> xptr_to_self) {
     } catch (Glib::ustring) {
 	throw std::invalid_argument("sm.id not set correctly in configuration");
     }
+    if (config->find("sm.id") != config->end()) {
+	// one link to the session manager for each configured id, the ids are distributed over the workers
+	std::list<xmppd::configuration_entry>::const_iterator p;
+	int i = 0;
+	for (p = (*config)["sm.id"].begin(); p != (*config)["sm.id"].end(); ++p, ++i) {
+	    sm_link_st link;
+
+	    if (i % workers != worker)
+		continue;
+
+	    link.id = p->value;
+	    link.c = NULL;
+	    link.connecting = NULL;
+	    link.down_since = 0;
+	    link.last_retry = 0;
+	    link.retries = 0;
+	    link.reconnects = 0;
+	    link.in_bytes = 0;
+	    link.out_bytes = 0;
+	    link.in_stanzas = 0;
+	    link.out_stanzas = 0;
+	    sm_links.push_back(link);
+	}
+    }
+    if (sm_links.empty()) {
+	throw Glib::ustring("Need at least as many IDs on the router (sm.id) as there are workers (io.workers) in the configuration");
+    }
+    sm_id = sm_links.front().id;
     try {
 	sm_secret = config->get_string("sm.secret");
     } catch (Glib::ustring) {
@@ -434,6 +542,16 @@ void c2s_st::configurate(xmppd::pointer<c2s_st> xptr_to_self) {
     } catch (Glib::ustring) {
 	throw std::invalid_argument("Problem with the io.connection_limits.seconds setting");
     }
+    try {
+	max_bps = config->get_integer("io.max_bps");
+    } catch (Glib::ustring) {
+	throw std::invalid_argument("Problem with the io.max_bps setting");
+    }
+    try {
+	websocket_max_message = config->get_integer("io.websocket_max_message");
+    } catch (Glib::ustring) {
+	throw std::invalid_argument("Problem with the io.websocket_max_message setting");
+    }
 
     if (config->find("local.id") != config->end())
 	local_id = (*config)["local.id"];
@@ -488,6 +606,7 @@ void c2s_st::configurate(xmppd::pointer<c2s_st> xptr_to_self) {
     ssl_no_ssl_v3 = config->find("local.ssl.no_ssl_v3") != config->end();
     ssl_no_tls_v1 = config->find("local.ssl.no_tls_v1") != config->end();
     ssl_enable_autodetect = config->find("local.ssl.enable_autodetect") != config->end();
+    ssl_no_ktls = config->find("local.ssl.no_ktls") != config->end();
 #endif
 
     iplog = config->find("io.iplog") != config->end();
@@ -587,6 +706,7 @@ void c2s_st::parse_commandline(int argc, char * const*argv) {
 		try {
 		    config = new xmppd::configuration(optarg);
 		    config_loaded = true;
+		    config_file = optarg;
 		} catch (...) {
 		    std::cerr << "Could not load configuration " << optarg << std::endl;
 		}
@@ -625,7 +745,209 @@ void c2s_st::seed_random() {
 
 void c2s_st::start_logging() {
     log = new xmppd::logging(sm_id);
-    log->level(LOG_NOTICE) << "starting up as " << sm_id << " (" << PACKAGE << " " << VERSION << ")";
+    if (workers > 1)
+	log->level(LOG_NOTICE) << "starting up worker " << worker << " as " << sm_id << " (" << PACKAGE << " " << VERSION << ")";
+    else
+	log->level(LOG_NOTICE) << "starting up as " << sm_id << " (" << PACKAGE << " " << VERSION << ")";
+}
+
+/**
+ * listen for client connections
+ *
+ * If there are several workers, each worker has its own listening sockets on
+ * the same ports, and the kernel distributes new connections over them.
+ *
+ * @param c2s the instance of the worker
+ * @return 0 on success, 1 on error
+ */
+static int _c2s_listen(xmppd::pointer<c2s_st>& c2s) {
+    int (*listen_fn)(mio_t, int, const char*, mio_handler_t, void*) = c2s->workers > 1 ? mio_listen_shared : mio_listen;
+
+    /* only bind the unencrypted port if we have a real port number for it */
+    if (c2s->local_port > 0) {
+        /* then make sure we can listen */
+        if (listen_fn(c2s->mio, c2s->local_port, c2s->local_ip.c_str(), client_io, &c2s) < 0) {
+	    c2s->log->level(LOG_ERR) << "failed to listen on port " << c2s->local_port << "!";
+            return 1;
+        }
+
+	c2s->log->level(LOG_NOTICE) << "listening for client connections on port " << c2s->local_port;
+    }
+
+#ifdef USE_SSL
+    if (c2s->ssl_ctx != NULL && c2s->local_sslport != 0) {
+	if (listen_fn(c2s->mio, c2s->local_sslport, c2s->local_ip.c_str(), client_io, &c2s) < 0)
+	    c2s->log->level(LOG_ERR) << "failed to listen on port " << c2s->local_sslport << "!";
+	else
+	    c2s->log->level(LOG_NOTICE) << "listening for SSL/TLS client connections on port " << c2s->local_sslport;
+    }
+#endif
+
+    return 0;
+}
+
+/**
+ * report the number of clients and the state of the sm links of a worker
+ *
+ * The first worker writes the reports of all workers to the statfile.
+ *
+ * @param c2s the instance of the worker
+ */
+static void _c2s_report_stats(xmppd::pointer<c2s_st> c2s) {
+    std::ostringstream links;
+
+    c2s->log->level(LOG_NOTICE) << "current number of clients: " << c2s->num_clients;
+    connect_write_stats(c2s, links);
+    links << "chunks worker " << c2s->worker << " free=" << c2s->chunks->free_count << " hits=" << c2s->chunks->hits << " misses=" << c2s->chunks->misses << std::endl;
+#ifdef USE_SSL
+    links << "ktls worker " << c2s->worker << " send=" << c2s->ktls_send << " recv=" << c2s->ktls_recv << std::endl;
+#endif
+
+    pthread_mutex_lock(&c2s->shared->stats_mutex);
+    c2s->shared->clients[c2s->worker] = c2s->num_clients;
+    c2s->shared->stats[c2s->worker] = links.str();
+
+    if (c2s->worker == 0 && c2s->local_statfile.length() > 0) {
+	std::ofstream statfile(c2s->local_statfile.c_str());
+	if (statfile) {
+	    int clients = 0;
+	    for (int i = 0; i < c2s->workers; i++)
+		clients += c2s->shared->clients[i];
+	    statfile << clients << std::endl;
+	    for (int i = 0; i < c2s->workers; i++)
+		statfile << c2s->shared->stats[i];
+	}
+    }
+    pthread_mutex_unlock(&c2s->shared->stats_mutex);
+}
+
+/**
+ * run a worker: connect to the sm, listen for clients and process the
+ * connections until we are requested to shut down
+ *
+ * @param c2s the instance of the worker (the mio handlers get its address, so it must not be moved while the worker runs)
+ * @return 0 on success, 1 on error
+ */
+static int c2s_run(xmppd::pointer<c2s_st>& c2s) {
+    time_t last_log, last_pending, last_jid_clean, now;
+
+#ifdef WITH_SASL
+    /* the callbacks for our SASL connections get the instance of this worker */
+    for (int i = 0; i < 3; i++) {
+	c2s->sasl_callbacks[i] = sasl_callbacks[i];
+	if (sasl_callbacks[i].id != SASL_CB_LIST_END)
+	    c2s->sasl_callbacks[i].context = &c2s;
+    }
+#endif
+
+    c2s->log->level(LOG_NOTICE) << "using mio backend " << mio_backend(c2s->mio);
+
+    /* first, make sure we can connect to our sm */
+    if (connect_links(c2s) == 0) {
+	c2s->log->level(LOG_ERR) << "Unable to connect to sm!";
+        exit(1);
+    }
+
+    if (_c2s_listen(c2s))
+	return 1;
+
+    /* just a matter of processing socket events now */
+    last_jid_clean = last_pending = last_log = time(NULL);
+    while(process_conns)
+    {
+        mio_run(c2s->mio, c2s->timeout);
+
+        /* log this no more than once per minute */
+        if ((time(NULL) - last_log) > 60) {
+	    _c2s_report_stats(c2s);
+            last_log = time(NULL);
+        }
+
+        /* !!! XXX Should these be configurable cleanup times? */
+        /* every so often check for timed out pending conns */
+	/*
+        if((time(&now) - last_pending) > 15) {
+	    std::map<Glib::ustring, conn_t>::iterator p;
+	    for (p = c2s->pending.begin(); p != c2s->pending.end(); ++p) {
+		// XXX we should not need this, but currently we do ... why?
+		if (p->second == NULL) {
+		    c2s->log->level(LOG_NOTICE) << "we have to erase " << p->first << " out of c2s->pending.";
+		    c2s->pending.erase(p->first);
+		    continue;
+		}
+		if (now - p->second->start > c2s->timeout && p->second->fd != -1) {
+		    conn_close(p->second, STREAM_ERR_TIMEOUT, "You have not authenticated in time");
+		}
+	    }
+            last_pending = time(NULL);
+        }
+	*/
+
+	/* cleanup the stringprep caches */
+	if ((time(NULL) - last_jid_clean) > 60) {
+	    c2s->used_jid_environment.nodes->clean_cache();
+	    c2s->used_jid_environment.domains->clean_cache();
+	    c2s->used_jid_environment.resources->clean_cache();
+	}
+
+	/* reconnect links to the session manager, that are down */
+	connect_check_links(c2s);
+
+        /* XXX This still feels odd having more stuff in here */
+        check_karma(c2s);
+    }
+
+    /* TODO: Notify sessionmanager about shutdown */
+    c2s->log->level(LOG_NOTICE) << "shutting down";
+
+    /* close client connections */
+    std::vector<conn_st*>::iterator p;
+    for (p=c2s->conns.begin(); p!=c2s->conns.end(); ++p) {
+	if ((*p)->fd != -1 && !connect_is_link(*p))
+	    conn_close(*p, STREAM_ERR_SYSTEM_SHUTDOWN, "shutting down " PACKAGE);
+    }
+
+    DBG("Closed open client connections");
+
+    /* close session manager connections */
+    c2s->shutting_down = 1;
+    for (unsigned int i = 0; i < c2s->sm_links.size(); i++) {
+	if (c2s->sm_links[i].c != NULL)
+	    conn_close(c2s->sm_links[i].c, "", "");
+	if (c2s->sm_links[i].connecting != NULL)
+	    mio_close(c2s->mio, c2s->sm_links[i].connecting->fd);
+    }
+
+    /* exiting, clean up */
+    mio_free(c2s->mio);
+
+    for (p=c2s->conns.begin(); p!=c2s->conns.end(); ++p) {
+	delete *p;
+    }
+
+    chunk_pool_free(c2s->chunks);
+    c2s->chunks = NULL;
+    nad_cache_free(c2s->nads);
+    if (c2s->log != NULL)
+	delete c2s->log;
+    c2s->log = NULL;
+
+    return 0;
+}
+
+/**
+ * thread running an additional worker
+ *
+ * @param arg pointer to the managed pointer of the worker's instance
+ * @return NULL
+ */
+static void *_c2s_worker(void *arg) {
+    xmppd::pointer<c2s_st>& c2s = *static_cast< xmppd::pointer<c2s_st>* >(arg);
+
+    if (c2s_run(c2s) != 0)
+	exit(1);
+
+    return NULL;
 }
 
 /* although this is our main and it's an all-in-one right now,
@@ -633,8 +955,7 @@ void c2s_st::start_logging() {
  * customize, or integrate with another codebase
  */
 int main(int argc, char* const* argv) {
-    time_t last_log, last_pending, last_jid_clean, now;
-    int i, fd;
+    int result = 0;
     int sasl_result = 0;
 
     signal(SIGINT, onSignal);
@@ -669,25 +990,8 @@ int main(int argc, char* const* argv) {
     /* seed the random number generator */
     c2s->seed_random();
 
-    /* first, make sure we can connect to our sm */
-    if (!connect_new(c2s)) {
-	c2s->log->level(LOG_ERR) << "Unable to connect to sm!";
-        exit(1);
-    }
-
-    /* only bind the unencrypted port if we have a real port number for it */
-    if (c2s->local_port > 0) {
-        /* then make sure we can listen */
-        if (mio_listen(c2s->mio, c2s->local_port, c2s->local_ip.c_str(), client_io, &c2s) < 0) {
-	    c2s->log->level(LOG_ERR) << "failed to listen on port " << c2s->local_port << "!";
-            return 1;
-        }
-
-	c2s->log->level(LOG_NOTICE) << "listening for client connections on port " << c2s->local_port;
-    }
-
 #ifdef USE_SSL
-    /* get the SSL port all set up */
+    /* get the SSL context all set up, it is shared by all workers */
 // XXX    if(c2s->local_sslport == 0 || c2s->pemfile == NULL)
     if (c2s->pemfile.length() == 0)
 	c2s->log->level(LOG_WARNING) << "SSL/TLS pem file not specified, SSL/TLS disabled";
@@ -723,12 +1027,6 @@ int main(int argc, char* const* argv) {
 		    c2s->log->level(LOG_ERR).ssl_errors();
 		    c2s->ssl_ctx = NULL;
 		}
-		if (c2s->local_sslport != 0 ) {
-		    if (mio_listen(c2s->mio, c2s->local_sslport, c2s->local_ip.c_str(), client_io, &c2s) < 0)
-			c2s->log->level(LOG_ERR) << "failed to listen on port " << c2s->local_sslport << "!";
-		    else
-			c2s->log->level(LOG_NOTICE) << "listening for SSL/TLS client connections on port " << c2s->local_sslport;
-		}
 	    }
         }
 
@@ -743,6 +1041,17 @@ int main(int argc, char* const* argv) {
 		SSL_CTX_set_options(c2s->ssl_ctx, SSL_OP_NO_SSLv3);
 	    if (c2s->ssl_no_tls_v1)
 		SSL_CTX_set_options(c2s->ssl_ctx, SSL_OP_NO_TLSv1);
+
+	    /* let the kernel encrypt and decrypt the records after the handshake
+	     * (AES-GCM and ChaCha20-Poly1305), OpenSSL falls back to doing it
+	     * itself for each connection the kernel cannot offload */
+#ifdef SSL_OP_ENABLE_KTLS
+	    if (!c2s->ssl_no_ktls)
+		SSL_CTX_set_options(c2s->ssl_ctx, SSL_OP_ENABLE_KTLS);
+#else
+	    if (!c2s->ssl_no_ktls)
+		c2s->log->level(LOG_NOTICE) << "OpenSSL does not support kernel TLS, records are encrypted by OpenSSL";
+#endif
 	}
     }
 #endif
@@ -754,6 +1063,8 @@ int main(int argc, char* const* argv) {
 	    DBG("callback init for " << i);
 	    sasl_callbacks[i].context = &c2s;
 	}
+	/* has to be set before the library gets initialized */
+	sasl_set_mutex(_sasl_mutex_alloc, _sasl_mutex_lock, _sasl_mutex_unlock, _sasl_mutex_free);
 	sasl_result = sasl_server_init(sasl_callbacks, c2s->sasl_appname.c_str());
 	if (sasl_result != SASL_OK) {
 	    c2s->log->level(LOG_ERR) << "initialization of SASL library failed: " << sasl_result;
@@ -771,87 +1082,44 @@ int main(int argc, char* const* argv) {
     }
 #endif /* WITH(out)_SASL */
 
-    /* just a matter of processing socket events now */
-    last_jid_clean = last_pending = last_log = time(NULL);
-    while(process_conns)
-    {
-        mio_run(c2s->mio, c2s->timeout);
-
-        /* log this no more than once per minute */
-        if ((time(NULL) - last_log) > 60) {
-	    c2s->log->level(LOG_NOTICE) << "current number of clients: " << c2s->num_clients;
-            if(c2s->local_statfile.length() > 0) {
-		std::ofstream statfile(c2s->local_statfile.c_str());
-		if (statfile)
-		    statfile << c2s->num_clients;
-            }
-            last_log = time(NULL);
-        }
-
-        /* !!! XXX Should these be configurable cleanup times? */
-        /* every so often check for timed out pending conns */
-	/*
-        if((time(&now) - last_pending) > 15) {
-	    std::map<Glib::ustring, conn_t>::iterator p;
-	    for (p = c2s->pending.begin(); p != c2s->pending.end(); ++p) {
-		// XXX we should not need this, but currently we do ... why?
-		if (p->second == NULL) {
-		    c2s->log->level(LOG_NOTICE) << "we have to erase " << p->first << " out of c2s->pending.";
-		    c2s->pending.erase(p->first);
-		    continue;
-		}
-		if (now - p->second->start > c2s->timeout && p->second->fd != -1) {
-		    conn_close(p->second, STREAM_ERR_TIMEOUT, "You have not authenticated in time");
-		}
-	    }
-            last_pending = time(NULL);
-        }
-	*/
-
-	/* cleanup the stringprep caches */
-	if ((time(NULL) - last_jid_clean) > 60) {
-	    c2s->used_jid_environment.nodes->clean_cache();
-	    c2s->used_jid_environment.domains->clean_cache();
-	    c2s->used_jid_environment.resources->clean_cache();
+    /* create the additional workers, this vector must not be resized while they are running */
+    std::vector< xmppd::pointer<c2s_st> > workers(c2s->workers - 1);
+    std::vector<pthread_t> threads(c2s->workers - 1);
+    for (int i = 0; i < c2s->workers - 1; i++) {
+	try {
+	    workers[i] = new c2s_st(*c2s, i + 1);
+	    workers[i]->configurate(workers[i]);
+	} catch (Glib::ustring message) {
+	    c2s->log->level(LOG_ERR) << "failed to create worker " << (i + 1) << ": " << message;
+	    return 1;
 	}
-
-        /* !!! XXX Move this in here for optimization? */
-        connection_rate_cleanup(c2s);
-
-        /* XXX This still feels odd having more stuff in here */
-        check_karma(c2s);
+	workers[i]->start_logging();
     }
 
-    /* TODO: Notify sessionmanager about shutdown */
-    c2s->log->level(LOG_NOTICE) << "shutting down";
-
-    /* close client connections */
-    std::vector<conn_st*>::iterator p;
-    for (p=c2s->conns.begin(); p!=c2s->conns.end(); ++p) {
-	if ((*p)->fd != -1 && (*p)->fd != c2s->sm->fd)
-	    conn_close(*p, STREAM_ERR_SYSTEM_SHUTDOWN, "shutting down " PACKAGE);
+    /* start them */
+    for (int i = 0; i < c2s->workers - 1; i++) {
+	if (pthread_create(&threads[i], NULL, _c2s_worker, &workers[i]) != 0) {
+	    c2s->log->level(LOG_ERR) << "failed to start thread for worker " << (i + 1) << ": " << strerror(errno);
+	    exit(1);
+	}
     }
+    if (c2s->workers > 1)
+	c2s->log->level(LOG_NOTICE) << "running " << c2s->workers << " workers";
 
-    DBG("Closed open client connections");
-
-    /* close session manager connection */
-    c2s->shutting_down = 1;
-    conn_close(c2s->sm, "", "");
-
-    /* exiting, clean up */
-    mio_free(c2s->mio);
+    /* the first worker runs in the main thread */
+    result = c2s_run(c2s);
 
-    for (p=c2s->conns.begin(); p!=c2s->conns.end(); ++p) {
-	delete *p;
+    /* wait for the other workers to shut down */
+    process_conns = 0;
+    for (int i = 0; i < c2s->workers - 1; i++) {
+	pthread_join(threads[i], NULL);
     }
 
-    nad_cache_free(c2s->nads);
-    if (c2s->log != NULL)
-	delete c2s->log;
-    c2s->log = NULL;
 #ifdef USE_SSL
     SSL_CTX_free(c2s->ssl_ctx);
 #endif
+    delete c2s->shared;
+    c2s->shared = NULL;
 
-    return 0;
+    return result;
 }
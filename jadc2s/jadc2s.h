@@ -7,6 +7,10 @@
 #include <vector>
 #include <iostream>
 #include <queue>
+#include <deque>
+#include <functional>
+
+#include <pthread.h>
 
 #include "mio/mio.h"
 #include <expat.h>
@@ -48,8 +52,10 @@
  * wraps the xml as it's being parsed from or written to a connection.  The
  * common conn/chunk utilities are in conn.c.
  *
- * There is one connection back to the sm at all times, all of it's processing
- * logic is in connection.c.  All of the incoming client connection processing
+ * There is one connection back to the sm at all times (or several, if more
+ * than one id is configured for the sm, the clients are then spread over
+ * these links by their JabberID), all of it's processing logic is in
+ * connection.c.  All of the incoming client connection processing
  * logic is in clients.c.
  *
  * Each of these two files consists of an I/O event callback (*_io) where the
@@ -57,6 +63,11 @@
  * state is updated based on the incoming xml and chunks are created/routed.
  *
  * All clients are hashed based on their unique id in a master hash table.
+ *
+ * If more than one worker is configured, each worker runs in its own thread
+ * with its own c2s_st instance: its own mio, connection table and sm links,
+ * and its own listening sockets sharing the client ports (SO_REUSEPORT).
+ * The little state the workers have to share is kept in c2s_shared_st.
  */
 
 /* stream error conditions */
@@ -67,9 +78,11 @@
 #define STREAM_ERR_INVALID_NAMESPACE	 "invalid-namespace"
 #define STREAM_ERR_INVALID_XML		 "invalid-xml"
 #define STREAM_ERR_NOT_AUTHORIZED	 "not-authorized"
+#define STREAM_ERR_POLICY_VIOLATION	 "policy-violation"
 #define STREAM_ERR_REMOTE_CONNECTION_FAILED "remote-connection-failed"
 #define STREAM_ERR_SYSTEM_SHUTDOWN	 "system-shutdown"
 #define STREAM_ERR_TIMEOUT		 "connection-timeout"
+#define STREAM_ERR_UNSUPPORTED_ENCODING	 "unsupported-encoding"
 
 /* forward decls */
 typedef class conn_st *conn_t;
@@ -87,8 +100,30 @@ typedef struct chunk_st
 
     /* and the char representation, for writing */
     std::string bytes;	/**< the byte representation (character data) for writing the chunk */
+    std::string head;	/**< written before bytes: start tag of the route around a raw packet */
+    std::string tail;	/**< written after bytes: end tag of that route */
+    int raw;		/**< bytes already hold the packet as received from the client, the nad does not have to be printed as long as it is not modified */
+
+    struct chunk_pool_st *pool;	/**< pool the chunk is returned to when it is freed, NULL if it is deleted */
+    struct chunk_st *next;	/**< next free chunk while the chunk is in the pool */
 } *chunk_t;
 
+/**
+ * free-list of chunks
+ *
+ * Each worker keeps the chunks it has freed, together with the capacity of
+ * their byte buffers, so that stanzas are processed without allocating
+ * chunks again. The nads of freed chunks go back to the nad cache.
+ */
+typedef struct chunk_pool_st
+{
+    nad_cache_t nads;		/**< nad cache to get the nads of new chunks from */
+    chunk_t free;		/**< first free chunk */
+    int free_count;		/**< number of free chunks */
+    unsigned long int hits;	/**< chunks taken from the free-list */
+    unsigned long int misses;	/**< chunks, that had to be allocated because the free-list was empty */
+} *chunk_pool_t;
+
 /* connection data */
 
 /**
@@ -139,9 +174,41 @@ typedef enum {
 typedef enum {
     root_element_NONE,		/**< no root element has been sent yet */
     root_element_NORMAL,	/**< a normal stream:stream element has been sent */
-    root_element_FLASH		/**< a flash:stream element has been sent */
+    root_element_FLASH,		/**< a flash:stream element has been sent */
+    root_element_WEBSOCKET	/**< an open element (RFC 7395) has been sent */
 } root_element_t;
 
+/**
+ * if the stream is transported over a WebSocket
+ */
+typedef enum {
+    websocket_NONE,		/**< no WebSocket, XML is sent directly over the connection */
+    websocket_HANDSHAKE,	/**< reading the HTTP request, that might be a WebSocket upgrade */
+    websocket_OPEN		/**< the XML elements are sent in WebSocket messages */
+} websocket_state_t;
+
+/**
+ * a link to the session manager
+ *
+ * Each link is a component connection to the router using its own id, the
+ * router routes packets for a client back on the link the client's myid
+ * belongs to.
+ */
+typedef struct sm_link_st {
+    Glib::ustring id;		/**< our id on the router for this link */
+    conn_t c;			/**< the connection, NULL while the link is down */
+    conn_t connecting;		/**< the connection, that is set up for the link, NULL if none */
+    std::deque<chunk_t> writeq;	/**< packets of the lost connection, sent when the link is up again */
+    time_t down_since;		/**< when the link went down, 0 if it is up */
+    time_t last_retry;		/**< when we last tried to reconnect the link */
+    int retries;		/**< failed reconnects since the link went down */
+    unsigned long int reconnects; /**< how often the link has been reconnected */
+    unsigned long int in_bytes;	/**< bytes read on previous connections of this link */
+    unsigned long int out_bytes; /**< bytes written on previous connections of this link */
+    unsigned long int in_stanzas; /**< stanzas read on previous connections of this link */
+    unsigned long int out_stanzas; /**< stanzas written on previous connections of this link */
+} sm_link_st;
+
 /**
  * The conn(ection) wraps the data we need for every client
  */
@@ -160,6 +227,7 @@ class conn_st {
 					 interval' */
 	time_t last_read;		/**< last time something has been read
 					 (for karma calculations) */
+	time_t karma_wake;		/**< when this conn may read again after it ate its karma, 0 if it is not waiting */
 	conn_state_t state;		/**< which of several states have been reached
 					 on the way to establish a session */
 	conn_type_t type;		/**< type of this connection
@@ -168,11 +236,14 @@ class conn_st {
 					 a session */
 	root_element_t root_element;/**< root element used on the connection */
 	Glib::ustring local_id;	/**< domain of the session manager ths client connected to */
+	int sm_link;		/**< index of the session manager link (in c2s_st::sm_links) used by this conn */
 
 #ifdef USE_SSL    
 	SSL *ssl;			/**< openssl's data for this connection */
 	autodetect_state_t autodetect_tls;
 				    /**< SSL/TLS autodetection state */
+	int ktls_send;			/**< if records sent on this connection are encrypted by the kernel */
+	int ktls_recv;			/**< if records received on this connection are decrypted by the kernel */
 #endif
 
 	/* tracking the id for the conn or chunk */
@@ -189,13 +260,26 @@ class conn_st {
 
 
 	/* chunks being written */
-	std::queue<chunk_t>	writeq;	/**< queue of chunks that have to be sent to this connection */
+	std::deque<chunk_t>	writeq;	/**< queue of chunks that have to be sent to this connection */
+	std::string::size_type writeq_offset; /**< bytes of the first chunk in writeq, that have already been written */
+#ifdef USE_SSL
+	std::string tls_record;		/**< chunks packed for the SSL_write() in progress, empty if none */
+#endif
 
 	/* parser stuff */
 	XML_Parser expat;		/**< parser used for parsing XML on this conn */
 	int depth;			/**< the element nesting level on this conn */
 	nad_t nad;			/**< the nad currently being build */
 
+	/* keeping the bytes of a stanza as received from the client */
+	const char *parse_buf;		/**< the buffer passed to the running XML_Parse() call */
+	XML_Index parse_base;		/**< byte index of parse_buf in the stream parsed by expat */
+	XML_Index raw_from;		/**< byte index of the stanza bytes, that have not been kept yet, -1 if they are not kept */
+	XML_Index raw_tag_end;		/**< byte index after the start tag of the stanza (the end of an empty element) */
+	std::string raw;		/**< the stanza bytes kept so far */
+	int raw_complete;		/**< raw holds the complete stanza */
+	int raw_usable;			/**< the stream is UTF-8, so its bytes can be forwarded as they are */
+
 #ifdef FLASH_HACK
 	/* Flash Hack */
 	int flash_hack;		/**< true if we are _currently_ replacing expat,
@@ -212,6 +296,13 @@ class conn_st {
 	/* reset stream */
 	int reset_stream;		/**< if set to 1 the stream will be reset (restarted) */
 
+	/* WebSocket */
+	websocket_state_t websocket;	/**< if the stream is transported over a WebSocket */
+	std::string ws_in;		/**< the HTTP request during the handshake, an incomplete frame after it */
+	int ws_fragmented;		/**< the last text frame received did not finish its message */
+	unsigned long long ws_message;	/**< payload received so far of the current message */
+	int ws_closing;			/**< our Close frame is queued, close the connection when it is written */
+
 	/* SASL */
 #ifdef WITH_SASL
 	sasl_conn_t *sasl_conn;	/**< connection object used by the sasl library */
@@ -230,10 +321,15 @@ void conn_error(conn_t c, const Glib::ustring &condition, const Glib::ustring &e
 /** close a conn with error (conn_t becomes invalid after this is called!) */
 void conn_close(conn_t c, const Glib::ustring &condition, const Glib::ustring &err);
 
+/** create and free a chunk pool */
+chunk_pool_t chunk_pool_new(nad_cache_t nads);
+void chunk_pool_free(chunk_pool_t pool);
+
 /** create a new chunk */
 chunk_t chunk_new(conn_t c);
 chunk_t chunk_new_packet(conn_t c, int packet_elem);
-chunk_t chunk_new_free(nad_cache_t nads);
+chunk_t chunk_new_free(chunk_pool_t pool);
+chunk_t chunk_new_empty(chunk_pool_t pool);
 
 /** and free one */
 void chunk_free(chunk_t chunk);
@@ -259,31 +355,120 @@ int conn_write(conn_t c);
 /* fill a nad with information about a user's connection */
 void connectionstate_send(xmppd::pointer<xmppd::configuration> config, conn_t c, conn_t client, int is_login);
 
+/* WebSocket transport (RFC 7395) */
+typedef int (*websocket_text_handler)(conn_t c, char *data, int len, int first, int last);
+/** read the HTTP request of a WebSocket upgrade, returns 1 if upgraded, 0 if incomplete, -1 if it is no upgrade for XMPP */
+int websocket_handshake(conn_t c, const char *buf, int len);
+/** process received frames, the payload of text messages is passed to the handler */
+int websocket_read(conn_t c, char *buf, int len, websocket_text_handler text_handler);
+/** put a chunk in a text frame */
+void websocket_frame(chunk_t chunk);
+/** send a control frame (ping, pong, close) */
+void websocket_write_control(conn_t c, int opcode, const char *payload, int len);
+
+#define WEBSOCKET_OPCODE_CONTINUATION 0x0
+#define WEBSOCKET_OPCODE_TEXT 0x1
+#define WEBSOCKET_OPCODE_CLOSE 0x8
+#define WEBSOCKET_OPCODE_PING 0x9
+#define WEBSOCKET_OPCODE_PONG 0xa
+
+/** the namespace of the open and close elements of XMPP over WebSocket */
+#define WEBSOCKET_FRAMING_NS "urn:ietf:params:xml:ns:xmpp-framing"
+
+/** maximum size of the HTTP request of a WebSocket upgrade */
+#define WEBSOCKET_MAX_REQUEST 8192
+
+
 /** maximum number of xml children in a chunk (checked by conn_read) */
 #define MAXDEPTH 10000
 #define MAXDEPTH_ERR "maximum node depth reached" /**< error to generate if MAXDEPTH reached */
 
+/** up to how many bytes of queued chunks are packed into a single SSL_write() */
+#define CONN_TLS_RECORD_SIZE 16384
+
+/** up to how many free chunks a worker keeps for reuse */
+#define CHUNK_POOL_SIZE 1024
+
+/** byte buffers of freed chunks are only kept up to this capacity */
+#define CHUNK_POOL_MAX_BYTES 16384
+
 /** maximum number of fd for daemonize */
 #define MAXFD 255
 
 /** IP Connection Rate Limit Functions **/
 int connection_rate_check(xmppd::pointer<c2s_st> c2s, const Glib::ustring& ip);
-void connection_rate_cleanup(xmppd::pointer<c2s_st> c2s);
 
-typedef struct bad_conn_st* bad_conn_t;
-struct bad_conn_st
-{
-    conn_t c;
-    time_t last;
-    bad_conn_t next;
-};
+/**
+ * a connection, that ate its karma and waits until it may read again
+ */
+typedef struct karma_timer_st {
+    time_t wake;	/**< when the connection may read again */
+    conn_t c;		/**< the connection */
 
-/* IP connection rate info */
+    bool operator>(const karma_timer_st& other) const { return wake > other.wake; }
+} karma_timer_st;
+
+/**
+ * token bucket of an IP address (or IPv6 network) in the connection rate table
+ *
+ * The tokens are counted in units of 1/connection_rate_seconds connections:
+ * a connect takes connection_rate_seconds units, each second adds
+ * connection_rate_times units, and the bucket holds up to
+ * connection_rate_times connections.
+ */
 typedef struct connection_rate_st
 {
-    Glib::ustring ip; /* need a copy of the ip */
-    int count; /* How many have connected */
-    time_t first_time; /* The time of the first conn */
+    unsigned char key[16];	/**< IPv6 address (only the /64 network) or IPv4-mapped address */
+    unsigned long int tokens;	/**< units left in the bucket */
+    time_t last;		/**< when tokens have been updated, 0 if the slot is unused */
+} connection_rate_st;
+
+/** number of shards of the connection rate table, each shard has its own lock */
+#define CONNECTION_RATE_SHARDS 16
+
+/** number of slots in each shard of the connection rate table */
+#define CONNECTION_RATE_SLOTS 2048
+
+/** number of slots an address can be stored in (the table is set-associative) */
+#define CONNECTION_RATE_WAYS 8
+
+/**
+ * a shard of the connection rate table
+ *
+ * An address can only be kept in the CONNECTION_RATE_WAYS slots of the set
+ * it is hashed to. If these are in use, the slot of the address, that is
+ * least limited, gets reused.
+ */
+typedef struct connection_rate_shard_st {
+    pthread_mutex_t mutex;	/**< lock protecting this shard */
+    connection_rate_st rates[CONNECTION_RATE_SLOTS]; /**< rate limit checks for the IP addresses in this shard */
+} connection_rate_shard_st;
+
+/**
+ * data shared by all workers of a jadc2s process
+ *
+ * The workers only keep a plain pointer to this instance, as managed
+ * pointers (xmppd::pointer) must not be used by more than one thread.
+ */
+class c2s_shared_st {
+    public:
+	/**
+	 * create the shared data for a number of workers
+	 *
+	 * @param workers the number of workers
+	 */
+	c2s_shared_st(int workers);
+
+	/**
+	 * destroy the shared data
+	 */
+	~c2s_shared_st();
+
+	connection_rate_shard_st rate_shards[CONNECTION_RATE_SHARDS]; /**< our current rate limit checks, sharded by IP address */
+
+	pthread_mutex_t stats_mutex;	/**< lock protecting clients and stats */
+	std::vector<int> clients;	/**< number of clients of each worker, as last reported by the worker */
+	std::vector<std::string> stats;	/**< state of the sm links of each worker, as last reported by the worker */
 };
 
 /** c2s master data type */
@@ -296,6 +481,17 @@ class c2s_st {
 	 */
 	c2s_st(int argc, char* const* argv);
 
+	/**
+	 * Constructor for an additional worker
+	 *
+	 * Creates an instance reading the same configuration file as the
+	 * first instance, and sharing its c2s_shared_st and SSL context
+	 *
+	 * @param first the instance of the first worker (already configurated)
+	 * @param worker the number of the new worker
+	 */
+	c2s_st(const c2s_st& first, int worker);
+
 	/**
 	 * Destructor
 	 *
@@ -308,6 +504,11 @@ class c2s_st {
 	int shutting_down;
 	xmppd::jid_environment used_jid_environment;
 
+	/* workers */
+	int worker;			/**< number of this worker, 0 for the worker in the main thread */
+	int workers;			/**< number of workers (threads) in this process */
+	c2s_shared_st *shared;		/**< data shared with the other workers */
+
 	/* setup */
 	std::list<xmppd::configuration_entry> local_id;
 	std::list<xmppd::configuration_entry> local_alias;
@@ -326,35 +527,41 @@ class c2s_st {
 	int ssl_no_tls_v1;
 	int ssl_enable_workarounds;
 	int ssl_enable_autodetect;
+	int ssl_no_ktls;		/**< do not offload the record layer to the kernel (local.ssl.no_ktls) */
 
 	SSL_CTX *ssl_ctx;
 
+	unsigned long int ktls_send;	/**< connections of this worker, for which the kernel encrypts the records sent */
+	unsigned long int ktls_recv;	/**< connections of this worker, for which the kernel decrypts the records received */
+
 	int tls_required;
 #endif
 
 	xmppd::pointer<xmppd::configuration> config;
 
 	nad_cache_t nads;		/**< nad cache */
+	chunk_pool_t chunks;		/**< free chunks of this worker */
 
 	/* client conn stuff */
-	std::map<Glib::ustring, xmppd::pointer<connection_rate_st> > connection_rates; /**< our current rate limit checks */
 	int connection_rate_times;
 	int connection_rate_seconds;
+	int max_bps;			/**< bandwidth a client may use (io.max_bps), 0 for no limit */
+	int websocket_max_message;	/**< maximum size of a message received over a WebSocket (io.websocket_max_message) */
 	std::map<Glib::ustring, conn_t> pending; /**< waiting for auth/session */
 	std::vector<struct conn_st*> conns; /**< all connected conns */
-	bad_conn_t bad_conns; /**< Karma controlled conns */
-	bad_conn_t bad_conns_tail;
+	std::priority_queue<karma_timer_st, std::vector<karma_timer_st>, std::greater<karma_timer_st> > karma_timers; /**< Karma controlled conns, the next one to wake up first */
 	int timeout; /**< how long to process mio */
 	int default_timeout; /**< configured default timeout */
 
 	int max_fds;
 
 	int num_clients;
+	unsigned int sc_id_serial;	/**< serial number for the ids of session control commands */
 
 	/* session manager stuff */
-	conn_t sm;
+	std::vector<sm_link_st> sm_links; /**< our links to the session manager, one for each configured sm.id */
 	Glib::ustring sm_host;
-	Glib::ustring sm_id;
+	Glib::ustring sm_id;		/**< our id on the router (of the first link) */
 	Glib::ustring sm_secret;
 	int sm_port;
 
@@ -374,6 +581,9 @@ class c2s_st {
 	int sasl_noseclayer;	/**< 0 = allow SASL security layer, 1 = do not allow SASL security layer */
 	unsigned sasl_sec_flags;	/**< SASL security flags to set */
 	std::list<xmppd::configuration_entry> sasl_admin; /**< accounts, that are allowed to authorize as other users */
+#ifdef WITH_SASL
+	sasl_callback_t sasl_callbacks[3]; /**< callbacks for the SASL connections of this worker */
+#endif
 
 	void seed_random();	/**< seed the random number generator */
 	void configurate(xmppd::pointer<c2s_st> xptr_to_self); /**< process teh configuration settings */
@@ -381,15 +591,38 @@ class c2s_st {
     private:
 	Glib::ustring rand_dev;	/**< device used for reading random data */
 	bool config_loaded;	/**< if the configuration file has been loaded */
+	Glib::ustring config_file; /**< the configuration file that has been loaded */
 	void parse_commandline(int argc, char* const* argv); /**< parse the commandline */
+	void set_config_defaults(); /**< set the default values of configuration settings */
 };
 
 /** the handler for client mio events */
 int client_io(mio_t m, mio_action_t a, int fd, const void *data, void *arg);
 void client_send_sc_command(conn_t sm_conn, const Glib::ustring& to, const Glib::ustring& from, const Glib::ustring& action, const xmppd::pointer<xmppd::jid> target, const Glib::ustring& id, const Glib::ustring& sc_sm, const Glib::ustring& sc_c2s);
 
-/** create a sm connection (block until it's connected) */
-int connect_new(xmppd::pointer<c2s_st> c2s);
+/** start connecting a session manager link */
+int connect_new(xmppd::pointer<c2s_st> c2s, int link);
+
+/** connect the session manager links at startup */
+int connect_links(xmppd::pointer<c2s_st> c2s);
+
+/** assign a client connection to one of the session manager links */
+void connect_assign(conn_t c, xmppd::pointer<xmppd::jid> user);
+
+/** get the session manager link a client connection sends its packets on */
+conn_t connect_get(conn_t c);
+
+/** check if a connection is one of our session manager links */
+int connect_is_link(conn_t c);
+
+/** send a packet of a client connection to the session manager */
+void connect_write(conn_t c, chunk_t chunk, const Glib::ustring& to, const Glib::ustring& from, const Glib::ustring& type);
+
+/** try to reconnect session manager links, that are down */
+void connect_check_links(xmppd::pointer<c2s_st> c2s);
+
+/** write the state and traffic counters of the session manager links */
+void connect_write_stats(xmppd::pointer<c2s_st> c2s, std::ostream& out);
 
 /* wrappers around read() and write(), with ssl support */
 int _read_actual(conn_t c, int fd, char *buf, size_t count);
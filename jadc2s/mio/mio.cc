@@ -52,6 +52,12 @@
 #ifdef MIO_EPOLL
 #include "mio_epoll.h"
 #endif
+#ifdef MIO_EPOLL_ET
+#include "mio_epoll_et.h"
+#endif
+#ifdef MIO_URING
+#include "mio_uring.h"
+#endif
 #ifdef MIO_SELECT
 #include "mio_select.h"
 #endif
@@ -97,6 +103,35 @@ struct mio_st
     MIO_VARS;
 };
 
+/*
+ * edge-triggered backends have to know if a handler stopped because the
+ * socket would block, the others do not care
+ */
+#ifndef MIO_READ_DONE
+# define MIO_READ_DONE(m, fd, blocked)  ((void)(blocked))
+# define MIO_WRITE_DONE(m, fd, blocked) ((void)(blocked))
+#endif
+
+/*
+ * backends, that accept new connections themselves, hand them out here
+ */
+#ifndef MIO_ACCEPT
+# define MIO_ACCEPT(m, fd, addr, addrlen) accept(fd, addr, addrlen)
+#endif
+
+/*
+ * backends, that receive data themselves, hand it out here
+ */
+#ifndef MIO_RECV
+# define MIO_RECV(m, fd, buf, count) read(fd, buf, count)
+# define MIO_RECV_BUFFERED(m, fd)
+#endif
+
+/**
+ * check if the last operation on a socket failed because it would block
+ */
+#define MIO_WOULDBLOCK (errno == EAGAIN || errno == EWOULDBLOCK)
+
 /**
  * accessor macro for a fd
  */
@@ -163,8 +198,9 @@ void mio_close(mio_t m, int fd)
  *
  * @param m the mio on which the connection is accepted
  * @param fd the fd of the incoming connection
+ * @return 0 if the accept queue has been empty, 1 else
  */
-static void _mio_accept(mio_t m, int fd) {
+static int _mio_accept(mio_t m, int fd) {
     std::ostringstream ip;
 #ifdef USE_IPV6
     struct sockaddr_storage serv_addr;
@@ -179,13 +215,14 @@ static void _mio_accept(mio_t m, int fd) {
 
     /* sanity check */
     if (m == NULL || fd < 0)
-	return;
+	return 0;
 
     mio_debug(ZONE, "accepting on fd #%d", fd);
 
     /* pull a socket off the accept queue and check */
-    newfd = accept(fd, (struct sockaddr*)&serv_addr, (socklen_t *)&addrlen);
-    if(newfd <= 0) return;
+    newfd = MIO_ACCEPT(m, fd, (struct sockaddr*)&serv_addr, (socklen_t *)&addrlen);
+    if(newfd < 0) return !MIO_WOULDBLOCK;
+    if(newfd == 0) return 1;
 
 #ifdef USE_IPV6
     switch (serv_addr.ss_family) {
@@ -217,7 +254,7 @@ static void _mio_accept(mio_t m, int fd) {
             mio_debug(ZONE,"failed to add fd");
             if(dupfd >= 0) close(dupfd);
 
-            return;
+            return 1;
         }
 
         newfd = dupfd;
@@ -233,7 +270,7 @@ static void _mio_accept(mio_t m, int fd) {
         memset(&FD(m, newfd), 0, sizeof(struct mio_fd_st));
     }
 
-    return;
+    return 1;
 }
 
 /**
@@ -335,7 +372,7 @@ void mio_run(mio_t m, int timeout)
 
     /* loop through the sockets, check for stuff to do */
     if(retval > 0)
-#ifdef MIO_EPOLL
+#if defined(MIO_EPOLL) || defined(MIO_EPOLL_ET) || defined(MIO_URING)
     for(i = 0; i < retval; i++)
     {
         fd = m->events[i].data.fd;
@@ -350,7 +387,7 @@ void mio_run(mio_t m, int timeout)
         /* new conns on a listen socket */
         if(FD(m,fd).type == type_LISTEN && MIO_CAN_READ(m, i))
         {
-            _mio_accept(m, fd);
+            MIO_READ_DONE(m, fd, !_mio_accept(m, fd));
             continue;
         }
 
@@ -365,8 +402,11 @@ void mio_run(mio_t m, int timeout)
         if(FD(m,fd).type == type_NORMAL && MIO_CAN_READ(m, i))
         {
             /* if they don't want to read any more right now */
+            errno = 0;
             if(ACT(m, fd, action_READ, NULL) == 0)
                 MIO_UNSET_READ(m, fd);
+            else
+                MIO_READ_DONE(m, fd, MIO_WOULDBLOCK);
             FD(m,fd).last_activity = time(NULL);
         }
 
@@ -374,8 +414,11 @@ void mio_run(mio_t m, int timeout)
         if(FD(m,fd).type == type_NORMAL && MIO_CAN_WRITE(m, i))
         {
             /* don't wait for writeability if nothing to write anymore */
+            errno = 0;
             if(ACT(m, fd, action_WRITE, NULL) == 0)
                 MIO_UNSET_WRITE(m, fd);
+            else
+                MIO_WRITE_DONE(m, fd, MIO_WOULDBLOCK);
             FD(m,fd).last_activity = time(NULL);
         }
     }
@@ -450,6 +493,25 @@ void mio_free(mio_t m)
     free(m);
 }
 
+const char *mio_backend(mio_t m)
+{
+    return MIO_NAME(m);
+}
+
+/* let the backend receive the data of this fd */
+void mio_recv_buffered(mio_t m, int fd)
+{
+    if(m == NULL || fd < 0) return;
+
+    MIO_RECV_BUFFERED(m, fd);
+}
+
+/* read data mio received, or from the socket */
+int mio_recv(mio_t m, int fd, char *buf, size_t count)
+{
+    return MIO_RECV(m, fd, buf, count);
+}
+
 /* start processing read events */
 void mio_read(mio_t m, int fd)
 {
@@ -468,6 +530,8 @@ void mio_read(mio_t m, int fd)
 /* try writing to the socket via the app */
 void mio_write(mio_t m, int fd)
 {
+    int saved_errno = errno;
+
     if(m == NULL || fd < 0) return;
 
     /* if connecting, do this later */
@@ -477,14 +541,26 @@ void mio_write(mio_t m, int fd)
         return;
     }
 
-    if(ACT(m, fd, action_WRITE, NULL) == 0) return;
+    /* keep errno of a read handler calling us, mio_run() checks it */
+    errno = 0;
+    if(ACT(m, fd, action_WRITE, NULL) == 0)
+    {
+        errno = saved_errno;
+        return;
+    }
 
     /* not all written, do more l8r */
     MIO_SET_WRITE(m, fd);
+    MIO_WRITE_DONE(m, fd, MIO_WOULDBLOCK);
+    errno = saved_errno;
 }
 
-/* set up a listener in this mio w/ this default app/arg */
-int mio_listen(mio_t m, int port, const char *sourceip, mio_handler_t app, void *arg)
+/**
+ * set up a listener in this mio w/ this default app/arg
+ *
+ * @param shared if the port can be shared with other sockets using SO_REUSEPORT
+ */
+static int _mio_listen(mio_t m, int port, const char *sourceip, mio_handler_t app, void *arg, int shared)
 {
     int fd, flag = 1, af = AF_INET;
 #ifdef USE_IPV6
@@ -524,6 +600,18 @@ int mio_listen(mio_t m, int port, const char *sourceip, mio_handler_t app, void
     if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (char*)&flag, sizeof(flag)) < 0) return -1;
     if(setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char*)&flag, sizeof(flag)) < 0)
         return(-1);
+    if (shared) {
+#ifdef SO_REUSEPORT
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (char*)&flag, sizeof(flag)) < 0) {
+	    close(fd);
+	    return -1;
+	}
+#else
+	mio_debug(ZONE, "SO_REUSEPORT not supported, cannot share port %d", port);
+	close(fd);
+	return -1;
+#endif
+    }
 
     /* set up and bind address info */
 #ifdef USE_IPV6
@@ -583,6 +671,16 @@ int mio_listen(mio_t m, int port, const char *sourceip, mio_handler_t app, void
     return fd;
 }
 
+int mio_listen(mio_t m, int port, const char *sourceip, mio_handler_t app, void *arg)
+{
+    return _mio_listen(m, port, sourceip, app, arg, 0);
+}
+
+int mio_listen_shared(mio_t m, int port, const char *sourceip, mio_handler_t app, void *arg)
+{
+    return _mio_listen(m, port, sourceip, app, arg, 1);
+}
+
 /* create an fd and connect to the given ip/port */
 int mio_connect(mio_t m, int port, char *hostip, mio_handler_t app, void *arg)
 {
@@ -67,7 +67,10 @@ typedef enum {
  * @param fd the fd on which the action happened
  * @param data action specific data
  * @param arg user provided argument at registering the callback
- * @return ?
+ * @return for action_READ and action_WRITE: 0 if no more events are wanted,
+ * non-zero to get called again. With the edge-triggered epoll backend the
+ * handler gets called again without waiting for a new event, until it returns
+ * with errno set to EAGAIN (as left by read() or write()).
  */
 typedef int (*mio_handler_t) (mio_t m, mio_action_t a, int fd, const void* data, void *arg);
 
@@ -86,6 +89,17 @@ mio_t mio_new(int maxfd);
  */
 void mio_free(mio_t m);
 
+/**
+ * get the name of the backend a mio instance is using
+ *
+ * This is the configured backend, or the backend it fell back to, if the
+ * configured one is not supported by the running kernel.
+ *
+ * @param m the mio instance
+ * @return name of the backend (e.g. "epoll" or "io_uring")
+ */
+const char *mio_backend(mio_t m);
+
 /**
  * create a new listen socket in this mio
  *
@@ -98,6 +112,22 @@ void mio_free(mio_t m);
  */
 int mio_listen(mio_t m, int port, const char *sourceip, mio_handler_t app, void *arg);
 
+/**
+ * create a new listen socket in this mio, that shares its port with the
+ * listen sockets of other mio instances (SO_REUSEPORT)
+ *
+ * The kernel distributes the incoming connections over all sockets
+ * listening on the port.
+ *
+ * @param m the mio to use
+ * @param port listen on which port
+ * @param sourceip listen on which IP address
+ * @param app callback to use
+ * @param arg what to pass to the arg argument of the mio_handler_t() function
+ * @return <0 on failure (or if SO_REUSEPORT is not supported), new fd else
+ */
+int mio_listen_shared(mio_t m, int port, const char *sourceip, mio_handler_t app, void *arg);
+
 /**
  * create a new socket connected to this ip:port
  *
@@ -157,6 +187,33 @@ void mio_write(mio_t m, int fd);
  */
 void mio_read(mio_t m, int fd);
 
+/**
+ * let mio receive the data of this fd
+ *
+ * Backends, that can receive data themselves (io_uring into its provided
+ * buffers), do so for this fd from now on. The application has to read the
+ * fd using mio_recv() then, it must neither read nor peek at the socket
+ * itself (e.g. through OpenSSL) anymore. Other backends ignore this.
+ *
+ * @param m the mio to use
+ * @param fd the fd
+ */
+void mio_recv_buffered(mio_t m, int fd);
+
+/**
+ * read data from a fd
+ *
+ * Returns the data mio already received for the fd (see
+ * mio_recv_buffered()), or reads from the socket.
+ *
+ * @param m the mio to use
+ * @param fd the fd
+ * @param buf where to store the data
+ * @param count size of buf
+ * @return number of bytes read, 0 at the end of the stream, -1 on error (errno is EAGAIN if no data is available)
+ */
+int mio_recv(mio_t m, int fd, char *buf, size_t count);
+
 /**
  * give some cpu time to mio to check its sockets
  *
@@ -14,6 +14,15 @@
         return 0;                                                       \
     }                                                                   \
                                                                         \
+    static int _mio_setflags(mio_t m, int fd, __uint32_t flags)         \
+    {                                                                   \
+        /* only tell the kernel if the interest set really changed */   \
+        if (m->evflags[fd] == flags)                                    \
+            return 0;                                                   \
+        m->evflags[fd] = flags;                                         \
+        return _mio_fdop(m->epfd, fd, EPOLL_CTL_MOD, flags);            \
+    }                                                                   \
+                                                                        \
     static int _mio_epoll(mio_t m, int t)                               \
     {                                                                   \
         return epoll_wait(m->epfd, m->events, m->maxfd, t*1000);        \
@@ -42,21 +51,23 @@
         memset(m->evflags, 0, sizeof(__uint32_t) * (maxfd + 1));        \
     } while(0)
 
-#define MIO_FREE_VARS(m)        free(m->events); close(m->epfd)
+#define MIO_FREE_VARS(m)        free(m->events); free(m->evflags); close(m->epfd)
 
-#define MIO_INIT_FD(m, pfd)     _mio_fdop(m->epfd, pfd, EPOLL_CTL_ADD, 0)
+#define MIO_INIT_FD(m, pfd)     _mio_fdop(m->epfd, pfd, EPOLL_CTL_ADD, m->evflags[pfd] = 0)
 
 #define MIO_REMOVE_FD(m, pfd)   _mio_fdop(m->epfd, pfd, EPOLL_CTL_DEL, 0)
 
 #define MIO_CHECK(m, t)         _mio_epoll(m, t)
 
-#define MIO_SET_READ(m, fd)     _mio_fdop(m->epfd, fd, EPOLL_CTL_MOD, m->evflags[fd] |= EPOLLIN)
-#define MIO_SET_WRITE(m, fd)    _mio_fdop(m->epfd, fd, EPOLL_CTL_MOD, m->evflags[fd] |= EPOLLOUT)
+#define MIO_SET_READ(m, fd)     _mio_setflags(m, fd, m->evflags[fd] | EPOLLIN)
+#define MIO_SET_WRITE(m, fd)    _mio_setflags(m, fd, m->evflags[fd] | EPOLLOUT)
 
-#define MIO_UNSET_READ(m, fd)   _mio_fdop(m->epfd, fd, EPOLL_CTL_MOD, m->evflags[fd] &= ~EPOLLIN)
-#define MIO_UNSET_WRITE(m, fd)  _mio_fdop(m->epfd, fd, EPOLL_CTL_MOD, m->evflags[fd] &= ~EPOLLOUT)
+#define MIO_UNSET_READ(m, fd)   _mio_setflags(m, fd, m->evflags[fd] & ~EPOLLIN)
+#define MIO_UNSET_WRITE(m, fd)  _mio_setflags(m, fd, m->evflags[fd] & ~EPOLLOUT)
 
 #define MIO_CAN_READ(m, e)      m->events[e].events & (EPOLLIN|EPOLLHUP|EPOLLERR)
 #define MIO_CAN_WRITE(m, e)     m->events[e].events & EPOLLOUT
 
 #define MIO_ERROR(m)            errno
+
+#define MIO_NAME(m)             "epoll"
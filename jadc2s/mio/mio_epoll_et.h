@@ -0,0 +1,199 @@
+#include <sys/epoll.h>
+
+/*
+ * edge-triggered epoll backend
+ *
+ * Each fd is registered once with EPOLLIN|EPOLLOUT|EPOLLET. What the
+ * application is interested in is only kept in user space (interest[]), so
+ * mio_read()/mio_write() and the unset calls never need a system call.
+ *
+ * As the kernel reports each change of readiness only once, the readiness is
+ * remembered in ready[] until a handler runs into EAGAIN. Sockets that are
+ * ready and wanted by the application are put on the pending list and
+ * processed by the next mio_run() without waiting in epoll_wait().
+ *
+ * The io_uring backend (mio_uring.h) shares this bookkeeping, it only gets
+ * the readiness from a completion ring instead of epoll_wait().
+ */
+
+/** minimum number of events fetched by one epoll_wait() call */
+#define MIO_ET_MIN_BATCH 32
+
+#define MIO_ET_FUNCS \
+    static int _mio_et_add(mio_t m, int fd)                             \
+    {                                                                   \
+        struct epoll_event ev;                                          \
+        ev.events = EPOLLIN|EPOLLOUT|EPOLLET;                           \
+        ev.data.u64 = 0;                                                \
+        ev.data.fd = fd;                                                \
+        if (epoll_ctl(m->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {          \
+            mio_debug(ZONE, "epoll add on fd %d failed", fd);           \
+            return -1;                                                  \
+        }                                                               \
+        m->interest[fd] = 0;                                            \
+        m->ready[fd] = 0;                                               \
+        m->nfds++;                                                      \
+        return 0;                                                       \
+    }                                                                   \
+                                                                        \
+    static void _mio_et_remove(mio_t m, int fd)                         \
+    {                                                                   \
+        struct epoll_event ev;                                          \
+        ev.events = 0;                                                  \
+        ev.data.u64 = 0;                                                \
+        if (epoll_ctl(m->epfd, EPOLL_CTL_DEL, fd, &ev) == 0)            \
+            m->nfds--;                                                  \
+        /* an entry on the pending list is skipped, as nothing is wanted */ \
+        m->interest[fd] = 0;                                            \
+        m->ready[fd] = 0;                                               \
+    }                                                                   \
+                                                                        \
+    static void _mio_et_queue(mio_t m, int fd)                          \
+    {                                                                   \
+        if (m->queued[fd] || !(m->ready[fd] & m->interest[fd]))         \
+            return;                                                     \
+        m->queued[fd] = 1;                                              \
+        m->pending[m->npending++] = fd;                                 \
+    }                                                                   \
+                                                                        \
+    static void _mio_et_want(mio_t m, int fd, __uint32_t ev)            \
+    {                                                                   \
+        m->interest[fd] |= ev;                                          \
+        _mio_et_queue(m, fd);                                           \
+    }                                                                   \
+                                                                        \
+    static void _mio_et_done(mio_t m, int fd, __uint32_t ev, int blocked) \
+    {                                                                   \
+        if (blocked)                                                    \
+            m->ready[fd] &= ~ev;                                        \
+        else                                                            \
+            _mio_et_queue(m, fd);                                       \
+    }                                                                   \
+                                                                        \
+    static void _mio_et_ready(mio_t m, int fd, __uint32_t ev)           \
+    {                                                                   \
+        if (ev & (EPOLLHUP|EPOLLERR))                                   \
+            ev |= EPOLLIN;                                              \
+        m->ready[fd] |= ev & (EPOLLIN|EPOLLOUT);                        \
+        _mio_et_queue(m, fd);                                           \
+    }                                                                   \
+                                                                        \
+    static int _mio_et_collect(mio_t m)                                 \
+    {                                                                   \
+        int i, fd, count = 0;                                           \
+        __uint32_t ev;                                                  \
+                                                                        \
+        /* hand the pending sockets to mio_run(), new work gets queued again */ \
+        for (i = 0; i < m->npending; i++) {                             \
+            fd = m->pending[i];                                         \
+            m->queued[fd] = 0;                                          \
+            ev = m->ready[fd] & m->interest[fd];                        \
+            if (ev == 0) continue;                                      \
+            m->events[count].data.fd = fd;                              \
+            m->events[count].events = ev;                               \
+            count++;                                                    \
+        }                                                               \
+        m->npending = 0;                                                \
+                                                                        \
+        return count;                                                   \
+    }                                                                   \
+                                                                        \
+    static int _mio_epoll_et(mio_t m, int t)                            \
+    {                                                                   \
+        int n, i, batch;                                                \
+                                                                        \
+        /* fetch as many events as we might get, but not less than the minimum */ \
+        batch = m->nfds < MIO_ET_MIN_BATCH ? MIO_ET_MIN_BATCH : m->nfds; \
+        if (batch > m->maxfd) batch = m->maxfd;                         \
+                                                                        \
+        /* do not sleep if there is still work left from the last run */ \
+        n = epoll_wait(m->epfd, m->kevents, batch, m->npending > 0 ? 0 : t*1000); \
+        if (n < 0) {                                                    \
+            if (m->npending == 0) return -1;                            \
+            n = 0;                                                      \
+        }                                                               \
+                                                                        \
+        for (i = 0; i < n; i++)                                         \
+            _mio_et_ready(m, m->kevents[i].data.fd, m->kevents[i].events); \
+                                                                        \
+        return _mio_et_collect(m);                                      \
+    }
+
+#define MIO_ET_VARS \
+    int epfd; \
+    struct epoll_event *kevents;    /**< events as returned by epoll_wait() */ \
+    struct epoll_event *events;     /**< sockets mio_run() has to process */ \
+    __uint32_t *interest;           /**< events the application waits for */ \
+    __uint32_t *ready;              /**< readiness not yet consumed up to EAGAIN */ \
+    char *queued;                   /**< if a fd is on the pending list */ \
+    int *pending;                   /**< sockets to process in the next run */ \
+    int npending; \
+    int nfds;
+
+/* allocate the bookkeeping, shared with the io_uring backend */
+#define MIO_ET_ALLOC_VARS(m, maxfd) \
+    do {                                                                \
+        m->npending = 0;                                                \
+        m->nfds = 0;                                                    \
+        m->kevents = static_cast<epoll_event*>(calloc(maxfd + 1, sizeof(struct epoll_event))); \
+        m->events = static_cast<epoll_event*>(calloc(maxfd + 1, sizeof(struct epoll_event))); \
+        m->interest = static_cast<__uint32_t*>(calloc(maxfd + 1, sizeof(__uint32_t))); \
+        m->ready = static_cast<__uint32_t*>(calloc(maxfd + 1, sizeof(__uint32_t))); \
+        m->queued = static_cast<char*>(calloc(maxfd + 1, sizeof(char))); \
+        m->pending = static_cast<int*>(calloc(maxfd + 1, sizeof(int))); \
+    } while(0)
+
+#define MIO_ET_FREE_VARS(m) \
+    do {                                                                \
+        free(m->kevents);                                               \
+        free(m->events);                                                \
+        free(m->interest);                                              \
+        free(m->ready);                                                 \
+        free(m->queued);                                                \
+        free(m->pending);                                               \
+    } while(0)
+
+#ifndef MIO_URING
+
+#define MIO_FUNCS               MIO_ET_FUNCS
+
+#define MIO_VARS                MIO_ET_VARS
+
+#define MIO_INIT_VARS(m) \
+    do {                                                                \
+        m->epfd = epoll_create(maxfd);                                  \
+        if (m->epfd == -1) {                                            \
+            mio_debug(ZONE, "Can't epoll_create(%d).", maxfd);          \
+            free(m->fds);                                               \
+            free(m);                                                    \
+            return NULL;                                                \
+        }                                                               \
+        mio_debug(ZONE, "epoll fd created: %d (size=%d)", m->epfd, maxfd); \
+        MIO_ET_ALLOC_VARS(m, maxfd);                                    \
+    } while(0)
+
+#define MIO_FREE_VARS(m)        MIO_ET_FREE_VARS(m); close(m->epfd)
+
+#define MIO_INIT_FD(m, pfd)     _mio_et_add(m, pfd)
+
+#define MIO_REMOVE_FD(m, pfd)   _mio_et_remove(m, pfd)
+
+#define MIO_CHECK(m, t)         _mio_epoll_et(m, t)
+
+#define MIO_SET_READ(m, fd)     _mio_et_want(m, fd, EPOLLIN)
+#define MIO_SET_WRITE(m, fd)    _mio_et_want(m, fd, EPOLLOUT)
+
+#define MIO_UNSET_READ(m, fd)   m->interest[fd] &= ~EPOLLIN
+#define MIO_UNSET_WRITE(m, fd)  m->interest[fd] &= ~EPOLLOUT
+
+#define MIO_CAN_READ(m, e)      m->events[e].events & EPOLLIN
+#define MIO_CAN_WRITE(m, e)     m->events[e].events & EPOLLOUT
+
+#define MIO_READ_DONE(m, fd, blocked)   _mio_et_done(m, fd, EPOLLIN, blocked)
+#define MIO_WRITE_DONE(m, fd, blocked)  _mio_et_done(m, fd, EPOLLOUT, blocked)
+
+#define MIO_ERROR(m)            errno
+
+#define MIO_NAME(m)             "epoll-et"
+
+#endif /* MIO_URING */
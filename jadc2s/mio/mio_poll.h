@@ -18,7 +18,7 @@
 
 #define MIO_INIT_VARS(m) \
     do {                                                                \
-        if((m->pfds = malloc(sizeof(struct pollfd) * maxfd)) == NULL)   \
+        if((m->pfds = static_cast<pollfd*>(malloc(sizeof(struct pollfd) * maxfd))) == NULL) \
         {                                                               \
             mio_debug(ZONE, "internal error creating new mio");         \
             free(m->fds);                                               \
@@ -46,3 +46,5 @@
 #define MIO_CAN_WRITE(m, fd)    m->pfds[fd].revents & POLLOUT
 
 #define MIO_ERROR(m)            errno
+
+#define MIO_NAME(m)             "poll"
@@ -38,3 +38,5 @@
 #define MIO_CAN_WRITE(m, fd)    FD_ISSET(fd, &m->wfds_out)
 
 #define MIO_ERROR(m)            errno
+
+#define MIO_NAME(m)             "select"
@@ -0,0 +1,741 @@
+#include "mio_epoll_et.h"
+
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <endian.h>
+#include <poll.h>
+
+/*
+ * io_uring backend
+ *
+ * The readiness of the sockets is reported through the completion ring of
+ * an io_uring: each socket gets one multishot poll request for
+ * POLLIN|POLLOUT, listening sockets get a multishot accept request, so new
+ * connections arrive already accepted. New requests are only queued in the
+ * submission ring, and handed to the kernel together with the wait for
+ * completions in a single io_uring_enter() per mio_run().
+ *
+ * Multishot requests report each change of readiness only once, so the
+ * bookkeeping of the edge-triggered epoll backend is used: the readiness is
+ * remembered until a handler runs into EAGAIN, and what the application is
+ * interested in is only kept in user space.
+ *
+ * Sockets, the application passed to mio_recv_buffered(), get a multishot
+ * recv request instead of being polled for POLLIN. The kernel receives
+ * their data into a ring of provided buffers, that is shared by all
+ * sockets, so memory is only used for data that has arrived and not been
+ * read yet. mio_recv() copies the data out and gives the buffers back to
+ * the kernel. If a socket has MIO_URING_RECV_QUEUE buffers waiting (the
+ * application does not read, e.g. because of karma), or the kernel ran
+ * out of buffers, the request is stopped; the application reads from the
+ * socket until EAGAIN then, and the request is made again.
+ *
+ * Kernels before 5.19 (that have no multishot accept) and kernels with
+ * io_uring disabled refuse to set up the ring, mio_new() falls back to
+ * edge-triggered epoll then. If the kernel refuses multishot accept
+ * nevertheless, listening sockets are polled and accept() is used. Without
+ * multishot recv (before 6.0) mio_recv() just reads from the socket.
+ */
+
+/** number of entries in the submission ring */
+#define MIO_URING_SQ_ENTRIES 1024
+
+/** number of provided buffers for receiving, has to be a power of 2 */
+#define MIO_URING_BUFFERS       1024
+
+/** size of a provided buffer */
+#define MIO_URING_BUFFER_SIZE   2048
+
+/** number of received buffers a socket may have, before receiving is stopped */
+#define MIO_URING_RECV_QUEUE    16
+
+/** buffer group of the provided buffers */
+#define MIO_URING_BGID          0
+
+/** user_data of requests, whose completions are not of interest */
+#define MIO_URING_IGNORE        0xffffffffffffffffULL
+
+/** flag in the user_data of accept requests, the rest is generation << 32 | fd */
+#define MIO_URING_ACCEPT        0x8000000000000000ULL
+
+/** flag in the user_data of recv requests */
+#define MIO_URING_RECV          0x4000000000000000ULL
+
+/* requests a fd has in the ring */
+#define MIO_URING_UNARMED       0       /**< none */
+#define MIO_URING_POLLING       1       /**< multishot poll */
+#define MIO_URING_ACCEPTING     2       /**< multishot accept */
+
+/* how the data of a fd is received */
+#define MIO_URING_RECV_NONE     0       /**< by the application */
+#define MIO_URING_RECV_ARMED    1       /**< into provided buffers by a multishot recv */
+#define MIO_URING_RECV_CANCELED 2       /**< the recv is being canceled */
+#define MIO_URING_RECV_STOPPED  3       /**< no recv, mio_recv() reads from the socket */
+
+#if __BYTE_ORDER == __BIG_ENDIAN
+# define MIO_URING_POLL32(ev)   (((ev) << 16) | ((ev) >> 16))
+#else
+# define MIO_URING_POLL32(ev)   (ev)
+#endif
+
+#define MIO_FUNCS \
+    MIO_ET_FUNCS                                                        \
+                                                                        \
+    static void _mio_uring_buffer_put(mio_t m, int bid)                 \
+    {                                                                   \
+        /* not bufs[], in C++ the empty struct of __DECLARE_FLEX_ARRAY moves it behind the tail */ \
+        struct io_uring_buf *buf = reinterpret_cast<io_uring_buf*>(m->buf_ring) + (m->buf_tail & (MIO_URING_BUFFERS - 1)); \
+                                                                        \
+        /* the tail overlays resv of the first entry, so it is not touched */ \
+        buf->addr = reinterpret_cast<__u64>(m->buf_data + bid * MIO_URING_BUFFER_SIZE); \
+        buf->len = MIO_URING_BUFFER_SIZE;                               \
+        buf->bid = bid;                                                 \
+        __atomic_store_n(&m->buf_ring->tail, ++m->buf_tail, __ATOMIC_RELEASE); \
+    }                                                                   \
+                                                                        \
+    static void _mio_uring_setup_buffers(mio_t m)                       \
+    {                                                                   \
+        struct io_uring_buf_reg reg;                                    \
+                                                                        \
+        m->recv_multishot = 0;                                          \
+        m->buf_ring = static_cast<io_uring_buf_ring*>(mmap(NULL, MIO_URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0)); \
+        if (m->buf_ring == MAP_FAILED) {                                \
+            m->buf_ring = NULL;                                         \
+            return;                                                     \
+        }                                                               \
+        m->buf_data = static_cast<char*>(malloc(MIO_URING_BUFFERS * MIO_URING_BUFFER_SIZE)); \
+                                                                        \
+        memset(&reg, 0, sizeof(reg));                                   \
+        reg.ring_addr = reinterpret_cast<__u64>(m->buf_ring);           \
+        reg.ring_entries = MIO_URING_BUFFERS;                           \
+        reg.bgid = MIO_URING_BGID;                                      \
+        if (m->buf_data == NULL || syscall(__NR_io_uring_register, m->ringfd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) { \
+            mio_debug(ZONE, "no provided buffers, the application reads the sockets"); \
+            munmap(m->buf_ring, MIO_URING_BUFFERS * sizeof(struct io_uring_buf)); \
+            free(m->buf_data);                                          \
+            m->buf_ring = NULL;                                         \
+            m->buf_data = NULL;                                         \
+            return;                                                     \
+        }                                                               \
+                                                                        \
+        m->buf_tail = 0;                                                \
+        for (int bid = 0; bid < MIO_URING_BUFFERS; bid++)               \
+            _mio_uring_buffer_put(m, bid);                              \
+        m->recv_multishot = 1;                                          \
+    }                                                                   \
+                                                                        \
+    static int _mio_uring_setup(mio_t m, int maxfd)                     \
+    {                                                                   \
+        struct io_uring_params p;                                       \
+        unsigned *array;                                                \
+        size_t sq_size, cq_size;                                        \
+                                                                        \
+        memset(&p, 0, sizeof(p));                                       \
+        /* COOP_TASKRUN came with 5.19 (as multishot accept), older kernels refuse it */ \
+        p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN; \
+        p.cq_entries = maxfd * 2;                                       \
+        m->ringfd = syscall(__NR_io_uring_setup, MIO_URING_SQ_ENTRIES, &p); \
+        if (m->ringfd < 0) {                                            \
+            mio_debug(ZONE, "io_uring_setup failed: %s", strerror(errno)); \
+            return -1;                                                  \
+        }                                                               \
+        if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP) || !(p.features & IORING_FEAT_EXT_ARG)) { \
+            mio_debug(ZONE, "io_uring is missing features (0x%x)", p.features); \
+            close(m->ringfd);                                           \
+            m->ringfd = -1;                                             \
+            return -1;                                                  \
+        }                                                               \
+                                                                        \
+        /* map the rings */                                             \
+        sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);     \
+        cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe); \
+        m->ring_size = sq_size > cq_size ? sq_size : cq_size;           \
+        m->ring = static_cast<char*>(mmap(NULL, m->ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, m->ringfd, IORING_OFF_SQ_RING)); \
+        if (m->ring == MAP_FAILED) {                                    \
+            close(m->ringfd);                                           \
+            m->ringfd = -1;                                             \
+            return -1;                                                  \
+        }                                                               \
+        m->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);      \
+        m->sqes = static_cast<io_uring_sqe*>(mmap(NULL, m->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, m->ringfd, IORING_OFF_SQES)); \
+        if (m->sqes == MAP_FAILED) {                                    \
+            munmap(m->ring, m->ring_size);                              \
+            close(m->ringfd);                                           \
+            m->ringfd = -1;                                             \
+            return -1;                                                  \
+        }                                                               \
+                                                                        \
+        m->sq_head = reinterpret_cast<unsigned*>(m->ring + p.sq_off.head); \
+        m->sq_tail = reinterpret_cast<unsigned*>(m->ring + p.sq_off.tail); \
+        m->sq_mask = *reinterpret_cast<unsigned*>(m->ring + p.sq_off.ring_mask); \
+        m->sq_entries = p.sq_entries;                                   \
+        m->sq_queued = 0;                                               \
+        array = reinterpret_cast<unsigned*>(m->ring + p.sq_off.array);  \
+        for (unsigned i = 0; i < p.sq_entries; i++)                     \
+            array[i] = i;                                               \
+        m->cq_head = reinterpret_cast<unsigned*>(m->ring + p.cq_off.head); \
+        m->cq_tail = reinterpret_cast<unsigned*>(m->ring + p.cq_off.tail); \
+        m->cq_mask = *reinterpret_cast<unsigned*>(m->ring + p.cq_off.ring_mask); \
+        m->cqes = reinterpret_cast<io_uring_cqe*>(m->ring + p.cq_off.cqes); \
+        m->multishot_accept = 1;                                        \
+        _mio_uring_setup_buffers(m);                                    \
+                                                                        \
+        mio_debug(ZONE, "io_uring created: %d (sq=%u, cq=%u)", m->ringfd, p.sq_entries, p.cq_entries); \
+        return 0;                                                       \
+    }                                                                   \
+                                                                        \
+    static int _mio_uring_enter(mio_t m, unsigned submit, unsigned wait, unsigned flags, void *arg, size_t argsz) \
+    {                                                                   \
+        return syscall(__NR_io_uring_enter, m->ringfd, submit, wait, flags, arg, argsz); \
+    }                                                                   \
+                                                                        \
+    static int _mio_uring_submit(mio_t m)                               \
+    {                                                                   \
+        int n;                                                          \
+                                                                        \
+        while (m->sq_queued > 0) {                                      \
+            n = _mio_uring_enter(m, m->sq_queued, 0, 0, NULL, 0);       \
+            if (n < 0) {                                                \
+                if (errno == EINTR) continue;                           \
+                mio_debug(ZONE, "io_uring submit failed: %s", strerror(errno)); \
+                return -1;                                              \
+            }                                                           \
+            m->sq_queued -= n;                                          \
+        }                                                               \
+        return 0;                                                       \
+    }                                                                   \
+                                                                        \
+    static struct io_uring_sqe *_mio_uring_sqe(mio_t m)                 \
+    {                                                                   \
+        struct io_uring_sqe *sqe;                                       \
+        unsigned tail = *m->sq_tail;                                    \
+                                                                        \
+        /* ring full: hand the queued requests to the kernel now */     \
+        if (tail - __atomic_load_n(m->sq_head, __ATOMIC_ACQUIRE) >= m->sq_entries) { \
+            _mio_uring_submit(m);                                       \
+            if (tail - __atomic_load_n(m->sq_head, __ATOMIC_ACQUIRE) >= m->sq_entries) \
+                return NULL;                                            \
+        }                                                               \
+        sqe = &m->sqes[tail & m->sq_mask];                              \
+        memset(sqe, 0, sizeof(*sqe));                                   \
+        return sqe;                                                     \
+    }                                                                   \
+                                                                        \
+    static void _mio_uring_push(mio_t m)                                \
+    {                                                                   \
+        __atomic_store_n(m->sq_tail, *m->sq_tail + 1, __ATOMIC_RELEASE); \
+        m->sq_queued++;                                                 \
+    }                                                                   \
+                                                                        \
+    static __u64 _mio_uring_data(mio_t m, int fd)                       \
+    {                                                                   \
+        return (m->armed[fd] == MIO_URING_ACCEPTING ? MIO_URING_ACCEPT : 0) | static_cast<__u64>(m->gen[fd]) << 32 | fd; \
+    }                                                                   \
+                                                                        \
+    static __uint32_t _mio_uring_poll_events(mio_t m, int fd)           \
+    {                                                                   \
+        return m->recv[fd] == MIO_URING_RECV_NONE ? POLLIN|POLLOUT : POLLOUT; \
+    }                                                                   \
+                                                                        \
+    static void _mio_uring_arm(mio_t m, int fd)                         \
+    {                                                                   \
+        struct io_uring_sqe *sqe;                                       \
+                                                                        \
+        if (m->armed[fd] != MIO_URING_UNARMED)                          \
+            return;                                                     \
+        if ((sqe = _mio_uring_sqe(m)) == NULL) {                        \
+            mio_debug(ZONE, "submission ring full, fd %d not armed", fd); \
+            return;                                                     \
+        }                                                               \
+        sqe->fd = fd;                                                   \
+        if (FD(m,fd).type == type_LISTEN && m->multishot_accept) {      \
+            sqe->opcode = IORING_OP_ACCEPT;                             \
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;                      \
+            sqe->accept_flags = SOCK_NONBLOCK;                          \
+            m->armed[fd] = MIO_URING_ACCEPTING;                         \
+        } else {                                                        \
+            sqe->opcode = IORING_OP_POLL_ADD;                           \
+            sqe->len = IORING_POLL_ADD_MULTI;                           \
+            sqe->poll32_events = MIO_URING_POLL32(_mio_uring_poll_events(m, fd)); \
+            m->armed[fd] = MIO_URING_POLLING;                           \
+        }                                                               \
+        sqe->user_data = _mio_uring_data(m, fd);                        \
+        _mio_uring_push(m);                                             \
+    }                                                                   \
+                                                                        \
+    static void _mio_uring_poll_update(mio_t m, int fd)                 \
+    {                                                                   \
+        struct io_uring_sqe *sqe;                                       \
+                                                                        \
+        /* a poll, that is not armed, gets the right events when it is made */ \
+        if (m->armed[fd] != MIO_URING_POLLING || (sqe = _mio_uring_sqe(m)) == NULL) \
+            return;                                                     \
+        sqe->opcode = IORING_OP_POLL_REMOVE;                            \
+        sqe->fd = -1;                                                   \
+        sqe->addr = _mio_uring_data(m, fd);                             \
+        sqe->len = IORING_POLL_UPDATE_EVENTS | IORING_POLL_ADD_MULTI;   \
+        sqe->poll32_events = MIO_URING_POLL32(_mio_uring_poll_events(m, fd)); \
+        sqe->flags = IOSQE_CQE_SKIP_SUCCESS;                            \
+        sqe->user_data = MIO_URING_IGNORE;                              \
+        _mio_uring_push(m);                                             \
+    }                                                                   \
+                                                                        \
+    static __u64 _mio_uring_recv_data(mio_t m, int fd)                  \
+    {                                                                   \
+        return MIO_URING_RECV | static_cast<__u64>(m->gen[fd]) << 32 | fd; \
+    }                                                                   \
+                                                                        \
+    static void _mio_uring_recv_arm(mio_t m, int fd)                    \
+    {                                                                   \
+        struct io_uring_sqe *sqe;                                       \
+                                                                        \
+        if ((sqe = _mio_uring_sqe(m)) == NULL) {                        \
+            /* the socket is polled for POLLIN again */                 \
+            m->recv[fd] = MIO_URING_RECV_NONE;                          \
+            _mio_uring_poll_update(m, fd);                              \
+            return;                                                     \
+        }                                                               \
+        sqe->opcode = IORING_OP_RECV;                                   \
+        sqe->fd = fd;                                                   \
+        sqe->ioprio = IORING_RECV_MULTISHOT;                            \
+        sqe->flags = IOSQE_BUFFER_SELECT;                               \
+        sqe->buf_group = MIO_URING_BGID;                                \
+        sqe->user_data = _mio_uring_recv_data(m, fd);                   \
+        _mio_uring_push(m);                                             \
+        m->recv[fd] = MIO_URING_RECV_ARMED;                             \
+    }                                                                   \
+                                                                        \
+    static void _mio_uring_recv_cancel(mio_t m, int fd)                 \
+    {                                                                   \
+        struct io_uring_sqe *sqe;                                       \
+                                                                        \
+        if (m->recv[fd] != MIO_URING_RECV_ARMED || (sqe = _mio_uring_sqe(m)) == NULL) \
+            return;                                                     \
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;                           \
+        sqe->fd = -1;                                                   \
+        sqe->addr = _mio_uring_recv_data(m, fd);                        \
+        sqe->flags = IOSQE_CQE_SKIP_SUCCESS;                            \
+        sqe->user_data = MIO_URING_IGNORE;                              \
+        _mio_uring_push(m);                                             \
+        m->recv[fd] = MIO_URING_RECV_CANCELED;                          \
+    }                                                                   \
+                                                                        \
+    static void _mio_uring_recv_buffered(mio_t m, int fd)               \
+    {                                                                   \
+        if (m->ringfd < 0 || !m->recv_multishot || m->recv[fd] != MIO_URING_RECV_NONE) \
+            return;                                                     \
+                                                                        \
+        m->recv_head[fd] = -1;                                          \
+        m->recv_queued[fd] = 0;                                         \
+        m->recv_res[fd] = 1;                                            \
+        _mio_uring_recv_arm(m, fd);                                     \
+                                                                        \
+        /* the recv reports new data, the poll only writability */      \
+        if (m->recv[fd] == MIO_URING_RECV_ARMED)                        \
+            _mio_uring_poll_update(m, fd);                              \
+    }                                                                   \
+                                                                        \
+    static void _mio_uring_received(mio_t m, int fd, struct io_uring_cqe *cqe) \
+    {                                                                   \
+        int bid;                                                        \
+                                                                        \
+        if (cqe->flags & IORING_CQE_F_BUFFER) {                         \
+            bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;                \
+            if (cqe->res <= 0) {                                        \
+                _mio_uring_buffer_put(m, bid);                          \
+            } else {                                                    \
+                m->buf_len[bid] = cqe->res;                             \
+                m->buf_offset[bid] = 0;                                 \
+                m->buf_next[bid] = -1;                                  \
+                if (m->recv_head[fd] == -1)                             \
+                    m->recv_head[fd] = bid;                             \
+                else                                                    \
+                    m->buf_next[m->recv_tail[fd]] = bid;                \
+                m->recv_tail[fd] = bid;                                 \
+                m->recv_queued[fd]++;                                   \
+            }                                                           \
+        }                                                               \
+                                                                        \
+        if (cqe->res == -EINVAL && m->recv_head[fd] == -1) {            \
+            /* no multishot recv, the application reads the sockets */  \
+            mio_debug(ZONE, "no multishot recv, reading sockets");      \
+            m->recv_multishot = 0;                                      \
+            m->recv[fd] = MIO_URING_RECV_NONE;                          \
+            _mio_uring_poll_update(m, fd);                              \
+        } else if (cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED)) { \
+            /* end of the stream or an error, reported after the data */ \
+            m->recv_res[fd] = cqe->res;                                 \
+        }                                                               \
+                                                                        \
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {                        \
+            if (m->recv[fd] != MIO_URING_RECV_NONE)                     \
+                m->recv[fd] = MIO_URING_RECV_STOPPED;                   \
+        } else if (m->recv_queued[fd] >= MIO_URING_RECV_QUEUE) {        \
+            /* the application does not read, leave the data in the socket */ \
+            _mio_uring_recv_cancel(m, fd);                              \
+        }                                                               \
+                                                                        \
+        _mio_et_ready(m, fd, EPOLLIN);                                  \
+    }                                                                   \
+                                                                        \
+    static int _mio_uring_recv(mio_t m, int fd, char *buf, size_t count) \
+    {                                                                   \
+        size_t copied = 0, len;                                         \
+        int bid, n;                                                     \
+                                                                        \
+        if (m->ringfd < 0 || m->recv[fd] == MIO_URING_RECV_NONE)        \
+            return read(fd, buf, count);                                \
+                                                                        \
+        /* data, that has been received for us */                       \
+        while (copied < count && (bid = m->recv_head[fd]) != -1) {      \
+            len = m->buf_len[bid] - m->buf_offset[bid];                 \
+            if (len > count - copied)                                   \
+                len = count - copied;                                   \
+            memcpy(buf + copied, m->buf_data + bid * MIO_URING_BUFFER_SIZE + m->buf_offset[bid], len); \
+            copied += len;                                              \
+            m->buf_offset[bid] += len;                                  \
+            if (m->buf_offset[bid] == m->buf_len[bid]) {                \
+                m->recv_head[fd] = m->buf_next[bid];                    \
+                m->recv_queued[fd]--;                                   \
+                _mio_uring_buffer_put(m, bid);                          \
+            }                                                           \
+        }                                                               \
+        if (copied > 0)                                                 \
+            return copied;                                              \
+                                                                        \
+        if (m->recv_res[fd] <= 0) {                                     \
+            errno = -m->recv_res[fd];                                   \
+            return m->recv_res[fd] == 0 ? 0 : -1;                       \
+        }                                                               \
+        if (m->recv[fd] != MIO_URING_RECV_STOPPED) {                    \
+            errno = EAGAIN;                                             \
+            return -1;                                                  \
+        }                                                               \
+                                                                        \
+        /* receiving stopped, read the socket until it is empty and receive again */ \
+        n = read(fd, buf, count);                                       \
+        if (n < 0 && MIO_WOULDBLOCK) {                                  \
+            _mio_uring_recv_arm(m, fd);                                 \
+            errno = EAGAIN;                                             \
+        }                                                               \
+        return n;                                                       \
+    }                                                                   \
+                                                                        \
+    static int _mio_uring_add(mio_t m, int fd)                          \
+    {                                                                   \
+        if (m->ringfd < 0)                                              \
+            return _mio_et_add(m, fd);                                  \
+                                                                        \
+        /* the request is made, when the application wants events */    \
+        m->interest[fd] = 0;                                            \
+        m->ready[fd] = 0;                                               \
+        m->armed[fd] = MIO_URING_UNARMED;                               \
+        m->recv[fd] = MIO_URING_RECV_NONE;                              \
+        m->accepted_head[fd] = -1;                                      \
+        return 0;                                                       \
+    }                                                                   \
+                                                                        \
+    static void _mio_uring_remove(mio_t m, int fd)                      \
+    {                                                                   \
+        struct io_uring_sqe *sqe;                                       \
+        int newfd, bid;                                                 \
+                                                                        \
+        if (m->ringfd < 0) {                                            \
+            _mio_et_remove(m, fd);                                      \
+            return;                                                     \
+        }                                                               \
+                                                                        \
+        /* data, that has not been read, gives back its buffers */      \
+        if (m->recv[fd] != MIO_URING_RECV_NONE) {                       \
+            _mio_uring_recv_cancel(m, fd);                              \
+            while ((bid = m->recv_head[fd]) != -1) {                    \
+                m->recv_head[fd] = m->buf_next[bid];                    \
+                _mio_uring_buffer_put(m, bid);                          \
+            }                                                           \
+            m->recv[fd] = MIO_URING_RECV_NONE;                          \
+        }                                                               \
+                                                                        \
+        /* the request holds a reference to the socket, it has to be canceled */ \
+        if (m->armed[fd] != MIO_URING_UNARMED && (sqe = _mio_uring_sqe(m)) != NULL) { \
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;                       \
+            sqe->fd = -1;                                               \
+            sqe->addr = _mio_uring_data(m, fd);                         \
+            sqe->flags = IOSQE_CQE_SKIP_SUCCESS;                        \
+            sqe->user_data = MIO_URING_IGNORE;                          \
+            _mio_uring_push(m);                                         \
+        }                                                               \
+                                                                        \
+        /* completions still in the ring belong to an old generation now */ \
+        m->gen[fd] = (m->gen[fd] + 1) & 0x3fffffff;                     \
+        m->armed[fd] = MIO_URING_UNARMED;                               \
+        m->interest[fd] = 0;                                            \
+        m->ready[fd] = 0;                                               \
+                                                                        \
+        /* connections accepted for a listener, that has been removed */ \
+        while ((newfd = m->accepted_head[fd]) != -1) {                  \
+            m->accepted_head[fd] = m->accepted_next[newfd];             \
+            close(newfd);                                               \
+        }                                                               \
+    }                                                                   \
+                                                                        \
+    static void _mio_uring_want(mio_t m, int fd, __uint32_t ev)         \
+    {                                                                   \
+        if (m->ringfd >= 0)                                             \
+            _mio_uring_arm(m, fd);                                      \
+        _mio_et_want(m, fd, ev);                                        \
+    }                                                                   \
+                                                                        \
+    static void _mio_uring_accepted(mio_t m, int fd, int newfd)         \
+    {                                                                   \
+        int lowfd;                                                      \
+                                                                        \
+        /* too high to be tracked, try to get a lower fd */             \
+        if (newfd >= m->maxfd) {                                        \
+            lowfd = dup(newfd);                                         \
+            close(newfd);                                               \
+            if (lowfd < 0 || lowfd >= m->maxfd) {                       \
+                mio_debug(ZONE, "no fd left for accepted connection");  \
+                if (lowfd >= 0) close(lowfd);                           \
+                return;                                                 \
+            }                                                           \
+            newfd = lowfd;                                              \
+        }                                                               \
+                                                                        \
+        /* queue it until mio_run() accepts it */                       \
+        m->accepted_next[newfd] = -1;                                   \
+        if (m->accepted_head[fd] == -1)                                 \
+            m->accepted_head[fd] = newfd;                               \
+        else                                                            \
+            m->accepted_next[m->accepted_tail[fd]] = newfd;             \
+        m->accepted_tail[fd] = newfd;                                   \
+        _mio_et_ready(m, fd, EPOLLIN);                                  \
+    }                                                                   \
+                                                                        \
+    static int _mio_uring_accept(mio_t m, int fd, struct sockaddr *addr, socklen_t *addrlen) \
+    {                                                                   \
+        int newfd = m->ringfd >= 0 ? m->accepted_head[fd] : -1;         \
+                                                                        \
+        if (newfd == -1) {                                              \
+            /* the kernel accepts for us, but there is nothing yet */   \
+            if (m->armed[fd] == MIO_URING_ACCEPTING) {                  \
+                errno = EAGAIN;                                         \
+                return -1;                                              \
+            }                                                           \
+            return accept(fd, addr, addrlen);                           \
+        }                                                               \
+                                                                        \
+        m->accepted_head[fd] = m->accepted_next[newfd];                 \
+        if (getpeername(newfd, addr, addrlen) != 0)                     \
+            memset(addr, 0, *addrlen);                                  \
+        return newfd;                                                   \
+    }                                                                   \
+                                                                        \
+    static void _mio_uring_complete(mio_t m, struct io_uring_cqe *cqe)  \
+    {                                                                   \
+        __u64 data = cqe->user_data;                                    \
+        int fd = static_cast<int>(data & 0xffffffff);                   \
+        int more = cqe->flags & IORING_CQE_F_MORE;                      \
+                                                                        \
+        if (data == MIO_URING_IGNORE)                                   \
+            return;                                                     \
+                                                                        \
+        /* request of a socket, that has been removed in the meantime */ \
+        if (fd >= m->maxfd || ((data & ~(MIO_URING_ACCEPT|MIO_URING_RECV)) >> 32) != m->gen[fd]) { \
+            if ((data & MIO_URING_ACCEPT) && cqe->res >= 0)             \
+                close(cqe->res);                                        \
+            if (cqe->flags & IORING_CQE_F_BUFFER)                       \
+                _mio_uring_buffer_put(m, cqe->flags >> IORING_CQE_BUFFER_SHIFT); \
+            return;                                                     \
+        }                                                               \
+                                                                        \
+        if (data & MIO_URING_RECV) {                                    \
+            _mio_uring_received(m, fd, cqe);                            \
+            return;                                                     \
+        }                                                               \
+                                                                        \
+        if (!more)                                                      \
+            m->armed[fd] = MIO_URING_UNARMED;                           \
+                                                                        \
+        if (data & MIO_URING_ACCEPT) {                                  \
+            if (cqe->res >= 0) {                                        \
+                _mio_uring_accepted(m, fd, cqe->res);                   \
+            } else if (cqe->res == -EINVAL && !more) {                  \
+                mio_debug(ZONE, "no multishot accept, polling listening sockets"); \
+                m->multishot_accept = 0;                                \
+            }                                                           \
+        } else if (cqe->res > 0) {                                      \
+            _mio_et_ready(m, fd, cqe->res);                             \
+        }                                                               \
+                                                                        \
+        /* the kernel ended the request (e.g. on an overflow of the completion ring) */ \
+        if (!more && m->interest[fd] != 0)                              \
+            _mio_uring_arm(m, fd);                                      \
+    }                                                                   \
+                                                                        \
+    static int _mio_uring(mio_t m, int t)                               \
+    {                                                                   \
+        struct io_uring_getevents_arg arg;                              \
+        struct __kernel_timespec ts;                                    \
+        unsigned head, wait;                                            \
+        int n, error;                                                   \
+                                                                        \
+        if (m->ringfd < 0)                                              \
+            return _mio_epoll_et(m, t);                                 \
+                                                                        \
+        /* do not sleep if there is still work left from the last run */ \
+        wait = m->npending == 0 && *m->cq_head == __atomic_load_n(m->cq_tail, __ATOMIC_ACQUIRE); \
+                                                                        \
+        /* submit all queued requests and wait for completions in one call */ \
+        memset(&arg, 0, sizeof(arg));                                   \
+        ts.tv_sec = t;                                                  \
+        ts.tv_nsec = 0;                                                 \
+        arg.ts = reinterpret_cast<__u64>(&ts);                          \
+        n = _mio_uring_enter(m, m->sq_queued, wait, IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG, &arg, sizeof(arg)); \
+        error = errno;                                                  \
+        if (n > 0)                                                      \
+            m->sq_queued -= n;                                          \
+                                                                        \
+        /* reap the completions */                                      \
+        head = *m->cq_head;                                             \
+        while (head != __atomic_load_n(m->cq_tail, __ATOMIC_ACQUIRE)) { \
+            _mio_uring_complete(m, &m->cqes[head & m->cq_mask]);        \
+            __atomic_store_n(m->cq_head, ++head, __ATOMIC_RELEASE);     \
+        }                                                               \
+                                                                        \
+        if (n < 0 && error != ETIME && m->npending == 0) {              \
+            errno = error;                                              \
+            return -1;                                                  \
+        }                                                               \
+        return _mio_et_collect(m);                                      \
+    }
+
+#define MIO_VARS \
+    MIO_ET_VARS \
+    int ringfd;                     /**< the io_uring, -1 if we fell back to epoll */ \
+    char *ring;                     /**< mapped submission and completion rings */ \
+    size_t ring_size; \
+    struct io_uring_sqe *sqes;      /**< mapped submission queue entries */ \
+    size_t sqes_size; \
+    unsigned *sq_head; \
+    unsigned *sq_tail; \
+    unsigned sq_mask; \
+    unsigned sq_entries; \
+    unsigned sq_queued;             /**< requests not yet handed to the kernel */ \
+    unsigned *cq_head; \
+    unsigned *cq_tail; \
+    unsigned cq_mask; \
+    struct io_uring_cqe *cqes; \
+    char *armed;                    /**< which request a fd has in the ring */ \
+    unsigned *gen;                  /**< generation of a fd, increased when it is removed */ \
+    int *accepted_head;             /**< first connection accepted for a listener */ \
+    int *accepted_tail;             /**< last connection accepted for a listener */ \
+    int *accepted_next;             /**< next connection accepted for the same listener */ \
+    int multishot_accept;           /**< if the kernel accepts for listeners */ \
+    struct io_uring_buf_ring *buf_ring; /**< ring of provided buffers, NULL if not registered */ \
+    unsigned short buf_tail;        /**< tail of the buffer ring */ \
+    char *buf_data;                 /**< memory of the provided buffers */ \
+    int *buf_len;                   /**< bytes received into a buffer */ \
+    int *buf_offset;                /**< bytes of a buffer already read by the application */ \
+    int *buf_next;                  /**< next buffer received for the same fd */ \
+    int recv_multishot;             /**< if the kernel receives into provided buffers */ \
+    char *recv;                     /**< how the data of a fd is received */ \
+    int *recv_head;                 /**< first buffer received for a fd */ \
+    int *recv_tail;                 /**< last buffer received for a fd */ \
+    int *recv_queued;               /**< number of buffers received for a fd */ \
+    int *recv_res;                  /**< 0 after the end of the stream, -errno after an error, 1 else */
+
+#define MIO_URING_FREE_VARS(m) \
+    do {                                                                \
+        MIO_ET_FREE_VARS(m);                                            \
+        free(m->armed);                                                 \
+        free(m->gen);                                                   \
+        free(m->accepted_head);                                         \
+        free(m->accepted_tail);                                         \
+        free(m->accepted_next);                                         \
+        free(m->buf_len);                                               \
+        free(m->buf_offset);                                            \
+        free(m->buf_next);                                              \
+        free(m->recv);                                                  \
+        free(m->recv_head);                                             \
+        free(m->recv_tail);                                             \
+        free(m->recv_queued);                                           \
+        free(m->recv_res);                                              \
+    } while(0)
+
+#define MIO_INIT_VARS(m) \
+    do {                                                                \
+        MIO_ET_ALLOC_VARS(m, maxfd);                                    \
+        m->armed = static_cast<char*>(calloc(maxfd + 1, sizeof(char))); \
+        m->gen = static_cast<unsigned*>(calloc(maxfd + 1, sizeof(unsigned))); \
+        m->accepted_head = static_cast<int*>(calloc(maxfd + 1, sizeof(int))); \
+        m->accepted_tail = static_cast<int*>(calloc(maxfd + 1, sizeof(int))); \
+        m->accepted_next = static_cast<int*>(calloc(maxfd + 1, sizeof(int))); \
+        m->buf_len = static_cast<int*>(calloc(MIO_URING_BUFFERS, sizeof(int))); \
+        m->buf_offset = static_cast<int*>(calloc(MIO_URING_BUFFERS, sizeof(int))); \
+        m->buf_next = static_cast<int*>(calloc(MIO_URING_BUFFERS, sizeof(int))); \
+        m->recv = static_cast<char*>(calloc(maxfd + 1, sizeof(char)));  \
+        m->recv_head = static_cast<int*>(calloc(maxfd + 1, sizeof(int))); \
+        m->recv_tail = static_cast<int*>(calloc(maxfd + 1, sizeof(int))); \
+        m->recv_queued = static_cast<int*>(calloc(maxfd + 1, sizeof(int))); \
+        m->recv_res = static_cast<int*>(calloc(maxfd + 1, sizeof(int))); \
+        m->buf_ring = NULL;                                             \
+        m->buf_data = NULL;                                             \
+        m->recv_multishot = 0;                                          \
+        m->epfd = -1;                                                   \
+        if (_mio_uring_setup(m, maxfd) != 0) {                          \
+            mio_debug(ZONE, "io_uring not available, falling back to epoll"); \
+            m->epfd = epoll_create(maxfd);                              \
+            if (m->epfd == -1) {                                        \
+                mio_debug(ZONE, "Can't epoll_create(%d).", maxfd);      \
+                MIO_URING_FREE_VARS(m);                                 \
+                free(m->fds);                                           \
+                free(m);                                                \
+                return NULL;                                            \
+            }                                                           \
+        }                                                               \
+    } while(0)
+
+#define MIO_FREE_VARS(m) \
+    do {                                                                \
+        if (m->ringfd >= 0) {                                           \
+            munmap(m->sqes, m->sqes_size);                              \
+            munmap(m->ring, m->ring_size);                              \
+            close(m->ringfd);                                           \
+            if (m->buf_ring != NULL) {                                  \
+                munmap(m->buf_ring, MIO_URING_BUFFERS * sizeof(struct io_uring_buf)); \
+                free(m->buf_data);                                      \
+            }                                                           \
+        } else {                                                        \
+            close(m->epfd);                                             \
+        }                                                               \
+        MIO_URING_FREE_VARS(m);                                         \
+    } while(0)
+
+#define MIO_INIT_FD(m, pfd)     _mio_uring_add(m, pfd)
+
+#define MIO_REMOVE_FD(m, pfd)   _mio_uring_remove(m, pfd)
+
+#define MIO_CHECK(m, t)         _mio_uring(m, t)
+
+#define MIO_SET_READ(m, fd)     _mio_uring_want(m, fd, EPOLLIN)
+#define MIO_SET_WRITE(m, fd)    _mio_uring_want(m, fd, EPOLLOUT)
+
+#define MIO_UNSET_READ(m, fd)   m->interest[fd] &= ~EPOLLIN
+#define MIO_UNSET_WRITE(m, fd)  m->interest[fd] &= ~EPOLLOUT
+
+#define MIO_CAN_READ(m, e)      m->events[e].events & EPOLLIN
+#define MIO_CAN_WRITE(m, e)     m->events[e].events & EPOLLOUT
+
+#define MIO_READ_DONE(m, fd, blocked)   _mio_et_done(m, fd, EPOLLIN, blocked)
+#define MIO_WRITE_DONE(m, fd, blocked)  _mio_et_done(m, fd, EPOLLOUT, blocked)
+
+#define MIO_ACCEPT(m, fd, addr, addrlen) _mio_uring_accept(m, fd, addr, addrlen)
+
+#define MIO_RECV(m, fd, buf, count)     _mio_uring_recv(m, fd, buf, count)
+#define MIO_RECV_BUFFERED(m, fd)        _mio_uring_recv_buffered(m, fd)
+
+#define MIO_ERROR(m)            errno
+
+#define MIO_NAME(m)             (m->ringfd >= 0 ? "io_uring" : "epoll-et")
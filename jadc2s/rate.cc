@@ -40,81 +40,132 @@
 
 #include "jadc2s.h"
 
-/***
-* walk over the rate table and clear out the old entries
-* @param c2s the c2s context
-*/
-void connection_rate_cleanup(xmppd::pointer<c2s_st> c2s) {
-    static time_t last = 0;
-    time_t now;
+/**
+ * get the key of the connection rate table for an IP address
+ *
+ * IPv4 addresses are mapped into the IPv6 address space. Of IPv6 addresses
+ * only the /64 network is used, as a single host normally gets a whole /64
+ * and could otherwise use a new address for each connection.
+ *
+ * @param ip the IP address as text
+ * @param key where to store the key
+ * @return 0 on success, 1 if the address could not be parsed
+ */
+static int _connection_rate_key(const Glib::ustring& ip, unsigned char key[16]) {
+    struct in6_addr addr6;
+    struct in_addr addr4;
 
-    /* no entries? nothing to do! */
-    if (c2s->connection_rates.empty())
-	return;
-
-    /* time to do a connection rate check again? */
-    if ((time(&now) - last) > c2s->connection_rate_seconds) {
-
-	/* iterate all entries in the map */
-	std::map<Glib::ustring, xmppd::pointer<connection_rate_st> >::iterator p;
-	for (p=c2s->connection_rates.begin(); p != c2s->connection_rates.end(); ++p) {
-	    try {
-		/* about to expire this entry? */
-		if (now - p->second->first_time > c2s->connection_rate_seconds) {
-		    DBG("free and zap");
-		    c2s->connection_rates.erase(p->first);
-		}
-	    } catch (Glib::ustring msg) {
-		DBG("Caught exception cleaning connection rates: " << msg);
-	    }
-	}
+    if (inet_pton(AF_INET, ip.c_str(), &addr4) == 1) {
+	memset(key, 0, 10);
+	key[10] = key[11] = 0xff;
+	memcpy(key + 12, &addr4, 4);
+	return 0;
+    }
+
+    if (inet_pton(AF_INET6, ip.c_str(), &addr6) != 1)
+	return 1;
+
+    memcpy(key, &addr6, 16);
+    if (!IN6_IS_ADDR_V4MAPPED(&addr6))
+	memset(key + 8, 0, 8);
+    return 0;
+}
+
+/**
+ * refill the token bucket of a slot up to the current time
+ *
+ * @param c2s the c2s context
+ * @param rate the slot
+ * @param now the current time
+ */
+static void _connection_rate_refill(xmppd::pointer<c2s_st> c2s, connection_rate_st& rate, time_t now) {
+    unsigned long int capacity = static_cast<unsigned long int>(c2s->connection_rate_times) * c2s->connection_rate_seconds;
 
-	/* remember when we did this check last */
-        time(&last);
+    if (now > rate.last) {
+	unsigned long int elapsed = now - rate.last;
+
+	/* a bucket, that has been idle for a whole period, is full anyway */
+	if (elapsed >= static_cast<unsigned long int>(c2s->connection_rate_seconds))
+	    rate.tokens = capacity;
+	else
+	    rate.tokens += elapsed * c2s->connection_rate_times;
+	rate.last = now;
     }
+
+    if (rate.tokens > capacity)
+	rate.tokens = capacity;
 }
 
 /***
 * See if a connection is within the rate limit
 *
+* Each address (IPv6 network) gets a token bucket, that allows
+* connection_rate_times connects at once and refills at
+* connection_rate_times connects per connection_rate_seconds.
+* The buckets are kept in a table of fixed size. A full bucket is
+* the same as no bucket, so entries do not have to be expired:
+* their slots are just reused.
+*
 * @param c2s the c2s context
 * @param ip the ip to check
 * @return 0 on valid 1 on invalid
 */
 int connection_rate_check(xmppd::pointer<c2s_st> c2s, const Glib::ustring& ip) {
-    xmppd::pointer<connection_rate_st> cr = NULL;
+    unsigned char key[16];
+    unsigned int hash = 2166136261U;
+    connection_rate_st *set = NULL;
+    connection_rate_st *rate = NULL;
     time_t now;
+    int result = 0;
     
     /* See if this is disabled */
     if (c2s->connection_rate_times == 0 || c2s->connection_rate_seconds == 0)
         return 0;
 
+    if (_connection_rate_key(ip, key)) {
+	DBG("cannot rate limit " << ip << ", not an IP address");
+	return 0;
+    }
 
-    /* If it is NULL they are the first of a possible series */
-    if (c2s->connection_rates.find(ip) == c2s->connection_rates.end()) {
-	cr = new connection_rate_st;
-        cr->ip = ip;
-        cr->count = 1;
-        time(&cr->first_time);
-	(c2s->connection_rates)[ip] = cr;
-        return 0;
+    for (int i = 0; i < 16; i++) {
+	hash ^= key[i];
+	hash *= 16777619U;
     }
 
-    // existing connection rate
-    cr = (c2s->connection_rates)[ip];
+    connection_rate_shard_st& shard = c2s->shared->rate_shards[hash % CONNECTION_RATE_SHARDS];
+    set = &shard.rates[(hash / CONNECTION_RATE_SHARDS) % (CONNECTION_RATE_SLOTS / CONNECTION_RATE_WAYS) * CONNECTION_RATE_WAYS];
+    time(&now);
 
-    /* If they are outside the time limit just reset them */
-    if ((time(&now) - cr->first_time) > c2s->connection_rate_seconds)
-    {
-        cr->first_time = now;
-        cr->count = 1;
-        return 0;
+    pthread_mutex_lock(&shard.mutex);
+
+    /* find the address, or the slot to reuse: an unused one or the one with the most tokens */
+    for (int i = 0; i < CONNECTION_RATE_WAYS; i++) {
+	if (set[i].last != 0 && memcmp(set[i].key, key, 16) == 0) {
+	    rate = &set[i];
+	    _connection_rate_refill(c2s, *rate, now);
+	    break;
+	}
+
+	if (set[i].last != 0)
+	    _connection_rate_refill(c2s, set[i], now);
+	if (rate == NULL || (rate->last != 0 && (set[i].last == 0 || set[i].tokens > rate->tokens)))
+	    rate = &set[i];
+    }
+
+    if (rate->last == 0 || memcmp(rate->key, key, 16) != 0) {
+	/* they are the first of a possible series */
+	memcpy(rate->key, key, 16);
+	rate->tokens = static_cast<unsigned long int>(c2s->connection_rate_times) * c2s->connection_rate_seconds;
+	rate->last = now;
     }
 
-    /* see if they have too many conns */
-    cr->count++;
-    if (cr->count > c2s->connection_rate_times)
-        return 1;
+    /* take a token if there is one */
+    if (rate->tokens >= static_cast<unsigned long int>(c2s->connection_rate_seconds))
+	rate->tokens -= c2s->connection_rate_seconds;
+    else
+	result = 1;
+
+    pthread_mutex_unlock(&shard.mutex);
     
-    return 0;
+    return result;
 }
@@ -0,0 +1,318 @@
+/*
+ * Licence
+ *
+ * Copyright (c) 2006 Matthias Wimmer,
+ *                    mailto:m@tthias.eu, xmpp:mawis@amessage.info
+ *
+ * You can use the content of this file using one of the following licences:
+ *
+ * - Version 1.0 of the Jabber Open Source Licence ("JOSL")
+ * - GNU GENERAL PUBLIC LICENSE, Version 2 or any newer version of this licence at your choice
+ * - Apache Licence, Version 2.0
+ * - GNU Lesser General Public License, Version 2.1 or any newer version of this licence at your choice
+ * - Mozilla Public License 1.1
+ */
+
+/**
+ * @file websocket.cc
+ * @brief WebSocket transport (RFC 6455) for XMPP streams (RFC 7395)
+ *
+ * A browser client opens the connection on the normal client port with an
+ * HTTP upgrade request. After the handshake each XML element is sent in its
+ * own text message. This file implements the handshake and the framing, how
+ * the messages are passed to the XML parser is handled in clients.cc.
+ */
+
+#include "jadc2s.h"
+
+/** the GUID, that is appended to the key of the client for the handshake */
+#define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+/**
+ * encode binary data using base64
+ *
+ * @param data the data to encode
+ * @return the encoded data
+ */
+static std::string _websocket_base64(const std::vector<uint8_t>& data) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string result;
+
+    for (std::vector<uint8_t>::size_type i = 0; i < data.size(); i += 3) {
+	unsigned long int group = data[i] << 16;
+	if (i+1 < data.size())
+	    group |= data[i+1] << 8;
+	if (i+2 < data.size())
+	    group |= data[i+2];
+
+	result += alphabet[(group >> 18) & 0x3f];
+	result += alphabet[(group >> 12) & 0x3f];
+	result += i+1 < data.size() ? alphabet[(group >> 6) & 0x3f] : '=';
+	result += i+2 < data.size() ? alphabet[group & 0x3f] : '=';
+    }
+
+    return result;
+}
+
+/**
+ * check if a comma separated header value contains a token
+ *
+ * @param value the header value
+ * @param token the token to search for (lowercase)
+ * @return 1 if the token is contained, 0 else
+ */
+static int _websocket_has_token(const std::string& value, const std::string& token) {
+    std::string::size_type start = 0;
+
+    while (start < value.length()) {
+	std::string::size_type end = value.find(',', start);
+	if (end == std::string::npos)
+	    end = value.length();
+
+	/* trim the element */
+	while (start < end && (value[start] == ' ' || value[start] == '\t'))
+	    start++;
+	std::string::size_type element_end = end;
+	while (element_end > start && (value[element_end-1] == ' ' || value[element_end-1] == '\t'))
+	    element_end--;
+
+	if (element_end-start == token.length() && strncasecmp(value.c_str()+start, token.c_str(), token.length()) == 0)
+	    return 1;
+
+	start = end+1;
+    }
+
+    return 0;
+}
+
+int websocket_handshake(conn_t c, const char *buf, int len) {
+    std::string::size_type end = 0;
+    std::string::size_type line_start = 0;
+    std::string key;
+    int upgrade = 0, connection = 0, version = 0, protocol = 0;
+    chunk_t response = NULL;
+
+    c->ws_in.append(buf, len);
+
+    /* wait for the complete request header */
+    end = c->ws_in.find("\r\n\r\n");
+    if (end == std::string::npos)
+	return c->ws_in.length() > WEBSOCKET_MAX_REQUEST ? -1 : 0;
+
+    if (c->ws_in.compare(0, 4, "GET ") != 0)
+	return -1;
+
+    /* check the header fields */
+    line_start = c->ws_in.find("\r\n") + 2;
+    while (line_start < end) {
+	std::string::size_type line_end = c->ws_in.find("\r\n", line_start);
+	std::string::size_type colon = c->ws_in.find(':', line_start);
+
+	if (colon != std::string::npos && colon < line_end) {
+	    std::string name = c->ws_in.substr(line_start, colon-line_start);
+	    std::string value = c->ws_in.substr(colon+1, line_end-colon-1);
+	    std::string::size_type value_start = value.find_first_not_of(" \t");
+	    value.erase(0, value_start == std::string::npos ? value.length() : value_start);
+	    value.erase(value.find_last_not_of(" \t")+1);
+
+	    if (strcasecmp(name.c_str(), "Upgrade") == 0)
+		upgrade = _websocket_has_token(value, "websocket");
+	    else if (strcasecmp(name.c_str(), "Connection") == 0)
+		connection = _websocket_has_token(value, "upgrade");
+	    else if (strcasecmp(name.c_str(), "Sec-WebSocket-Version") == 0)
+		version = value == "13";
+	    else if (strcasecmp(name.c_str(), "Sec-WebSocket-Protocol") == 0)
+		protocol = _websocket_has_token(value, "xmpp");
+	    else if (strcasecmp(name.c_str(), "Sec-WebSocket-Key") == 0)
+		key = value;
+	}
+
+	line_start = line_end + 2;
+    }
+
+    if (!upgrade || !connection || !version || !protocol || key.empty()) {
+	DBG("no WebSocket upgrade for XMPP on fd " << c->fd);
+	return -1;
+    }
+
+    /* accept the upgrade */
+    xmppd::sha1 accept_hash;
+    accept_hash.update(key + WEBSOCKET_GUID);
+
+    response = chunk_new_empty(c->c2s->chunks);
+    response->bytes = "HTTP/1.1 101 Switching Protocols\r\n"
+	"Upgrade: websocket\r\n"
+	"Connection: Upgrade\r\n"
+	"Sec-WebSocket-Protocol: xmpp\r\n"
+	"Sec-WebSocket-Accept: " + _websocket_base64(accept_hash.final()) + "\r\n\r\n";
+    chunk_write(c, response, "", "", "");
+
+    /* from now on everything is framed, data following the request is the first frame */
+    c->websocket = websocket_OPEN;
+    c->ws_in.erase(0, end+4);
+    c->ws_fragmented = 0;
+    c->ws_message = 0;
+
+    return 1;
+}
+
+/**
+ * build the header of a frame sent by us (not masked)
+ *
+ * @param header where to append the header
+ * @param opcode the opcode of the frame
+ * @param length the payload length
+ */
+static void _websocket_frame_header(std::string& header, int opcode, std::string::size_type length) {
+    header += static_cast<char>(0x80 | opcode);
+    if (length < 126) {
+	header += static_cast<char>(length);
+    } else if (length < 65536) {
+	header += static_cast<char>(126);
+	header += static_cast<char>(length >> 8);
+	header += static_cast<char>(length & 0xff);
+    } else {
+	header += static_cast<char>(127);
+	for (int shift = 56; shift >= 0; shift -= 8)
+	    header += static_cast<char>((static_cast<unsigned long long>(length) >> shift) & 0xff);
+    }
+}
+
+void websocket_frame(chunk_t chunk) {
+    std::string header;
+
+    _websocket_frame_header(header, WEBSOCKET_OPCODE_TEXT, chunk->head.length() + chunk->bytes.length() + chunk->tail.length());
+    chunk->head.insert(0, header);
+}
+
+void websocket_write_control(conn_t c, int opcode, const char *payload, int len) {
+    chunk_t frame = chunk_new_empty(c->c2s->chunks);
+
+    _websocket_frame_header(frame->bytes, opcode, len);
+    frame->bytes.append(payload, len);
+
+    /* already framed, so not passed through chunk_write() */
+    c->writeq.push_back(frame);
+    mio_write(c->c2s->mio, c->fd);
+}
+
+int websocket_read(conn_t c, char *buf, int len, websocket_text_handler text_handler) {
+    char *data = buf;
+    std::string::size_type available = len;
+    std::string::size_type pos = 0;
+    int ret = 1;
+
+    /* continue an incomplete frame from the previous read */
+    if (!c->ws_in.empty()) {
+	c->ws_in.append(buf, len);
+	data = &c->ws_in[0];
+	available = c->ws_in.length();
+    }
+
+    while (pos < available) {
+	unsigned char *frame = reinterpret_cast<unsigned char*>(data + pos);
+	std::string::size_type header_len = 2;
+	unsigned long long payload_len = 0;
+	int fin = 0, opcode = 0;
+	char *payload = NULL;
+
+	if (available - pos < 2)
+	    break;
+
+	fin = frame[0] & 0x80;
+	opcode = frame[0] & 0x0f;
+	payload_len = frame[1] & 0x7f;
+	if (payload_len == 126)
+	    header_len += 2;
+	else if (payload_len == 127)
+	    header_len += 8;
+	header_len += 4; /* masking key */
+
+	if (available - pos < header_len)
+	    break;
+
+	if (payload_len == 126) {
+	    payload_len = frame[2] << 8 | frame[3];
+	} else if (payload_len == 127) {
+	    payload_len = 0;
+	    for (int i = 2; i < 10; i++)
+		payload_len = payload_len << 8 | frame[i];
+
+	    /* the most significant bit has to be 0 (RFC 6455, 5.2) */
+	    if (payload_len & 0x8000000000000000ULL) {
+		conn_close(c, STREAM_ERR_BAD_FORMAT, "invalid WebSocket frame length");
+		return 0;
+	    }
+	}
+
+	/* clients have to mask their frames, we do not support extensions */
+	if ((frame[0] & 0x70) != 0 || !(frame[1] & 0x80)) {
+	    conn_close(c, STREAM_ERR_BAD_FORMAT, "invalid WebSocket frame");
+	    return 0;
+	}
+
+	if (opcode >= WEBSOCKET_OPCODE_CLOSE && (payload_len > 125 || !fin)) {
+	    conn_close(c, STREAM_ERR_POLICY_VIOLATION, "WebSocket control frame too big");
+	    return 0;
+	}
+
+	/* limit the size of the whole message, not of its single frames
+	 * (compared without adding, the client controls payload_len) */
+	if (opcode == WEBSOCKET_OPCODE_TEXT)
+	    c->ws_message = 0;
+	if (opcode < WEBSOCKET_OPCODE_CLOSE && c->c2s->websocket_max_message > 0 &&
+		(c->ws_message > static_cast<unsigned long long>(c->c2s->websocket_max_message) ||
+		 payload_len > static_cast<unsigned long long>(c->c2s->websocket_max_message) - c->ws_message)) {
+	    conn_close(c, STREAM_ERR_POLICY_VIOLATION, "WebSocket message too big");
+	    return 0;
+	}
+
+	if (payload_len > available - pos - header_len)
+	    break;
+
+	/* unmask in place */
+	payload = data + pos + header_len;
+	for (unsigned long long i = 0; i < payload_len; i++)
+	    payload[i] ^= frame[header_len - 4 + (i & 3)];
+	pos += header_len + payload_len;
+
+	switch (opcode) {
+	    case WEBSOCKET_OPCODE_CONTINUATION:
+	    case WEBSOCKET_OPCODE_TEXT:
+		if ((opcode == WEBSOCKET_OPCODE_TEXT) == (c->ws_fragmented != 0)) {
+		    conn_close(c, STREAM_ERR_BAD_FORMAT, "unexpected WebSocket continuation frame");
+		    return 0;
+		}
+		ret = text_handler(c, payload, payload_len, opcode == WEBSOCKET_OPCODE_TEXT, fin);
+		c->ws_fragmented = !fin;
+		c->ws_message = fin ? 0 : c->ws_message + payload_len;
+		break;
+	    case WEBSOCKET_OPCODE_PING:
+		websocket_write_control(c, WEBSOCKET_OPCODE_PONG, payload, payload_len);
+		break;
+	    case WEBSOCKET_OPCODE_PONG:
+		break;
+	    case WEBSOCKET_OPCODE_CLOSE:
+		/* echo the status code, close once it has been written */
+		DBG("WebSocket closed by the client on fd " << c->fd);
+		c->ws_closing = 1;
+		websocket_write_control(c, WEBSOCKET_OPCODE_CLOSE, payload, payload_len >= 2 ? 2 : 0);
+		return 0;
+	    default:
+		/* binary frames are not used for XMPP */
+		conn_close(c, STREAM_ERR_UNSUPPORTED_ENCODING, "XMPP over WebSocket uses text frames only");
+		return 0;
+	}
+
+	if (ret == 0 || c->fd < 0)
+	    return 0;
+    }
+
+    /* keep an incomplete frame for the next read */
+    if (data == buf)
+	c->ws_in.assign(buf + pos, available - pos);
+    else
+	c->ws_in.erase(0, pos);
+
+    return ret;
+}